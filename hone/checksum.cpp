@@ -0,0 +1,156 @@
+//----------------------------------------------------------------------------
+// Internet checksum calculation for the Hone driver
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#include "checksum.h"
+
+#ifdef _M_X64
+#include <emmintrin.h>
+#endif
+
+// Lets the test program use the checksum code without linking to ntdll
+#ifndef KERNEL
+#include <stdlib.h>
+#define RtlUshortByteSwap(value) _byteswap_ushort(value)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+UINT16 Checksum(
+	void         *buffer,
+	const UINT32  length,
+	const UINT32  checksumIndex,
+	const UINT32  innerLoopSum)
+{
+	return CompleteChecksum(ChecksumInnerLoop(buffer, length, checksumIndex,
+			innerLoopSum));
+}
+
+//----------------------------------------------------------------------------
+UINT16 CompleteChecksum(UINT32 innerLoopSum)
+{
+	UINT16 checksum;
+	UINT32 sum = innerLoopSum;
+
+	// Take 16 bits out of the 32 bit sum and add up the carries
+	while (sum >> 16) {
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	}
+
+	// Save the one's complement of the result in network byte order
+	checksum = RtlUshortByteSwap(~sum & 0xFFFF);
+
+	// Convert all 0 checksums to 0xFFFF, not just UDP checksums
+	// http://communities.intel.com/community/wired/blog/2009/06/03/checksums-and-plus-or-minus-zero
+	return (checksum == 0) ? 0xFFFF : checksum;
+}
+
+//----------------------------------------------------------------------------
+UINT32 ChecksumInnerLoop(
+	void   *buffer,
+	UINT32  length,
+	UINT32  checksumIndex,
+	UINT32  innerLoopSum)
+{
+	const UINT8 *buffer8 = reinterpret_cast<const UINT8*>(buffer);
+	UINT32       sum;
+
+	// Only whole 16 bit values are summed, and the checksum field is skipped
+	// by summing the data on each side of it
+	length &= ~1;
+	checksumIndex &= ~1;
+	if (checksumIndex < length) {
+		sum = ChecksumRange(buffer8, checksumIndex) +
+				ChecksumRange(buffer8 + checksumIndex + 2,
+						length - checksumIndex - 2);
+	} else {
+		sum = ChecksumRange(buffer8, length);
+	}
+
+	// The one's complement sum of byte-swapped values is the byte-swapped sum,
+	// so swap once here instead of swapping each value
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return innerLoopSum + RtlUshortByteSwap(static_cast<UINT16>(sum));
+}
+
+//----------------------------------------------------------------------------
+UINT32 ChecksumRange(
+	const UINT8 *buffer,
+	UINT32       length)
+{
+	UINT64 sum = 0;
+	UINT64 value;
+
+#ifdef _M_X64
+	// SSE2 is always available on x64, and kernel code may use the XMM
+	// registers without saving floating point state, so sum 16 bytes at a
+	// time by widening each 32 bit value to 64 bits
+	if (length >= 64) {
+		const __m128i zero   = _mm_setzero_si128();
+		__m128i       vecSum = zero;
+
+		for (; length >= 16; buffer += 16, length -= 16) {
+			const __m128i data = _mm_loadu_si128(
+					reinterpret_cast<const __m128i*>(buffer));
+			vecSum = _mm_add_epi64(vecSum, _mm_unpacklo_epi32(data, zero));
+			vecSum = _mm_add_epi64(vecSum, _mm_unpackhi_epi32(data, zero));
+		}
+		UINT64 lanes[2];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), vecSum);
+		sum = FoldChecksum(lanes[0]) + FoldChecksum(lanes[1]);
+	}
+#endif
+
+	// Sum 64 bits at a time, adding carries back in at the bottom
+	for (; length >= 8; buffer += 8, length -= 8) {
+		RtlCopyMemory(&value, buffer, sizeof(value));
+		sum += value;
+		sum += (sum < value) ? 1 : 0;
+	}
+
+	// Sum any remaining 32 and 16 bit values
+	sum = FoldChecksum(sum);
+	if (length >= 4) {
+		UINT32 value32;
+		RtlCopyMemory(&value32, buffer, sizeof(value32));
+		sum    += value32;
+		buffer += 4;
+		length -= 4;
+	}
+	if (length >= 2) {
+		UINT16 value16;
+		RtlCopyMemory(&value16, buffer, sizeof(value16));
+		sum += value16;
+	}
+	return static_cast<UINT32>(FoldChecksum(sum));
+}
+
+//----------------------------------------------------------------------------
+UINT64 FoldChecksum(UINT64 sum)
+{
+	while (sum >> 16) {
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	}
+	return sum;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,96 @@
+//----------------------------------------------------------------------------
+// Internet checksum calculation for the Hone driver
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#include <limits.h>
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Function prototypes
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+/// @brief Calculates the checksum for a buffer
+///
+/// See RFC 1701 - https://tools.ietf.org/html/rfc1071
+///
+/// @param buffer         Buffer to calculate the checksum for
+/// @param length         Buffer length in bytes
+/// @param checksumIndex  Offset to checksum field in the buffer (_UI32_MAX if none)
+/// @param innerLoopSum   Inner loop sum value to carry forward
+///
+/// @returns The checksum
+UINT16 Checksum(
+	void         *buffer,
+	const UINT32  length,
+	const UINT32  checksumIndex = _UI32_MAX,
+	const UINT32  innerLoopSum  = 0);
+
+//----------------------------------------------------------------------------
+/// @brief Sums the buffer contents as 16 bit values in host byte order
+///
+/// @param buffer         Buffer to calculate the checksum for
+/// @param length         Buffer length in bytes
+/// @param checksumIndex  Offset to checksum field in the buffer (_UI32_MAX if none)
+/// @param checksumSeed   Seed checksum value to carry forward
+///
+/// @returns The inner loop result, which Checksum folds into the final checksum
+UINT32 ChecksumInnerLoop(
+	void   *buffer,
+	UINT32  length,
+	UINT32  checksumIndex = _UI32_MAX,
+	UINT32  innerLoopSum  = 0);
+
+//----------------------------------------------------------------------------
+/// @brief Calculates the one's complement sum of a buffer in native byte order
+///
+/// @param buffer  Buffer to sum
+/// @param length  Buffer length in bytes (must be a multiple of two)
+///
+/// @returns The sum folded to 16 bits
+UINT32 ChecksumRange(
+	const UINT8 *buffer,
+	UINT32       length);
+
+//----------------------------------------------------------------------------
+/// @brief Folds a one's complement sum to 16 bits by adding the carries
+///
+/// @param sum  Sum to fold
+///
+/// @returns The folded sum
+UINT64 FoldChecksum(UINT64 sum);
+
+//----------------------------------------------------------------------------
+/// @brief Completes a checksum from its inner loop sum
+///
+/// @param innerLoopSum  Inner loop sum of the data being checksummed
+///
+/// @returns The checksum in network byte order
+UINT16 CompleteChecksum(UINT32 innerLoopSum);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // CHECKSUM_H
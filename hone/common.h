@@ -18,7 +18,11 @@
 //----------------------------------------------------------------------------
 // Includes
 //----------------------------------------------------------------------------
+#ifdef KERNEL
 #include <ntifs.h> // ntddk.h doesn't include all the functions that we need
+#else
+#include <Windows.h> // Lets the test program build the inline data structures
+#endif
 #include <sal.h>
 
 #if (_WIN32_WINNT < _WIN32_WINNT_WIN7)
@@ -33,4 +37,30 @@
 #define ARRAY_SIZEOF(a) (sizeof(a) / sizeof(a[0]))
 #endif
 
+#define CACHE_LINE_SIZE 64  // Size of a processor cache line in bytes
+
+//----------------------------------------------------------------------------
+// Inline functions
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+/// @brief Rounds a value up to the next power of 2
+///
+/// See http://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
+///
+/// @param value  Value to round up
+///
+/// @returns Next power of 2 that is greater than or equal to the value
+static inline UINT32 RoundUpPowerOf2(__in UINT32 value)
+{
+	value--;
+	value |= value >> 1;
+	value |= value >> 2;
+	value |= value >> 4;
+	value |= value >> 8;
+	value |= value >> 16;
+	value++;
+	return value;
+}
+
 #endif // COMMON_H
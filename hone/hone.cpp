@@ -27,6 +27,7 @@ extern "C" {
 //----------------------------------------------------------------------------
 
 static const DRIVER_COMPONENT gComponents[] = {
+	{"slab allocator",  InitializeSlabAllocator,  DeinitializeSlabAllocator },
 	{"queue manager",   InitializeQueueManager,   DeinitializeQueueManager  },
 	{"process monitor", InitializeProcessMonitor, DeinitializeProcessMonitor},
 	{"network monitor", InitializeNetworkMonitor, DeinitializeNetworkMonitor},
@@ -130,6 +131,7 @@ NTSTATUS DriverEntry(
 
 	// Finish initializing read interface
 	driverObject->MajorFunction[IRP_MJ_CREATE]         = DispatchCreate;
+	driverObject->MajorFunction[IRP_MJ_CLEANUP]        = DispatchCleanup;
 	driverObject->MajorFunction[IRP_MJ_CLOSE]          = DispatchClose;
 	driverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = DispatchDeviceControl;
 	driverObject->MajorFunction[IRP_MJ_READ]           = DispatchRead;
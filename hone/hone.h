@@ -27,6 +27,7 @@ extern "C" {
 #include "network_monitor.h"
 #include "process_monitor.h"
 #include "read_interface.h"
+#include "slab_allocator.h"
 
 #include <wdf.h>
 
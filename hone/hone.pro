@@ -9,12 +9,14 @@ INCLUDEPATH += \
 
 SOURCES += \
 	../wfp_common.cpp \
+	checksum.cpp \
 	debug_print.c \
 	hone.cpp \
 	network_monitor.cpp \
 	process_monitor.cpp \
 	read_interface.cpp \
 	queue_manager.cpp \
+	slab_allocator.cpp \
 	system_id.cpp
 
 OTHER_FILES += \
@@ -24,17 +26,23 @@ OTHER_FILES += \
 
 HEADERS += \
 	../ioctls.h \
+	../packet_filter.h \
+	../pcap_ng.h \
+	../shared_ring.h \
 	../version.h \
 	../version_info.h \
 	../wfp_common.h \
+	checksum.h \
 	common.h \
 	debug_print.h \
 	hone.h \
 	hone_info.h \
+	id_set.h \
 	llrb.h \
 	llrb_clear.h \
 	network_monitor.h \
 	network_monitor_priv.h \
+	oconn_table.h \
 	process_monitor.h \
 	process_monitor_priv.h \
 	queue_manager.h \
@@ -42,4 +50,7 @@ HEADERS += \
 	read_interface.h \
 	read_interface_priv.h \
 	ring_buffer.h \
-	system_id.h
+	slab_allocator.h \
+	slab_allocator_priv.h \
+	system_id.h \
+	timer_wheel.h
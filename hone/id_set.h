@@ -0,0 +1,139 @@
+//----------------------------------------------------------------------------
+// Open-addressing hash set of 32-bit IDs
+//
+// The set is built once and then only read, so lookups need no locking.
+// Slots that hold 0 are empty, and whether 0 itself is in the set is tracked
+// separately.  The number of slots is a power of 2 that is at least twice
+// the number of IDs, so probe sequences stay short.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef ID_SET_H
+#define ID_SET_H
+
+#include "common.h"
+
+//----------------------------------------------------------------------------
+struct ID_SET {
+	UINT32  NumIds;       // Number of unique IDs in the set
+	UINT32  Mask;         // Mask to wrap a probe to the first slot
+	UINT32  Shift;        // Shift to convert a hash to a slot
+	bool    ContainsZero; // True if 0 is in the set
+	UINT32  Slots[1];     // IDs (0 if the slot is empty)
+};
+
+//----------------------------------------------------------------------------
+/// @brief Gets the number of slots needed to hold a number of IDs
+///
+/// @param numIds  Number of IDs the set will hold
+///
+/// @returns Number of slots
+static inline UINT32 GetIdSetSlots(__in const UINT32 numIds)
+{
+	return RoundUpPowerOf2((numIds < 4) ? 8 : numIds * 2);
+}
+
+//----------------------------------------------------------------------------
+/// @brief Gets the size of an ID set
+///
+/// @param numIds  Number of IDs the set will hold
+///
+/// @returns Size of the set in bytes
+static inline SIZE_T GetIdSetSize(__in const UINT32 numIds)
+{
+	return sizeof(ID_SET) + ((GetIdSetSlots(numIds) - 1) * sizeof(UINT32));
+}
+
+//----------------------------------------------------------------------------
+/// @brief Gets the slot to start probing at for an ID
+///
+/// @param set  ID set to probe
+/// @param id   ID to hash
+///
+/// @returns Slot index
+static inline UINT32 GetIdSetHash(__in const ID_SET *set, __in const UINT32 id)
+{
+	// Fibonacci hashing spreads out sequential and aligned IDs, and its top
+	// bits are the best mixed, so take the slot from them
+	return (id * 2654435761U) >> set->Shift;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Initializes an empty ID set
+///
+/// @param set     ID set to initialize, which must be GetIdSetSize bytes
+/// @param numIds  Number of IDs the set will hold
+static inline void InitIdSet(__out ID_SET *set, __in const UINT32 numIds)
+{
+	const UINT32 numSlots = GetIdSetSlots(numIds);
+
+	set->NumIds       = 0;
+	set->Mask         = numSlots - 1;
+	set->Shift        = 32;
+	set->ContainsZero = false;
+	for (UINT32 slots = numSlots; slots > 1; slots >>= 1) {
+		set->Shift--;
+	}
+	RtlZeroMemory(set->Slots, numSlots * sizeof(UINT32));
+}
+
+//----------------------------------------------------------------------------
+/// @brief Adds an ID to the set
+///
+/// @param set  ID set to add to
+/// @param id   ID to add
+static inline void IdSetInsert(__in ID_SET *set, __in const UINT32 id)
+{
+	if (!id) {
+		if (!set->ContainsZero) {
+			set->ContainsZero = true;
+			set->NumIds++;
+		}
+		return;
+	}
+
+	for (UINT32 slot = GetIdSetHash(set, id);; slot = (slot + 1) & set->Mask) {
+		if (set->Slots[slot] == id) {
+			return;
+		}
+		if (!set->Slots[slot]) {
+			set->Slots[slot] = id;
+			set->NumIds++;
+			return;
+		}
+	}
+}
+
+//----------------------------------------------------------------------------
+/// @brief Checks if an ID is in the set
+///
+/// @param set  ID set to check
+/// @param id   ID to look for
+///
+/// @returns True if the ID is in the set; false otherwise
+static inline bool IsIdInSet(__in const ID_SET *set, __in const UINT32 id)
+{
+	if (!id) {
+		return set->ContainsZero;
+	}
+
+	for (UINT32 slot = GetIdSetHash(set, id);; slot = (slot + 1) & set->Mask) {
+		if (set->Slots[slot] == id) {
+			return true;
+		}
+		if (!set->Slots[slot]) {
+			return false;
+		}
+	}
+}
+
+#endif  // ID_SET_H
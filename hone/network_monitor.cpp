@@ -45,57 +45,57 @@ extern "C" {
 
 static UINT32            *gCalloutIds        = NULL;   // Registered callout IDs
 static DEVICE_OBJECT     *gDevice            = NULL;   // Driver's device object
-static LOOKASIDE_LIST_EX  gNetBufferLal;               // Holds memory for netbuffer storage
-static bool               gNetBufferLalInit  = false;  // True if lookaside list was initialized
+static FLOW_TEMPLATE     *gFlowTemplates     = NULL;   // Per-processor caches of outbound header templates
+static UINT32             gNumProcessors     = 0;      // Number of active processors when driver loaded
 static LONG               gPacketCount       = 0;      // Number of packets processed
 static LOOKASIDE_LIST_EX  gPacketInfoLal;              // Holds memory for packet information structures
 static bool               gPacketInfoLalInit = false;  // True if lookaside list was initialized
 static const UINT32       gPoolTag           = 'gNoH'; // Tag to use when allocating general pool data
+static const UINT32       gPoolTagFlow       = 'fNoH'; // Tag to use when allocating flow template caches
 static const UINT32       gPoolTagLookaside  = 'lNoH'; // Tag to use when allocating lookaside buffers
 
 //----------------------------------------------------------------------------
-UINT16 Checksum(
-	void         *buffer,
-	const UINT32  length,
-	const UINT32  checksumIndex,
-	const UINT32  innerLoopSum)
+void BuildFlowTemplate(
+	__in const PACKET_INFO *packetInfo,
+	__out FLOW_TEMPLATE    *flow)
 {
-	UINT16  checksum;
-	UINT32  sum = ChecksumInnerLoop(buffer, length, checksumIndex, innerLoopSum);
-
-	// Take 16 bits out of the 32 bit sum and add up the carries
-	while (sum >> 16) {
-		sum = (sum & 0xFFFF) + (sum >> 16);
-	}
-
-	// Save the one's complement of the result in network byte order
-	checksum = RtlUshortByteSwap(~sum & 0xFFFF);
-
-	// Convert all 0 checksums to 0xFFFF, not just UDP checksums
-	// http://communities.intel.com/community/wired/blog/2009/06/03/checksums-and-plus-or-minus-zero
-	return (checksum == 0) ? 0xFFFF : checksum;
-}
-
-//----------------------------------------------------------------------------
-UINT32 ChecksumInnerLoop(
-	void   *buffer,
-	UINT32  length,
-	UINT32  checksumIndex,
-	UINT32  innerLoopSum)
-{
-	UINT16 *buffer16 = reinterpret_cast<UINT16*>(buffer);
-	UINT32  index;
+	RtlZeroMemory(flow, sizeof(FLOW_TEMPLATE));
+	flow->AddressFamily = packetInfo->AddressFamily;
+	flow->ConnectionId  = packetInfo->ConnectionId;
+	flow->Protocol      = packetInfo->Protocol;
+	flow->SrcIp         = packetInfo->SrcIp;
+	flow->DstIp         = packetInfo->DstIp;
+
+	// Build the headers and sum the pseudo-header with zero lengths, since
+	// adding a length to the sums is the same as summing it in place
+	if (packetInfo->AddressFamily == AF_INET) {
+		IPV4_PSEUDO_HEADER ph = {0};
+
+		flow->Ipv4Header.VersionHeaderLen = 0x45;
+		flow->Ipv4Header.TimeToLive       = 128;
+		flow->Ipv4Header.Protocol         = packetInfo->Protocol;
+		flow->Ipv4Header.SrcIp            = packetInfo->SrcIp.AsUInt32;
+		flow->Ipv4Header.DstIp            = packetInfo->DstIp.AsUInt32;
+		flow->HeaderSum = ChecksumInnerLoop(&flow->Ipv4Header,
+				sizeof(flow->Ipv4Header), 10);
+
+		ph.SrcIp        = packetInfo->SrcIp.AsUInt32;
+		ph.DstIp        = packetInfo->DstIp.AsUInt32;
+		ph.Protocol     = packetInfo->Protocol;
+		flow->PseudoSum = ChecksumInnerLoop(&ph, sizeof(ph));
+	} else {
+		IPV6_PSEUDO_HEADER ph = {0};
 
-	length        /= 2;
-	checksumIndex /= 2;
+		flow->Ipv6Header.Control    = 0x60;
+		flow->Ipv6Header.NextHeader = packetInfo->Protocol;
+		RtlCopyMemory(flow->Ipv6Header.SrcIp, packetInfo->SrcIp.AsUInt8, 16);
+		RtlCopyMemory(flow->Ipv6Header.DstIp, packetInfo->DstIp.AsUInt8, 16);
 
-	// Sum each 16 bit value in the header in host byte order
-	for (index = 0; index < length; index++) {
-		if (index != checksumIndex) { // Skip checksum field
-			innerLoopSum += RtlUshortByteSwap(buffer16[index]);
-		}
+		RtlCopyMemory(ph.SrcIp, packetInfo->SrcIp.AsUInt8, 16);
+		RtlCopyMemory(ph.DstIp, packetInfo->DstIp.AsUInt8, 16);
+		ph.NextHeader   = packetInfo->Protocol;
+		flow->PseudoSum = ChecksumInnerLoop(&ph, sizeof(ph));
 	}
-	return innerLoopSum;
 }
 
 //----------------------------------------------------------------------------
@@ -105,6 +105,7 @@ void CapturePacketData(
 {
 	BLOCK_NODE   *blockNode        = NULL;
 	char         *blockData        = NULL; // Pointer to data in the block node
+	FLOW_TEMPLATE flow             = {0};  // Header templates for generated IP header
 	UINT32        bytesCaptured    = 0;    // Number of data bytes captured
 	UINT32        bytesToCapture   = 0;    // Number of data bytes to capture
 	UINT32        bytesToCopy      = 0;    // Number of bytes to copy from a buffer
@@ -113,7 +114,6 @@ void CapturePacketData(
 	const UINT32  maxSnapLen       = QmGetMaxSnapLen();
 	UINT32        newIpHeaderSize  = 0;    // Size of generated IP header
 	NET_BUFFER   *netBuffer        = NULL;
-	void         *netBufferStorage = NULL; // For non-contiguous net buffer data
 	LONG          packetId;                // Unique packet ID
 
 	// Get the size of data in the net buffer list
@@ -146,43 +146,33 @@ void CapturePacketData(
 
 	// -=-=- Need to run cleanup code after this point -=-=-
 
-	// Allocate packet buffer and maximum-sized backing storage
+	// Allocate packet buffer
 	blockNode = QmAllocatePacketBlock(bytesToCapture, &blockData);
 	if (!blockNode) {
 		DBGPRINT(D_ERR, "Cannot allocate packet block for %u bytes of data",
 				bytesToCapture);
 		goto Cleanup;
 	}
-	netBufferStorage = ExAllocateFromLookasideListEx(&gNetBufferLal);
-	if (!netBufferStorage) {
-		DBGPRINT(D_ERR, "Cannot allocate %u bytes for net buffer data", _UI16_MAX);
-		goto Cleanup;
-	}
 
-	// Generate a new IP header for outbound packets and copy it into the block
+	// Generate a new IP header for outbound packets from the flow's template
+	// and copy it into the block.  Only the length fields change from packet
+	// to packet, so patch them in and update the checksum incrementally.
 	if (newIpHeaderSize) {
+		GetFlowTemplate(packetInfo, &flow);
 		if (packetInfo->AddressFamily == AF_INET) {
-			IPV4_HEADER header = {0};
-
-			header.VersionHeaderLen = 0x45;
-			header.TotalLength      = RtlUshortByteSwap(dataSize);
-			header.TimeToLive       = 128;
-			header.Protocol         = packetInfo->Protocol;
-			header.SrcIp            = packetInfo->SrcIp.AsUInt32;
-			header.DstIp            = packetInfo->DstIp.AsUInt32;
-			header.Checksum         = Checksum(&header, sizeof(header), 10);
-			bytesToCopy             = (sizeof(header) > bytesToCapture) ?
+			IPV4_HEADER header = flow.Ipv4Header;
+
+			header.TotalLength = RtlUshortByteSwap(dataSize);
+			header.Checksum    = CompleteChecksum(flow.HeaderSum +
+					static_cast<UINT16>(dataSize));
+			bytesToCopy        = (sizeof(header) > bytesToCapture) ?
 					bytesToCapture : sizeof(header);
 			RtlCopyMemory(blockData, &header, bytesToCopy);
 			bytesCaptured += bytesToCopy;
 		} else {
-			IPV6_HEADER header = {0};
+			IPV6_HEADER header = flow.Ipv6Header;
 
-			header.Control       = 0x60;
 			header.PayloadLength = RtlUshortByteSwap(dataSize - newIpHeaderSize);
-			header.NextHeader    = packetInfo->Protocol;
-			RtlCopyMemory(header.SrcIp, packetInfo->SrcIp.AsUInt8, 16);
-			RtlCopyMemory(header.DstIp, packetInfo->DstIp.AsUInt8, 16);
 			bytesToCopy = (sizeof(header) > bytesToCapture) ?
 					bytesToCapture : sizeof(header);
 			RtlCopyMemory(blockData, &header, bytesToCopy);
@@ -201,26 +191,22 @@ void CapturePacketData(
 		}
 	}
 
-	// Copy packet data into the block
+	// Copy packet data directly into the block
 	for (
 			netBuffer = NET_BUFFER_LIST_FIRST_NB(packetInfo->NetBufferList);
 			(netBuffer != NULL) && (bytesCaptured < bytesToCapture);
 			netBuffer = NET_BUFFER_NEXT_NB(netBuffer)) {
-		const UINT32  netBufferSize = NET_BUFFER_DATA_LENGTH(netBuffer);
-		char         *buffer;
+		const UINT32 netBufferSize = NET_BUFFER_DATA_LENGTH(netBuffer);
 
 		if (!netBufferSize) {
 			continue;
 		}
 		bytesToCopy = (bytesCaptured + netBufferSize > bytesToCapture) ?
 				bytesToCapture - bytesCaptured : netBufferSize;
-		buffer = reinterpret_cast<char*>(NdisGetDataBuffer(netBuffer, bytesToCopy,
-				netBufferStorage, 1, 0));
-		if (!buffer) {
+		if (!CopyNetBufferData(netBuffer, blockData + bytesCaptured, bytesToCopy)) {
 			DBGPRINT(D_ERR, "Cannot get %u bytes of net buffer data", bytesToCopy);
 			goto Cleanup;
 		}
-		RtlCopyMemory(blockData + bytesCaptured, buffer, bytesToCopy);
 		bytesCaptured += bytesToCopy;
 	}
 
@@ -230,26 +216,18 @@ void CapturePacketData(
 
 	// Fix TCP and UDP checksums if generated IP header
 	if (checksumOffset && (bytesCaptured > newIpHeaderSize + checksumOffset + 2)) {
-		UINT32 innerLoopSum;
-		UINT16 checksum;
-		UINT32 dataLength;
+		const UINT32 payloadLength = dataSize - newIpHeaderSize;
+		UINT32       innerLoopSum;
+		UINT16       checksum;
+		UINT32       dataLength;
 
+		// Add the payload length to the cached pseudo-header sum (16 bits for
+		// IPv4 and 32 bits for IPv6)
 		if (packetInfo->AddressFamily == AF_INET) {
-			IPV4_PSEUDO_HEADER ph = {0};
-
-			ph.SrcIp     = packetInfo->SrcIp.AsUInt32;
-			ph.DstIp     = packetInfo->DstIp.AsUInt32;
-			ph.Protocol  = packetInfo->Protocol;
-			ph.Length    = RtlUshortByteSwap(dataSize - newIpHeaderSize);
-			innerLoopSum = ChecksumInnerLoop(&ph, sizeof(ph));
+			innerLoopSum = flow.PseudoSum + static_cast<UINT16>(payloadLength);
 		} else {
-			IPV6_PSEUDO_HEADER ph = {0};
-
-			RtlCopyMemory(ph.SrcIp, packetInfo->SrcIp.AsUInt8, 16);
-			RtlCopyMemory(ph.DstIp, packetInfo->DstIp.AsUInt8, 16);
-			ph.NextHeader = packetInfo->Protocol;
-			ph.Length     = RtlUlongByteSwap(dataSize - newIpHeaderSize);
-			innerLoopSum  = ChecksumInnerLoop(&ph, sizeof(ph));
+			innerLoopSum = flow.PseudoSum + (payloadLength >> 16) +
+					(payloadLength & 0xFFFF);
 		}
 
 		dataLength = bytesCaptured - newIpHeaderSize;
@@ -272,9 +250,6 @@ Cleanup:
 	if (blockNode) {
 		QmCleanupBlock(blockNode);
 	}
-	if (netBufferStorage) {
-		ExFreeToLookasideListEx(&gNetBufferLal, netBufferStorage);
-	}
 }
 
 //----------------------------------------------------------------------------
@@ -353,6 +328,43 @@ void ConnectionCallout(
 	QmEnqueueConnectionBlock(connectionOpened, connectionId, processId);
 }
 
+//----------------------------------------------------------------------------
+bool CopyNetBufferData(
+	__in NET_BUFFER                 *netBuffer,
+	__out_bcount(length) char       *destination,
+	__in const UINT32                length)
+{
+	MDL    *mdl    = NET_BUFFER_CURRENT_MDL(netBuffer);
+	ULONG   offset = NET_BUFFER_CURRENT_MDL_OFFSET(netBuffer);
+	UINT32  copied = 0;
+
+	// Walk the MDL chain and copy each mapped piece of the net buffer, so that
+	// non-contiguous data doesn't need to be gathered into separate storage
+	while (mdl && (copied < length)) {
+		void  *address   = NULL;
+		ULONG  mdlLength = 0;
+
+		NdisQueryMdl(mdl, &address, &mdlLength, NormalPagePriority);
+		if (!address) {
+			return false;
+		}
+		if (mdlLength > offset) {
+			UINT32 bytesToCopy = mdlLength - offset;
+			if (bytesToCopy > length - copied) {
+				bytesToCopy = length - copied;
+			}
+			RtlCopyMemory(destination + copied,
+					reinterpret_cast<char*>(address) + offset, bytesToCopy);
+			copied += bytesToCopy;
+			offset  = 0;
+		} else {
+			offset -= mdlLength;
+		}
+		mdl = mdl->Next;
+	}
+	return (copied == length) ? true : false;
+}
+
 //----------------------------------------------------------------------------
 __checkReturn
 NTSTATUS DeinitializeNetworkMonitor(void)
@@ -375,16 +387,47 @@ NTSTATUS DeinitializeNetworkMonitor(void)
 		ExFreePool(gCalloutIds);
 	}
 
-	if (gNetBufferLalInit) {
-		ExDeleteLookasideListEx(&gNetBufferLal);
-	}
 	if (gPacketInfoLalInit) {
 		ExDeleteLookasideListEx(&gPacketInfoLal);
 	}
+	if (gFlowTemplates) {
+		ExFreePool(gFlowTemplates);
+		gFlowTemplates = NULL;
+	}
 
 	return STATUS_SUCCESS;
 }
 
+//----------------------------------------------------------------------------
+void GetFlowTemplate(
+	__in const PACKET_INFO *packetInfo,
+	__out FLOW_TEMPLATE    *flow)
+{
+	KIRQL oldIrql;
+
+	// Raise IRQL so that we stay on this processor while using its cache
+	KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+	const ULONG index = KeGetCurrentProcessorNumberEx(NULL);
+	if (gFlowTemplates && (index < gNumProcessors)) {
+		const UINT32   hash  = (packetInfo->ConnectionId * 2654435761U) >> 16;
+		FLOW_TEMPLATE *entry = gFlowTemplates + (index * FLOW_CACHE_SIZE) +
+				(hash & (FLOW_CACHE_SIZE - 1));
+
+		// Rebuild the entry if it holds a different flow
+		if ((entry->AddressFamily != packetInfo->AddressFamily) ||
+				(entry->ConnectionId != packetInfo->ConnectionId) ||
+				(entry->Protocol != packetInfo->Protocol) ||
+				!RtlEqualMemory(&entry->SrcIp, &packetInfo->SrcIp, sizeof(IP_ADDRESS)) ||
+				!RtlEqualMemory(&entry->DstIp, &packetInfo->DstIp, sizeof(IP_ADDRESS))) {
+			BuildFlowTemplate(packetInfo, entry);
+		}
+		RtlCopyMemory(flow, entry, sizeof(FLOW_TEMPLATE));
+	} else {
+		BuildFlowTemplate(packetInfo, flow);
+	}
+	KeLowerIrql(oldIrql);
+}
+
 //----------------------------------------------------------------------------
 __checkReturn
 NTSTATUS InitializeNetworkMonitor(DEVICE_OBJECT *device)
@@ -395,6 +438,18 @@ NTSTATUS InitializeNetworkMonitor(DEVICE_OBJECT *device)
 	// Save pointer to the device object
 	gDevice = device;
 
+	// Allocate a cache of outbound header templates for each processor
+	gNumProcessors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	gFlowTemplates = reinterpret_cast<FLOW_TEMPLATE*>(ExAllocatePoolWithTag(
+			NonPagedPoolCacheAligned,
+			gNumProcessors * FLOW_CACHE_SIZE * sizeof(FLOW_TEMPLATE), gPoolTagFlow));
+	if (!gFlowTemplates) {
+		DBGPRINT(D_ERR, "Cannot allocate flow template caches");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(gFlowTemplates,
+			gNumProcessors * FLOW_CACHE_SIZE * sizeof(FLOW_TEMPLATE));
+
 	// Allocate memory to hold registered callout IDs
 	gCalloutIds = reinterpret_cast<UINT32*>(ExAllocatePoolWithTag(NonPagedPool,
 			HoneNumLayers() * sizeof(UINT32), gPoolTag));
@@ -427,14 +482,6 @@ NTSTATUS InitializeNetworkMonitor(DEVICE_OBJECT *device)
 		gCalloutIds[index] = calloutId;
 	}
 
-	status = ExInitializeLookasideListEx(&gNetBufferLal, NULL, NULL,
-			NonPagedPool, 0, _UI16_MAX, gPoolTagLookaside, 0);
-	if (!NT_SUCCESS(status)) {
-		DBGPRINT(D_ERR, "Cannot create net buffer lookaside list");
-		return status;
-	}
-	gNetBufferLalInit = true;
-
 	status = ExInitializeLookasideListEx(&gPacketInfoLal, NULL, NULL,
 			NonPagedPool, 0, _UI16_MAX, gPoolTagLookaside, 0);
 	if (!NT_SUCCESS(status)) {
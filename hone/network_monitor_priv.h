@@ -42,10 +42,17 @@ extern "C" {
 
 // Project includes
 #include "../wfp_common.h"
+#include "checksum.h"
 #include "queue_manager.h"
 #include "hone_info.h"
 #include "debug_print.h"
 
+//----------------------------------------------------------------------------
+// Defines
+//----------------------------------------------------------------------------
+
+#define FLOW_CACHE_SIZE 64  // Number of flow templates cached by each processor (must be a power of 2)
+
 //----------------------------------------------------------------------------
 // Structures and enumerations
 //----------------------------------------------------------------------------
@@ -109,41 +116,32 @@ struct PACKET_INFO {
 	IP_ADDRESS       DstIp;          // Destination IP address for outbound packets
 };
 
+// Headers generated for outbound packets on a connection, with the length
+// fields set to zero so that each packet only needs to patch them in
+struct FLOW_TEMPLATE {
+	ADDRESS_FAMILY  AddressFamily;  // IPv4 or IPv6 (0 if the template is unused)
+	UINT32          ConnectionId;   // 32-bit connection associated with the flow
+	UINT8           Protocol;       // IP protocol for the flow
+	IP_ADDRESS      SrcIp;          // Source IP address
+	IP_ADDRESS      DstIp;          // Destination IP address
+	UINT32          HeaderSum;      // Inner loop sum of the IPv4 header template
+	UINT32          PseudoSum;      // Inner loop sum of the pseudo-header template
+	IPV4_HEADER     Ipv4Header;     // IPv4 header template
+	IPV6_HEADER     Ipv6Header;     // IPv6 header template
+};
+
 //----------------------------------------------------------------------------
 // Function prototypes
 //----------------------------------------------------------------------------
 
 //----------------------------------------------------------------------------
-/// @brief Calculates the checksum for a buffer
-///
-/// See RFC 1701 - https://tools.ietf.org/html/rfc1071
-///
-/// @param buffer         Buffer to calculate the checksum for
-/// @param length         Buffer length in bytes
-/// @param checksumIndex  Offset to checksum field in the buffer (_UI32_MAX if none)
-/// @param innerLoopSum   Inner loop sum value to carry forward
-///
-/// @returns The checksum
-UINT16 Checksum(
-	void         *buffer,
-	const UINT32  length,
-	const UINT32  checksumIndex = _UI32_MAX,
-	const UINT32  innerLoopSum  = 0);
-
-//----------------------------------------------------------------------------
-/// @brief Sums the buffer contents, 16 bits at a time
-///
-/// @param buffer         Buffer to calculate the checksum for
-/// @param length         Buffer length in bytes
-/// @param checksumIndex  Offset to checksum field in the buffer (_UI32_MAX if none)
-/// @param checksumSeed   Seed checksum value to carry forward
+/// @brief Builds the header templates for a packet's flow
 ///
-/// @returns The inner loop result
-UINT32 ChecksumInnerLoop(
-	void   *buffer,
-	UINT32  length,
-	UINT32  checksumIndex = _UI32_MAX,
-	UINT32  innerLoopSum  = 0);
+/// @param packetInfo  Information about the packet to build templates for
+/// @param flow        Receives the templates
+void BuildFlowTemplate(
+	__in const PACKET_INFO *packetInfo,
+	__out FLOW_TEMPLATE    *flow);
 
 //----------------------------------------------------------------------------
 /// @brief Captures and enqueues data from the packet
@@ -172,6 +170,33 @@ void ConnectionCallout(
 	__in UINT64                               flowContext,
 	__out FWPS_CLASSIFY_OUT                  *classifyOut);
 
+//----------------------------------------------------------------------------
+/// @brief Copies data from a net buffer by walking its MDL chain
+///
+/// @param netBuffer    Net buffer to copy data from
+/// @param destination  Buffer to receive the data
+/// @param length       Number of bytes to copy from the start of the net buffer
+///
+/// @returns True if successful; false if an MDL cannot be mapped or the net
+///          buffer holds fewer than length bytes
+bool CopyNetBufferData(
+	__in NET_BUFFER                 *netBuffer,
+	__out_bcount(length) char       *destination,
+	__in const UINT32                length);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the header templates for a packet's flow
+///
+/// Looks up the templates in the current processor's cache, and builds and
+/// caches them if they aren't already there.
+///
+/// @param packetInfo  Information about the packet to get templates for
+/// @param flow        Receives a copy of the templates
+__drv_maxIRQL(DISPATCH_LEVEL)
+void GetFlowTemplate(
+	__in const PACKET_INFO *packetInfo,
+	__out FLOW_TEMPLATE    *flow);
+
 //----------------------------------------------------------------------------
 /// @brief Called when a filter is added to or deleted from the engine
 ///
@@ -0,0 +1,140 @@
+//----------------------------------------------------------------------------
+// Tables of previously opened connections indexed directly by port
+//
+// Each entry carries a sequence number that is odd while the entry is being
+// written.  Writers are serialized by the caller, and readers take no locks:
+// they retry if the sequence number is odd or changes while they copy the
+// entry, so they never see a process ID from one connection paired with the
+// timestamp of another.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef OCONN_TABLE_H
+#define OCONN_TABLE_H
+
+#include <limits.h>
+#ifdef KERNEL
+#include "common.h"
+#include <ws2def.h>
+#else
+#include <WinSock2.h> // Must come before Windows.h
+#include "common.h"
+#endif
+
+#define OCONN_TABLE_SIZE 65536  // Number of entries in each open connection table (one per port)
+
+//----------------------------------------------------------------------------
+// Open connection tables, one for each protocol and address family
+enum OCONN_TABLE_INDEX {
+	OconnTcp4Table,
+	OconnTcp6Table,
+	OconnUdp4Table,
+	OconnUdp6Table,
+	OconnNumTables,
+};
+
+//----------------------------------------------------------------------------
+// Information for an open connection on a port
+struct OCONN_ENTRY {
+	volatile LONG   Sequence;   // Odd while the entry is being written
+	UINT32          ProcessId;  // Process that owns the connection (_UI32_MAX if none)
+	LARGE_INTEGER   Timestamp;  // Time connection was opened
+};
+
+//----------------------------------------------------------------------------
+// Previously opened connections supplied by user mode.  Each table is indexed
+// directly by port, and tables without any connections are NULL.  A full list
+// of connections replaces the tables as a whole, while changes to the list
+// update entries in place (see SetOconnEntry).
+struct OCONN_TABLES {
+	OCONN_ENTRY * volatile Tables[OconnNumTables];  // Open connections for each table index
+};
+
+//----------------------------------------------------------------------------
+/// @brief Gets the open connection table for a protocol and address family
+///
+/// @param addressFamily  Address family for the connection (IPv4/IPv6)
+/// @param protocol       Protocol for the connection (TCP/UDP)
+///
+/// @returns Index of the open connection table
+static inline OCONN_TABLE_INDEX GetOconnTableIndex(
+	__in const UINT16 addressFamily,
+	__in const UINT8  protocol)
+{
+	if (addressFamily == AF_INET) {
+		return (protocol == IPPROTO_TCP) ? OconnTcp4Table : OconnUdp4Table;
+	}
+	return (protocol == IPPROTO_TCP) ? OconnTcp6Table : OconnUdp6Table;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Marks every port in an open connection table as having no
+/// connection
+///
+/// @param oconnTable  Table of OCONN_TABLE_SIZE entries to initialize
+static inline void InitOconnTable(__out OCONN_ENTRY *oconnTable)
+{
+	for (UINT32 port = 0; port < OCONN_TABLE_SIZE; port++) {
+		oconnTable[port].Sequence           = 0;
+		oconnTable[port].ProcessId          = _UI32_MAX;
+		oconnTable[port].Timestamp.QuadPart = 0;
+	}
+}
+
+//----------------------------------------------------------------------------
+/// @brief Changes an open connection entry that readers may be using
+///
+/// The interlocked increments are full barriers, so the sequence number is
+/// odd for as long as either field can be seen partly written.  The caller
+/// serializes writers and keeps them from being preempted by a reader on the
+/// same processor (see SetOconnEntry).
+///
+/// @param oconnEntry  Entry to store the connection in
+/// @param processId   Process that owns the connection (_UI32_MAX for none)
+/// @param timestamp   Time connection was opened
+static inline void WriteOconnEntry(
+	__in OCONN_ENTRY          *oconnEntry,
+	__in const UINT32          processId,
+	__in const LARGE_INTEGER  *timestamp)
+{
+	InterlockedIncrement(&oconnEntry->Sequence);
+	oconnEntry->ProcessId = processId;
+	oconnEntry->Timestamp = *timestamp;
+	InterlockedIncrement(&oconnEntry->Sequence);
+}
+
+//----------------------------------------------------------------------------
+/// @brief Reads an open connection entry without locking it
+///
+/// @param oconnEntry  Entry to read
+/// @param timestamp   Receives the time connection was opened
+///
+/// @returns Process that owns the connection, or _UI32_MAX if none
+static inline UINT32 ReadOconnEntry(
+	__in const OCONN_ENTRY  *oconnEntry,
+	__out LARGE_INTEGER     *timestamp)
+{
+	UINT32 processId;
+	LONG   sequence;
+
+	// Retry if the entry was being changed
+	do {
+		sequence = oconnEntry->Sequence;
+		MemoryBarrier();
+		processId  = oconnEntry->ProcessId;
+		*timestamp = oconnEntry->Timestamp;
+		MemoryBarrier();
+	} while ((sequence & 1) || (sequence != oconnEntry->Sequence));
+	return processId;
+}
+
+#endif // OCONN_TABLE_H
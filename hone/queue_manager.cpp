@@ -29,51 +29,66 @@ extern "C" {
 #pragma warning(push)
 #pragma warning(disable:4706) // LLRB uses assignments in conditional expressions
 LLRB_GENERATE(BlockTree, BLOCK_NODE, TreeEntry, CompareBlockNodes)
-LLRB_GENERATE(OconnTree, OCONN_NODE, TreeEntry, CompareOconnNodes)
 #pragma warning(pop)
 
 LLRB_CLEAR_GENERATE(BlockTree, BLOCK_NODE, TreeEntry, QmCleanupBlock)
-LLRB_CLEAR_GENERATE(OconnTree, OCONN_NODE, TreeEntry, CleanupOconnNode)
 
-static BLOCK_TREE_HEAD     gConnTreeHead        = LLRB_INITIALIZER(&gConnTreeHead);      // Open connections
-static OCONN_TREE_HEAD     gOconnTcp4TreeHead   = LLRB_INITIALIZER(&gOconnTcp4TreeHead); // Previously opened TCP/IPv4 connections
-static OCONN_TREE_HEAD     gOconnTcp6TreeHead   = LLRB_INITIALIZER(&gOconnTcp6TreeHead); // Previously opened TCP/IPv6 connections
-static OCONN_TREE_HEAD     gOconnUdp4TreeHead   = LLRB_INITIALIZER(&gOconnUdp4TreeHead); // Previously opened UDP/IPv4 connections
-static OCONN_TREE_HEAD     gOconnUdp6TreeHead   = LLRB_INITIALIZER(&gOconnUdp6TreeHead); // Previously opened UDP/IPv6 connections
 static BLOCK_TREE_HEAD     gPacketTreeHead      = LLRB_INITIALIZER(&gPacketTreeHead);    // Held packets
 static BLOCK_TREE_HEAD     gProcessTreeHead     = LLRB_INITIALIZER(&gProcessTreeHead);   // Running processes
 
-static LOOKASIDE_LIST_EX   gBlockNodeLal;                   // Holds memory for the block nodes
-static bool                gBlockNodeLalInit    = false;    // True if lookaside list was initialized
 static KDPC                gConnCloseDpc;                   // DPC to process connection close events
+static CPU_STATISTICS     *gCpuStatistics       = NULL;     // Per-processor statistics
 static KTIMER              gConnCloseTimer;                 // Timer to trigger processing of connection close events
 static LARGE_INTEGER       gConnCloseTimeout;               // Timeout to use for connection close timer
-static LIST_ENTRY          gConnCloseListHead   = {0};      // Head of list of closed connections
-static UINT16              gConnTreeCount       = 0;        // Number of open connections
+static KSPIN_LOCK          gConnCloseLock;                  // Locks connection close timing wheel
+static TIMER_WHEEL         gConnCloseWheel;                 // Schedules removal of closed connections
+static BLOCK_NODE         *gConnTable[CONN_TABLE_SIZE];     // Open connections hashed by connection ID
+static volatile LONG       gConnTableCount      = 0;        // Number of open connections
+static CONN_TABLE_LOCK     gConnTableLocks[CONN_TABLE_LOCKS]; // Locks stripes of connection table buckets
 static LARGE_INTEGER       gDriverLoadTick      = {0};      // Tick count when driver loaded
-static LOOKASIDE_LIST_EX   gOconnNodeLal;                   // Holds memory for the open connection nodes
-static bool                gOconnNodeLalInit    = false;    // True if lookaside list was initialized
-static UINT16              gPacketTreeCount     = 0;        // Number of held packets
-static const UINT32        gPoolTagBlockNode    = 'bQoH';   // Tag to use when allocating block nodes from lookaside list
-static const UINT32        gPoolTagConnection   = 'cQoH';   // Tag to use when allocating connection block buffers
-static const UINT32        gPoolTagInterface    = 'iQoH';   // Tag to use when allocating interface description block buffers
-static const UINT32        gPoolTagPacket       = 'kQoH';   // Tag to use when allocating packet block buffers
-static const UINT32        gPoolTagOconnNode    = 'oQoH';   // Tag to use when allocating open connection nodes from lookaside list
-static const UINT32        gPoolTagProcess      = 'pQoH';   // Tag to use when allocating process block buffers
+static UINT32              gHeldPacketBudget    = HELD_PACKET_MEMORY; // Maximum memory for held packets in bytes
+static UINT32              gHeldPacketBytes     = 0;        // Memory used by held packets in bytes
+static KDPC                gHeldPacketDpc;                  // DPC to release expired held packets
+static UINT32              gHeldPacketTicks     = 0;        // Maximum number of ticks to hold a packet
+static KTIMER              gHeldPacketTimer;                // Timer to trigger release of expired held packets
+static LARGE_INTEGER       gHeldPacketTimeout;              // Timeout to use for held packet timer
+static TIMER_WHEEL         gHeldPacketWheel;                // Schedules expiration of held packets
+static FAST_MUTEX          gOconnMutex;                     // Serializes changes to the open connection tables
+static OCONN_TABLES * volatile gOconnTables = NULL;         // Previously opened connections
+static UINT32              gNumProcessors       = 0;        // Number of active processors when driver loaded
+static UINT32              gPacketTreeCount     = 0;        // Number of held packets
+static const UINT32        gPoolTagConnection   = 'cQoH';   // Tag to use when allocating oversized connection blocks
+static const UINT32        gPoolTagDpc          = 'dQoH';   // Tag to use when allocating reader snapshot synchronization DPCs
+static const UINT32        gPoolTagFilter       = 'fQoH';   // Tag to use when allocating filtered ID sets and packet filters
+static const UINT32        gPoolTagInterface    = 'iQoH';   // Tag to use when allocating oversized interface description blocks
+static const UINT32        gPoolTagPacket       = 'kQoH';   // Tag to use when allocating oversized packet blocks
+static const UINT32        gPoolTagOconnTable   = 'oQoH';   // Tag to use when allocating open connection tables
+static const UINT32        gPoolTagProcess      = 'pQoH';   // Tag to use when allocating oversized process blocks
+static const UINT32        gPoolTagReaders      = 'lQoH';   // Tag to use when allocating reader snapshots
 static const UINT32        gPoolTagRingBuffer   = 'rQoH';   // Tag to use when allocating initial blocks ring buffer
-static const UINT32        gPoolTagSection      = 'sQoH';   // Tag to use when allocating section header block buffers
+static const UINT32        gPoolTagSection      = 'sQoH';   // Tag to use when allocating oversized section header blocks
+static const UINT32        gPoolTagStatistics   = 'tQoH';   // Tag to use when allocating per-processor statistics
 static UINT16              gProcessTreeCount    = 0;        // Number of running processes
 static LIST_ENTRY          gReaderListHead      = {0};      // Head of list of registered readers
 static KSPIN_LOCK          gReaderListLock;                 // Locks list of registered readers
+static READER_SNAPSHOT * volatile gReaderSnapshot = NULL;  // Snapshot of registered readers for enqueuing blocks
 static LARGE_INTEGER       gReaderTick          = {0};      // Tick count when first register registered
 static BLOCK_NODE         *gSectionHeaderBlock  = NULL;     // PCAP-NG section header block
 static STATISTICS          gStatistics    = {HONE_VERSION}; // Driver statistics;
+static KDPC               *gSyncDpcs            = NULL;     // DPCs to wait for processors to finish with reader snapshots
+static KEVENT              gSyncEvent;                      // Signaled when all synchronization DPCs have run
+static FAST_MUTEX          gSyncMutex;                      // Serializes waits for reader snapshots
+static LONG                gSyncPending         = 0;        // Number of synchronization DPCs that haven't run yet
+static volatile LONG       gTimersStopped       = 0;        // Keeps DPCs and enqueue paths from restarting timers while unloading
 static const LONGLONG      gTimestampConv = 11644473600;    // Number of seconds between 1/1/1601 and 1/1/1970
-static KSPIN_LOCK          gTreesLock;                      // Locks connection and process LLRB trees
+static KSPIN_LOCK          gTreesLock;                      // Locks packet and process LLRB trees
 
-// Ring buffer size registry key and value
+// Registry key and values
 static wchar_t *gBufferSizeKeyPath   = L"\\Registry\\Machine\\SOFTWARE\\PNNL\\Hone";
 static wchar_t *gBufferSizeValueName = L"RingBufferSize";
+static wchar_t *gHeldMemoryValueName = L"HeldPacketMemory";
+static wchar_t *gHeldTimeValueName   = L"HeldPacketTime";
+static wchar_t *gPerCpuValueName     = L"PerProcessorRings";
 
 //----------------------------------------------------------------------------
 __checkReturn
@@ -81,32 +96,82 @@ BLOCK_NODE* AllocateBlockNode(
 	__in const UINT32 blockLength,
 	__in const UINT32 poolTag)
 {
-	BLOCK_NODE *blockNode = reinterpret_cast<BLOCK_NODE*>(
-			ExAllocateFromLookasideListEx(&gBlockNodeLal));
+	UINT32 sizeClass;
+
+	// Allocate the block node and its data together from the smallest slab
+	// that can hold both
+	BLOCK_NODE *blockNode = reinterpret_cast<BLOCK_NODE*>(SlabAllocate(
+			sizeof(BLOCK_NODE) + blockLength, poolTag, &sizeClass));
 	if (!blockNode) {
 		return NULL;
 	}
 
 	// Zero block node header, but not the data
-	RtlZeroMemory(blockNode, sizeof(BLOCK_NODE) - sizeof(blockNode->Data));
+	RtlZeroMemory(blockNode, sizeof(BLOCK_NODE));
 	blockNode->ConnectionId = 0xFFFFFFFF;
-
-	// Allocate separate data buffer if the block node isn't large enough to
-	// hold all of the data
-	if (blockLength > sizeof(blockNode->Data)) {
-		blockNode->Buffer = reinterpret_cast<char*>(ExAllocatePoolWithTag(
-				NonPagedPool, blockLength, poolTag));
-		if (!blockNode->Buffer) {
-			ExFreeToLookasideListEx(&gBlockNodeLal, blockNode);
-			return NULL;
-		}
-	}
+	blockNode->SizeClass    = sizeClass;
+	blockNode->Buffer       = reinterpret_cast<char*>(blockNode + 1);
 
 	blockNode->RefCount    = 1; // Hold a reference to the block
 	blockNode->BlockLength = blockLength;
 	return blockNode;
 }
 
+//----------------------------------------------------------------------------
+__checkReturn
+OCONN_ENTRY* AllocateOconnTable(void)
+{
+	OCONN_ENTRY *oconnTable = reinterpret_cast<OCONN_ENTRY*>(ExAllocatePoolWithTag(
+			NonPagedPool, OCONN_TABLE_SIZE * sizeof(OCONN_ENTRY), gPoolTagOconnTable));
+	if (!oconnTable) {
+		DBGPRINT(D_ERR, "Cannot allocate open connection table");
+		return NULL;
+	}
+
+	InitOconnTable(oconnTable);
+	return oconnTable;
+}
+
+//----------------------------------------------------------------------------
+__checkReturn
+NTSTATUS AllocateCpuBuffers(
+	__in READER_INFO  *reader,
+	__in const UINT32  bufferSize)
+{
+	const UINT32  numCpus    = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	UINT32        cpuSize    = RoundUpPowerOf2(bufferSize / numCpus);
+	UINT32        headerSize;
+	UINT32        index;
+	char         *buffer;
+
+	if (cpuSize < 1024) {
+		cpuSize = 1024;
+	}
+
+	// Allocate the ring buffers, the heads, and the slots for all of the ring
+	// buffers in a single block of memory
+	headerSize = numCpus * (sizeof(RING_BUFFER) + sizeof(BLOCK_NODE*));
+	buffer     = reinterpret_cast<char*>(ExAllocatePoolWithTag(NonPagedPool,
+			headerSize + (numCpus * cpuSize), gPoolTagRingBuffer));
+	if (!buffer) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	reader->NumCpuBuffers = numCpus;
+	reader->CpuBuffers    = reinterpret_cast<RING_BUFFER*>(buffer);
+	reader->CpuHeads      = reinterpret_cast<BLOCK_NODE**>(
+			buffer + (numCpus * sizeof(RING_BUFFER)));
+	for (index = 0; index < numCpus; index++) {
+		reader->CpuHeads[index] = NULL;
+		InitRingBuffer(&reader->CpuBuffers[index],
+				reinterpret_cast<RING_BUFFER_SLOT*>(
+				buffer + headerSize + (index * cpuSize)), cpuSize);
+	}
+	DBGPRINT(D_INFO, "Allocated %d per-processor ring buffers of %d bytes",
+			numCpus, cpuSize);
+	return STATUS_SUCCESS;
+}
+
 //----------------------------------------------------------------------------
 void CalculateMaxSnapLength(void)
 {
@@ -127,10 +192,15 @@ void CalculateMaxSnapLength(void)
 }
 
 //----------------------------------------------------------------------------
-void CleanupOconnNode(__in OCONN_NODE *oconnNode)
+void CleanupOconnTables(__in OCONN_TABLES *oconnTables)
 {
-	if (oconnNode) {
-		ExFreeToLookasideListEx(&gOconnNodeLal, oconnNode);
+	if (oconnTables) {
+		for (UINT32 index = 0; index < OconnNumTables; index++) {
+			if (oconnTables->Tables[index]) {
+				ExFreePool(oconnTables->Tables[index]);
+			}
+		}
+		ExFreePool(oconnTables);
 	}
 }
 
@@ -145,22 +215,36 @@ void CleanupReader(__in READER_INFO *reader)
 		CleanupRingBuffer(&reader->InitialBuffer);
 		ExFreePool(reader->InitialBuffer.Buffer);
 	}
+	if (reader->CpuBuffers) {
+		for (UINT32 index = 0; index < reader->NumCpuBuffers; index++) {
+			QmCleanupBlock(reader->CpuHeads[index]);
+			CleanupRingBuffer(&reader->CpuBuffers[index]);
+		}
+		ExFreePool(reader->CpuBuffers);
+	}
 	if (reader->DataEvent) {
 		ObDereferenceObject(reader->DataEvent);
 	}
+	if (reader->FilteredConnectionIds) {
+		ExFreePool(reader->FilteredConnectionIds);
+	}
+	if (reader->FilteredProcessIds) {
+		ExFreePool(reader->FilteredProcessIds);
+	}
+	if (reader->PacketFilter) {
+		ExFreePool(reader->PacketFilter);
+	}
 }
 
 //----------------------------------------------------------------------------
 void CleanupRingBuffer(__in RING_BUFFER *buffer)
 {
 	if (buffer) {
-		while (!IsRingBufferEmpty(buffer)) {
-			BLOCK_NODE *blockNode = reinterpret_cast<BLOCK_NODE*>(
-					RingBufferDequeue(buffer));
+		BLOCK_NODE *blockNode;
+		while ((blockNode = reinterpret_cast<BLOCK_NODE*>(
+				RingBufferDequeue(buffer))) != NULL) {
 			QmCleanupBlock(blockNode);
 		}
-		buffer->Front = 0;
-		buffer->Back  = 0;
 	}
 }
 
@@ -170,11 +254,6 @@ int CompareBlockNodes(BLOCK_NODE *first, BLOCK_NODE *second)
 	return first->SortId - second->SortId;
 }
 
-//----------------------------------------------------------------------------
-int CompareOconnNodes(OCONN_NODE *first, OCONN_NODE *second)
-{
-	return first->Port - second->Port;
-}
 
 //----------------------------------------------------------------------------
 UINT16 ConvertCommandLineToArgv(__in char *buffer, __in const UINT16 length)
@@ -328,8 +407,18 @@ NTSTATUS DeinitializeQueueManager(__in void)
 {
 	KLOCK_QUEUE_HANDLE  lockHandle;
 	LIST_ENTRY         *entry;
+	TIMER_WHEEL_ENTRY   heldListHead;
+	TIMER_WHEEL_ENTRY  *timerEntry;
 
+	// A connection close or held packet DPC that is already queued or running
+	// may restart its timer before it sees the flag, so wait for it and cancel
+	// the timers again before freeing anything they touch
+	InterlockedExchange(&gTimersStopped, 1);
+	KeCancelTimer(&gConnCloseTimer);
+	KeCancelTimer(&gHeldPacketTimer);
+	KeFlushQueuedDpcs();
 	KeCancelTimer(&gConnCloseTimer);
+	KeCancelTimer(&gHeldPacketTimer);
 
 	entry = gReaderListHead.Flink;
 	while (entry != &gReaderListHead) {
@@ -338,30 +427,60 @@ NTSTATUS DeinitializeQueueManager(__in void)
 		CleanupReader(reader);
 	}
 
-	entry = gConnCloseListHead.Flink;
-	while (entry != &gConnCloseListHead) {
-		BLOCK_NODE *blockNode = CONTAINING_RECORD(entry, BLOCK_NODE, ListEntry);
-		entry = entry->Flink;
-		QmCleanupBlock(blockNode);
+	// Closed connections are still in the connection table, which holds the
+	// only reference to them, so clearing the table frees them too
+	DBGPRINT(D_LOCK, "Acquiring connection close lock at %d", __LINE__);
+	KeAcquireInStackQueuedSpinLock(&gConnCloseLock, &lockHandle);
+	InitTimerWheel(&gConnCloseWheel, GetTimerWheelTick(CONN_CLOSE_TICK));
+	KeReleaseInStackQueuedSpinLock(&lockHandle);
+	DBGPRINT(D_LOCK, "Released connection close lock at %d", __LINE__);
+
+	for (UINT32 bucket = 0; bucket < CONN_TABLE_SIZE; bucket++) {
+		DBGPRINT(D_LOCK, "Acquiring connection lock at %d", __LINE__);
+		KeAcquireInStackQueuedSpinLock(
+				&gConnTableLocks[bucket & (CONN_TABLE_LOCKS - 1)].Lock, &lockHandle);
+		BLOCK_NODE *blockNode = gConnTable[bucket];
+		gConnTable[bucket] = NULL;
+		while (blockNode) {
+			BLOCK_NODE *nextNode = blockNode->HashNext;
+			InterlockedDecrement(&gConnTableCount);
+			QmCleanupBlock(blockNode);
+			blockNode = nextNode;
+		}
+		KeReleaseInStackQueuedSpinLock(&lockHandle);
+		DBGPRINT(D_LOCK, "Released connection lock at %d", __LINE__);
 	}
 
+	// Every held packet is in the timing wheel, including the ones chained to
+	// another held packet for the same connection instead of in the tree
 	DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
 	KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
-	LLRB_CLEAR(BlockTree, &gConnTreeHead);
-	LLRB_CLEAR(BlockTree, &gPacketTreeHead);
+	InitTimerWheelList(&heldListHead);
+	TimerWheelRemoveAll(&gHeldPacketWheel, &heldListHead);
+	while ((timerEntry = TimerWheelListRemoveHead(&heldListHead)) != NULL) {
+		QmCleanupBlock(CONTAINING_RECORD(timerEntry, BLOCK_NODE, TimerEntry));
+	}
+	LLRB_INIT(&gPacketTreeHead);
+	gPacketTreeCount = 0;
+	gHeldPacketBytes = 0;
 	LLRB_CLEAR(BlockTree, &gProcessTreeHead);
-	LLRB_CLEAR(OconnTree, &gOconnTcp4TreeHead);
-	LLRB_CLEAR(OconnTree, &gOconnTcp6TreeHead);
-	LLRB_CLEAR(OconnTree, &gOconnUdp4TreeHead);
-	LLRB_CLEAR(OconnTree, &gOconnUdp6TreeHead);
 	KeReleaseInStackQueuedSpinLock(&lockHandle);
 	DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
 
-	if (gBlockNodeLalInit) {
-		ExDeleteLookasideListEx(&gBlockNodeLal);
+	CleanupOconnTables(gOconnTables);
+	gOconnTables = NULL;
+
+	if (gReaderSnapshot) {
+		ExFreePool(gReaderSnapshot);
+		gReaderSnapshot = NULL;
 	}
-	if (gOconnNodeLalInit) {
-		ExDeleteLookasideListEx(&gOconnNodeLal);
+	if (gSyncDpcs) {
+		ExFreePool(gSyncDpcs);
+		gSyncDpcs = NULL;
+	}
+	if (gCpuStatistics) {
+		ExFreePool(gCpuStatistics);
+		gCpuStatistics = NULL;
 	}
 
 	QmCleanupBlock(gSectionHeaderBlock);
@@ -370,44 +489,163 @@ NTSTATUS DeinitializeQueueManager(__in void)
 
 //----------------------------------------------------------------------------
 __checkReturn
-void EnqueueBlock(__in BLOCK_NODE *blockNode)
+UINT32 DequeueMergedBlocks(
+	__in READER_INFO                 *reader,
+	__out_ecount(count) BLOCK_NODE  **blocks,
+	__in const UINT32                 count)
 {
-	KLOCK_QUEUE_HANDLE  lockHandle;
-	LIST_ENTRY         *entry = gReaderListHead.Flink;
+	UINT32 numBlocks = 0;
+
+	while (numBlocks < count) {
+		BLOCK_NODE *oldest      = NULL;
+		UINT32      oldestIndex = 0;
+
+		// Find the oldest block at the head of the ring buffers, refilling any
+		// heads that were consumed on a previous pass
+		for (UINT32 index = 0; index < reader->NumCpuBuffers; index++) {
+			BLOCK_NODE *head = reader->CpuHeads[index];
+			if (!head) {
+				head = reinterpret_cast<BLOCK_NODE*>(
+						RingBufferDequeue(&reader->CpuBuffers[index]));
+				if (!head) {
+					continue;
+				}
+				reader->CpuHeads[index] = head;
+			}
+			if (!oldest || (head->Timestamp.QuadPart < oldest->Timestamp.QuadPart)) {
+				oldest      = head;
+				oldestIndex = index;
+			}
+		}
+		if (!oldest) {
+			break;
+		}
 
-	if (!gStatistics.NumReaders) {
-		return;
+		reader->CpuHeads[oldestIndex] = NULL;
+		blocks[numBlocks++]           = oldest;
 	}
+	return numBlocks;
+}
 
-	DBGPRINT(D_LOCK, "Acquiring reader list lock at %d", __LINE__);
-	KeAcquireInStackQueuedSpinLock(&gReaderListLock, &lockHandle);
+//----------------------------------------------------------------------------
+__checkReturn
+void EnqueueBlock(__in BLOCK_NODE *blockNode)
+{
+	PACKET_FILTER_FIELDS  fields;
+	KIRQL                 oldIrql;
+	bool                  parsed = false;
+	READER_SNAPSHOT      *snapshot;
+
+	// Stay at dispatch level while using the reader snapshot so that it cannot
+	// be freed until we are done with it (see WaitForReaderSnapshot)
+	KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+	snapshot = gReaderSnapshot;
+	if (!snapshot) {
+		KeLowerIrql(oldIrql);
+		return;
+	}
 
-	// Increment packet counts inside the spin lock
 	if (blockNode->BlockType == PacketBlock) {
-		char                  *buffer = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+		char                  *buffer = blockNode->Buffer;
 		PCAP_NG_PACKET_HEADER *header = reinterpret_cast<PCAP_NG_PACKET_HEADER*>(buffer);
 
-		gStatistics.CapturedPackets++;
-		gStatistics.CapturedPacketBytes += header->CapturedLength;
+		CPU_STATISTICS        *stats  = GetCpuStatistics();
+
+		InterlockedIncrement64(reinterpret_cast<LONG64*>(&stats->CapturedPackets));
+		InterlockedExchangeAdd64(reinterpret_cast<LONG64*>(
+				&stats->CapturedPacketBytes), header->CapturedLength);
 	}
 
-	while (entry != &gReaderListHead) {
-		READER_INFO *reader = CONTAINING_RECORD(entry, READER_INFO, ListEntry);
-		const bool empty = IsRingBufferEmpty(&reader->BlocksBuffer);
+	for (UINT32 index = 0; index < snapshot->NumReaders; index++) {
+		READER_INFO *reader = snapshot->Readers[index];
+		RING_BUFFER *ring;
+		ULONG        position;
+
+		if (!reader) {
+			continue;
+		}
+
+		// Don't take up room in the reader's ring buffer with packets it will
+		// never read
+		if ((blockNode->BlockType == PacketBlock) &&
+				IsPacketFiltered(reader, blockNode, &fields, &parsed)) {
+			continue;
+		}
+		ring = &reader->BlocksBuffer;
+
+		// Use the current processor's ring buffer if the reader has them.  We
+		// are at dispatch level, so we cannot move to another processor.
+		if (reader->CpuBuffers) {
+			ring = &reader->CpuBuffers[KeGetCurrentProcessorNumberEx(NULL) %
+					reader->NumCpuBuffers];
+		}
+
 		InterlockedIncrement(&blockNode->RefCount);
-		if (RingBufferEnqueue(&reader->BlocksBuffer, blockNode)) {
-			// Only signal the reader if the buffer was empty
-			if (empty && reader->DataEvent) {
-				KeSetEvent(reader->DataEvent, 1, FALSE);
+		if (RingBufferEnqueue(ring, blockNode, &position)) {
+			// Only signal the reader if this is the next block it will read,
+			// since it may be waiting for it.  This also covers the case where
+			// the buffer was empty.
+			if (static_cast<ULONG>(ring->Front) == position) {
+				NotifyReader(reader);
 			}
 		} else {
 			InterlockedDecrement(&blockNode->RefCount);
 		}
-		entry = entry->Flink;
 	}
 
+	KeLowerIrql(oldIrql);
+}
+
+//----------------------------------------------------------------------------
+void ExpireHeldPackets(
+	__in     KDPC *dpc,
+	__in_opt void *context,
+	__in_opt void *arg1,
+	__in_opt void *arg2)
+{
+	UNREFERENCED_PARAMETER(dpc);
+	UNREFERENCED_PARAMETER(context);
+	UNREFERENCED_PARAMETER(arg1);
+	UNREFERENCED_PARAMETER(arg2);
+
+	KLOCK_QUEUE_HANDLE  lockHandle;
+	TIMER_WHEEL_ENTRY   expiredListHead;
+	TIMER_WHEEL_ENTRY  *timerEntry;
+
+	InitTimerWheelList(&expiredListHead);
+
+	// Enqueue the expired blocks while holding the trees lock, so they can't
+	// get ahead of or behind blocks for the same connection that
+	// ReleasePacketBlocks() enqueues
+	DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
+	KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
+	TimerWheelAdvance(&gHeldPacketWheel, GetTimerWheelTick(HELD_PACKET_TICK),
+			&expiredListHead);
+	while ((timerEntry = TimerWheelListRemoveHead(&expiredListHead)) != NULL) {
+		BLOCK_NODE *blockNode = CONTAINING_RECORD(timerEntry, BLOCK_NODE, TimerEntry);
+
+		DBGPRINT(D_INFO, "Releasing expired packet block for connection %08X",
+				blockNode->ConnectionId);
+		RemoveHeldPacketBlock(blockNode);
+		EnqueueBlock(blockNode);
+		QmCleanupBlock(blockNode);
+	}
+	if (!gTimersStopped && !IsTimerWheelEmpty(&gHeldPacketWheel)) {
+		KeSetTimer(&gHeldPacketTimer, gHeldPacketTimeout, &gHeldPacketDpc);
+	}
 	KeReleaseInStackQueuedSpinLock(&lockHandle);
-	DBGPRINT(D_LOCK, "Released reader list lock at %d", __LINE__);
+	DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+}
+
+//----------------------------------------------------------------------------
+BLOCK_NODE* FindConnectionBlock(__in const UINT32 connectionId)
+{
+	BLOCK_NODE *blockNode = gConnTable[GetConnectionBucket(connectionId)];
+
+	while (blockNode && (blockNode->SortId != connectionId)) {
+		blockNode = blockNode->HashNext;
+	}
+	return blockNode;
 }
 
 //----------------------------------------------------------------------------
@@ -448,7 +686,7 @@ BLOCK_NODE* GetConnectionBlock(
 		GetTimestamp(&blockNode->Timestamp);
 	}
 
-	buffer = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+	buffer = blockNode->Buffer;
 	header = reinterpret_cast<PCAP_NG_CONNECTION_HEADER*>(buffer);
 	header->BlockType     = blockNode->BlockType;
 	header->BlockLength   = blockNode->BlockLength;
@@ -467,6 +705,26 @@ BLOCK_NODE* GetConnectionBlock(
 	return blockNode;
 }
 
+//----------------------------------------------------------------------------
+UINT32 GetConnectionBucket(__in const UINT32 connectionId)
+{
+	// Fibonacci hashing spreads out sequential connection IDs
+	return (connectionId * 2654435761U) >> (32 - CONN_TABLE_BITS);
+}
+
+//----------------------------------------------------------------------------
+KSPIN_LOCK* GetConnectionLock(__in const UINT32 connectionId)
+{
+	return &gConnTableLocks[GetConnectionBucket(connectionId) &
+			(CONN_TABLE_LOCKS - 1)].Lock;
+}
+
+//----------------------------------------------------------------------------
+CPU_STATISTICS* GetCpuStatistics(void)
+{
+	return &gCpuStatistics[KeGetCurrentProcessorNumberEx(NULL) % gNumProcessors];
+}
+
 //----------------------------------------------------------------------------
 __checkReturn
 BLOCK_NODE* GetInterfaceDescriptionBlock(void)
@@ -483,7 +741,7 @@ BLOCK_NODE* GetInterfaceDescriptionBlock(void)
 	}
 
 	blockNode->BlockType = InterfaceDescriptionBlock;
-	buffer = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+	buffer = blockNode->Buffer;
 	block  = reinterpret_cast<PCAP_NG_INTERFACE_DESCRIPTION*>(buffer);
 	block->BlockType                 = blockNode->BlockType;
 	block->BlockLength               = blockNode->BlockLength;
@@ -499,6 +757,101 @@ BLOCK_NODE* GetInterfaceDescriptionBlock(void)
 	return blockNode;
 }
 
+//----------------------------------------------------------------------------
+__drv_requiresIRQL(PASSIVE_LEVEL)
+bool GetPerProcessorRings(void)
+{
+	return GetRegistryDword(gPerCpuValueName, 0, 0, 1) ? true : false;
+}
+
+//----------------------------------------------------------------------------
+void GetPacketFilterFields(
+	__in const BLOCK_NODE       *blockNode,
+	__out PACKET_FILTER_FIELDS  *fields)
+{
+	const char                  *buffer = blockNode->Buffer;
+	const PCAP_NG_PACKET_HEADER *header =
+			reinterpret_cast<const PCAP_NG_PACKET_HEADER*>(buffer);
+	const PCAP_NG_PACKET_FOOTER *footer =
+			reinterpret_cast<const PCAP_NG_PACKET_FOOTER*>(buffer +
+			sizeof(PCAP_NG_PACKET_HEADER) + PCAP_NG_PADDING(header->CapturedLength));
+	const UINT8                 *data   =
+			reinterpret_cast<const UINT8*>(buffer + sizeof(PCAP_NG_PACKET_HEADER));
+	const UINT32                 length = header->CapturedLength;
+	const UINT8                 *srcAddress;
+	const UINT8                 *dstAddress;
+	UINT32                       addressLength;
+	UINT32                       offset;
+	UINT8                        protocol;
+
+	RtlZeroMemory(fields, sizeof(PACKET_FILTER_FIELDS));
+	fields->ProcessId = blockNode->ProcessId;
+	fields->Direction = static_cast<UINT8>(footer->Flags);
+	if (!length) {
+		return;
+	}
+
+	// Find the addresses and the start of the transport header
+	if (((data[0] >> 4) == 4) && (length >= 20)) {
+		protocol      = data[9];
+		srcAddress    = data + 12;
+		dstAddress    = data + 16;
+		addressLength = 4;
+		offset        = (data[0] & 0x0F) * 4;
+
+		// Only the first fragment has the transport header
+		if ((data[6] & 0x1F) || data[7]) {
+			offset = length;
+		}
+		fields->IpVersion = 4;
+	} else if (((data[0] >> 4) == 6) && (length >= 40)) {
+		protocol      = data[6];
+		srcAddress    = data + 8;
+		dstAddress    = data + 24;
+		addressLength = 16;
+		offset        = 40;
+
+		// Skip extension headers to get to the transport header
+		while ((protocol == IPPROTO_HOPOPTS) || (protocol == IPPROTO_ROUTING) ||
+				(protocol == IPPROTO_DSTOPTS) || (protocol == IPPROTO_FRAGMENT)) {
+			if (offset + 8 > length) {
+				break;
+			}
+			if ((protocol == IPPROTO_FRAGMENT) &&
+					((data[offset + 2] << 8 | data[offset + 3]) & 0xFFF8)) {
+				offset = length;
+				break;
+			}
+			const UINT8 extension = protocol;
+			protocol = data[offset];
+			offset  += (extension == IPPROTO_FRAGMENT) ? 8 : (data[offset + 1] + 1) * 8;
+		}
+		fields->IpVersion = 6;
+	} else {
+		return;
+	}
+	fields->Protocol = protocol;
+
+	if (fields->Direction == PfInbound) {
+		RtlCopyMemory(fields->LocalAddress, dstAddress, addressLength);
+		RtlCopyMemory(fields->RemoteAddress, srcAddress, addressLength);
+	} else {
+		RtlCopyMemory(fields->LocalAddress, srcAddress, addressLength);
+		RtlCopyMemory(fields->RemoteAddress, dstAddress, addressLength);
+	}
+
+	// Both TCP and UDP start with the source and destination ports
+	if (((protocol == IPPROTO_TCP) || (protocol == IPPROTO_UDP)) &&
+			(offset + 4 <= length)) {
+		const UINT16 srcPort = static_cast<UINT16>((data[offset] << 8) | data[offset + 1]);
+		const UINT16 dstPort = static_cast<UINT16>((data[offset + 2] << 8) | data[offset + 3]);
+
+		fields->HasPorts   = true;
+		fields->LocalPort  = (fields->Direction == PfInbound) ? dstPort : srcPort;
+		fields->RemotePort = (fields->Direction == PfInbound) ? srcPort : dstPort;
+	}
+}
+
 //----------------------------------------------------------------------------
 __checkReturn
 BLOCK_NODE* GetProcessBlock(
@@ -566,7 +919,7 @@ BLOCK_NODE* GetProcessBlock(
 	} else {
 		GetTimestamp(&blockNode->Timestamp);
 	}
-	buffer = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+	buffer = blockNode->Buffer;
 	header = reinterpret_cast<PCAP_NG_PROCESS_HEADER*>(buffer);
 	header->BlockType                    = blockNode->BlockType;
 	header->ProcessId                    = pid;
@@ -607,103 +960,99 @@ UINT32 GetProcessIdForConnectionId(
 	__in const UINT8  protocol,
 	__in const UINT16 port)
 {
-	UINT32              processId;
+	UINT32              processId = _UI32_MAX;
 	BLOCK_NODE         *blockNode;
-	BLOCK_NODE          searchNode;
+	BLOCK_NODE         *existing;
+	OCONN_TABLES       *oconnTables;
+	const OCONN_ENTRY  *oconnTable;
+	LARGE_INTEGER       timestamp = {0};
 	KLOCK_QUEUE_HANDLE  lockHandle;
+	KIRQL               oldIrql;
 
-	searchNode.SortId = connectionId;
-	DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-	KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
-
-	blockNode = LLRB_FIND(BlockTree, &gConnTreeHead, &searchNode);
+	DBGPRINT(D_LOCK, "Acquiring connection lock at %d", __LINE__);
+	KeAcquireInStackQueuedSpinLock(GetConnectionLock(connectionId), &lockHandle);
+	blockNode = FindConnectionBlock(connectionId);
 	if (blockNode) {
 		processId = blockNode->ProcessId;
-	} else {
-		// Try to find the connection in the previously opened connections trees
-		OCONN_TREE_HEAD *treeHead;
-		OCONN_NODE      *oconnNode;
-		OCONN_NODE       searchNode;
-
-		if (addressFamily == AF_INET) {
-			if (protocol == IPPROTO_TCP) {
-				treeHead = &gOconnTcp4TreeHead;
-			} else {
-				treeHead = &gOconnUdp4TreeHead;
-			}
-		} else {
-			if (protocol == IPPROTO_TCP) {
-				treeHead = &gOconnTcp6TreeHead;
-			} else {
-				treeHead = &gOconnUdp6TreeHead;
-			}
+	}
+	KeReleaseInStackQueuedSpinLock(&lockHandle);
+	DBGPRINT(D_LOCK, "Released connection lock at %d", __LINE__);
+	if (blockNode) {
+		return processId;
+	}
+
+	// Try to find the connection in the previously opened connections tables.
+	// Stay at dispatch level while using the tables so that they cannot be
+	// freed until we are done with them (see QmSetOpenConnections).
+	KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+	oconnTables = gOconnTables;
+	if (oconnTables) {
+		oconnTable = oconnTables->Tables[GetOconnTableIndex(addressFamily, protocol)];
+		if (oconnTable) {
+			processId = ReadOconnEntry(&oconnTable[port], &timestamp);
 		}
+	}
+	KeLowerIrql(oldIrql);
+	if (processId == _UI32_MAX) {
+		return _UI32_MAX;
+	}
 
-		searchNode.Port = port;
-		oconnNode = LLRB_FIND(OconnTree, treeHead, &searchNode);
-		if (oconnNode) {
-			// Cache this open connection now that we have a mapping between the
-			// connection ID and the process ID
-			BLOCK_NODE *blockNode;
-
-			processId = oconnNode->ProcessId;
-			blockNode = GetConnectionBlock(true, connectionId, processId,
-				&oconnNode->Timestamp);
-			if (blockNode) {
-				LLRB_INSERT(BlockTree, &gConnTreeHead, blockNode);
-				EnqueueBlock(blockNode);
-			}
-		} else {
-			processId = _UI32_MAX;
+	// Cache this open connection now that we have a mapping between the
+	// connection ID and the process ID.  Another processor may have cached it
+	// since we looked, in which case we use its block instead.
+	blockNode = GetConnectionBlock(true, connectionId, processId, &timestamp);
+	if (blockNode) {
+		InterlockedIncrement(&blockNode->RefCount);
+		DBGPRINT(D_LOCK, "Acquiring connection lock at %d", __LINE__);
+		KeAcquireInStackQueuedSpinLock(GetConnectionLock(connectionId), &lockHandle);
+		existing = InsertConnectionBlock(blockNode);
+		if (existing) {
+			processId = existing->ProcessId;
+			InterlockedDecrement(&blockNode->RefCount);
 		}
+		KeReleaseInStackQueuedSpinLock(&lockHandle);
+		DBGPRINT(D_LOCK, "Released connection lock at %d", __LINE__);
+		if (!existing) {
+			EnqueueBlock(blockNode);
+		}
+		QmCleanupBlock(blockNode);
 	}
-
-	KeReleaseInStackQueuedSpinLock(&lockHandle);
-	DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
 	return processId;
 }
 
 //----------------------------------------------------------------------------
-__drv_requiresIRQL(PASSIVE_LEVEL)
-UINT32 GetRingBufferSize(void)
+UINT32 GetRegistryDword(
+	__in wchar_t      *valueName,
+	__in const UINT32  defaultValue,
+	__in const UINT32  minValue,
+	__in const UINT32  maxValue)
 {
-	UINT32                    bufferSize;
+	UINT32                    value = 0;
 	NTSTATUS                  status;
 	RTL_QUERY_REGISTRY_TABLE  queryTable[2] = {0};
 
-	// Get the system ID if possible
-	queryTable[0].QueryRoutine = GetRingBufferSizeQueryRoutine;
+	queryTable[0].QueryRoutine = GetRegistryDwordQueryRoutine;
 	queryTable[0].Flags        = RTL_QUERY_REGISTRY_REQUIRED;
-	queryTable[0].Name         = gBufferSizeValueName;
-	queryTable[0].EntryContext = &bufferSize;
+	queryTable[0].Name         = valueName;
+	queryTable[0].EntryContext = &value;
 	queryTable[0].DefaultType  = REG_NONE;
 
 	status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, gBufferSizeKeyPath,
 			queryTable, NULL, NULL);
-	if (!NT_SUCCESS(status) || (bufferSize == 0)) {
-		return PAGE_SIZE << 2;
+	if (!NT_SUCCESS(status) || (value == 0)) {
+		return defaultValue;
 	}
-	if (bufferSize < 1024) {
-		return 1024;
+	if (value < minValue) {
+		return minValue;
 	}
-	if (bufferSize > (PAGE_SIZE << 5)) {
-		return PAGE_SIZE << 5;
+	if (value > maxValue) {
+		return maxValue;
 	}
-
-	// Round up to next power of 2
-	// http://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
-	bufferSize--;
-	bufferSize |= bufferSize >> 1;
-	bufferSize |= bufferSize >> 2;
-	bufferSize |= bufferSize >> 4;
-	bufferSize |= bufferSize >> 8;
-	bufferSize |= bufferSize >> 16;
-	bufferSize++;
-	return bufferSize;
+	return value;
 }
 
 //----------------------------------------------------------------------------
-NTSTATUS GetRingBufferSizeQueryRoutine(
+NTSTATUS GetRegistryDwordQueryRoutine(
 	__in wchar_t       *valueName,
 	__in unsigned long  valueType,
 	__in void          *valueData,
@@ -713,7 +1062,6 @@ NTSTATUS GetRingBufferSizeQueryRoutine(
 {
 	UNREFERENCED_PARAMETER(context);
 	if (valueName && valueData && entryContext &&
-			(0 == wcscmp(valueName, gBufferSizeValueName)) &&
 			(valueType == REG_DWORD) && (valueLength >= sizeof(UINT32))) {
 		RtlCopyMemory(entryContext, valueData, sizeof(UINT32));
 		return STATUS_SUCCESS;
@@ -721,6 +1069,14 @@ NTSTATUS GetRingBufferSizeQueryRoutine(
 	return STATUS_OBJECT_NAME_NOT_FOUND;
 }
 
+//----------------------------------------------------------------------------
+__drv_requiresIRQL(PASSIVE_LEVEL)
+UINT32 GetRingBufferSize(void)
+{
+	return RoundUpPowerOf2(GetRegistryDword(gBufferSizeValueName,
+			PAGE_SIZE << 2, 1024, PAGE_SIZE << 5));
+}
+
 //----------------------------------------------------------------------------
 __checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
 BLOCK_NODE* GetSectionHeaderBlock(void)
@@ -845,7 +1201,7 @@ BLOCK_NODE* GetSectionHeaderBlock(void)
 	}
 
 	blockNode->BlockType = SectionHeaderBlock;
-	buffer = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+	buffer = blockNode->Buffer;
 	header = reinterpret_cast<PCAP_NG_SECTION_HEADER*>(buffer);
 	header->BlockType     = blockNode->BlockType;
 	header->BlockLength   = blockNode->BlockLength;
@@ -864,6 +1220,13 @@ BLOCK_NODE* GetSectionHeaderBlock(void)
 	return blockNode;
 }
 
+//----------------------------------------------------------------------------
+UINT64 GetTimerWheelTick(__in const UINT32 tickTime)
+{
+	// Interrupt time is in 100-nanosecond units
+	return KeQueryInterruptTime() / (tickTime * 10000ULL);
+}
+
 //----------------------------------------------------------------------------
 void GetTimestamp(__out LARGE_INTEGER *timestamp)
 {
@@ -878,23 +1241,44 @@ void HoldPacketBlock(__in BLOCK_NODE *blockNode)
 {
 	BLOCK_NODE         *existing;
 	KLOCK_QUEUE_HANDLE  lockHandle;
-
-	DBGPRINT(D_INFO, "Holding packet block for connection %08X",
-			blockNode->ConnectionId);
+	const UINT32        blockSize = sizeof(BLOCK_NODE) + blockNode->BlockLength;
+	bool                held      = false;
 
 	DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
 	KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
-	InterlockedIncrement(&blockNode->RefCount);
-	existing = LLRB_INSERT(BlockTree, &gPacketTreeHead, blockNode);
-	if (existing) {
-		// Insert this block in the list
-		InsertTailList(&existing->ListEntry, &blockNode->ListEntry);
-	} else {
-		InitializeListHead(&blockNode->ListEntry);
+	if ((gHeldPacketBudget - gHeldPacketBytes) >= blockSize) {
+		DBGPRINT(D_INFO, "Holding packet block for connection %08X",
+				blockNode->ConnectionId);
+		InterlockedIncrement(&blockNode->RefCount);
+		existing = LLRB_INSERT(BlockTree, &gPacketTreeHead, blockNode);
+		if (existing) {
+			// Insert this block in the list
+			InsertTailList(&existing->ListEntry, &blockNode->ListEntry);
+		} else {
+			InitializeListHead(&blockNode->ListEntry);
+		}
+
+		// Start the timer when the first packet is held.  After that, the
+		// DPC restarts it for as long as there are packets left.
+		const UINT64 tick = GetTimerWheelTick(HELD_PACKET_TICK);
+		if (!gTimersStopped && IsTimerWheelEmpty(&gHeldPacketWheel)) {
+			KeSetTimer(&gHeldPacketTimer, gHeldPacketTimeout, &gHeldPacketDpc);
+		}
+		TimerWheelInsert(&gHeldPacketWheel, &blockNode->TimerEntry, tick,
+				tick + gHeldPacketTicks);
+		gHeldPacketBytes += blockSize;
+		gPacketTreeCount++;
+		held = true;
 	}
-	gPacketTreeCount++;
 	KeReleaseInStackQueuedSpinLock(&lockHandle);
 	DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+
+	if (!held) {
+		DBGPRINT(D_INFO, "Held packet memory is full, so enqueuing packet "
+				"block for connection %08X without a process ID",
+				blockNode->ConnectionId);
+		EnqueueBlock(blockNode);
+	}
 }
 
 //----------------------------------------------------------------------------
@@ -907,33 +1291,129 @@ NTSTATUS InitializeQueueManager(DEVICE_OBJECT *device)
 
 	KeQueryTickCount(&gDriverLoadTick);
 	InitializeListHead(&gReaderListHead);
-	InitializeListHead(&gConnCloseListHead);
+	KeInitializeSpinLock(&gConnCloseLock);
+	ExInitializeFastMutex(&gOconnMutex);
+	for (UINT32 index = 0; index < CONN_TABLE_LOCKS; index++) {
+		KeInitializeSpinLock(&gConnTableLocks[index].Lock);
+	}
 
-	status = ExInitializeLookasideListEx(&gBlockNodeLal, NULL, NULL,
-			NonPagedPool, 0, sizeof(BLOCK_NODE), gPoolTagBlockNode, 0);
-	if (!NT_SUCCESS(status)) {
-		DBGPRINT(D_ERR, "Cannot create block node lookaside list");
-		return status;
+	InitTimerWheel(&gConnCloseWheel, GetTimerWheelTick(CONN_CLOSE_TICK));
+	KeInitializeDpc(&gConnCloseDpc, ProcessConnectionCloseEvents, NULL);
+	KeInitializeTimer(&gConnCloseTimer);
+	gConnCloseTimeout.QuadPart = -(CONN_CLOSE_TICK * 10000);
+
+	// Held packets are released without a process ID once they have been
+	// held for the maximum hold time, rounded up to a whole number of ticks
+	gHeldPacketBudget = GetRegistryDword(gHeldMemoryValueName,
+			HELD_PACKET_MEMORY, HELD_PACKET_MEMORY_MIN, HELD_PACKET_MEMORY_MAX);
+	gHeldPacketTicks  = (GetRegistryDword(gHeldTimeValueName, HELD_PACKET_TIME,
+			HELD_PACKET_TICK, HELD_PACKET_TIME_MAX) + HELD_PACKET_TICK - 1) /
+			HELD_PACKET_TICK;
+	InitTimerWheel(&gHeldPacketWheel, GetTimerWheelTick(HELD_PACKET_TICK));
+	KeInitializeDpc(&gHeldPacketDpc, ExpireHeldPackets, NULL);
+	KeInitializeTimer(&gHeldPacketTimer);
+	gHeldPacketTimeout.QuadPart = -(HELD_PACKET_TICK * 10000);
+
+	// Allocate a cache-aligned statistics slot for each processor
+	gNumProcessors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	gCpuStatistics = reinterpret_cast<CPU_STATISTICS*>(ExAllocatePoolWithTag(
+			NonPagedPoolCacheAligned, gNumProcessors * sizeof(CPU_STATISTICS),
+			gPoolTagStatistics));
+	if (!gCpuStatistics) {
+		DBGPRINT(D_ERR, "Cannot allocate per-processor statistics");
+		return STATUS_INSUFFICIENT_RESOURCES;
 	}
-	gBlockNodeLalInit = true;
+	RtlZeroMemory(gCpuStatistics, gNumProcessors * sizeof(CPU_STATISTICS));
 
-	status = ExInitializeLookasideListEx(&gOconnNodeLal, NULL, NULL,
-			NonPagedPool, 0, sizeof(BLOCK_NODE), gPoolTagOconnNode, 0);
-	if (!NT_SUCCESS(status)) {
-		DBGPRINT(D_ERR, "Cannot create open connection node lookaside list");
-		return status;
+	// Initialize a DPC targeted at each processor to wait for processors to
+	// finish with replaced reader snapshots
+	gSyncDpcs    = reinterpret_cast<KDPC*>(ExAllocatePoolWithTag(NonPagedPool,
+			gNumProcessors * sizeof(KDPC), gPoolTagDpc));
+	if (!gSyncDpcs) {
+		DBGPRINT(D_ERR, "Cannot allocate reader snapshot synchronization DPCs");
+		return STATUS_INSUFFICIENT_RESOURCES;
 	}
-	gOconnNodeLalInit = true;
+	for (UINT32 index = 0; index < gNumProcessors; index++) {
+		PROCESSOR_NUMBER processor;
 
-	KeInitializeDpc(&gConnCloseDpc, ProcessConnectionCloseEvents, NULL);
-	KeInitializeTimer(&gConnCloseTimer);
-	gConnCloseTimeout.QuadPart = -10000;
+		status = KeGetProcessorNumberFromIndex(index, &processor);
+		if (!NT_SUCCESS(status)) {
+			DBGPRINT(D_ERR, "Cannot get processor number for index %d", index);
+			return status;
+		}
+		KeInitializeDpc(&gSyncDpcs[index], SyncReaderSnapshotDpc, NULL);
+		status = KeSetTargetProcessorDpcEx(&gSyncDpcs[index], &processor);
+		if (!NT_SUCCESS(status)) {
+			DBGPRINT(D_ERR, "Cannot set target processor for DPC %d", index);
+			return status;
+		}
+	}
+	KeInitializeEvent(&gSyncEvent, NotificationEvent, FALSE);
+	ExInitializeFastMutex(&gSyncMutex);
 
 	KeInitializeSpinLock(&gReaderListLock);
 	KeInitializeSpinLock(&gTreesLock);
 	return status;
 }
 
+//----------------------------------------------------------------------------
+BLOCK_NODE* InsertConnectionBlock(__in BLOCK_NODE *blockNode)
+{
+	const UINT32  bucket   = GetConnectionBucket(blockNode->SortId);
+	BLOCK_NODE   *existing = FindConnectionBlock(blockNode->SortId);
+
+	if (existing) {
+		return existing;
+	}
+	blockNode->HashNext = gConnTable[bucket];
+	gConnTable[bucket]  = blockNode;
+	InterlockedIncrement(&gConnTableCount);
+	return NULL;
+}
+
+//----------------------------------------------------------------------------
+bool IsPacketFiltered(
+	__in const READER_INFO        *reader,
+	__in const BLOCK_NODE         *blockNode,
+	__inout PACKET_FILTER_FIELDS  *fields,
+	__inout bool                  *parsed)
+{
+	const ID_SET        *processIds    = reader->FilteredProcessIds;
+	const ID_SET        *connectionIds = reader->FilteredConnectionIds;
+	const PACKET_FILTER *packetFilter  = reader->PacketFilter;
+
+	if (processIds && IsIdInSet(processIds, blockNode->ProcessId)) {
+		return true;
+	}
+	if (connectionIds && IsIdInSet(connectionIds, blockNode->ConnectionId)) {
+		return true;
+	}
+	if (packetFilter) {
+		if (!*parsed) {
+			GetPacketFilterFields(blockNode, fields);
+			*parsed = true;
+		}
+		if (!RunPacketFilter(packetFilter->Insns, packetFilter->NumInsns, fields)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//----------------------------------------------------------------------------
+void NotifyReader(__in READER_INFO *reader)
+{
+	KEVENT *dataEvent = reader->DataEvent;
+	KDPC   *dataDpc   = reader->DataDpc;
+
+	if (dataEvent) {
+		KeSetEvent(dataEvent, 1, FALSE);
+	}
+	if (dataDpc) {
+		KeInsertQueueDpc(dataDpc, NULL, NULL);
+	}
+}
+
 //----------------------------------------------------------------------------
 void ProcessConnectionCloseEvents(
 	__in     KDPC *dpc,
@@ -947,34 +1427,70 @@ void ProcessConnectionCloseEvents(
 	UNREFERENCED_PARAMETER(arg2);
 
 	KLOCK_QUEUE_HANDLE  lockHandle;
-	LIST_ENTRY         *entry;
-	LARGE_INTEGER       timestamp;
+	TIMER_WHEEL_ENTRY   expiredListHead;
+	TIMER_WHEEL_ENTRY  *timerEntry;
 
-	GetTimestamp(&timestamp);
+	InitTimerWheelList(&expiredListHead);
 
-	DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-	KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
+	// Move connections that are old enough to remove to our own list, so we
+	// don't hold the close lock while taking connection table locks
+	DBGPRINT(D_LOCK, "Acquiring connection close lock at %d", __LINE__);
+	KeAcquireInStackQueuedSpinLock(&gConnCloseLock, &lockHandle);
+	TimerWheelAdvance(&gConnCloseWheel, GetTimerWheelTick(CONN_CLOSE_TICK),
+			&expiredListHead);
+	if (!gTimersStopped && !IsTimerWheelEmpty(&gConnCloseWheel)) {
+		KeSetTimer(&gConnCloseTimer, gConnCloseTimeout, &gConnCloseDpc);
+	}
+	KeReleaseInStackQueuedSpinLock(&lockHandle);
+	DBGPRINT(D_LOCK, "Released connection close lock at %d", __LINE__);
 
-	entry = gConnCloseListHead.Flink;
-	while (entry != &gConnCloseListHead) {
-		BLOCK_NODE *blockNode = CONTAINING_RECORD(entry, BLOCK_NODE, ListEntry);
+	while ((timerEntry = TimerWheelListRemoveHead(&expiredListHead)) != NULL) {
+		BLOCK_NODE *blockNode = CONTAINING_RECORD(timerEntry, BLOCK_NODE, TimerEntry);
 
-		entry = entry->Flink;
-		if (timestamp.QuadPart > (blockNode->Timestamp.QuadPart + 1000)) {
-			// This connection is old enough that we can remove it from the tree
-			DBGPRINT(D_INFO, "Removing closed connection %08X",
-					blockNode->ConnectionId);
-			if (LLRB_REMOVE(BlockTree, &gConnTreeHead, blockNode)) {
-				gConnTreeCount--;
-			}
-			InterlockedDecrement(&gStatistics.NumConnections);
-			RemoveEntryList(&blockNode->ListEntry);
-			QmCleanupBlock(blockNode);
+		DBGPRINT(D_INFO, "Removing closed connection %08X",
+				blockNode->ConnectionId);
+		DBGPRINT(D_LOCK, "Acquiring connection lock at %d", __LINE__);
+		KeAcquireInStackQueuedSpinLock(GetConnectionLock(blockNode->SortId),
+				&lockHandle);
+		RemoveConnectionBlock(blockNode);
+		KeReleaseInStackQueuedSpinLock(&lockHandle);
+		DBGPRINT(D_LOCK, "Released connection lock at %d", __LINE__);
+		InterlockedDecrement(&GetCpuStatistics()->NumConnections);
+		QmCleanupBlock(blockNode);
+	}
+}
+
+//----------------------------------------------------------------------------
+__checkReturn
+NTSTATUS PublishReaderSnapshot(__out READER_SNAPSHOT **oldSnapshot)
+{
+	READER_SNAPSHOT *snapshot   = NULL;
+	LIST_ENTRY      *entry;
+	UINT32           numReaders = 0;
+
+	for (entry = gReaderListHead.Flink; entry != &gReaderListHead; entry = entry->Flink) {
+		numReaders++;
+	}
+
+	// Build the new snapshot before publishing it, since it is immutable once
+	// EnqueueBlock() can see it
+	if (numReaders) {
+		snapshot = reinterpret_cast<READER_SNAPSHOT*>(ExAllocatePoolWithTag(
+				NonPagedPool, FIELD_OFFSET(READER_SNAPSHOT, Readers) +
+				(numReaders * sizeof(READER_INFO*)), gPoolTagReaders));
+		if (!snapshot) {
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		snapshot->NumReaders = 0;
+		for (entry = gReaderListHead.Flink; entry != &gReaderListHead; entry = entry->Flink) {
+			snapshot->Readers[snapshot->NumReaders++] =
+					CONTAINING_RECORD(entry, READER_INFO, ListEntry);
 		}
 	}
 
-	KeReleaseInStackQueuedSpinLock(&lockHandle);
-	DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+	*oldSnapshot = reinterpret_cast<READER_SNAPSHOT*>(InterlockedExchangePointer(
+			reinterpret_cast<void* volatile*>(&gReaderSnapshot), snapshot));
+	return STATUS_SUCCESS;
 }
 
 //----------------------------------------------------------------------------
@@ -992,8 +1508,7 @@ BLOCK_NODE *QmAllocatePacketBlock(
 	if (!blockNode) {
 		return NULL;
 	}
-	*dataBuffer = (blockNode->Buffer ? blockNode->Buffer : blockNode->Data) +
-			sizeof(PCAP_NG_PACKET_HEADER);
+	*dataBuffer = blockNode->Buffer + sizeof(PCAP_NG_PACKET_HEADER);
 	return blockNode;
 }
 
@@ -1004,10 +1519,7 @@ bool QmCleanupBlock(__in BLOCK_NODE *blockNode)
 	if (blockNode) {
 		const LONG refCount = InterlockedDecrement(&blockNode->RefCount);
 		if (refCount == 0) { // Free memory if reference count is 0
-			if (blockNode->Buffer) {
-				ExFreePool(blockNode->Buffer);
-			}
-			ExFreeToLookasideListEx(&gBlockNodeLal, blockNode);
+			SlabFree(blockNode, blockNode->SizeClass);
 			freed = true;
 		}
 	}
@@ -1016,25 +1528,31 @@ bool QmCleanupBlock(__in BLOCK_NODE *blockNode)
 
 //----------------------------------------------------------------------------
 __checkReturn
-BLOCK_NODE* QmDequeueBlock(__in READER_INFO *reader)
+UINT32 QmDequeueBlocks(
+	__in READER_INFO                 *reader,
+	__out_ecount(count) BLOCK_NODE  **blocks,
+	__in const UINT32                 count)
 {
-	BLOCK_NODE *blockNode = NULL;
+	UINT32 numBlocks = 0;
 
 	// No need to lock, since we're using a lock-free ring buffer
-	if (reader) {
+	if (reader && blocks && count) {
 		if (reader->InitialBuffer.Buffer) {
-			blockNode = reinterpret_cast<BLOCK_NODE*>(
-					RingBufferDequeue(&reader->InitialBuffer));
+			numBlocks = RingBufferDequeueBatch(&reader->InitialBuffer,
+					reinterpret_cast<void**>(blocks), count);
 			if (IsRingBufferEmpty(&reader->InitialBuffer)) {
 				ExFreePool(reader->InitialBuffer.Buffer);
 				reader->InitialBuffer.Buffer = NULL;
 			}
 		} else {
-			blockNode = reinterpret_cast<BLOCK_NODE*>(
-					RingBufferDequeue(&reader->BlocksBuffer));
+			numBlocks = RingBufferDequeueBatch(&reader->BlocksBuffer,
+					reinterpret_cast<void**>(blocks), count);
+			if (!numBlocks && reader->CpuBuffers) {
+				numBlocks = DequeueMergedBlocks(reader, blocks, count);
+			}
 		}
 	}
-	return blockNode;
+	return numBlocks;
 }
 
 //----------------------------------------------------------------------------
@@ -1042,6 +1560,7 @@ __checkReturn
 NTSTATUS QmDeregisterReader(__in READER_INFO *reader)
 {
 	KLOCK_QUEUE_HANDLE  lockHandle;
+	READER_SNAPSHOT    *oldSnapshot = NULL;
 
 	if (!reader) {
 		return STATUS_INVALID_PARAMETER;
@@ -1050,6 +1569,20 @@ NTSTATUS QmDeregisterReader(__in READER_INFO *reader)
 	DBGPRINT(D_LOCK, "Acquiring reader list lock at %d", __LINE__);
 	KeAcquireInStackQueuedSpinLock(&gReaderListLock, &lockHandle);
 
+	RemoveEntryList(&reader->ListEntry);
+	if (!NT_SUCCESS(PublishReaderSnapshot(&oldSnapshot))) {
+		// Cannot allocate a new snapshot, so remove the reader from the current
+		// snapshot in place instead
+		READER_SNAPSHOT *snapshot = gReaderSnapshot;
+		for (UINT32 index = 0; snapshot && (index < snapshot->NumReaders); index++) {
+			if (snapshot->Readers[index] == reader) {
+				InterlockedExchangePointer(reinterpret_cast<void* volatile*>(
+						&snapshot->Readers[index]), NULL);
+			}
+		}
+		oldSnapshot = NULL;
+	}
+
 	gStatistics.NumReaders--;
 	if (gStatistics.NumReaders == 0) {
 		LARGE_INTEGER tickCount;
@@ -1059,13 +1592,18 @@ NTSTATUS QmDeregisterReader(__in READER_INFO *reader)
 	}
 	DBGPRINT(D_INFO, "Deregistered reader %d, total registered readers %d",
 			reader->Id, gStatistics.NumReaders);
-	CleanupReader(reader);
-	RemoveEntryList(&reader->ListEntry);
 	CalculateMaxSnapLength();
 
 	KeReleaseInStackQueuedSpinLock(&lockHandle);
 	DBGPRINT(D_LOCK, "Released reader list lock at %d", __LINE__);
 
+	// Wait until no processor can be enqueuing blocks for this reader before
+	// cleaning it up
+	WaitForReaderSnapshot();
+	if (oldSnapshot) {
+		ExFreePool(oldSnapshot);
+	}
+	CleanupReader(reader);
 	return STATUS_SUCCESS;
 }
 
@@ -1077,7 +1615,6 @@ NTSTATUS QmEnqueueConnectionBlock(
 	__in const UINT32 processId)
 {
 	BLOCK_NODE         *blockNode = NULL;
-	BLOCK_NODE          searchNode;
 	KLOCK_QUEUE_HANDLE  lockHandle;
 
 	// Release packet blocks held for this connection
@@ -1085,37 +1622,49 @@ NTSTATUS QmEnqueueConnectionBlock(
 
 	// If connection opened, get the block node, if one already exists
 	// If connection closed, set timer to delete the block node, if one exists
-	searchNode.SortId = connectionId;
 	if (opened) {
-		DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-		KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
-		blockNode = LLRB_FIND(BlockTree, &gConnTreeHead, &searchNode);
+		DBGPRINT(D_LOCK, "Acquiring connection lock at %d", __LINE__);
+		KeAcquireInStackQueuedSpinLock(GetConnectionLock(connectionId), &lockHandle);
+		blockNode = FindConnectionBlock(connectionId);
 		KeReleaseInStackQueuedSpinLock(&lockHandle);
-		DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+		DBGPRINT(D_LOCK, "Released connection lock at %d", __LINE__);
 		if (blockNode) {
 			return STATUS_SUCCESS; // Already enqueued open block for this connection
 		}
-		InterlockedIncrement(&gStatistics.ConnectionOpenEvents);
-		InterlockedIncrement(&gStatistics.NumConnections);
+		CPU_STATISTICS *stats = GetCpuStatistics();
+		InterlockedIncrement(&stats->ConnectionOpenEvents);
+		InterlockedIncrement(&stats->NumConnections);
 	} else {
 		bool held = false;
-		DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-		KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
-		blockNode = LLRB_FIND(BlockTree, &gConnTreeHead, &searchNode);
-		if (blockNode && (blockNode->ListEntry.Flink == 0)) {
-			// Hold the connection block for one second in case more packets arrive
+		DBGPRINT(D_LOCK, "Acquiring connection lock at %d", __LINE__);
+		KeAcquireInStackQueuedSpinLock(GetConnectionLock(connectionId), &lockHandle);
+		blockNode = FindConnectionBlock(connectionId);
+		if (blockNode && (blockNode->TimerEntry.Expires == 0)) {
+			KLOCK_QUEUE_HANDLE closeLockHandle;
+			const UINT64       tick = GetTimerWheelTick(CONN_CLOSE_TICK);
+
+			// Hold the connection block for one second in case more packets
+			// arrive.  Its expiration tick stays set after it expires, which
+			// keeps later close events from scheduling it again.
 			DBGPRINT(D_INFO, "Holding closed connection %08X for 1 second", connectionId);
-			InsertTailList(&gConnCloseListHead, &blockNode->ListEntry);
-			KeSetTimer(&gConnCloseTimer, gConnCloseTimeout, &gConnCloseDpc);
+			DBGPRINT(D_LOCK, "Acquiring connection close lock at %d", __LINE__);
+			KeAcquireInStackQueuedSpinLockAtDpcLevel(&gConnCloseLock, &closeLockHandle);
+			if (!gTimersStopped && IsTimerWheelEmpty(&gConnCloseWheel)) {
+				KeSetTimer(&gConnCloseTimer, gConnCloseTimeout, &gConnCloseDpc);
+			}
+			TimerWheelInsert(&gConnCloseWheel, &blockNode->TimerEntry, tick,
+					tick + (CONN_CLOSE_TIME / CONN_CLOSE_TICK));
+			KeReleaseInStackQueuedSpinLockFromDpcLevel(&closeLockHandle);
+			DBGPRINT(D_LOCK, "Released connection close lock at %d", __LINE__);
 			held = true;
 		}
 		KeReleaseInStackQueuedSpinLock(&lockHandle);
-		DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+		DBGPRINT(D_LOCK, "Released connection lock at %d", __LINE__);
 		if (blockNode && !held) {
 			return STATUS_SUCCESS; // Already enqueued close block for this connection
 		}
 		blockNode = NULL; // So we don't free the block in the code below
-		InterlockedIncrement(&gStatistics.ConnectionCloseEvents);
+		InterlockedIncrement(&GetCpuStatistics()->ConnectionCloseEvents);
 	}
 
 	// Create a block if there are readers or need to save connection information
@@ -1127,17 +1676,15 @@ NTSTATUS QmEnqueueConnectionBlock(
 
 		if (opened) {
 			// Store the connection opened block
-			DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-			KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
+			DBGPRINT(D_LOCK, "Acquiring connection lock at %d", __LINE__);
+			KeAcquireInStackQueuedSpinLock(GetConnectionLock(connectionId), &lockHandle);
 			InterlockedIncrement(&blockNode->RefCount);
-			if (LLRB_INSERT(BlockTree, &gConnTreeHead, blockNode)) {
+			if (InsertConnectionBlock(blockNode)) {
 				// Already stored the block
 				InterlockedDecrement(&blockNode->RefCount);
-			} else {
-				gConnTreeCount++;
 			}
 			KeReleaseInStackQueuedSpinLock(&lockHandle);
-			DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+			DBGPRINT(D_LOCK, "Released connection lock at %d", __LINE__);
 		}
 
 		EnqueueBlock(blockNode);
@@ -1183,7 +1730,7 @@ NTSTATUS QmEnqueuePacketBlock(
 		blockNode->ConnectionId = connectionId;
 		blockNode->ProcessId    = processId;
 		GetTimestamp(&blockNode->Timestamp);
-		buffer = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+		buffer = blockNode->Buffer;
 		header = reinterpret_cast<PCAP_NG_PACKET_HEADER*>(buffer);
 		header->BlockType      = blockNode->BlockType;
 		header->BlockLength    = blockNode->BlockLength;
@@ -1253,8 +1800,9 @@ NTSTATUS QmEnqueueProcessBlock(
 		if (blockNode) {
 			return STATUS_SUCCESS; // Readers already have a block for this process
 		}
-		InterlockedIncrement(&gStatistics.ProcessStartEvents);
-		InterlockedIncrement(&gStatistics.NumProcesses);
+		CPU_STATISTICS *stats = GetCpuStatistics();
+		InterlockedIncrement(&stats->ProcessStartEvents);
+		InterlockedIncrement(&stats->NumProcesses);
 	} else {
 		DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
 		KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
@@ -1263,13 +1811,13 @@ NTSTATUS QmEnqueueProcessBlock(
 			// In case we get multiple process close events, we only want to
 			// decrement these counts one time
 			gProcessTreeCount--;
-			InterlockedDecrement(&gStatistics.NumProcesses);
+			InterlockedDecrement(&GetCpuStatistics()->NumProcesses);
 		}
 		KeReleaseInStackQueuedSpinLock(&lockHandle);
 		DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
 		QmCleanupBlock(blockNode);
 		blockNode = NULL; // So we don't free the block in the code below
-		InterlockedIncrement(&gStatistics.ProcessEndEvents);
+		InterlockedIncrement(&GetCpuStatistics()->ProcessEndEvents);
 	}
 
 	// Create a block if there are readers or need to save process information
@@ -1311,10 +1859,17 @@ NTSTATUS QmGetInitialBlocks(
 {
 	NTSTATUS             status = STATUS_SUCCESS;
 	KLOCK_QUEUE_HANDLE   lockHandle;
+	UINT32               bucket;
+	UINT32               lockIndex;
+	UINT32               connSlots;
+	UINT32               numConns                  = 0;
+	BLOCK_TREE_HEAD      connTreeHead              = LLRB_INITIALIZER(&connTreeHead);
+	BLOCK_NODE          *blockNode;
 	BLOCK_NODE          *connBlock                 = NULL;
 	BLOCK_NODE          *procBlock                 = NULL;
 	BLOCK_NODE          *interfaceDescriptionBlock = NULL;
 	BLOCK_NODE          *sectionHeaderBlock        = NULL;
+	BLOCK_NODE          *headerBlocks[2];
 	RING_BUFFER         *ringBuffer                = NULL;
 
 	if (!reader) {
@@ -1364,15 +1919,15 @@ NTSTATUS QmGetInitialBlocks(
 		ringBuffer = &reader->BlocksBuffer;
 	} else {
 		// Allocate new initial blocks buffer
-		const UINT32 bufferSize = (gConnTreeCount + gProcessTreeCount + 2) *
-				sizeof(void*);
-		void **buffer = reinterpret_cast<void**>(ExAllocatePoolWithTag(
-				NonPagedPool, bufferSize, gPoolTagRingBuffer));
+		const UINT32 bufferSize = RoundUpPowerOf2(
+				static_cast<UINT32>(gConnTableCount) + gProcessTreeCount + 2) *
+				sizeof(RING_BUFFER_SLOT);
+		RING_BUFFER_SLOT *buffer = reinterpret_cast<RING_BUFFER_SLOT*>(
+				ExAllocatePoolWithTag(NonPagedPool, bufferSize, gPoolTagRingBuffer));
 		if (!buffer) {
 			status = STATUS_INSUFFICIENT_RESOURCES;
 			goto Cleanup;
 		}
-		RtlZeroMemory(buffer, bufferSize);
 		InitRingBuffer(&reader->InitialBuffer, buffer, bufferSize);
 		ringBuffer = &reader->InitialBuffer;
 	}
@@ -1384,46 +1939,76 @@ NTSTATUS QmGetInitialBlocks(
 		goto Cleanup;
 	}
 	InterlockedIncrement(&sectionHeaderBlock->RefCount);
-	RingBufferEnqueue(ringBuffer, sectionHeaderBlock);
-	RingBufferEnqueue(ringBuffer, interfaceDescriptionBlock);
+	headerBlocks[0] = sectionHeaderBlock;
+	headerBlocks[1] = interfaceDescriptionBlock;
+	RingBufferEnqueueBatch(ringBuffer, reinterpret_cast<void**>(headerBlocks),
+			ARRAY_SIZEOF(headerBlocks));
+
+	// Keep enough free slots for every process block, and use the rest for
+	// connection blocks.  Only one stripe of the connection table is locked at
+	// a time, so connections can still open while we walk it.  Any that don't
+	// fit are skipped, since the reader gets their blocks as they open.
+	connSlots = ringBuffer->Length -
+			static_cast<UINT32>(ringBuffer->Back - ringBuffer->Front);
+	connSlots = (connSlots > gProcessTreeCount) ? connSlots - gProcessTreeCount : 0;
+
+	// Sort the connection blocks by connection ID.  Connection blocks live in
+	// the connection table rather than a tree, so their tree entries are free
+	// to use here, and the trees lock keeps other readers from using them at
+	// the same time.
+	for (lockIndex = 0; (lockIndex < CONN_TABLE_LOCKS) && (numConns < connSlots);
+			lockIndex++) {
+		KLOCK_QUEUE_HANDLE connLockHandle;
+
+		DBGPRINT(D_LOCK, "Acquiring connection lock at %d", __LINE__);
+		KeAcquireInStackQueuedSpinLockAtDpcLevel(&gConnTableLocks[lockIndex].Lock,
+				&connLockHandle);
+		for (bucket = lockIndex; bucket < CONN_TABLE_SIZE; bucket += CONN_TABLE_LOCKS) {
+			for (connBlock = gConnTable[bucket]; connBlock && (numConns < connSlots);
+					connBlock = connBlock->HashNext) {
+				InterlockedIncrement(&connBlock->RefCount);
+				if (LLRB_INSERT(BlockTree, &connTreeHead, connBlock)) {
+					InterlockedDecrement(&connBlock->RefCount);
+				} else {
+					numConns++;
+				}
+			}
+		}
+		KeReleaseInStackQueuedSpinLockFromDpcLevel(&connLockHandle);
+		DBGPRINT(D_LOCK, "Released connection lock at %d", __LINE__);
+	}
 
-	// Enqueue process and connection blocks by comparing timestamps
-	connBlock = LLRB_MIN(BlockTree, &gConnTreeHead);
+	// Enqueue process and connection blocks by comparing timestamps.  The
+	// connection blocks already hold a reference, and a connection may have
+	// closed since we walked the table, so release it with QmCleanupBlock.
+	connBlock = LLRB_MIN(BlockTree, &connTreeHead);
 	procBlock = LLRB_MIN(BlockTree, &gProcessTreeHead);
-	while (connBlock && procBlock) {
-		if (procBlock->Timestamp.QuadPart < connBlock->Timestamp.QuadPart) {
-			InterlockedIncrement(&procBlock->RefCount);
-			RingBufferEnqueue(ringBuffer, procBlock);
+	while (connBlock || procBlock) {
+		if (procBlock && (!connBlock ||
+				(procBlock->Timestamp.QuadPart < connBlock->Timestamp.QuadPart))) {
+			blockNode = procBlock;
 			procBlock = LLRB_NEXT(BlockTree, &gProcessTreeHead, procBlock);
+			InterlockedIncrement(&blockNode->RefCount);
+			if (!RingBufferEnqueue(ringBuffer, blockNode)) {
+				InterlockedDecrement(&blockNode->RefCount);
+			}
 		} else {
-			InterlockedIncrement(&connBlock->RefCount);
-			RingBufferEnqueue(ringBuffer, connBlock);
-			connBlock = LLRB_NEXT(BlockTree, &gConnTreeHead, connBlock);
+			blockNode = connBlock;
+			connBlock = LLRB_NEXT(BlockTree, &connTreeHead, connBlock);
+			if (!RingBufferEnqueue(ringBuffer, blockNode)) {
+				QmCleanupBlock(blockNode);
+			}
 		}
 	}
 
-	// Enqueue remaining process or connection entries
-	while (procBlock) {
-		InterlockedIncrement(&procBlock->RefCount);
-		RingBufferEnqueue(ringBuffer, procBlock);
-		procBlock = LLRB_NEXT(BlockTree, &gProcessTreeHead, procBlock);
-	}
-	while (connBlock) {
-		InterlockedIncrement(&connBlock->RefCount);
-		RingBufferEnqueue(ringBuffer, connBlock);
-		connBlock = LLRB_NEXT(BlockTree, &gConnTreeHead, connBlock);
-	}
-
 Cleanup:
 	// Release the spin lock here so it gets released when cleaning up
 	KeReleaseInStackQueuedSpinLock(&lockHandle);
 	DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
 
 	if (NT_SUCCESS(status)) {
-		// Set event after releasing the spin lock
-		if (reader->DataEvent) {
-			KeSetEvent(reader->DataEvent, 1, FALSE);
-		}
+		// Notify reader after releasing the spin lock
+		NotifyReader(reader);
 	} else if (!useBlocksBuffer && reader->InitialBuffer.Buffer) {
 		CleanupRingBuffer(&reader->InitialBuffer);
 		ExFreePool(reader->InitialBuffer.Buffer);
@@ -1451,6 +2036,23 @@ void QmGetStatistics(__in STATISTICS *statistics, __in READER_INFO *reader)
 
 	KeQueryTickCount(&tickCount);
 	memcpy(statistics, &gStatistics, sizeof(STATISTICS));
+
+	// Sum the per-processor statistics
+	for (UINT32 index = 0; index < gNumProcessors; index++) {
+		CPU_STATISTICS *stats = &gCpuStatistics[index];
+
+		// Use interlocked reads so that 64-bit counts are not torn on 32-bit systems
+		statistics->CapturedPackets += InterlockedCompareExchange64(
+				reinterpret_cast<LONG64*>(&stats->CapturedPackets), 0, 0);
+		statistics->CapturedPacketBytes += InterlockedCompareExchange64(
+				reinterpret_cast<LONG64*>(&stats->CapturedPacketBytes), 0, 0);
+		statistics->ProcessStartEvents    += stats->ProcessStartEvents;
+		statistics->NumProcesses          += stats->NumProcesses;
+		statistics->ProcessEndEvents      += stats->ProcessEndEvents;
+		statistics->ConnectionOpenEvents  += stats->ConnectionOpenEvents;
+		statistics->NumConnections        += stats->NumConnections;
+		statistics->ConnectionCloseEvents += stats->ConnectionCloseEvents;
+	}
 	statistics->LoadedTime       = TickDiffToSeconds(&gDriverLoadTick, &tickCount);
 	statistics->LoggingTime     += TickDiffToSeconds(&gReaderTick, &tickCount);
 	statistics->ReaderBufferSize = reader->RingBufferSize;
@@ -1473,25 +2075,41 @@ NTSTATUS QmRegisterReader(__in READER_INFO *reader)
 {
 	NTSTATUS            status = STATUS_SUCCESS;
 	KLOCK_QUEUE_HANDLE  lockHandle;
-	const UINT32        bufferSize = GetRingBufferSize();
-	void              **buffer;
+	const UINT32        bufferSize  = GetRingBufferSize();
+	RING_BUFFER_SLOT   *buffer;
+	READER_SNAPSHOT    *oldSnapshot = NULL;
 
-	buffer = reinterpret_cast<void**>(ExAllocatePoolWithTag(
+	buffer = reinterpret_cast<RING_BUFFER_SLOT*>(ExAllocatePoolWithTag(
 				NonPagedPool, bufferSize, gPoolTagRingBuffer));
 	if (!buffer) {
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
-	RtlZeroMemory(buffer, bufferSize);
 
 	InitRingBuffer(&reader->BlocksBuffer, buffer, bufferSize);
+	if (GetPerProcessorRings()) {
+		status = AllocateCpuBuffers(reader, bufferSize);
+		if (!NT_SUCCESS(status)) {
+			CleanupReader(reader);
+			return status;
+		}
+	}
 	status = QmGetInitialBlocks(reader, true);
 	if (!NT_SUCCESS(status)) {
+		CleanupReader(reader);
 		return status;
 	}
 
 	DBGPRINT(D_LOCK, "Acquiring reader list lock at %d", __LINE__);
 	KeAcquireInStackQueuedSpinLock(&gReaderListLock, &lockHandle);
 	InsertTailList(&gReaderListHead, &reader->ListEntry);
+	status = PublishReaderSnapshot(&oldSnapshot);
+	if (!NT_SUCCESS(status)) {
+		RemoveEntryList(&reader->ListEntry);
+		KeReleaseInStackQueuedSpinLock(&lockHandle);
+		DBGPRINT(D_LOCK, "Released reader list lock at %d", __LINE__);
+		CleanupReader(reader);
+		return status;
+	}
 	if (gStatistics.NumReaders == 0) {
 		KeQueryTickCount(&gReaderTick);
 	}
@@ -1507,55 +2125,75 @@ NTSTATUS QmRegisterReader(__in READER_INFO *reader)
 	gStatistics.MaxSnapLength = _UI32_MAX; // Unlimited snap length by default
 	KeReleaseInStackQueuedSpinLock(&lockHandle);
 	DBGPRINT(D_LOCK, "Released reader list lock at %d", __LINE__);
+
+	if (oldSnapshot) {
+		WaitForReaderSnapshot();
+		ExFreePool(oldSnapshot);
+	}
 	return status;
 }
 
 //----------------------------------------------------------------------------
-void QmSetOpenConnections(__in CONNECTIONS *connections)
+__checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS QmSetOpenConnections(__in CONNECTIONS *connections)
 {
-	UINT32              index;
-	KLOCK_QUEUE_HANDLE  lockHandle;
-
-	DBGPRINT(D_LOCK, "Acquiring trees lock at %d", __LINE__);
-	KeAcquireInStackQueuedSpinLock(&gTreesLock, &lockHandle);
-	LLRB_CLEAR(OconnTree, &gOconnTcp4TreeHead);
-	LLRB_CLEAR(OconnTree, &gOconnTcp6TreeHead);
-	LLRB_CLEAR(OconnTree, &gOconnUdp4TreeHead);
-	LLRB_CLEAR(OconnTree, &gOconnUdp6TreeHead);
+	OCONN_TABLES *oconnTables;
+	UINT32        index;
+
+	// Build the new tables without holding any locks, since packets can still
+	// be looked up in the current tables while we do it
+	oconnTables = reinterpret_cast<OCONN_TABLES*>(ExAllocatePoolWithTag(
+			NonPagedPool, sizeof(OCONN_TABLES), gPoolTagOconnTable));
+	if (!oconnTables) {
+		DBGPRINT(D_ERR, "Cannot allocate open connection tables");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(oconnTables, sizeof(OCONN_TABLES));
 
 	for (index = 0; index < connections->NumRecords; index++) {
-		OCONN_TREE_HEAD *treeHead;
-		OCONN_NODE      *oconnNode = reinterpret_cast<OCONN_NODE*>(
-				ExAllocateFromLookasideListEx(&gOconnNodeLal));
-		if (!oconnNode) {
-			break;
-		}
-		RtlZeroMemory(oconnNode, sizeof(OCONN_NODE));
-		oconnNode->Port      = connections->Records[index].Port;
-		oconnNode->ProcessId = connections->Records[index].ProcessId;
-		oconnNode->Timestamp = connections->Records[index].Timestamp;
-
-		if (connections->Records[index].AddressFamily == AF_INET) {
-			if (connections->Records[index].Protocol == IPPROTO_TCP) {
-				treeHead = &gOconnTcp4TreeHead;
-			} else {
-				treeHead = &gOconnUdp4TreeHead;
-			}
-		} else {
-			if (connections->Records[index].Protocol == IPPROTO_TCP) {
-				treeHead = &gOconnTcp6TreeHead;
-			} else {
-				treeHead = &gOconnUdp6TreeHead;
+		const CONNECTION_RECORD *record     = &connections->Records[index];
+		const OCONN_TABLE_INDEX  tableIndex = GetOconnTableIndex(
+				record->AddressFamily, record->Protocol);
+		OCONN_ENTRY             *oconnTable = oconnTables->Tables[tableIndex];
+
+		if (!oconnTable) {
+			oconnTable = AllocateOconnTable();
+			if (!oconnTable) {
+				CleanupOconnTables(oconnTables);
+				return STATUS_INSUFFICIENT_RESOURCES;
 			}
+			oconnTables->Tables[tableIndex] = oconnTable;
 		}
 
-		if (LLRB_INSERT(OconnTree, treeHead, oconnNode)) {
-			ExFreeToLookasideListEx(&gOconnNodeLal, oconnNode);
+		// Keep the first connection listed for a port
+		if (oconnTable[record->Port].ProcessId == _UI32_MAX) {
+			oconnTable[record->Port].ProcessId = record->ProcessId;
+			oconnTable[record->Port].Timestamp = record->Timestamp;
 		}
 	}
 
-	KeReleaseInStackQueuedSpinLock(&lockHandle);
-	DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
+	// Publish the new tables under the mutex, so that changes aren't applied
+	// to the old tables.  Free the old ones once no processor can still be
+	// looking up packets in them, after releasing the mutex, since waiting
+	// for the readers requires PASSIVE_LEVEL.
+	ExAcquireFastMutex(&gOconnMutex);
+	oconnTables = reinterpret_cast<OCONN_TABLES*>(InterlockedExchangePointer(
+			reinterpret_cast<void* volatile*>(&gOconnTables), oconnTables));
+	ExReleaseFastMutex(&gOconnMutex);
+	if (oconnTables) {
+		WaitForReaderSnapshot();
+		CleanupOconnTables(oconnTables);
+	}
+	return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+void QmSetReaderDataDpc(
+	__in READER_INFO  *reader,
+	__in KDPC         *dpc)
+{
+	InterlockedExchangePointer(reinterpret_cast<void* volatile*>(
+			&reader->DataDpc), dpc);
 }
 
 //----------------------------------------------------------------------------
@@ -1564,7 +2202,7 @@ NTSTATUS QmSetReaderDataEvent(
 	__in READER_INFO  *reader,
 	__in const HANDLE  userEvent)
 {
-	KLOCK_QUEUE_HANDLE  lockHandle;
+	KEVENT             *oldEvent;
 	KEVENT             *kernelEvent = NULL;
 
 	// Get pointer to event object
@@ -1577,17 +2215,99 @@ NTSTATUS QmSetReaderDataEvent(
 		}
 	}
 
-	DBGPRINT(D_LOCK, "Acquiring reader list lock at %d", __LINE__);
-	KeAcquireInStackQueuedSpinLock(&gReaderListLock, &lockHandle);
+	// Release old object once no processor can be signaling it
+	oldEvent = reinterpret_cast<KEVENT*>(InterlockedExchangePointer(
+			reinterpret_cast<void* volatile*>(&reader->DataEvent), kernelEvent));
+	if (oldEvent) {
+		WaitForReaderSnapshot();
+		ObDereferenceObject(oldEvent);
+	}
+	return STATUS_SUCCESS;
+}
 
-	// Release old object before setting the new one
-	if (reader->DataEvent) {
-		ObDereferenceObject(reader->DataEvent);
+//----------------------------------------------------------------------------
+__checkReturn
+NTSTATUS QmSetReaderIdList(
+	__in READER_INFO                  *reader,
+	__in const ID_LIST_TYPE            idListType,
+	__in_ecount(numIds) const UINT32  *ids,
+	__in const UINT32                  numIds)
+{
+	ID_SET      *oldSet;
+	ID_SET      *set    = NULL;
+	ID_SET     **target = (idListType == ConnectionIdList) ?
+			&reader->FilteredConnectionIds : &reader->FilteredProcessIds;
+	const char  *label  = (idListType == ConnectionIdList) ?
+			"connection" : "process";
+
+	DBGPRINT(D_INFO, "Filtering %d %s ID(s) for reader %d", numIds, label,
+			reader->Id);
+
+	// Build a hash set of the IDs
+	if (numIds) {
+		set = reinterpret_cast<ID_SET*>(ExAllocatePoolWithTag(NonPagedPool,
+				GetIdSetSize(numIds), gPoolTagFilter));
+		if (!set) {
+			DBGPRINT(D_ERR, "Cannot allocate %s ID set for reader %d", label,
+					reader->Id);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		InitIdSet(set, numIds);
+		for (UINT32 index = 0; index < numIds; index++) {
+			DBGPRINT(D_INFO, "Filtering %s %08X (%d) for reader %d", label,
+					ids[index], ids[index], reader->Id);
+			IdSetInsert(set, ids[index]);
+		}
 	}
-	reader->DataEvent = kernelEvent;
 
-	KeReleaseInStackQueuedSpinLock(&lockHandle);
-	DBGPRINT(D_LOCK, "Released reader list lock at %d", __LINE__);
+	// Free old set once no processor can be checking it
+	oldSet = reinterpret_cast<ID_SET*>(InterlockedExchangePointer(
+			reinterpret_cast<void* volatile*>(target), set));
+	if (oldSet) {
+		WaitForReaderSnapshot();
+		ExFreePool(oldSet);
+	}
+	return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+__checkReturn
+NTSTATUS QmSetReaderPacketFilter(
+	__in READER_INFO                                *reader,
+	__in_ecount(numInsns) const PACKET_FILTER_INSN  *insns,
+	__in const UINT32                                numInsns)
+{
+	PACKET_FILTER *oldFilter;
+	PACKET_FILTER *filter = NULL;
+
+	DBGPRINT(D_INFO, "Setting %d packet filter instruction(s) for reader %d",
+			numInsns, reader->Id);
+
+	// Copy the program, since the request's buffer goes away when it completes
+	if (numInsns) {
+		if (!IsPacketFilterValid(insns, numInsns)) {
+			DBGPRINT(D_ERR, "Invalid packet filter for reader %d", reader->Id);
+			return STATUS_INVALID_PARAMETER;
+		}
+		filter = reinterpret_cast<PACKET_FILTER*>(ExAllocatePoolWithTag(
+				NonPagedPool, sizeof(PACKET_FILTER) +
+				((numInsns - 1) * sizeof(PACKET_FILTER_INSN)), gPoolTagFilter));
+		if (!filter) {
+			DBGPRINT(D_ERR, "Cannot allocate packet filter for reader %d",
+					reader->Id);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		filter->NumInsns = numInsns;
+		RtlCopyMemory(filter->Insns, insns, numInsns * sizeof(PACKET_FILTER_INSN));
+	}
+
+	// Free old program once no processor can be running it
+	oldFilter = reinterpret_cast<PACKET_FILTER*>(InterlockedExchangePointer(
+			reinterpret_cast<void* volatile*>(&reader->PacketFilter), filter));
+	if (oldFilter) {
+		WaitForReaderSnapshot();
+		ExFreePool(oldFilter);
+	}
 	return STATUS_SUCCESS;
 }
 
@@ -1609,6 +2329,69 @@ NTSTATUS QmSetReaderSnapLength(
 	return STATUS_SUCCESS;
 }
 
+//----------------------------------------------------------------------------
+__checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS QmUpdateOpenConnections(__in CONNECTION_CHANGES *changes)
+{
+	const CONNECTION_RECORD *removed     = changes->Records + changes->NumAdded;
+	const LARGE_INTEGER      noTimestamp = {0};
+	OCONN_TABLES            *oconnTables;
+	NTSTATUS                 status      = STATUS_SUCCESS;
+	UINT32                   index;
+
+	ExAcquireFastMutex(&gOconnMutex);
+
+	// Start with empty tables if there isn't a list of connections yet
+	oconnTables = gOconnTables;
+	if (!oconnTables) {
+		oconnTables = reinterpret_cast<OCONN_TABLES*>(ExAllocatePoolWithTag(
+				NonPagedPool, sizeof(OCONN_TABLES), gPoolTagOconnTable));
+		if (!oconnTables) {
+			DBGPRINT(D_ERR, "Cannot allocate open connection tables");
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			goto Cleanup;
+		}
+		RtlZeroMemory(oconnTables, sizeof(OCONN_TABLES));
+		InterlockedExchangePointer(reinterpret_cast<void* volatile*>(
+				&gOconnTables), oconnTables);
+	}
+
+	// Remove connections first, so that a port that was closed and reopened
+	// ends up with the new connection
+	for (index = 0; index < changes->NumRemoved; index++) {
+		OCONN_ENTRY *oconnTable = oconnTables->Tables[GetOconnTableIndex(
+				removed[index].AddressFamily, removed[index].Protocol)];
+		if (oconnTable) {
+			SetOconnEntry(&oconnTable[removed[index].Port], _UI32_MAX,
+					&noTimestamp);
+		}
+	}
+
+	for (index = 0; index < changes->NumAdded; index++) {
+		const CONNECTION_RECORD *record     = &changes->Records[index];
+		const OCONN_TABLE_INDEX  tableIndex = GetOconnTableIndex(
+				record->AddressFamily, record->Protocol);
+		OCONN_ENTRY             *oconnTable = oconnTables->Tables[tableIndex];
+
+		if (!oconnTable) {
+			// Lookups see either no table or an empty one
+			oconnTable = AllocateOconnTable();
+			if (!oconnTable) {
+				status = STATUS_INSUFFICIENT_RESOURCES;
+				goto Cleanup;
+			}
+			InterlockedExchangePointer(reinterpret_cast<void* volatile*>(
+					&oconnTables->Tables[tableIndex]), oconnTable);
+		}
+		SetOconnEntry(&oconnTable[record->Port], record->ProcessId,
+				&record->Timestamp);
+	}
+
+Cleanup:
+	ExReleaseFastMutex(&gOconnMutex);
+	return status;
+}
+
 //----------------------------------------------------------------------------
 void ReleasePacketBlocks(
 	__in const UINT32 connectionId,
@@ -1635,12 +2418,15 @@ void ReleasePacketBlocks(
 			UINT32                 blockOffset;
 			BLOCK_NODE            *previousBlockNode;
 
-			buffer      = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+			buffer      = blockNode->Buffer;
 			header      = reinterpret_cast<PCAP_NG_PACKET_HEADER*>(buffer);
 			blockOffset = sizeof(PCAP_NG_PACKET_HEADER) +
 					PCAP_NG_PADDING(header->CapturedLength);
 			footer = reinterpret_cast<PCAP_NG_PACKET_FOOTER*>(buffer + blockOffset);
-			footer->ProcessId = processId;
+			footer->ProcessId    = processId;
+			blockNode->ProcessId = processId;
+			TimerWheelRemove(&gHeldPacketWheel, &blockNode->TimerEntry);
+			gHeldPacketBytes -= sizeof(BLOCK_NODE) + blockNode->BlockLength;
 			EnqueueBlock(blockNode);
 
 			// Release our hold on this block after getting the next block in the list
@@ -1658,6 +2444,59 @@ void ReleasePacketBlocks(
 	DBGPRINT(D_LOCK, "Released trees lock at %d", __LINE__);
 }
 
+//----------------------------------------------------------------------------
+bool RemoveConnectionBlock(__in BLOCK_NODE *blockNode)
+{
+	BLOCK_NODE **link = &gConnTable[GetConnectionBucket(blockNode->SortId)];
+
+	while (*link && (*link != blockNode)) {
+		link = &(*link)->HashNext;
+	}
+	if (!*link) {
+		return false;
+	}
+	*link = blockNode->HashNext;
+	blockNode->HashNext = NULL;
+	InterlockedDecrement(&gConnTableCount);
+	return true;
+}
+
+//----------------------------------------------------------------------------
+void RemoveHeldPacketBlock(__in BLOCK_NODE *blockNode)
+{
+	// Only the first held block for a connection is in the tree, and the rest
+	// are chained to it.  If this block is in the tree, the next block in the
+	// chain takes its place.
+	if (LLRB_FIND(BlockTree, &gPacketTreeHead, blockNode) == blockNode) {
+		LLRB_REMOVE(BlockTree, &gPacketTreeHead, blockNode);
+		if (!IsListEmpty(&blockNode->ListEntry)) {
+			BLOCK_NODE *nextNode = CONTAINING_RECORD(blockNode->ListEntry.Flink,
+					BLOCK_NODE, ListEntry);
+			RemoveEntryList(&blockNode->ListEntry);
+			LLRB_INSERT(BlockTree, &gPacketTreeHead, nextNode);
+		}
+	} else {
+		RemoveEntryList(&blockNode->ListEntry);
+	}
+
+	TimerWheelRemove(&gHeldPacketWheel, &blockNode->TimerEntry);
+	gHeldPacketBytes -= sizeof(BLOCK_NODE) + blockNode->BlockLength;
+	gPacketTreeCount--;
+}
+
+//----------------------------------------------------------------------------
+void SetOconnEntry(
+	__in OCONN_ENTRY          *oconnEntry,
+	__in const UINT32          processId,
+	__in const LARGE_INTEGER  *timestamp)
+{
+	KIRQL oldIrql;
+
+	KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+	WriteOconnEntry(oconnEntry, processId, timestamp);
+	KeLowerIrql(oldIrql);
+}
+
 //----------------------------------------------------------------------------
 UINT32 SetOption(
 	__in char         *buffer,
@@ -1717,6 +2556,23 @@ UINT32 SetUtf8Option(
 	return offset;
 }
 
+//----------------------------------------------------------------------------
+void SyncReaderSnapshotDpc(
+	__in     KDPC *dpc,
+	__in_opt void *context,
+	__in_opt void *arg1,
+	__in_opt void *arg2)
+{
+	UNREFERENCED_PARAMETER(dpc);
+	UNREFERENCED_PARAMETER(context);
+	UNREFERENCED_PARAMETER(arg1);
+	UNREFERENCED_PARAMETER(arg2);
+
+	if (InterlockedDecrement(&gSyncPending) == 0) {
+		KeSetEvent(&gSyncEvent, 0, FALSE);
+	}
+}
+
 //----------------------------------------------------------------------------
 UINT32 TickDiffToSeconds(const LARGE_INTEGER *start, const LARGE_INTEGER *end)
 {
@@ -1724,6 +2580,20 @@ UINT32 TickDiffToSeconds(const LARGE_INTEGER *start, const LARGE_INTEGER *end)
 			KeQueryTimeIncrement()) / 10000000);
 }
 
+//----------------------------------------------------------------------------
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void WaitForReaderSnapshot(void)
+{
+	ExAcquireFastMutex(&gSyncMutex);
+	KeClearEvent(&gSyncEvent);
+	gSyncPending = static_cast<LONG>(gNumProcessors);
+	for (UINT32 index = 0; index < gNumProcessors; index++) {
+		KeInsertQueueDpc(&gSyncDpcs[index], NULL, NULL);
+	}
+	KeWaitForSingleObject(&gSyncEvent, Executive, KernelMode, FALSE, NULL);
+	ExReleaseFastMutex(&gSyncMutex);
+}
+
 #ifdef __cplusplus
 };
 #endif
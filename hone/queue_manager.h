@@ -20,238 +20,31 @@
 //----------------------------------------------------------------------------
 
 #include "common.h"
+#include "id_set.h"
 #include "llrb_clear.h"
 #include "ring_buffer.h"
+#include "timer_wheel.h"
 #include "../ioctls.h"
+#include "../packet_filter.h"
+#include "../pcap_ng.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-//----------------------------------------------------------------------------
-// Defines
-//----------------------------------------------------------------------------
-
-#ifndef PCAP_NG_PADDING
-#define PCAP_NG_PADDING(x) ((x) + ((4-(x)) & 0x03))
-#endif
-
 //----------------------------------------------------------------------------
 // Structures and enumerations
 //----------------------------------------------------------------------------
 
-// Supported PCAP-NG block types
-enum BLOCK_TYPES {
-	ConnectionBlock           = 0x00000102,
-	InterfaceDescriptionBlock = 0x00000001,
-	PacketBlock               = 0x00000006,
-	ProcessBlock              = 0x00000101,
-	SectionHeaderBlock        = 0x0A0D0D0A,
-};
-
-#pragma pack(push, 4) // PCAP-NG structures are 32-bit aligned
-
-// PCAP-NG block option header
-struct PCAP_NG_OPTION_HEADER {
-	UINT16 OptionCode;
-	UINT16 OptionLength;
-};
-
-// PCAP-NG connection block format:
-//
-//     0                   1                   2                   3
-//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-//    +---------------------------------------------------------------+
-//  0 |                    Block Type = 0x00000102                    |
-//    +---------------------------------------------------------------+
-//  4 |                      Block Total Length                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//  8 |                        Connection ID                          |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 12 |                          Process ID                           |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 16 |                        Timestamp (High)                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 20 |                        Timestamp (Low)                        |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 24 /                                                               /
-//    /                      Options (variable)                       /
-//    /                                                               /
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//    |                      Block Total Length                       |
-//    +---------------------------------------------------------------+
-//
-struct PCAP_NG_CONNECTION_HEADER {
-	UINT32 BlockType;
-	UINT32 BlockLength;
-	UINT32 ConnectionId;
-	UINT32 ProcessId;
-	UINT32 TimestampHigh;
-	UINT32 TimestampLow;
-	// Options and block length
-};
-
-// PCAP-NG interface description block format:
-//
-//     0                   1                   2                   3
-//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-//    +---------------------------------------------------------------+
-//  0 |                    Block Type = 0x00000001                    |
-//    +---------------------------------------------------------------+
-//  4 |                      Block Total Length                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//  8 |           LinkType            |           Reserved            |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 12 |                            SnapLen                            |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 16 /                                                               /
-//    /                      Options (variable)                       /
-//    /                                                               /
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//    |                      Block Total Length                       |
-//    +---------------------------------------------------------------+
-//
-struct PCAP_NG_INTERFACE_DESCRIPTION {
-	UINT32                       BlockType;
-	UINT32                       BlockLength;
-	UINT16                       LinkType;
-	UINT16                       Reserved;
-	UINT32                       SnapLength;
-	struct PCAP_NG_OPTION_HEADER IfDescHeader;
-	char                         IfDesc[28];
-	struct PCAP_NG_OPTION_HEADER OptionEnd;
-	UINT32                       BlockLengthFooter;
-};
-
-// PCAP-NG enhanced packet block format:
-//
-//    0                   1                   2                   3
-//    0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-//    +---------------------------------------------------------------+
-//  0 |                    Block Type = 0x00000006                    |
-//    +---------------------------------------------------------------+
-//  4 |                      Block Total Length                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//  8 |                         Interface ID                          |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 12 |                        Timestamp (High)                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 16 |                        Timestamp (Low)                        |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 20 |                         Captured Len                          |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 24 |                          Packet Len                           |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 28 /                                                               /
-//    /                          Packet Data                          /
-//    /           ( variable length, aligned to 32 bits )             /
-//    /                                                               /
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//    /                                                               /
-//    /                      Options (variable)                       /
-//    /                                                               /
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//    |                      Block Total Length                       |
-//    +---------------------------------------------------------------+
-//
-struct PCAP_NG_PACKET_HEADER {
-	UINT32 BlockType;
-	UINT32 BlockLength;
-	UINT32 InterfaceId;
-	UINT32 TimestampHigh;
-	UINT32 TimestampLow;
-	UINT32 CapturedLength;
-	UINT32 PacketLength;
-	// Block data, options, and block length
-};
-
-struct PCAP_NG_PACKET_FOOTER {
-	struct PCAP_NG_OPTION_HEADER ConnectionIdHeader;
-	UINT32                       ConnectionId;
-	struct PCAP_NG_OPTION_HEADER ProcessIdHeader;
-	UINT32                       ProcessId;
-	struct PCAP_NG_OPTION_HEADER FlagsHeader;
-	UINT32                       Flags;
-	struct PCAP_NG_OPTION_HEADER OptionEnd;
-	UINT32                       BlockLength;
-};
-
-// PCAP-NG process event block format:
-//
-//     0                   1                   2                   3
-//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-//    +---------------------------------------------------------------+
-//  0 |                    Block Type = 0x00000101                    |
-//    +---------------------------------------------------------------+
-//  4 |                      Block Total Length                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//  8 |                          Process ID                           |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 12 |                        Timestamp (High)                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 16 |                        Timestamp (Low)                        |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 20 /                                                               /
-//    /                      Options (variable)                       /
-//    /                                                               /
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//    |                      Block Total Length                       |
-//    +---------------------------------------------------------------+
-//
-struct PCAP_NG_PROCESS_HEADER {
-	UINT32                       BlockType;
-	UINT32                       BlockLength;
-	UINT32                       ProcessId;
-	UINT32                       TimestampHigh;
-	UINT32                       TimestampLow;
-	struct PCAP_NG_OPTION_HEADER ParentPidHeader;
-	UINT32                       ParentPid;
-	// Options and block length
-};
-
-// PCAP-NG section header block format:
-//
-//   0                   1                   2                   3
-//    0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-//    +---------------------------------------------------------------+
-//  0 |                   Block Type = 0x0A0D0D0A                     |
-//    +---------------------------------------------------------------+
-//  4 |                      Block Total Length                       |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//  8 |                      Byte-Order Magic                         |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 12 |          Major Version        |         Minor Version         |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 16 |                                                               |
-//    |                          Section Length                       |
-//    |                                                               |
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-// 24 /                                                               /
-//    /                      Options (variable)                       /
-//    /                                                               /
-//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//    |                      Block Total Length                       |
-//    +---------------------------------------------------------------+
-//
-struct PCAP_NG_SECTION_HEADER {
-	UINT32 BlockType;
-	UINT32 BlockLength;
-	UINT32 ByteOrder;
-	UINT16 MajorVersion;
-	UINT16 MinorVersion;
-	UINT64 SectionLength;
-	// Options and block length
-};
-
-#pragma pack(pop)
-
 // An LLRB tree node that holds a PCAP-NG block
-// The PCAP-NG data is in the Data member if the block is large enough to
-// contain all of it.  Otherwise, it is in the buffer pointed to by Buffer.
+// The PCAP-NG data immediately follows the node in the same slab allocation,
+// and Buffer points to it.
 typedef bool _Bool;
 struct BLOCK_NODE {
 	LLRB_ENTRY(BLOCK_NODE) TreeEntry;    // LLRB tree entry
+	BLOCK_NODE            *HashNext;     // Next block in connection table bucket
 	LIST_ENTRY             ListEntry;    // Doubly-linked list of blocks
+	TIMER_WHEEL_ENTRY      TimerEntry;   // Timing wheel entry for held packets and closed connections
 	LONG                   RefCount;     // Block reference count
 	UINT32                 BlockType;    // Block type to aid in debugging
 	UINT32                 BlockLength;  // Block data length in bytes
@@ -259,19 +52,37 @@ struct BLOCK_NODE {
 	UINT32                 ConnectionId; // Connection ID (0 if none)
 	UINT32                 ProcessId;    // Process ID (0xFFFFFFFF if none, since 0 is a valid PID)
 	LARGE_INTEGER          Timestamp;    // Block timestamp in milliseconds since 1970-01-01
-	char                  *Buffer;       // Buffer to use if this block isn't large enough, NULL otherwise
-	char                   Data[512];    // Block data
+	UINT32                 SizeClass;    // Slab size class that the node was allocated from
+	char                  *Buffer;       // Block data
+};
+
+// Packet filter program set by a reader
+struct PACKET_FILTER {
+	UINT32             NumInsns;  // Number of instructions in the program
+	PACKET_FILTER_INSN Insns[1];  // The program
 };
 
 // Information about a registered reader
 struct READER_INFO {
-	LIST_ENTRY   ListEntry;       // Doubly-linked list of readers
-	RING_BUFFER  BlocksBuffer;    // Ring buffer that holds PCAP-NG blocks for normal processing
-	RING_BUFFER  InitialBuffer;   // Ring buffer that holds initial PCAP-NG blocks when resetting
-	UINT32       SnapLength;      // Number of bytes to capture (0 if none, 0xFFFFFFFF if unlimited)
-	UINT32       Id;              // Unique ID for this reader
-	UINT32       RingBufferSize;  // Size of blocks ring buffer
-	KEVENT      *DataEvent;       // Event to signal when data is available (NULL if none)
+	LIST_ENTRY     ListEntry;              // Doubly-linked list of readers
+	RING_BUFFER    BlocksBuffer;           // Ring buffer that holds PCAP-NG blocks for normal processing
+	RING_BUFFER    InitialBuffer;          // Ring buffer that holds initial PCAP-NG blocks when resetting
+	RING_BUFFER   *CpuBuffers;             // Per-processor ring buffers (NULL if not using per-processor ring buffers)
+	BLOCK_NODE   **CpuHeads;               // Oldest block taken from each per-processor ring buffer but not yet dequeued
+	UINT32         NumCpuBuffers;          // Number of per-processor ring buffers
+	UINT32         SnapLength;             // Number of bytes to capture (0 if none, 0xFFFFFFFF if unlimited)
+	UINT32         Id;                     // Unique ID for this reader
+	UINT32         RingBufferSize;         // Size of blocks ring buffer
+	KEVENT        *DataEvent;              // Event to signal when data is available (NULL if none)
+	KDPC          *DataDpc;                // DPC to queue when data is available (NULL if none)
+	ID_SET        *FilteredConnectionIds;  // Connection IDs whose packets are not enqueued (NULL if none)
+	ID_SET        *FilteredProcessIds;     // Process IDs whose packets are not enqueued (NULL if none)
+	PACKET_FILTER *PacketFilter;           // Program that packets must pass to be enqueued (NULL if none)
+};
+
+enum ID_LIST_TYPE {
+	ConnectionIdList, // List of connection IDs
+	ProcessIdList,    // List of process IDs
 };
 
 enum PACKET_DIRECTION {
@@ -320,13 +131,18 @@ BLOCK_NODE *QmAllocatePacketBlock(
 bool QmCleanupBlock(__in BLOCK_NODE *blockNode);
 
 //----------------------------------------------------------------------------
-/// @brief Dequeues the next available block
+/// @brief Dequeues a batch of the next available blocks
 ///
-/// @param reader  Reader to get block for
+/// @param reader  Reader to get blocks for
+/// @param blocks  Array to hold the dequeued blocks
+/// @param count   Maximum number of blocks to dequeue
 ///
-/// @returns Block if successful; NULL otherwise
+/// @returns Number of blocks dequeued (0 if none are available)
 __checkReturn
-BLOCK_NODE *QmDequeueBlock(__in READER_INFO *reader);
+UINT32 QmDequeueBlocks(
+	__in READER_INFO                 *reader,
+	__out_ecount(count) BLOCK_NODE  **blocks,
+	__in const UINT32                 count);
 
 //----------------------------------------------------------------------------
 /// @brief Removes the reader's buffer and associated information
@@ -408,6 +224,11 @@ NTSTATUS QmEnqueueProcessBlock(
 /// a separate buffer to store the initial blocks, since the driver may be
 /// enqueuing other blocks on the blocks buffer at the same time.
 ///
+/// Process and connection blocks are interleaved by timestamp, with the
+/// processes in process ID order and the connections in connection ID order.
+/// Process blocks get room in the buffer first, and connections that don't
+/// fit in the rest of it are skipped.
+///
 /// @param reader           Reader to get blocks for
 /// @param useBlocksBuffer  Use blocks buffer if true, initial buffer if false
 ///
@@ -458,8 +279,26 @@ NTSTATUS QmRegisterReader(__in READER_INFO *reader);
 /// when the driver loads a boot time, since it loads before the network is
 /// available.
 ///
+/// The connections are stored in tables indexed by port, which replace the
+/// previous tables as a whole once they are built.
+///
 /// @param connections  List of currently open connections
-void QmSetOpenConnections(__in CONNECTIONS *connections);
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS QmSetOpenConnections(__in CONNECTIONS *connections);
+
+//----------------------------------------------------------------------------
+/// @brief Sets the DPC to queue when data is available for the specified reader
+///
+/// The DPC is queued whenever the reader's event would be signaled, so it
+/// can complete pending reads without waiting for the reader to retry.
+///
+/// @param reader  Reader to set data notify DPC for
+/// @param dpc     DPC to queue (must stay valid until the reader deregisters)
+void QmSetReaderDataDpc(
+	__in READER_INFO  *reader,
+	__in KDPC         *dpc);
 
 //----------------------------------------------------------------------------
 /// @brief Sets the specified reader's data notify event handle
@@ -473,6 +312,42 @@ NTSTATUS QmSetReaderDataEvent(
 	__in READER_INFO  *reader,
 	__in const HANDLE  userEvent);
 
+//----------------------------------------------------------------------------
+/// @brief Sets the connection or process IDs to filter for the specified reader
+///
+/// Packet blocks for filtered IDs are never added to the reader's ring
+/// buffers.  Replaces any IDs previously set for the same type of list.
+///
+/// @param reader      Reader to set ID list for
+/// @param idListType  Type of ID list to set
+/// @param ids         IDs to filter
+/// @param numIds      Number of IDs (0 to stop filtering)
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS QmSetReaderIdList(
+	__in READER_INFO                  *reader,
+	__in const ID_LIST_TYPE            idListType,
+	__in_ecount(numIds) const UINT32  *ids,
+	__in const UINT32                  numIds);
+
+//----------------------------------------------------------------------------
+/// @brief Sets the packet filter program for the specified reader
+///
+/// Packet blocks that the program rejects are never added to the reader's
+/// ring buffers.  Replaces any program previously set for the reader.
+///
+/// @param reader    Reader to set packet filter for
+/// @param insns     Program instructions
+/// @param numInsns  Number of instructions (0 to stop filtering)
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS QmSetReaderPacketFilter(
+	__in READER_INFO                                *reader,
+	__in_ecount(numInsns) const PACKET_FILTER_INSN  *insns,
+	__in const UINT32                                numInsns);
+
 //----------------------------------------------------------------------------
 /// @brief Sets the specified reader's snap length
 ///
@@ -485,6 +360,19 @@ NTSTATUS QmSetReaderSnapLength(
 	__in READER_INFO  *reader,
 	__in const UINT32  snapLength);
 
+//----------------------------------------------------------------------------
+/// @brief Applies changes to the list of open connections
+///
+/// Only the entries for the changed ports are updated, so packet lookups are
+/// never blocked while a large list is rebuilt.  Removed connections are
+/// applied before added ones.
+///
+/// @param changes  Added and removed open connections
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS QmUpdateOpenConnections(__in CONNECTION_CHANGES *changes);
+
 #ifdef __cplusplus
 };
 #endif
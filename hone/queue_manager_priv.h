@@ -26,27 +26,69 @@
 
 #include "hone_info.h"
 #include "debug_print.h"
+#include "oconn_table.h"
+#include "slab_allocator.h"
 #include "system_id.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+//----------------------------------------------------------------------------
+// Defines
+//----------------------------------------------------------------------------
+
+#define CONN_TABLE_BITS  12                     // Log2 of the number of connection table buckets
+#define CONN_TABLE_SIZE  (1 << CONN_TABLE_BITS) // Number of connection table buckets
+#define CONN_TABLE_LOCKS 64                     // Number of locks striped across the connection table buckets (must be a power of 2)
+
+#define CONN_CLOSE_TICK        10           // Milliseconds between connection close timing wheel ticks
+#define CONN_CLOSE_TIME        1000         // Milliseconds to keep a closed connection in case more packets arrive
+
+#define HELD_PACKET_MEMORY     (4 << 20)    // Default memory budget for held packets in bytes
+#define HELD_PACKET_MEMORY_MIN (64 << 10)   // Minimum memory budget for held packets in bytes
+#define HELD_PACKET_MEMORY_MAX (256 << 20)  // Maximum memory budget for held packets in bytes
+#define HELD_PACKET_TICK       100          // Milliseconds between held packet timing wheel ticks
+#define HELD_PACKET_TIME       2000         // Default maximum time to hold a packet in milliseconds
+#define HELD_PACKET_TIME_MAX   60000        // Maximum time to hold a packet in milliseconds
+
 //----------------------------------------------------------------------------
 // Structures and enumerations
 //----------------------------------------------------------------------------
 
-// An LLRB tree node that holds information for an open connection
-struct OCONN_NODE {
-	LLRB_ENTRY(OCONN_NODE) TreeEntry;   // LLRB tree entry
-	UINT16                 Port;        // Connection port
-	UINT32                 ProcessId;   // Process that owns the connection
-	LARGE_INTEGER          Timestamp;   // Time connection was opened
+// Lock for a stripe of connection table buckets.  Each lock covers every
+// CONN_TABLE_LOCKS-th bucket and sits on its own cache line, so lookups for
+// connections in different stripes never contend.
+struct CONN_TABLE_LOCK {
+	KSPIN_LOCK Lock;                                  // Locks the buckets in this stripe
+	UINT8      Pad[CACHE_LINE_SIZE - sizeof(KSPIN_LOCK)];
+};
+
+// Statistics that are updated on every packet or event.  Each processor
+// updates its own cache line, and the counts are only summed when a reader
+// requests the driver statistics.
+struct CPU_STATISTICS {
+	UINT64 CapturedPackets;        // Number of PCAP-NG packet blocks captured
+	UINT64 CapturedPacketBytes;    // Number of packet bytes captured
+	LONG   ProcessStartEvents;     // Number of process start events
+	LONG   NumProcesses;           // Change in number of processes
+	LONG   ProcessEndEvents;       // Number of process end events
+	LONG   ConnectionOpenEvents;   // Number of connection open events
+	LONG   NumConnections;         // Change in number of connections
+	LONG   ConnectionCloseEvents;  // Number of connection close events
+	UINT8  Pad[CACHE_LINE_SIZE - (2 * sizeof(UINT64)) - (6 * sizeof(LONG))];
+};
+
+// Immutable snapshot of the registered readers that EnqueueBlock() walks
+// without holding the reader list lock.  A snapshot is only freed after a
+// grace period during which every processor has dropped below dispatch level.
+struct READER_SNAPSHOT {
+	UINT32       NumReaders;  // Number of entries in the snapshot
+	READER_INFO *Readers[1];  // Registered readers (NULL if removed in place)
 };
 
 // LLRB tree structures
 typedef LLRB_HEAD(BlockTree, BLOCK_NODE) BLOCK_TREE_HEAD;
-typedef LLRB_HEAD(OconnTree, OCONN_NODE) OCONN_TREE_HEAD;
 
 //----------------------------------------------------------------------------
 // Function prototypes
@@ -65,15 +107,37 @@ BLOCK_NODE* AllocateBlockNode(
 	__in const UINT32 dataLength,
 	__in const UINT32 poolTag);
 
+//----------------------------------------------------------------------------
+/// @brief Allocates an open connection table with no connections in it
+///
+/// @returns The table if successful; NULL otherwise
+__checkReturn
+OCONN_ENTRY* AllocateOconnTable(void);
+
+//----------------------------------------------------------------------------
+/// @brief Allocates a ring buffer for each processor for a reader
+///
+/// The per-processor ring buffers split the total ring buffer size between
+/// them, but each one is at least 1024 bytes
+///
+/// @param reader      Reader to allocate ring buffers for
+/// @param bufferSize  Total size of the ring buffers in bytes
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn
+NTSTATUS AllocateCpuBuffers(
+	__in READER_INFO  *reader,
+	__in const UINT32  bufferSize);
+
 //----------------------------------------------------------------------------
 /// @brief Calculates the maximum snap length of all registered readers
 void CalculateMaxSnapLength(void);
 
 //----------------------------------------------------------------------------
-/// @brief Frees a node in an open connection tree
+/// @brief Frees a set of open connection tables
 ///
-/// @param oconnNode  Node to clean up
-void CleanupOconnNode(__in OCONN_NODE *oconnNode);
+/// @param oconnTables  Tables to clean up (may be NULL)
+void CleanupOconnTables(__in OCONN_TABLES *oconnTables);
 
 //----------------------------------------------------------------------------
 /// @brief Frees resources held by a reader
@@ -82,7 +146,7 @@ void CleanupOconnNode(__in OCONN_NODE *oconnNode);
 void CleanupReader(__in READER_INFO *reader);
 
 //----------------------------------------------------------------------------
-/// @brief Deletes all blocks from a ring buffer and resets its state
+/// @brief Deletes all blocks from a ring buffer
 ///
 /// @param buffer  Ring buffer to clean up
 void CleanupRingBuffer(__in RING_BUFFER *buffer);
@@ -98,17 +162,6 @@ void CleanupRingBuffer(__in RING_BUFFER *buffer);
 ///          >0 if first node's block ID is greater than second
 int CompareBlockNodes(BLOCK_NODE *first, BLOCK_NODE *second);
 
-//----------------------------------------------------------------------------
-/// @brief Compare two open connection nodes for sorting the LLRB tree
-///
-/// @param first   First open connection node to compare
-/// @param second  Second open connection node to compare
-///
-/// @returns <0 if first node's port is less than second;
-///           0 if nodes' ports are equal
-///          >0 if first node's port is greater than second
-int CompareOconnNodes(OCONN_NODE *first, OCONN_NODE *second);
-
 //----------------------------------------------------------------------------
 /// @brief Converts a command line string to a null-separated argv list in place
 ///
@@ -132,6 +185,25 @@ UINT16 ConvertCommandLineToArgv(__in char *buffer, __in const UINT16 length);
 /// @param out  Timestamp converted to PCAP-NG format
 void ConvertKeTime(__in const LARGE_INTEGER *in, __out LARGE_INTEGER *out);
 
+//----------------------------------------------------------------------------
+/// @brief Dequeues blocks from a reader's per-processor ring buffers in
+/// timestamp order
+///
+/// Performs a k-way merge on the oldest block from each ring buffer.  Blocks
+/// are only ordered with respect to the blocks that have been enqueued so far,
+/// so a block that arrives late on another processor may still be out of order.
+///
+/// @param reader  Reader to get blocks for
+/// @param blocks  Array to hold the dequeued blocks
+/// @param count   Maximum number of blocks to dequeue
+///
+/// @returns Number of blocks dequeued (0 if none are available)
+__checkReturn
+UINT32 DequeueMergedBlocks(
+	__in READER_INFO                 *reader,
+	__out_ecount(count) BLOCK_NODE  **blocks,
+	__in const UINT32                 count);
+
 //----------------------------------------------------------------------------
 /// @brief Called when DLL is initialized
 ///
@@ -162,6 +234,28 @@ DRIVER_INITIALIZE DriverEntry;
 __checkReturn
 void EnqueueBlock(__in BLOCK_NODE *blockNode);
 
+//----------------------------------------------------------------------------
+/// @brief Releases held packet blocks that have waited too long for their
+///        connection event
+///
+/// The blocks are enqueued without a process ID instead of being dropped.
+///
+/// @param dpc      DPC object associated with this routine
+/// @param context  Unused
+/// @param arg1     Unused
+/// @param arg2     Unused
+KDEFERRED_ROUTINE ExpireHeldPackets;
+
+//----------------------------------------------------------------------------
+/// @brief Finds the block for an open connection in the connection table
+///
+/// The caller must hold the connection's lock from GetConnectionLock()
+///
+/// @param connectionId  ID of the connection
+///
+/// @returns The connection's block if found; NULL otherwise
+BLOCK_NODE* FindConnectionBlock(__in const UINT32 connectionId);
+
 //----------------------------------------------------------------------------
 /// @brief Allocates and populates PCAP-NG connection block
 ///
@@ -180,6 +274,31 @@ BLOCK_NODE* GetConnectionBlock(
 	__in const UINT32          processId,
 	__in const LARGE_INTEGER  *timestamp);
 
+//----------------------------------------------------------------------------
+/// @brief Gets the connection table bucket for a connection ID
+///
+/// @param connectionId  ID of the connection
+///
+/// @returns Bucket index
+UINT32 GetConnectionBucket(__in const UINT32 connectionId);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the lock that covers a connection's table bucket
+///
+/// @param connectionId  ID of the connection
+///
+/// @returns Lock for the connection's bucket
+KSPIN_LOCK* GetConnectionLock(__in const UINT32 connectionId);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the statistics slot for the current processor
+///
+/// Callers may be moved to another processor after this returns, so they must
+/// update the slot with interlocked operations
+///
+/// @returns Statistics slot for the current processor
+CPU_STATISTICS* GetCpuStatistics(void);
+
 //----------------------------------------------------------------------------
 /// @brief Allocates and populates PCAP-NG interface description block
 ///
@@ -189,6 +308,27 @@ BLOCK_NODE* GetConnectionBlock(
 __checkReturn
 BLOCK_NODE* GetInterfaceDescriptionBlock(void);
 
+//----------------------------------------------------------------------------
+/// @brief Checks the registry to see if readers should use per-processor ring
+/// buffers
+///
+/// @returns True if the registry value is set to a non-zero value; false otherwise
+__drv_requiresIRQL(PASSIVE_LEVEL)
+bool GetPerProcessorRings(void);
+
+//----------------------------------------------------------------------------
+/// @brief Parses the fields that packet filter programs test from a packet block
+///
+/// The local address and port are the destination for inbound packets and
+/// the source for outbound packets.  Fields that are past the end of the
+/// captured data are left zeroed.
+///
+/// @param blockNode  Packet block to parse
+/// @param fields     Receives the parsed fields
+void GetPacketFilterFields(
+	__in const BLOCK_NODE       *blockNode,
+	__out PACKET_FILTER_FIELDS  *fields);
+
 //----------------------------------------------------------------------------
 /// @brief Allocates and populates PCAP-NG process block
 ///
@@ -229,18 +369,24 @@ UINT32 GetProcessIdForConnectionId(
 	__in const UINT16 port);
 
 //----------------------------------------------------------------------------
-/// @brief Gets the size of the ring buffer from the registry
+/// @brief Gets a DWORD value from the Hone registry key
 ///
-/// * Minimum size is 1024 bytes
-/// * Default size is four pages
-/// * Maximum size is 32 pages
+/// @param valueName     Name of the registry value
+/// @param defaultValue  Value to use if the registry value is missing or 0
+/// @param minValue      Minimum value
+/// @param maxValue      Maximum value
 ///
-/// @returns Ring buffer size from registry successful; default size otherwise
+/// @returns Registry value limited to the minimum and maximum if successful;
+///          default value otherwise
 __drv_requiresIRQL(PASSIVE_LEVEL)
-UINT32 GetRingBufferSize(void);
+UINT32 GetRegistryDword(
+	__in wchar_t      *valueName,
+	__in const UINT32  defaultValue,
+	__in const UINT32  minValue,
+	__in const UINT32  maxValue);
 
 //----------------------------------------------------------------------------
-/// @brief Checks if the registry value is a valid system ID value
+/// @brief Checks if the registry value is a valid DWORD value
 ///
 /// @param valueName     Name of the registry value
 /// @param valueType     Type of the registry value
@@ -250,7 +396,18 @@ UINT32 GetRingBufferSize(void);
 /// @param entryContext  Destination buffer for the data
 ///
 /// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
-RTL_QUERY_REGISTRY_ROUTINE GetRingBufferSizeQueryRoutine;
+RTL_QUERY_REGISTRY_ROUTINE GetRegistryDwordQueryRoutine;
+
+//----------------------------------------------------------------------------
+/// @brief Gets the size of the ring buffer from the registry
+///
+/// * Minimum size is 1024 bytes
+/// * Default size is four pages
+/// * Maximum size is 32 pages
+///
+/// @returns Ring buffer size from registry successful; default size otherwise
+__drv_requiresIRQL(PASSIVE_LEVEL)
+UINT32 GetRingBufferSize(void);
 
 //----------------------------------------------------------------------------
 /// @brief Allocates and populates PCAP-NG section header block
@@ -261,6 +418,14 @@ RTL_QUERY_REGISTRY_ROUTINE GetRingBufferSizeQueryRoutine;
 __checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
 BLOCK_NODE* GetSectionHeaderBlock(void);
 
+//----------------------------------------------------------------------------
+/// @brief Gets the current tick for a timing wheel
+///
+/// @param tickTime  Milliseconds between the timing wheel's ticks
+///
+/// @returns Number of ticks since the system started
+UINT64 GetTimerWheelTick(__in const UINT32 tickTime);
+
 //----------------------------------------------------------------------------
 /// @brief Gets the current timestamp in PCAP-NG format
 ///
@@ -270,11 +435,60 @@ void GetTimestamp(__out LARGE_INTEGER *timestamp);
 //----------------------------------------------------------------------------
 /// @brief Holds a packet block until its connection event is received
 ///
+/// The block is held for at most the maximum hold time.  If holding it would
+/// go over the held packet memory budget, it is enqueued right away without a
+/// process ID instead.
+///
 /// @param blockNode  Packet block to hold
 void HoldPacketBlock(__in BLOCK_NODE *blockNode);
 
 //----------------------------------------------------------------------------
-/// @brief Processes all deferred connection close events
+/// @brief Inserts a connection block into the connection table
+///
+/// The caller must hold the connection's lock from GetConnectionLock().  The
+/// table takes over the caller's reference to the block if it is inserted.
+///
+/// @param blockNode  Connection block to insert
+///
+/// @returns NULL if inserted; existing block for the connection otherwise
+BLOCK_NODE* InsertConnectionBlock(__in BLOCK_NODE *blockNode);
+
+//----------------------------------------------------------------------------
+/// @brief Checks if a reader is filtering a packet block
+///
+/// Must be called at DISPATCH_LEVEL.
+///
+/// The packet is only parsed for the reader's packet filter program the first
+/// time a reader needs it, and the parsed fields are reused for later readers.
+///
+/// @param reader     Reader to check
+/// @param blockNode  Packet block to check
+/// @param fields     Parsed packet fields
+/// @param parsed     True if fields are already parsed; set to true on parsing
+///
+/// @returns True if the reader is filtering the block's connection or
+///          process, or if its packet filter rejects the block; false otherwise
+__drv_requiresIRQL(DISPATCH_LEVEL)
+bool IsPacketFiltered(
+	__in const READER_INFO        *reader,
+	__in const BLOCK_NODE         *blockNode,
+	__inout PACKET_FILTER_FIELDS  *fields,
+	__inout bool                  *parsed);
+
+//----------------------------------------------------------------------------
+/// @brief Tells a reader that data is available
+///
+/// Signals the reader's data event and queues its data DPC, if it has them.
+///
+/// @param reader  Reader to notify
+void NotifyReader(__in READER_INFO *reader);
+
+//----------------------------------------------------------------------------
+/// @brief Removes closed connections whose hold time has expired
+///
+/// Only touches the connections that expire on the connection close timing
+/// wheel's ticks since the last time it ran, and restarts the connection
+/// close timer if any connections are still waiting.
 ///
 /// @param dpc      DPC object associated with this routine
 /// @param context  Unused
@@ -282,6 +496,18 @@ void HoldPacketBlock(__in BLOCK_NODE *blockNode);
 /// @param arg2     Unused
 KDEFERRED_ROUTINE ProcessConnectionCloseEvents;
 
+//----------------------------------------------------------------------------
+/// @brief Publishes a new snapshot of the registered readers
+///
+/// The caller must hold the reader list lock
+///
+/// @param oldSnapshot  Receives the previous snapshot, which the caller must
+///                     free after calling WaitForReaderSnapshot() (may be NULL)
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn
+NTSTATUS PublishReaderSnapshot(__out READER_SNAPSHOT **oldSnapshot);
+
 //----------------------------------------------------------------------------
 /// @brief Releases all packet blocks for a connection
 ///
@@ -291,6 +517,42 @@ void ReleasePacketBlocks(
 	__in const UINT32 connectionId,
 	__in const UINT32 processId);
 
+//----------------------------------------------------------------------------
+/// @brief Removes a connection block from the connection table
+///
+/// The caller must hold the connection's lock from GetConnectionLock().  The
+/// caller takes over the table's reference to the block if it is removed.
+///
+/// @param blockNode  Connection block to remove
+///
+/// @returns True if the block was in the table; false otherwise
+bool RemoveConnectionBlock(__in BLOCK_NODE *blockNode);
+
+//----------------------------------------------------------------------------
+/// @brief Removes a held packet block from the held packet tree and timing wheel
+///
+/// The caller must hold the trees lock.  The caller takes over the tree's
+/// reference to the block.
+///
+/// @param blockNode  Packet block to remove
+void RemoveHeldPacketBlock(__in BLOCK_NODE *blockNode);
+
+//----------------------------------------------------------------------------
+/// @brief Stores a connection in an open connection table entry
+///
+/// The caller must hold the open connection tables mutex.  Lookups read the
+/// entry without a lock (see WriteOconnEntry).  The entry is written at
+/// DISPATCH_LEVEL so that a lookup on the same processor can never spin
+/// waiting for it.
+///
+/// @param oconnEntry  Entry to store the connection in
+/// @param processId   Process that owns the connection (_UI32_MAX for none)
+/// @param timestamp   Time connection was opened
+void SetOconnEntry(
+	__in OCONN_ENTRY          *oconnEntry,
+	__in const UINT32          processId,
+	__in const LARGE_INTEGER  *timestamp);
+
 //----------------------------------------------------------------------------
 /// @brief Sets PCAP-NG option parameters and copies option data
 ///
@@ -331,6 +593,16 @@ UINT32 SetUtf8Option(
 	__in UINT16                length,
 	__in UINT16               *bytesRemoved);
 
+//----------------------------------------------------------------------------
+/// @brief Wakes the thread waiting in WaitForReaderSnapshot() once all
+/// processors have run this DPC
+///
+/// @param dpc      Unused
+/// @param context  Unused
+/// @param arg1     Unused
+/// @param arg2     Unused
+KDEFERRED_ROUTINE SyncReaderSnapshotDpc;
+
 //----------------------------------------------------------------------------
 /// @brief Calculates seconds elapsed between start and end tick counts
 ///
@@ -340,6 +612,17 @@ UINT32 SetUtf8Option(
 /// @returns Seconds elapsed between start and end tick counts
 UINT32 TickDiffToSeconds(const LARGE_INTEGER *start, const LARGE_INTEGER *end);
 
+//----------------------------------------------------------------------------
+/// @brief Waits until no processor can still be using a reader snapshot or
+/// open connection tables that were replaced before this call
+///
+/// EnqueueBlock() only uses the reader snapshot at dispatch level, and
+/// GetProcessIdForConnectionId() does the same with the open connection
+/// tables, so queuing a DPC on each processor and waiting for all of them to
+/// run guarantees that every processor has finished with any it was using.
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void WaitForReaderSnapshot(void);
+
 #ifdef __cplusplus
 };
 #endif
@@ -38,11 +38,13 @@ static const IOCTL_PARAMS gIoctlParams[] =
 	{ sizeof(UINT32), 0,     sizeof(UINT64), 0     }, // IoctlSetDataEvent
 	{ sizeof(UINT32), 0,     sizeof(UINT32), 0     }, // IoctlOpenConnections
 	{ 0, sizeof(STATISTICS), 0, sizeof(STATISTICS) }, // IoctlGetStatistics
+	{ 0,              0,     0,              0     }, // IoctlSetPacketFilter
+	{ sizeof(UINT32), sizeof(UINT64), sizeof(UINT32), sizeof(UINT64) }, // IoctlMapSharedRing
+	{ 2 * sizeof(UINT32), 0, 2 * sizeof(UINT32), 0 }, // IoctlUpdateOpenConnections
 };
 
 static LOOKASIDE_LIST_EX gLookasideList;              // Holds memory for netbuffer storage
 static bool              gLookasideListInit = false;  // True if lookaside list was initialized
-static const UINT32      gPoolTagIds        = 'iRoH'; // Tag to use when allocating ID lists
 static const UINT32      gPoolTagLookaside  = 'lRoH'; // Tag to use when allocating lookaside buffers
 
 //----------------------------------------------------------------------------
@@ -57,6 +59,67 @@ static inline NTSTATUS CompleteIrp(
 	return status;
 }
 
+//----------------------------------------------------------------------------
+void CsqAcquireReadLock(__in PIO_CSQ csq, __out PKIRQL irql)
+{
+	READER_CONTEXT *context = CONTAINING_RECORD(csq, READER_CONTEXT, PendingReads);
+	KeAcquireSpinLock(&context->PendingReadLock, irql);
+}
+
+//----------------------------------------------------------------------------
+void CsqCompleteCanceledRead(__in PIO_CSQ csq, __in PIRP irp)
+{
+	UNREFERENCED_PARAMETER(csq);
+	CompleteIrp(irp, STATUS_CANCELLED);
+}
+
+//----------------------------------------------------------------------------
+NTSTATUS CsqInsertRead(
+	__in PIO_CSQ  csq,
+	__in PIRP     irp,
+	__in_opt void *insertContext)
+{
+	READER_CONTEXT *context = CONTAINING_RECORD(csq, READER_CONTEXT, PendingReads);
+
+	if (insertContext) {
+		InsertHeadList(&context->PendingReadList, &irp->Tail.Overlay.ListEntry);
+	} else {
+		InsertTailList(&context->PendingReadList, &irp->Tail.Overlay.ListEntry);
+	}
+	return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+PIRP CsqPeekNextRead(
+	__in PIO_CSQ  csq,
+	__in_opt PIRP irp,
+	__in_opt void *peekContext)
+{
+	READER_CONTEXT *context = CONTAINING_RECORD(csq, READER_CONTEXT, PendingReads);
+	LIST_ENTRY     *next;
+
+	UNREFERENCED_PARAMETER(peekContext);
+	next = irp ? irp->Tail.Overlay.ListEntry.Flink : context->PendingReadList.Flink;
+	if (next == &context->PendingReadList) {
+		return NULL;
+	}
+	return CONTAINING_RECORD(next, IRP, Tail.Overlay.ListEntry);
+}
+
+//----------------------------------------------------------------------------
+void CsqReleaseReadLock(__in PIO_CSQ csq, __in KIRQL irql)
+{
+	READER_CONTEXT *context = CONTAINING_RECORD(csq, READER_CONTEXT, PendingReads);
+	KeReleaseSpinLock(&context->PendingReadLock, irql);
+}
+
+//----------------------------------------------------------------------------
+void CsqRemoveRead(__in PIO_CSQ csq, __in PIRP irp)
+{
+	UNREFERENCED_PARAMETER(csq);
+	RemoveEntryList(&irp->Tail.Overlay.ListEntry);
+}
+
 //----------------------------------------------------------------------------
 __checkReturn
 NTSTATUS DeinitializeReadInterface(void)
@@ -67,6 +130,41 @@ NTSTATUS DeinitializeReadInterface(void)
 	return STATUS_SUCCESS;
 }
 
+//----------------------------------------------------------------------------
+NTSTATUS DispatchCleanup(__in PDEVICE_OBJECT deviceObject, __inout PIRP irp)
+{
+	LIST_ENTRY          canceledList;
+	IO_STACK_LOCATION  *irpSp = IoGetCurrentIrpStackLocation(irp);
+	READER_CONTEXT     *context;
+	KLOCK_QUEUE_HANDLE  lockHandle;
+	PIRP                pendingIrp;
+
+	UNREFERENCED_PARAMETER(deviceObject);
+	context = reinterpret_cast<READER_CONTEXT*>(irpSp->FileObject->FsContext);
+	if (context == NULL) {
+		return CompleteIrp(irp, STATUS_INVALID_PARAMETER);
+	}
+	InitializeListHead(&canceledList);
+
+	// Cancel pending reads, holding the fill lock so that no DPC is filling
+	// one of them while we remove it
+	KeAcquireInStackQueuedSpinLock(&context->FillLock, &lockHandle);
+	while ((pendingIrp = IoCsqRemoveNextIrp(&context->PendingReads, NULL)) != NULL) {
+		InsertTailList(&canceledList, &pendingIrp->Tail.Overlay.ListEntry);
+	}
+	KeReleaseInStackQueuedSpinLock(&lockHandle);
+	while (!IsListEmpty(&canceledList)) {
+		pendingIrp = CONTAINING_RECORD(RemoveHeadList(&canceledList), IRP,
+				Tail.Overlay.ListEntry);
+		CompleteIrp(pendingIrp, STATUS_CANCELLED);
+	}
+
+	// Cleanup runs in the context of the process that closed its last handle,
+	// which is normally the process that mapped the shared ring
+	UnmapSharedRing(context);
+	return CompleteIrp(irp, STATUS_SUCCESS);
+}
+
 //----------------------------------------------------------------------------
 NTSTATUS DispatchClose(__in PDEVICE_OBJECT deviceObject, __inout PIRP irp)
 {
@@ -80,14 +178,18 @@ NTSTATUS DispatchClose(__in PDEVICE_OBJECT deviceObject, __inout PIRP irp)
 	}
 
 	QmDeregisterReader(&context->Reader);
+	if (context->DataDpcSet) {
+		// The queue manager no longer queues the DPC, so just wait for it to
+		// finish if it's already queued
+		KeRemoveQueueDpc(&context->DataDpc);
+		KeFlushQueuedDpcs();
+	}
+	UnmapSharedRing(context);
 	if (context->CurrentBlock) {
 		QmCleanupBlock(context->CurrentBlock);
 	}
-	if (context->FilteredConnectionIds) {
-		ExFreePool(context->FilteredConnectionIds);
-	}
-	if (context->FilteredProcessIds) {
-		ExFreePool(context->FilteredProcessIds);
+	while (context->BatchIndex < context->BatchCount) {
+		QmCleanupBlock(context->BatchBlocks[context->BatchIndex++]);
 	}
 	ExFreeToLookasideListEx(&gLookasideList, context);
 	return CompleteIrp(irp, STATUS_SUCCESS);
@@ -129,6 +231,16 @@ NTSTATUS DispatchCreate(__in PDEVICE_OBJECT deviceObject, __inout PIRP irp)
 
 	RtlZeroMemory(context, sizeof(READER_CONTEXT));
 	context->DeviceExtension = devExt;
+	KeInitializeSpinLock(&context->FillLock);
+	KeInitializeSpinLock(&context->PendingReadLock);
+	InitializeListHead(&context->PendingReadList);
+	KeInitializeDpc(&context->DataDpc, ReadDataDpc, context);
+	status = IoCsqInitializeEx(&context->PendingReads, CsqInsertRead,
+			CsqRemoveRead, CsqPeekNextRead, CsqAcquireReadLock, CsqReleaseReadLock,
+			CsqCompleteCanceledRead);
+	if (!NT_SUCCESS(status)) {
+		goto Cleanup;
+	}
 	status = QmRegisterReader(&context->Reader);
 	if (!NT_SUCCESS(status)) {
 		goto Cleanup;
@@ -193,14 +305,31 @@ NTSTATUS DispatchDeviceControl(
 
 	switch (irpSp->Parameters.DeviceIoControl.IoControlCode) {
 	case IOCTL_HONE_FILTER_CONNECTIONS:
-		SetIdList(context, ConnectionIdList, buffer, inBufLen);
+		status = QmSetReaderIdList(&context->Reader, ConnectionIdList,
+				reinterpret_cast<const UINT32*>(buffer), inBufLen / sizeof(UINT32));
 		break;
 	case IOCTL_HONE_FILTER_PROCESSES:
-		SetIdList(context, ProcessIdList, buffer, inBufLen);
+		status = QmSetReaderIdList(&context->Reader, ProcessIdList,
+				reinterpret_cast<const UINT32*>(buffer), inBufLen / sizeof(UINT32));
+		break;
+	case IOCTL_HONE_SET_PACKET_FILTER:
+		status = QmSetReaderPacketFilter(&context->Reader,
+				reinterpret_cast<const PACKET_FILTER_INSN*>(buffer),
+				inBufLen / sizeof(PACKET_FILTER_INSN));
+		break;
+	case IOCTL_HONE_MAP_SHARED_RING:
+		status = MapSharedRing(context, *reinterpret_cast<const UINT32*>(buffer),
+				reinterpret_cast<UINT64*>(buffer));
+		if (NT_SUCCESS(status)) {
+			bytesOut = outBufLenReq;
+		}
 		break;
 	case IOCTL_HONE_MARK_RESTART:
 		context->RestartRequested = 1;
 		DBGPRINT(D_INFO, "Restarting reader %d", context->Reader.Id);
+
+		// Let a pending read return the block boundary
+		ServicePendingReads(context);
 		break;
 	case IOCTL_HONE_SET_SNAP_LENGTH:
 	{
@@ -245,8 +374,28 @@ NTSTATUS DispatchDeviceControl(
 	}
 #endif
 	case IOCTL_HONE_SET_OPEN_CONNECTIONS:
-		QmSetOpenConnections(reinterpret_cast<CONNECTIONS*>(buffer));
+	{
+		CONNECTIONS *connections = reinterpret_cast<CONNECTIONS*>(buffer);
+		if (offsetof(CONNECTIONS, Records) + (static_cast<UINT64>(
+				connections->NumRecords) * sizeof(CONNECTION_RECORD)) > inBufLen) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		status = QmSetOpenConnections(connections);
+		break;
+	}
+	case IOCTL_HONE_UPDATE_OPEN_CONNECTIONS:
+	{
+		CONNECTION_CHANGES *changes = reinterpret_cast<CONNECTION_CHANGES*>(buffer);
+		if (offsetof(CONNECTION_CHANGES, Records) + ((static_cast<UINT64>(
+				changes->NumAdded) + changes->NumRemoved) *
+				sizeof(CONNECTION_RECORD)) > inBufLen) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		status = QmUpdateOpenConnections(changes);
 		break;
+	}
 	case IOCTL_HONE_GET_STATISTICS:
 		QmGetStatistics(reinterpret_cast<STATISTICS*>(buffer), &context->Reader);
 		bytesOut = outBufLenReq;
@@ -264,103 +413,98 @@ NTSTATUS DispatchRead(
 	__in PDEVICE_OBJECT deviceObject,
 	__inout PIRP        irp)
 {
-	BLOCK_NODE        *blockNode    = NULL;
-	UINT32             blockOffset  = 0;
-	IO_STACK_LOCATION *irpSp        = IoGetCurrentIrpStackLocation(irp);
-	READER_CONTEXT    *context      = NULL;
-	UINT8             *readBuffer   = NULL;
-	UINT32             readLength   = 0;
-	UINT32             readOffset   = 0;
+	IO_STACK_LOCATION  *irpSp        = IoGetCurrentIrpStackLocation(irp);
+	READER_CONTEXT     *context      = NULL;
+	KLOCK_QUEUE_HANDLE  lockHandle;
+	UINT32              readOffset   = 0;
 
 	UNREFERENCED_PARAMETER(deviceObject);
 
-	// Verify the buffer and open instance aren't NULL
-	readBuffer = reinterpret_cast<UINT8*>(irp->AssociatedIrp.SystemBuffer);
-	if (readBuffer == NULL) {
-		return CompleteIrp(irp, STATUS_INVALID_PARAMETER);
-	}
+	// Verify the open instance isn't NULL, and that there is somewhere to put
+	// the data
 	context = reinterpret_cast<READER_CONTEXT*>(irpSp->FileObject->FsContext);
 	if (context == NULL) {
 		return CompleteIrp(irp, STATUS_INVALID_PARAMETER);
 	}
+	if ((irp->AssociatedIrp.SystemBuffer == NULL) && (context->SharedRing == NULL)) {
+		return CompleteIrp(irp, STATUS_INVALID_PARAMETER);
+	}
 
-	// Check restart state
-	switch (context->RestartState) {
-	case RestartStateSendEof:
+	// Get initial PCAP-NG blocks here, since we're at passive level.  Claim
+	// the state change first, so that reads issued together on the same
+	// handle don't both get them.
+	if (InterlockedCompareExchange(&context->RestartState, RestartStateLoading,
+			RestartStateInit) == RestartStateInit) {
+		QmGetInitialBlocks(&context->Reader, false);
+		InterlockedExchange(&context->RestartState, RestartStateNormal);
+	}
+
+	// Readers with overlapped handles get their reads completed when data
+	// arrives instead of having to wait for an event and retry
+	if (!(irpSp->FileObject->Flags & FO_SYNCHRONOUS_IO)) {
+		if (!context->DataDpcSet) {
+			QmSetReaderDataDpc(&context->Reader, &context->DataDpc);
+			context->DataDpcSet = true;
+		}
+		IoCsqInsertIrp(&context->PendingReads, irp, NULL);
+		ServicePendingReads(context);
+		return STATUS_PENDING;
+	}
+
+	KeAcquireInStackQueuedSpinLock(&context->FillLock, &lockHandle);
+	if (context->RestartState == RestartStateSendEof) {
 		// Return zero bytes to tell reader it's at a block boundary
 		context->RestartState = RestartStateInit;
-		return CompleteIrp(irp, STATUS_SUCCESS);
-	case RestartStateInit:
-		// Get initial PCAP-NG blocks
-		QmGetInitialBlocks(&context->Reader, false);
-		context->RestartState = RestartStateNormal;
-		break;
-	case RestartStateNormal:
-		break;
+	} else {
+		readOffset = FillReadIrp(context, irp);
 	}
+	KeReleaseInStackQueuedSpinLock(&lockHandle);
+	return CompleteIrp(irp, STATUS_SUCCESS, readOffset);
+}
+
+//----------------------------------------------------------------------------
+UINT32 FillReadBuffer(
+	__inout READER_CONTEXT          *context,
+	__out_bcount(readLength) UINT8  *readBuffer,
+	__in const UINT32                readLength,
+	__in const UINT32                bytesCopied)
+{
+	BLOCK_NODE *blockNode   = context->CurrentBlock;
+	UINT32      blockOffset = context->CurrentBlockOffset;
+	UINT32      readOffset  = 0;
 
-	readLength  = irpSp->Parameters.Read.Length;
-	blockNode   = context->CurrentBlock;
-	blockOffset = context->CurrentBlockOffset;
 	while (readOffset < readLength) {
 		char   *blockData   = NULL;
 		UINT32  blockLength = 0;
 		UINT32  bytesToCopy = 0;
 
 		if (!blockNode) {
-			// Handle restart request now that we're at a block boundary
-			if (InterlockedCompareExchange(&context->RestartRequested, 0, 1) == 1) {
-				context->RestartState = readOffset ?
-						RestartStateSendEof : RestartStateInit;
-				break;
+			if (context->BatchIndex >= context->BatchCount) {
+				// Handle restart request now that we're at a block boundary and
+				// have read all blocks from the previous batch
+				if (InterlockedCompareExchange(&context->RestartRequested, 0, 1) == 1) {
+					context->RestartState = (readOffset || bytesCopied) ?
+							RestartStateSendEof : RestartStateInit;
+					break;
+				}
+
+				context->BatchCount = QmDequeueBlocks(&context->Reader,
+						context->BatchBlocks, ARRAY_SIZEOF(context->BatchBlocks));
+				context->BatchIndex = 0;
+				if (!context->BatchCount) {
+					break;  // No more blocks
+				}
 			}
 
-			blockNode   = QmDequeueBlock(&context->Reader);
+			blockNode   = context->BatchBlocks[context->BatchIndex++];
 			blockOffset = 0;
-			if (!blockNode) {
-				break;  // No more blocks
-			}
 			context->ModifiedHeader.BlockType = 0; // Not trimming packet block
 
 			if (blockNode->BlockType == PacketBlock) {
 				PCAP_NG_PACKET_HEADER *header;
 
-				// Filter this block if filtering the connection or process ID
-				bool filter = false;
-				if (context->FilteredProcessIds) {
-					for (UINT32 index = 1; index <= context->FilteredProcessIds[0]; index++) {
-						DBGPRINT(D_DBG, "Checking filter %d of %d: block process ID %d (%08X), filter process ID %d (%08X)",
-								index, context->FilteredProcessIds[0],
-								blockNode->ProcessId, blockNode->ProcessId,
-								context->FilteredProcessIds[index], context->FilteredProcessIds[index]);
-						if (context->FilteredProcessIds[index] == blockNode->ProcessId) {
-							filter = true;
-							break;
-						}
-					}
-				}
-				if (!filter && context->FilteredConnectionIds) {
-					for (UINT32 index = 1; index <= context->FilteredConnectionIds[0]; index++) {
-						DBGPRINT(D_DBG, "Checking filter %d of %d: block connection ID %d (%08X), filter connection ID %d (%08X)",
-								index, context->FilteredConnectionIds[0],
-								blockNode->ConnectionId, blockNode->ConnectionId,
-								context->FilteredConnectionIds[index], context->FilteredConnectionIds[index]);
-						if (context->FilteredConnectionIds[index] == blockNode->ConnectionId) {
-							filter = true;
-							break;
-						}
-					}
-				}
-				if (filter) {
-					DBGPRINT(D_INFO, "Filtering packet for process %08X, connection %08X",
-							blockNode->ProcessId, blockNode->ConnectionId);
-					QmCleanupBlock(blockNode);
-					blockNode = NULL;
-					continue;
-				}
-
 				// Trim block to snap length
-				blockData = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+				blockData = blockNode->Buffer;
 				header    = reinterpret_cast<PCAP_NG_PACKET_HEADER*>(blockData);
 				if (context->SnapLength && (header->CapturedLength > context->SnapLength)) {
 					// Fix up packet header and footer
@@ -377,7 +521,7 @@ NTSTATUS DispatchRead(
 		}
 
 		// Handle truncated packet blocks
-		blockData   = blockNode->Buffer ? blockNode->Buffer : blockNode->Data;
+		blockData   = blockNode->Buffer;
 		blockLength = blockNode->BlockLength;
 		if (context->ModifiedHeader.BlockType) {
 			// Copy fixed-up packet header
@@ -458,7 +602,55 @@ NTSTATUS DispatchRead(
 
 	context->CurrentBlock       = blockNode;
 	context->CurrentBlockOffset = blockOffset;
-	return CompleteIrp(irp, STATUS_SUCCESS, readOffset);
+	return readOffset;
+}
+
+//----------------------------------------------------------------------------
+UINT32 FillReadIrp(
+	__inout READER_CONTEXT  *context,
+	__in PIRP                irp)
+{
+	if (context->SharedRing) {
+		return FillSharedRing(context);
+	}
+	return FillReadBuffer(context,
+			reinterpret_cast<UINT8*>(irp->AssociatedIrp.SystemBuffer),
+			IoGetCurrentIrpStackLocation(irp)->Parameters.Read.Length, 0);
+}
+
+//----------------------------------------------------------------------------
+UINT32 FillSharedRing(__inout READER_CONTEXT *context)
+{
+	SHARED_RING_HEADER *ring        = context->SharedRing;
+	UINT8              *data        = reinterpret_cast<UINT8*>(ring) + SHARED_RING_HEADER_SIZE;
+	UINT32              producer    = context->SharedRingProducer;
+	const UINT32        consumer    = ring->Consumer; // Read once, since the reader can change it
+	UINT32              bytesCopied = 0;
+
+	// Fill the free space up to the end of the ring, then wrap around
+	for (;;) {
+		UINT32       offset;
+		UINT32       length;
+		const UINT32 span = GetSharedRingWriteSpan(context->SharedRingSize,
+				producer, consumer, &offset);
+		if (!span) {
+			break;
+		}
+		length       = FillReadBuffer(context, data + offset, span, bytesCopied);
+		producer    += length;
+		bytesCopied += length;
+		if ((length < span) || (context->RestartState != RestartStateNormal)) {
+			break;
+		}
+	}
+
+	// Publish the data to the reader
+	if (bytesCopied) {
+		context->SharedRingProducer = producer;
+		SHARED_RING_BARRIER();
+		ring->Producer = producer;
+	}
+	return bytesCopied;
 }
 
 //----------------------------------------------------------------------------
@@ -479,43 +671,206 @@ NTSTATUS InitializeReadInterface(DEVICE_OBJECT *device)
 }
 
 //----------------------------------------------------------------------------
-void SetIdList(
-		READER_CONTEXT     *context,
-		const ID_LIST_TYPE  idListType,
-		const void         *buffer,
-		const UINT32        bufferLen)
+__checkReturn
+NTSTATUS MapSharedRing(
+	__inout READER_CONTEXT  *context,
+	__in UINT32              dataSize,
+	__out UINT64            *address)
 {
-	const char  *label;
-	const char  *labelPs;
-	void       **target;
-	if (idListType == ConnectionIdList) {
-		label = "connection";
-		labelPs = "connection(s)";
-		target = reinterpret_cast<void**>(&context->FilteredConnectionIds);
-	} else {
-		label = "process";
-		labelPs = "process(es)";
-		target = reinterpret_cast<void**>(&context->FilteredProcessIds);
-	}
-
-	UINT32       *ids    = NULL;
-	const UINT32  numIds = bufferLen / sizeof(UINT32);
-	DBGPRINT(D_INFO, "Filtering %d %s for reader %d", numIds, labelPs, context->Reader.Id);
-	if (numIds) {
-		ids = reinterpret_cast<UINT32*>(ExAllocatePoolWithTag(NonPagedPool, (numIds + 1) * sizeof(UINT32), gPoolTagIds));
-		ids[0] = numIds;
-		const UINT32 *newIds = reinterpret_cast<const UINT32*>(buffer);
-		for (UINT32 index = 0; index < numIds; index++) {
-			const UINT32 id = newIds[index];
-			DBGPRINT(D_INFO, "Filtering %s %08X (%d) for reader %d", label, id, id, context->Reader.Id);
-			ids[index + 1] = id;
+	PHYSICAL_ADDRESS    highAddress;
+	KLOCK_QUEUE_HANDLE  lockHandle;
+	PHYSICAL_ADDRESS    lowAddress  = {0};
+	MDL                *mdl         = NULL;
+	bool                pending;
+	SHARED_RING_HEADER *ring        = NULL;
+	PHYSICAL_ADDRESS    skipBytes   = {0};
+	NTSTATUS            status      = STATUS_SUCCESS;
+	void               *userAddress = NULL;
+
+	if (context->SharedRingMdl) {
+		DBGPRINT(D_ERR, "Reader %d already has a shared ring", context->Reader.Id);
+		return STATUS_INVALID_DEVICE_STATE;
+	}
+	if (!dataSize) {
+		dataSize = SHARED_RING_DEFAULT_SIZE;
+	}
+	if ((dataSize < SHARED_RING_MIN_SIZE) || (dataSize > SHARED_RING_MAX_SIZE) ||
+			(dataSize & (dataSize - 1))) {
+		DBGPRINT(D_ERR, "Invalid shared ring size %08X for reader %d", dataSize,
+				context->Reader.Id);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	// Use whole pages outside of the pools, since the ring can be large and
+	// must be mapped into the reader's address space
+	highAddress.QuadPart = -1;
+	mdl = MmAllocatePagesForMdlEx(lowAddress, highAddress, skipBytes,
+			SHARED_RING_HEADER_SIZE + dataSize, MmCached, MM_ALLOCATE_FULLY_REQUIRED);
+	if (!mdl) {
+		DBGPRINT(D_ERR, "Cannot allocate %08X byte shared ring for reader %d",
+				dataSize, context->Reader.Id);
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		goto Cleanup;
+	}
+	ring = reinterpret_cast<SHARED_RING_HEADER*>(
+			MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority));
+	if (!ring) {
+		DBGPRINT(D_ERR, "Cannot map shared ring for reader %d", context->Reader.Id);
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		goto Cleanup;
+	}
+	RtlZeroMemory(ring, SHARED_RING_HEADER_SIZE);
+	ring->DataSize   = dataSize;
+	ring->DataOffset = SHARED_RING_HEADER_SIZE;
+
+	// Mapping into user mode raises an exception on failure
+	__try {
+		userAddress = MmMapLockedPagesSpecifyCache(mdl, UserMode, MmCached, NULL,
+				FALSE, NormalPagePriority);
+	} __except (EXCEPTION_EXECUTE_HANDLER) {
+		userAddress = NULL;
+	}
+	if (!userAddress) {
+		DBGPRINT(D_ERR, "Cannot map shared ring into reader %d", context->Reader.Id);
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		goto Cleanup;
+	}
+
+	// Set up the ring under the fill lock, storing the ring pointer last, so
+	// the data DPC never sees a partly set up ring.  Reads that are already
+	// pending were sent with their own buffers, so don't let the ring take
+	// them over, and don't replace a ring that another request just mapped.
+	KeAcquireInStackQueuedSpinLock(&context->FillLock, &lockHandle);
+	KeAcquireSpinLockAtDpcLevel(&context->PendingReadLock);
+	pending = IsListEmpty(&context->PendingReadList) ? false : true;
+	KeReleaseSpinLockFromDpcLevel(&context->PendingReadLock);
+	if (context->SharedRingMdl || pending) {
+		KeReleaseInStackQueuedSpinLock(&lockHandle);
+		DBGPRINT(D_ERR, "Reader %d already has a shared ring or pending reads",
+				context->Reader.Id);
+		status = STATUS_INVALID_DEVICE_STATE;
+		goto Cleanup;
+	}
+	context->SharedRingMdl      = mdl;
+	context->SharedRingProcess  = PsGetCurrentProcess();
+	context->SharedRingProducer = 0;
+	context->SharedRingSize     = dataSize;
+	context->SharedRingUser     = userAddress;
+	ObReferenceObject(context->SharedRingProcess);
+	KeMemoryBarrier();
+	context->SharedRing         = ring;
+	KeReleaseInStackQueuedSpinLock(&lockHandle);
+	*address = reinterpret_cast<ULONG_PTR>(userAddress);
+	DBGPRINT(D_INFO, "Mapped %08X byte shared ring at %p for reader %d",
+			dataSize, userAddress, context->Reader.Id);
+
+Cleanup:
+	if (!NT_SUCCESS(status) && mdl) {
+		if (userAddress) {
+			MmUnmapLockedPages(userAddress, mdl);
+		}
+		if (ring) {
+			MmUnmapLockedPages(ring, mdl);
+		}
+		MmFreePagesFromMdl(mdl);
+		ExFreePool(mdl);
+	}
+	return status;
+}
+
+//----------------------------------------------------------------------------
+void ReadDataDpc(
+	__in     KDPC *dpc,
+	__in_opt void *context,
+	__in_opt void *arg1,
+	__in_opt void *arg2)
+{
+	UNREFERENCED_PARAMETER(dpc);
+	UNREFERENCED_PARAMETER(arg1);
+	UNREFERENCED_PARAMETER(arg2);
+
+	ServicePendingReads(reinterpret_cast<READER_CONTEXT*>(context));
+}
+
+//----------------------------------------------------------------------------
+void ServicePendingReads(__inout READER_CONTEXT *context)
+{
+	PIRP               irp;
+	KLOCK_QUEUE_HANDLE lockHandle;
+	UINT32             readOffset;
+
+	for (;;) {
+		KeAcquireInStackQueuedSpinLock(&context->FillLock, &lockHandle);
+		if ((context->RestartState == RestartStateInit) ||
+				(context->RestartState == RestartStateLoading)) {
+			KeReleaseInStackQueuedSpinLock(&lockHandle);
+			break;
+		}
+		irp = IoCsqRemoveNextIrp(&context->PendingReads, NULL);
+		if (!irp) {
+			KeReleaseInStackQueuedSpinLock(&lockHandle);
+			break;
 		}
+
+		readOffset = 0;
+		if (context->RestartState == RestartStateSendEof) {
+			// Return zero bytes to tell reader it's at a block boundary
+			context->RestartState = RestartStateInit;
+		} else {
+			readOffset = FillReadIrp(context, irp);
+			if (!readOffset && (context->RestartState == RestartStateNormal)) {
+				// Nothing to read yet, so put the read back at the front of the
+				// queue until the queue manager has data
+				IoCsqInsertIrpEx(&context->PendingReads, irp, NULL, context);
+				KeReleaseInStackQueuedSpinLock(&lockHandle);
+				break;
+			}
+		}
+		KeReleaseInStackQueuedSpinLock(&lockHandle);
+		CompleteIrp(irp, STATUS_SUCCESS, readOffset);
 	}
+}
 
-	UINT32 *currentIds = reinterpret_cast<UINT32*>(InterlockedExchangePointer(target, ids));
-	if (currentIds) {
-		ExFreePool(currentIds);
+//----------------------------------------------------------------------------
+void UnmapSharedRing(__inout READER_CONTEXT *context)
+{
+	KAPC_STATE          apcState;
+	KLOCK_QUEUE_HANDLE  lockHandle;
+	SHARED_RING_HEADER *ring;
+	MDL                *mdl;
+	PEPROCESS           process;
+	void               *userAddress;
+
+	// Detach the ring under the fill lock, so that once the lock is released
+	// no DPC or read can still be copying blocks into it
+	KeAcquireInStackQueuedSpinLock(&context->FillLock, &lockHandle);
+	ring                       = context->SharedRing;
+	mdl                        = context->SharedRingMdl;
+	process                    = context->SharedRingProcess;
+	userAddress                = context->SharedRingUser;
+	context->SharedRing        = NULL;
+	context->SharedRingMdl     = NULL;
+	context->SharedRingProcess = NULL;
+	context->SharedRingUser    = NULL;
+	KeReleaseInStackQueuedSpinLock(&lockHandle);
+	if (!mdl) {
+		return;
 	}
+
+	// The user-mode mapping can only be removed from the reader's process
+	if (PsGetCurrentProcess() == process) {
+		MmUnmapLockedPages(userAddress, mdl);
+	} else {
+		KeStackAttachProcess(process, &apcState);
+		MmUnmapLockedPages(userAddress, mdl);
+		KeUnstackDetachProcess(&apcState);
+	}
+	ObDereferenceObject(process);
+
+	MmUnmapLockedPages(ring, mdl);
+	MmFreePagesFromMdl(mdl);
+	ExFreePool(mdl);
+	DBGPRINT(D_INFO, "Unmapped shared ring for reader %d", context->Reader.Id);
 }
 
 #ifdef __cplusplus
@@ -37,6 +37,16 @@ extern "C" {
 __checkReturn
 NTSTATUS DeinitializeReadInterface(void);
 
+//----------------------------------------------------------------------------
+/// @brief Releases resources tied to the process that closed the last handle
+/// to an open device
+///
+/// @param deviceObject  The target device for the operation
+/// @param irp           I/O request packet for the operation
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__drv_dispatchType(IRP_MJ_CLEANUP) DRIVER_DISPATCH DispatchCleanup;
+
 //----------------------------------------------------------------------------
 /// @brief Closes an open device
 ///
@@ -28,11 +28,18 @@
 #include "queue_manager.h"
 #include "hone_info.h"
 #include "debug_print.h"
+#include "../shared_ring.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+//----------------------------------------------------------------------------
+// Defines
+//----------------------------------------------------------------------------
+
+#define READ_BATCH_SIZE 32  // Maximum number of blocks dequeued at once
+
 //----------------------------------------------------------------------------
 // Structures and enumerations
 //----------------------------------------------------------------------------
@@ -41,6 +48,7 @@ enum RESTART_STATE {
 	RestartStateNormal,   // Normal operation
 	RestartStateSendEof,  // Send End-Of-File to reader
 	RestartStateInit,     // Send initial PCAP-NG blocks to reader
+	RestartStateLoading,  // A read is getting the initial PCAP-NG blocks
 };
 
 struct DEVICE_EXTENSION {
@@ -52,12 +60,13 @@ struct DEVICE_EXTENSION {
 struct READER_CONTEXT {
 	DEVICE_EXTENSION      *DeviceExtension;       // Device that owns this instance
 	READER_INFO            Reader;                // Reader's registration information
-	RESTART_STATE          RestartState;          // Normal or restarting
+	volatile LONG          RestartState;          // RESTART_STATE value
 	LONG                   RestartRequested;      // Non-zero if reader requested a restart
 	BLOCK_NODE            *CurrentBlock;          // PCAP-NG block currently being read
 	UINT32                 CurrentBlockOffset;    // Offset into current PCAP-NG block
-	UINT32                *FilteredConnectionIds; // List of connection IDs being filtered (NULL if none)
-	UINT32                *FilteredProcessIds;    // List of processes IDs being filtered (NULL if none)
+	BLOCK_NODE            *BatchBlocks[READ_BATCH_SIZE]; // Blocks dequeued but not yet read
+	UINT32                 BatchCount;            // Number of blocks in the batch
+	UINT32                 BatchIndex;            // Index of next block to read from the batch
 	UINT32                 SnapLength;            // Number of bytes to capture (0 or 0xFFFFFFFF for unlimited)
 	UINT32                 SnapLengthPad;         // Bytes of padding needed based on snap length
 	PCAP_NG_PACKET_HEADER  ModifiedHeader;        // Modified packet header for truncated blocks
@@ -65,6 +74,18 @@ struct READER_CONTEXT {
 	UINT32                 DataEndOffset;         // Offset to end of unpadded data
 	UINT32                 ModifiedFooterOffset;  // Offset to start of modified packet footer
 	UINT32                 OriginalFooterOffset;  // Offset to start of original packet footer
+	SHARED_RING_HEADER    *SharedRing;            // System address of shared ring (NULL if not mapped)
+	MDL                   *SharedRingMdl;         // Pages that hold the shared ring
+	PEPROCESS              SharedRingProcess;     // Process the shared ring is mapped into
+	UINT32                 SharedRingProducer;    // Producer offset (the reader cannot change this copy)
+	UINT32                 SharedRingSize;        // Number of data bytes in the shared ring
+	void                  *SharedRingUser;        // User-mode address of shared ring
+	KSPIN_LOCK             FillLock;              // Serializes copying blocks to readers
+	IO_CSQ                 PendingReads;          // Cancel-safe queue of reads waiting for data
+	LIST_ENTRY             PendingReadList;       // Reads waiting for data
+	KSPIN_LOCK             PendingReadLock;       // Locks list of reads waiting for data
+	KDPC                   DataDpc;               // Completes pending reads when data arrives
+	bool                   DataDpcSet;            // True if the queue manager queues the data DPC
 };
 
 struct IOCTL_PARAMS {
@@ -74,29 +95,147 @@ struct IOCTL_PARAMS {
 	UINT8  OutputLength64;
 };
 
-enum ID_LIST_TYPE {
-	ConnectionIdList, // List of connection IDs
-	ProcessIdList,    // List of process IDs
-};
-
 //----------------------------------------------------------------------------
 // Function prototypes
 //----------------------------------------------------------------------------
 
 //----------------------------------------------------------------------------
-/// @brief Sets a new connection or process ID list in the reader context
-/// structure
+/// @brief Acquires the lock for a reader's pending reads queue
+///
+/// @param csq   Pending reads queue
+/// @param irql  Receives the IRQL to restore when releasing the lock
+IO_CSQ_ACQUIRE_LOCK CsqAcquireReadLock;
+
+//----------------------------------------------------------------------------
+/// @brief Completes a pending read that was canceled
 ///
-/// @brief context     Reader context
-/// @brief idListType  Type of ID list to set
-/// @brief buffer      Buffer that holds the ID list
-/// @brief bufferLen   Length in bytes of buffer that holds the ID list
+/// @param csq  Pending reads queue
+/// @param irp  Read that was canceled
+IO_CSQ_COMPLETE_CANCELED_IRP CsqCompleteCanceledRead;
 
-void SetIdList(
-		READER_CONTEXT     *context,
-		const ID_LIST_TYPE  idListType,
-		const void         *buffer,
-		const UINT32        bufferLen);
+//----------------------------------------------------------------------------
+/// @brief Adds a read to a reader's pending reads queue
+///
+/// @param csq            Pending reads queue
+/// @param irp            Read to add
+/// @param insertContext  Non-NULL to add the read to the front of the queue
+///
+/// @returns STATUS_SUCCESS
+IO_CSQ_INSERT_IRP_EX CsqInsertRead;
+
+//----------------------------------------------------------------------------
+/// @brief Gets the next read in a reader's pending reads queue
+///
+/// @param csq          Pending reads queue
+/// @param irp          Read to start after (NULL to start at the front)
+/// @param peekContext  Unused, since each reader has its own queue
+///
+/// @returns The next read, or NULL if there isn't one
+IO_CSQ_PEEK_NEXT_IRP CsqPeekNextRead;
+
+//----------------------------------------------------------------------------
+/// @brief Releases the lock for a reader's pending reads queue
+///
+/// @param csq   Pending reads queue
+/// @param irql  IRQL returned when the lock was acquired
+IO_CSQ_RELEASE_LOCK CsqReleaseReadLock;
+
+//----------------------------------------------------------------------------
+/// @brief Removes a read from a reader's pending reads queue
+///
+/// @param csq  Pending reads queue
+/// @param irp  Read to remove
+IO_CSQ_REMOVE_IRP CsqRemoveRead;
+
+//----------------------------------------------------------------------------
+/// @brief Copies the reader's pending PCAP-NG blocks into a buffer
+///
+/// Picks up where the previous call left off, so blocks can be split across
+/// buffers.  Stops at a block boundary if the reader requested a restart.
+///
+/// @param context      Reader to copy blocks for
+/// @param readBuffer   Buffer to copy blocks into
+/// @param readLength   Size of the buffer in bytes
+/// @param bytesCopied  Bytes already returned to the reader by this request
+///
+/// @returns Number of bytes copied into the buffer
+UINT32 FillReadBuffer(
+	__inout READER_CONTEXT          *context,
+	__out_bcount(readLength) UINT8  *readBuffer,
+	__in const UINT32                readLength,
+	__in const UINT32                bytesCopied);
+
+//----------------------------------------------------------------------------
+/// @brief Copies the reader's pending PCAP-NG blocks for a read request
+///
+/// Copies blocks into the shared ring if the reader has one, and into the
+/// request's buffer otherwise.  Must be called with the fill lock held.
+///
+/// @param context  Reader to copy blocks for
+/// @param irp      Read request
+///
+/// @returns Number of bytes to return for the request
+UINT32 FillReadIrp(
+	__inout READER_CONTEXT  *context,
+	__in PIRP                irp);
+
+//----------------------------------------------------------------------------
+/// @brief Copies the reader's pending PCAP-NG blocks into its shared ring
+///
+/// Never trusts the reader's copy of the producer offset, and does not
+/// overwrite data if the reader's consumer offset is inconsistent.
+///
+/// @param context  Reader to copy blocks for
+///
+/// @returns Number of bytes added to the shared ring
+UINT32 FillSharedRing(__inout READER_CONTEXT *context);
+
+//----------------------------------------------------------------------------
+/// @brief Allocates a shared ring and maps it into the current process
+///
+/// Must be called at PASSIVE_LEVEL in the context of the reader's process.
+/// Fails if the reader already has a shared ring or has reads pending.
+///
+/// @param context   Reader to map shared ring for
+/// @param dataSize  Number of data bytes (0 for the default size)
+/// @param address   Receives the user-mode address of the shared ring
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn
+NTSTATUS MapSharedRing(
+	__inout READER_CONTEXT  *context,
+	__in UINT32              dataSize,
+	__out UINT64            *address);
+
+//----------------------------------------------------------------------------
+/// @brief Completes the reader's pending reads when the queue manager has
+/// data for it
+///
+/// @param dpc      Unused
+/// @param context  Reader context
+/// @param arg1     Unused
+/// @param arg2     Unused
+KDEFERRED_ROUTINE ReadDataDpc;
+
+//----------------------------------------------------------------------------
+/// @brief Completes as many of the reader's pending reads as possible
+///
+/// Completes reads in the order they were queued, and stops at the first
+/// read that there is no data for.  Reads that must wait for the initial
+/// PCAP-NG blocks are left for DispatchRead, since the initial blocks can
+/// only be gathered at PASSIVE_LEVEL.
+///
+/// @param context  Reader to complete reads for
+void ServicePendingReads(__inout READER_CONTEXT *context);
+
+//----------------------------------------------------------------------------
+/// @brief Unmaps and frees the reader's shared ring, if it has one
+///
+/// Must be called at PASSIVE_LEVEL.  The ring is detached from the reader
+/// under the fill lock before it is unmapped.
+///
+/// @param context  Reader to unmap shared ring for
+void UnmapSharedRing(__inout READER_CONTEXT *context);
 
 #ifdef __cplusplus
 };
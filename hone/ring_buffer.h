@@ -1,8 +1,13 @@
 //----------------------------------------------------------------------------
-// Simple lock-free ring buffer implementation
+// Lock-free ring buffer implementation
 //
-// Note that the ring buffer will only roll over correctly when the size is
-// a power of 2.
+// Each slot carries a sequence number that tells producers and consumers
+// whether the slot is free or holds a published block for the current lap
+// around the ring, so readers never have to spin on a slot that a producer
+// has reserved but not yet filled.  See Dmitry Vyukov's bounded MPMC queue:
+// http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+//
+// Note that the number of slots in the ring buffer must be a power of 2.
 //
 // Copyright (c) 2014 Battelle Memorial Institute
 // Licensed under a modification of the 3-clause BSD license
@@ -22,29 +27,43 @@
 #include <limits.h>
 #include "common.h"
 
+//----------------------------------------------------------------------------
+struct RING_BUFFER_SLOT {
+	volatile LONG   Sequence;  // Index this slot is ready for
+	void           *Block;     // Block stored in this slot
+};
+
 //----------------------------------------------------------------------------
 struct RING_BUFFER {
-	UINT32   Front;
-	UINT32   Back;
-	UINT32   Length;
-	void   **Buffer;
+	volatile LONG      Front;                                   // Index of next slot to dequeue
+	UINT8              FrontPad[CACHE_LINE_SIZE - sizeof(LONG)];  // Keeps indices on separate cache lines
+	volatile LONG      Back;                                    // Index of next slot to enqueue
+	UINT8              BackPad[CACHE_LINE_SIZE - sizeof(LONG)];   // Keeps indices on separate cache lines
+	UINT32             Length;                                  // Number of slots
+	UINT32             Mask;                                    // Mask to convert an index to a slot
+	RING_BUFFER_SLOT  *Buffer;                                  // The slots
 };
 
 //----------------------------------------------------------------------------
 /// @brief Initializes the ring buffer
 ///
 /// @param ring    Ring buffer to initialize
-/// @param buffer  Buffer to hold pointers to blocks
-/// @param size    Size of buffer in bytes
+/// @param buffer  Buffer to hold the slots
+/// @param size    Size of buffer in bytes (number of slots must be a power of 2)
 static inline void InitRingBuffer(
-	__in RING_BUFFER                      *queue,
-	__in __drv_in(__drv_aliasesMem) void **buffer,
-	__in ULONG                             size)
+	__in RING_BUFFER                                  *queue,
+	__in __drv_in(__drv_aliasesMem) RING_BUFFER_SLOT  *buffer,
+	__in ULONG                                         size)
 {
 	queue->Front  = 0;
 	queue->Back   = 0;
 	queue->Buffer = buffer;
-	queue->Length = size / sizeof(void*);
+	queue->Length = size / sizeof(RING_BUFFER_SLOT);
+	queue->Mask   = queue->Length - 1;
+	for (UINT32 index = 0; index < queue->Length; index++) {
+		buffer[index].Sequence = static_cast<LONG>(index);
+		buffer[index].Block    = NULL;
+	}
 }
 
 //----------------------------------------------------------------------------
@@ -66,7 +85,8 @@ static inline bool IsRingBufferEmpty(__in RING_BUFFER *ring)
 /// @returns True if ring buffer is full; false otherwise
 static inline bool IsRingBufferFull(__in RING_BUFFER *ring)
 {
-	return (ring->Back == (ring->Front + ring->Length)) ? true : false;
+	return (static_cast<ULONG>(ring->Back - ring->Front) >= ring->Length) ?
+			true : false;
 }
 
 //----------------------------------------------------------------------------
@@ -74,66 +94,184 @@ static inline bool IsRingBufferFull(__in RING_BUFFER *ring)
 ///
 /// @param ring  Ring buffer to get block from
 ///
-/// @returns Pointer to dequeued block if successful; NULL if buffer is empty
+/// @returns Pointer to dequeued block if successful; NULL if buffer is empty or
+///          the next block hasn't been published yet
 static inline void* RingBufferDequeue(__in RING_BUFFER *ring)
 {
-	void *block = NULL;
+	RING_BUFFER_SLOT *slot;
+	ULONG             front;
 
 	for (;;) {
-		// Get index of next slot in the buffer and check if the buffer is empty
-		const ULONG front = ring->Front;
-		if (front == ring->Back) {
+		// Check if the next slot holds a block for this lap around the buffer
+		front = ring->Front;
+		slot  = ring->Buffer + (front & ring->Mask);
+		const LONG diff = slot->Sequence - static_cast<LONG>(front + 1);
+		if (diff < 0) {
 			return NULL;
 		}
 
-		// Check if our slot contains anything yet
-		void **slot = ring->Buffer + (front % ring->Length);
-		block = *slot;
-		if (!block) {
-			continue;
+		// Claim the slot if no one else has already done it
+		if ((diff == 0) && (static_cast<ULONG>(InterlockedCompareExchange(
+				&ring->Front, static_cast<LONG>(front + 1),
+				static_cast<LONG>(front))) == front)) {
+			break;
+		}
+	}
+
+	// Take the block and mark the slot as free for the next lap
+	void *block = slot->Block;
+	InterlockedExchange(&slot->Sequence, static_cast<LONG>(front + ring->Length));
+	return block;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Gets up to count blocks from the front of the ring buffer
+///
+/// Claims all of the dequeued slots with a single update of the front index
+/// instead of one update per block.  Stops early at the first slot whose
+/// block hasn't been published yet.
+///
+/// @param ring    Ring buffer to get blocks from
+/// @param blocks  Array to hold the dequeued blocks
+/// @param count   Maximum number of blocks to dequeue
+///
+/// @returns Number of blocks dequeued (0 if buffer is empty)
+static inline UINT32 RingBufferDequeueBatch(
+	__in RING_BUFFER               *ring,
+	__out_ecount(count) void      **blocks,
+	__in const UINT32               count)
+{
+	ULONG  front;
+	UINT32 available;
+	UINT32 index;
+
+	for (;;) {
+		// Count the published slots at the front of the buffer
+		front = ring->Front;
+		for (available = 0; available < count; available++) {
+			const ULONG       position = front + available;
+			RING_BUFFER_SLOT *slot     = ring->Buffer + (position & ring->Mask);
+			if (slot->Sequence != static_cast<LONG>(position + 1)) {
+				break;
+			}
+		}
+		if (!available) {
+			return 0;
 		}
 
-		// If our slot still contains our block, write NULL into it
-		void *init = InterlockedCompareExchangePointer(slot, NULL, block);
-		if (init == block) {
+		// Claim the slots if no one else has already done it
+		if (static_cast<ULONG>(InterlockedCompareExchange(
+				&ring->Front, static_cast<LONG>(front + available),
+				static_cast<LONG>(front))) == front) {
 			break;
 		}
 	}
 
-	// Increment index of next slot (assumes that there is only one reader)
-	InterlockedIncrement(reinterpret_cast<LONG*>(&ring->Front));
-	return block;
+	// Take the blocks and mark the slots as free for the next lap
+	for (index = 0; index < available; index++) {
+		RING_BUFFER_SLOT *slot = ring->Buffer + ((front + index) & ring->Mask);
+		blocks[index] = slot->Block;
+		InterlockedExchange(&slot->Sequence,
+				static_cast<LONG>(front + index + ring->Length));
+	}
+	return available;
 }
 
 //----------------------------------------------------------------------------
 /// @brief Adds a block to the back of the ring buffer
 ///
-/// @param ring   Ring buffer to add block to
-/// @param block  Block to add
+/// @param ring      Ring buffer to add block to
+/// @param block     Block to add
+/// @param position  Receives the index of the slot that holds the block (optional)
 ///
 /// @returns True if successful; false if buffer is full
 static inline bool RingBufferEnqueue(
 	__in RING_BUFFER                     *ring,
-	__in __drv_in(__drv_aliasesMem) void *block)
+	__in __drv_in(__drv_aliasesMem) void *block,
+	__out_opt ULONG                      *position = NULL)
 {
-	ULONG back;
+	RING_BUFFER_SLOT *slot;
+	ULONG             back;
 
 	for (;;) {
-		// Get index of next slot in the buffer and check if the buffer is full
+		// Check if the next slot is free for this lap around the buffer
 		back = ring->Back;
-		if ((back - ring->Front) >= ring->Length) {
+		slot = ring->Buffer + (back & ring->Mask);
+		const LONG diff = slot->Sequence - static_cast<LONG>(back);
+		if (diff < 0) {
 			return false;
 		}
 
-		// Increment index of next slot if no one else has already done it
-		if (static_cast<ULONG>(InterlockedCompareExchange(
-				reinterpret_cast<LONG*>(&ring->Back), back + 1, back)) == back) {
+		// Claim the slot if no one else has already done it
+		if ((diff == 0) && (static_cast<ULONG>(InterlockedCompareExchange(
+				&ring->Back, static_cast<LONG>(back + 1),
+				static_cast<LONG>(back))) == back)) {
 			break;
 		}
 	}
 
-	// Store the block into our slot
-	ring->Buffer[back % ring->Length] = block;
+	// Store the block into our slot and publish it to readers
+	slot->Block = block;
+	InterlockedExchange(&slot->Sequence, static_cast<LONG>(back + 1));
+	if (position) {
+		*position = back;
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Adds several blocks to the back of the ring buffer
+///
+/// Reserves slots for all of the blocks with a single update of the back
+/// index.  Either all of the blocks are added or none of them are.
+///
+/// @param ring    Ring buffer to add blocks to
+/// @param blocks  Blocks to add
+/// @param count   Number of blocks to add
+///
+/// @returns True if successful; false if buffer doesn't have room for all blocks
+static inline bool RingBufferEnqueueBatch(
+	__in RING_BUFFER                                       *ring,
+	__in_ecount(count) __drv_in(__drv_aliasesMem) void    **blocks,
+	__in const UINT32                                       count)
+{
+	ULONG  back;
+	UINT32 index;
+
+	if (count > ring->Length) {
+		return false;
+	}
+
+	for (;;) {
+		// Check if all of the slots are free for this lap around the buffer
+		LONG diff = 0;
+		back = ring->Back;
+		for (index = 0; index < count; index++) {
+			const ULONG       position = back + index;
+			RING_BUFFER_SLOT *slot     = ring->Buffer + (position & ring->Mask);
+			diff = slot->Sequence - static_cast<LONG>(position);
+			if (diff) {
+				break;
+			}
+		}
+		if (diff < 0) {
+			return false;
+		}
+
+		// Reserve the slots if no one else has already reserved them
+		if ((diff == 0) && (static_cast<ULONG>(InterlockedCompareExchange(
+				&ring->Back, static_cast<LONG>(back + count),
+				static_cast<LONG>(back))) == back)) {
+			break;
+		}
+	}
+
+	// Store the blocks into our slots and publish them to readers in order
+	for (index = 0; index < count; index++) {
+		RING_BUFFER_SLOT *slot = ring->Buffer + ((back + index) & ring->Mask);
+		slot->Block = blocks[index];
+		InterlockedExchange(&slot->Sequence, static_cast<LONG>(back + index + 1));
+	}
 	return true;
 }
 
@@ -0,0 +1,201 @@
+//----------------------------------------------------------------------------
+// Allocates memory for PCAP-NG blocks from a fixed set of size classes
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#include "slab_allocator_priv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Global variables
+//----------------------------------------------------------------------------
+
+// Size classes must be sorted by size.  The 2 KB class holds a full Ethernet
+// frame along with its block node and PCAP-NG headers, and the 9 KB and 65 KB
+// classes do the same for jumbo frames and maximum size IP packets.
+static SLAB_CLASS          gClasses[SLAB_NUM_CLASSES] = {
+	{  128, 32, 'aSoH'},
+	{  256, 32, 'bSoH'},
+	{  512, 32, 'cSoH'},
+	{ 2048, 16, 'dSoH'},
+	{ 9216,  4, 'eSoH'},
+	{66560,  1, 'fSoH'},
+};
+static SLAB_CPU_CACHE     *gCpuCaches         = NULL;    // Per-processor caches of free objects
+static SIZE_T              gCpuCacheStride    = 0;       // Distance between per-processor caches in bytes
+static UINT32              gNumProcessors     = 0;       // Number of active processors when driver loaded
+static const UINT32        gPoolTagCpuCache   = 'mSoH';  // Tag to use when allocating per-processor caches
+
+//----------------------------------------------------------------------------
+NTSTATUS DeinitializeSlabAllocator(void)
+{
+	UINT32 index;
+
+	// Return objects cached by each processor to the lookaside lists
+	if (gCpuCaches) {
+		for (index = 0; index < gNumProcessors; index++) {
+			SLAB_CPU_CACHE *cache = reinterpret_cast<SLAB_CPU_CACHE*>(
+					reinterpret_cast<char*>(gCpuCaches) + (index * gCpuCacheStride));
+			for (UINT32 sizeClass = 0; sizeClass < SLAB_NUM_CLASSES; sizeClass++) {
+				SLAB_MAGAZINE *magazine = &cache->Magazines[sizeClass];
+				while (magazine->Count) {
+					ExFreeToLookasideListEx(&gClasses[sizeClass].Lookaside,
+							magazine->Objects[--magazine->Count]);
+				}
+			}
+		}
+		ExFreePool(gCpuCaches);
+		gCpuCaches = NULL;
+	}
+
+	for (index = 0; index < SLAB_NUM_CLASSES; index++) {
+		if (gClasses[index].LookasideInit) {
+			ExDeleteLookasideListEx(&gClasses[index].Lookaside);
+			gClasses[index].LookasideInit = false;
+		}
+	}
+	return STATUS_SUCCESS;
+}
+
+//----------------------------------------------------------------------------
+SLAB_CPU_CACHE* GetCpuCache(void)
+{
+	const ULONG index = KeGetCurrentProcessorNumberEx(NULL);
+	if (index >= gNumProcessors) {
+		return NULL;
+	}
+	return reinterpret_cast<SLAB_CPU_CACHE*>(
+			reinterpret_cast<char*>(gCpuCaches) + (index * gCpuCacheStride));
+}
+
+//----------------------------------------------------------------------------
+UINT32 GetSizeClass(__in const UINT32 size)
+{
+	for (UINT32 index = 0; index < SLAB_NUM_CLASSES; index++) {
+		if (size <= gClasses[index].Size) {
+			return index;
+		}
+	}
+	return SLAB_POOL_CLASS;
+}
+
+//----------------------------------------------------------------------------
+NTSTATUS InitializeSlabAllocator(__in DEVICE_OBJECT *device)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	UNREFERENCED_PARAMETER(device);
+
+	for (UINT32 index = 0; index < SLAB_NUM_CLASSES; index++) {
+		status = ExInitializeLookasideListEx(&gClasses[index].Lookaside, NULL,
+				NULL, NonPagedPool, 0, gClasses[index].Size,
+				gClasses[index].PoolTag, 0);
+		if (!NT_SUCCESS(status)) {
+			DBGPRINT(D_ERR, "Cannot create lookaside list for %d byte objects",
+					gClasses[index].Size);
+			return status;
+		}
+		gClasses[index].LookasideInit = true;
+	}
+
+	// Allocate a cache for each processor, with each cache starting on its own
+	// cache line so that processors don't contend for the same lines
+	gNumProcessors  = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	gCpuCacheStride = (sizeof(SLAB_CPU_CACHE) + CACHE_LINE_SIZE - 1) &
+			~static_cast<SIZE_T>(CACHE_LINE_SIZE - 1);
+	gCpuCaches      = reinterpret_cast<SLAB_CPU_CACHE*>(ExAllocatePoolWithTag(
+			NonPagedPoolCacheAligned, gNumProcessors * gCpuCacheStride,
+			gPoolTagCpuCache));
+	if (!gCpuCaches) {
+		DBGPRINT(D_ERR, "Cannot allocate per-processor slab caches");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	RtlZeroMemory(gCpuCaches, gNumProcessors * gCpuCacheStride);
+	return status;
+}
+
+//----------------------------------------------------------------------------
+void* SlabAllocate(
+	__in const UINT32  size,
+	__in const UINT32  poolTag,
+	__out UINT32      *sizeClass)
+{
+	KIRQL  oldIrql;
+	void  *object = NULL;
+
+	*sizeClass = GetSizeClass(size);
+	if (*sizeClass == SLAB_POOL_CLASS) {
+		return ExAllocatePoolWithTag(NonPagedPool, size, poolTag);
+	}
+
+	// Take an object from this processor's magazine if it has one.  Raise
+	// IRQL so that we can't be moved to another processor or interrupted by
+	// a DPC that uses the same magazine.
+	KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+	SLAB_CPU_CACHE *cache = GetCpuCache();
+	if (cache) {
+		SLAB_MAGAZINE *magazine = &cache->Magazines[*sizeClass];
+		if (magazine->Count) {
+			object = magazine->Objects[--magazine->Count];
+		}
+	}
+	KeLowerIrql(oldIrql);
+
+	if (!object) {
+		object = ExAllocateFromLookasideListEx(&gClasses[*sizeClass].Lookaside);
+	}
+	return object;
+}
+
+//----------------------------------------------------------------------------
+void SlabFree(
+	__in __drv_freesMem(Mem) void *object,
+	__in const UINT32              sizeClass)
+{
+	KIRQL oldIrql;
+	bool  cached = false;
+
+	if (!object) {
+		return;
+	}
+	if (sizeClass >= SLAB_NUM_CLASSES) {
+		ExFreePool(object);
+		return;
+	}
+
+	// Keep the object in this processor's magazine if it has room
+	KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+	SLAB_CPU_CACHE *cache = GetCpuCache();
+	if (cache) {
+		SLAB_MAGAZINE *magazine = &cache->Magazines[sizeClass];
+		if (magazine->Count < gClasses[sizeClass].MagazineSize) {
+			magazine->Objects[magazine->Count++] = object;
+			cached = true;
+		}
+	}
+	KeLowerIrql(oldIrql);
+
+	if (!cached) {
+		ExFreeToLookasideListEx(&gClasses[sizeClass].Lookaside, object);
+	}
+}
+
+#ifdef __cplusplus
+};
+#endif
@@ -0,0 +1,87 @@
+//----------------------------------------------------------------------------
+// Allocates memory for PCAP-NG blocks from a fixed set of size classes
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef SLAB_ALLOCATOR_H
+#define SLAB_ALLOCATOR_H
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Defines
+//----------------------------------------------------------------------------
+
+#define SLAB_POOL_CLASS 0xFFFFFFFF  // Size class of objects too large for any slab
+
+//----------------------------------------------------------------------------
+// Function prototypes
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+/// @brief Deinitializes the slab allocator
+///
+/// All objects must be freed before calling this function.
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn
+NTSTATUS DeinitializeSlabAllocator(void);
+
+//----------------------------------------------------------------------------
+/// @brief Initializes the slab allocator
+///
+/// @param device  WDM device object for this driver
+///
+/// @returns STATUS_SUCCESS if successful; NTSTATUS error code otherwise
+__checkReturn __drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS InitializeSlabAllocator(__in DEVICE_OBJECT *device);
+
+//----------------------------------------------------------------------------
+/// @brief Allocates an object from the smallest size class that can hold it
+///
+/// Objects that are larger than the largest size class are allocated
+/// directly from nonpaged pool.
+///
+/// @param size       Size of the object in bytes
+/// @param poolTag    Tag to use if the object is allocated directly from pool
+/// @param sizeClass  Receives the size class to pass to SlabFree
+///
+/// @returns Pointer to the object if successful; NULL otherwise
+__checkReturn __drv_maxIRQL(DISPATCH_LEVEL)
+void* SlabAllocate(
+	__in const UINT32  size,
+	__in const UINT32  poolTag,
+	__out UINT32      *sizeClass);
+
+//----------------------------------------------------------------------------
+/// @brief Frees an object allocated with SlabAllocate
+///
+/// @param object     Object to free
+/// @param sizeClass  Size class returned when the object was allocated
+__drv_maxIRQL(DISPATCH_LEVEL)
+void SlabFree(
+	__in __drv_freesMem(Mem) void *object,
+	__in const UINT32              sizeClass);
+
+#ifdef __cplusplus
+}; // extern "C"
+#endif
+
+#endif // SLAB_ALLOCATOR_H
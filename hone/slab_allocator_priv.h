@@ -0,0 +1,93 @@
+//----------------------------------------------------------------------------
+// Allocates memory for PCAP-NG blocks from a fixed set of size classes
+//
+// Each size class has a lookaside list, and each processor keeps a small
+// magazine of free objects for each size class so that most allocations and
+// frees never touch shared state.  A magazine is only accessed at
+// DISPATCH_LEVEL on the processor that owns it, so it needs no lock.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef SLAB_ALLOCATOR_PRIV_H
+#define SLAB_ALLOCATOR_PRIV_H
+
+//----------------------------------------------------------------------------
+// Includes
+//----------------------------------------------------------------------------
+
+#include "slab_allocator.h"
+
+#include "debug_print.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//----------------------------------------------------------------------------
+// Defines
+//----------------------------------------------------------------------------
+
+#define SLAB_NUM_CLASSES    6   // Number of size classes
+#define SLAB_MAGAZINE_SIZE  32  // Maximum number of objects in a magazine
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+// Size class of objects that share a lookaside list
+struct SLAB_CLASS {
+	UINT32             Size;          // Size of each object in bytes
+	UINT32             MagazineSize;  // Maximum number of objects to keep in each magazine
+	UINT32             PoolTag;       // Tag to use when allocating objects for the lookaside list
+	LOOKASIDE_LIST_EX  Lookaside;     // Holds memory for the objects
+	bool               LookasideInit; // True if lookaside list was initialized
+};
+
+// Free objects of one size class cached by a processor
+struct SLAB_MAGAZINE {
+	UINT32  Count;                        // Number of objects in the magazine
+	void   *Objects[SLAB_MAGAZINE_SIZE];  // Free objects
+};
+
+// Free objects of every size class cached by a processor
+struct SLAB_CPU_CACHE {
+	SLAB_MAGAZINE Magazines[SLAB_NUM_CLASSES];
+};
+
+//----------------------------------------------------------------------------
+// Function prototypes
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+/// @brief Gets the current processor's cache of free objects
+///
+/// Must be called at DISPATCH_LEVEL.
+///
+/// @returns Pointer to the cache if successful; NULL if the processor was
+///          added after the driver loaded
+__drv_requiresIRQL(DISPATCH_LEVEL)
+SLAB_CPU_CACHE* GetCpuCache(void);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the smallest size class that can hold an object
+///
+/// @param size  Size of the object in bytes
+///
+/// @returns Index of the size class; SLAB_POOL_CLASS if no size class is large
+///          enough
+UINT32 GetSizeClass(__in const UINT32 size);
+
+#ifdef __cplusplus
+}; // extern "C"
+#endif
+
+#endif // SLAB_ALLOCATOR_PRIV_H
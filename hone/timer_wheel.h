@@ -0,0 +1,327 @@
+//----------------------------------------------------------------------------
+// Hierarchical timing wheel
+//
+// Entries are scheduled to expire at an absolute tick.  The wheel has
+// TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots each, and an entry is
+// placed in the lowest level whose range covers its expiration time.  When
+// the lowest level wraps around, the entries in the next slot of the level
+// above it are cascaded down, so advancing the wheel only touches entries
+// that are about to expire.  Scheduling and removing an entry are O(1).
+//
+// The wheel does no locking or memory allocation of its own.  Entries are
+// embedded in the caller's structures, and the caller serializes access.
+//
+// Copyright (c) 2014 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include "common.h"
+
+#define TIMER_WHEEL_BITS   6                         // Log2 of the number of slots in each level
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)   // Number of slots in each level
+#define TIMER_WHEEL_MASK   (TIMER_WHEEL_SLOTS - 1)   // Mask to convert a tick to a slot
+#define TIMER_WHEEL_LEVELS 4                         // Number of levels
+#define TIMER_WHEEL_RANGE  (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) // Number of ticks the wheel spans
+
+//----------------------------------------------------------------------------
+struct TIMER_WHEEL_ENTRY {
+	TIMER_WHEEL_ENTRY *Next;     // Next entry in the slot or list
+	TIMER_WHEEL_ENTRY *Prev;     // Previous entry in the slot or list
+	UINT64             Expires;  // Tick when the entry expires
+};
+
+//----------------------------------------------------------------------------
+struct TIMER_WHEEL {
+	UINT64             Tick;   // Next tick to process
+	UINT32             Count;  // Number of scheduled entries
+	TIMER_WHEEL_ENTRY  Slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // List heads for the slots
+};
+
+//----------------------------------------------------------------------------
+/// @brief Initializes a list of timer wheel entries
+///
+/// @param head  Head of the list
+static inline void InitTimerWheelList(__in TIMER_WHEEL_ENTRY *head)
+{
+	head->Next    = head;
+	head->Prev    = head;
+	head->Expires = 0;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Adds an entry to the end of a list of timer wheel entries
+///
+/// @param head   Head of the list
+/// @param entry  Entry to add
+static inline void TimerWheelListAdd(
+	__in TIMER_WHEEL_ENTRY *head,
+	__in TIMER_WHEEL_ENTRY *entry)
+{
+	entry->Next      = head;
+	entry->Prev      = head->Prev;
+	head->Prev->Next = entry;
+	head->Prev       = entry;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Removes an entry from whatever list it is in
+///
+/// Does nothing if the entry isn't in a list
+///
+/// @param entry  Entry to remove
+///
+/// @returns True if the entry was in a list; false otherwise
+static inline bool TimerWheelListRemove(__in TIMER_WHEEL_ENTRY *entry)
+{
+	if (!entry->Next) {
+		return false;
+	}
+	entry->Prev->Next = entry->Next;
+	entry->Next->Prev = entry->Prev;
+	entry->Next       = NULL;
+	entry->Prev       = NULL;
+	return true;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Removes the first entry from a list of timer wheel entries
+///
+/// @param head  Head of the list
+///
+/// @returns The entry if successful; NULL if the list is empty
+static inline TIMER_WHEEL_ENTRY* TimerWheelListRemoveHead(
+	__in TIMER_WHEEL_ENTRY *head)
+{
+	TIMER_WHEEL_ENTRY *entry = head->Next;
+	if (entry == head) {
+		return NULL;
+	}
+	TimerWheelListRemove(entry);
+	return entry;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Moves all of the entries from one list to the end of another
+///
+/// @param head  Head of the list to add the entries to
+/// @param from  Head of the list to take the entries from
+///
+/// @returns Number of entries moved
+static inline UINT32 TimerWheelListSplice(
+	__in TIMER_WHEEL_ENTRY *head,
+	__in TIMER_WHEEL_ENTRY *from)
+{
+	UINT32 count = 0;
+
+	if (from->Next == from) {
+		return 0;
+	}
+	for (TIMER_WHEEL_ENTRY *entry = from->Next; entry != from; entry = entry->Next) {
+		count++;
+	}
+	from->Next->Prev = head->Prev;
+	from->Prev->Next = head;
+	head->Prev->Next = from->Next;
+	head->Prev       = from->Prev;
+	InitTimerWheelList(from);
+	return count;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Initializes the timer wheel
+///
+/// @param wheel  Timer wheel to initialize
+/// @param tick   Current tick
+static inline void InitTimerWheel(
+	__in TIMER_WHEEL  *wheel,
+	__in const UINT64  tick)
+{
+	wheel->Tick  = tick;
+	wheel->Count = 0;
+	for (UINT32 level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		for (UINT32 slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+			InitTimerWheelList(&wheel->Slots[level][slot]);
+		}
+	}
+}
+
+//----------------------------------------------------------------------------
+/// @brief Checks if the timer wheel has any scheduled entries
+///
+/// @param wheel  Timer wheel to check
+///
+/// @returns True if the timer wheel is empty; false otherwise
+static inline bool IsTimerWheelEmpty(__in TIMER_WHEEL *wheel)
+{
+	return (wheel->Count == 0) ? true : false;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Puts an entry in the slot for its expiration time
+///
+/// Entries that have already expired go in the slot for the next tick, and
+/// entries past the end of the wheel's range are clamped to the end of it.
+///
+/// @param wheel  Timer wheel to put entry in
+/// @param entry  Entry to put in the timer wheel
+static inline void PlaceTimerWheelEntry(
+	__in TIMER_WHEEL       *wheel,
+	__in TIMER_WHEEL_ENTRY *entry)
+{
+	UINT32 level;
+	UINT64 delta;
+
+	if (entry->Expires < wheel->Tick) {
+		entry->Expires = wheel->Tick;
+	}
+	delta = entry->Expires - wheel->Tick;
+	if (delta >= TIMER_WHEEL_RANGE) {
+		entry->Expires = wheel->Tick + TIMER_WHEEL_RANGE - 1;
+		delta          = TIMER_WHEEL_RANGE - 1;
+	}
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if (delta < (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+			break;
+		}
+	}
+	TimerWheelListAdd(&wheel->Slots[level][static_cast<UINT32>(
+			(entry->Expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK)],
+			entry);
+}
+
+//----------------------------------------------------------------------------
+/// @brief Moves the entries in the current slot of a level down to lower levels
+///
+/// @param wheel  Timer wheel to cascade
+/// @param level  Level to cascade entries from (must be at least 1)
+///
+/// @returns Index of the slot that was cascaded
+static inline UINT32 CascadeTimerWheel(
+	__in TIMER_WHEEL  *wheel,
+	__in const UINT32  level)
+{
+	TIMER_WHEEL_ENTRY  listHead;
+	TIMER_WHEEL_ENTRY *entry;
+	const UINT32       slot = static_cast<UINT32>(
+			(wheel->Tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+
+	InitTimerWheelList(&listHead);
+	TimerWheelListSplice(&listHead, &wheel->Slots[level][slot]);
+	while ((entry = TimerWheelListRemoveHead(&listHead)) != NULL) {
+		PlaceTimerWheelEntry(wheel, entry);
+	}
+	return slot;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Schedules an entry to expire
+///
+/// If the wheel is empty, it skips ahead to the current tick first, so an
+/// idle wheel never has to step through the ticks it missed.
+///
+/// @param wheel    Timer wheel to schedule entry in
+/// @param entry    Entry to schedule (must not already be scheduled)
+/// @param tick     Current tick
+/// @param expires  Tick when the entry expires
+static inline void TimerWheelInsert(
+	__in TIMER_WHEEL       *wheel,
+	__in TIMER_WHEEL_ENTRY *entry,
+	__in const UINT64       tick,
+	__in const UINT64       expires)
+{
+	if (!wheel->Count && (tick > wheel->Tick)) {
+		wheel->Tick = tick;
+	}
+	entry->Expires = expires;
+	PlaceTimerWheelEntry(wheel, entry);
+	wheel->Count++;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Cancels a scheduled entry
+///
+/// @param wheel  Timer wheel the entry is scheduled in
+/// @param entry  Entry to cancel
+static inline void TimerWheelRemove(
+	__in TIMER_WHEEL       *wheel,
+	__in TIMER_WHEEL_ENTRY *entry)
+{
+	if (TimerWheelListRemove(entry)) {
+		wheel->Count--;
+	}
+}
+
+//----------------------------------------------------------------------------
+/// @brief Advances the timer wheel and collects the entries that expired
+///
+/// @param wheel    Timer wheel to advance
+/// @param tick     Current tick
+/// @param expired  Head of a list to add expired entries to
+///
+/// @returns Number of entries that expired
+static inline UINT32 TimerWheelAdvance(
+	__in TIMER_WHEEL       *wheel,
+	__in const UINT64       tick,
+	__in TIMER_WHEEL_ENTRY *expired)
+{
+	UINT32 count = 0;
+
+	while (wheel->Count && (wheel->Tick <= tick)) {
+		const UINT32 slot = static_cast<UINT32>(wheel->Tick & TIMER_WHEEL_MASK);
+
+		// Cascade entries from each level whose lower levels just wrapped
+		if (!slot) {
+			for (UINT32 level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+				if (CascadeTimerWheel(wheel, level)) {
+					break;
+				}
+			}
+		}
+
+		const UINT32 numExpired = TimerWheelListSplice(expired,
+				&wheel->Slots[0][slot]);
+		wheel->Count -= numExpired;
+		count        += numExpired;
+		wheel->Tick++;
+	}
+
+	// Nothing is left to expire, so skip any remaining ticks
+	if (wheel->Tick <= tick) {
+		wheel->Tick = tick + 1;
+	}
+	return count;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Removes all of the scheduled entries without waiting for them to expire
+///
+/// @param wheel    Timer wheel to empty
+/// @param entries  Head of a list to add the entries to
+///
+/// @returns Number of entries removed
+static inline UINT32 TimerWheelRemoveAll(
+	__in TIMER_WHEEL       *wheel,
+	__in TIMER_WHEEL_ENTRY *entries)
+{
+	UINT32 count = 0;
+
+	for (UINT32 level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		for (UINT32 slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+			count += TimerWheelListSplice(entries, &wheel->Slots[level][slot]);
+		}
+	}
+	wheel->Count = 0;
+	return count;
+}
+
+#endif  // TIMER_WHEEL_H
@@ -0,0 +1,283 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility PCAP-NG block cache
+//
+// Tracks the blocks for running processes and open connections so that the
+// utility can start a new log file without asking the driver to send its
+// initial blocks again.  Entries live in an open addressing hash table keyed
+// by block type and ID.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <Windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block_cache.h"
+#include "../pcap_ng.h"
+
+//--------------------------------------------------------------------------
+// Defines
+//--------------------------------------------------------------------------
+
+#define BLOCK_CACHE_MIN_BITS  8  // Log2 of the initial number of hash table entries
+
+//--------------------------------------------------------------------------
+static inline UINT32 HashBlock(const BLOCK_CACHE *cache, const UINT32 blockType,
+		const UINT32 id)
+{
+	// Mix the block type in before multiplying, and take the slot from the
+	// top bits of the product, since process IDs are multiples of 4 and the
+	// low bits would leave most slots unused
+	return ((id ^ (blockType << 16)) * 2654435761U) >> (32 - cache->Bits);
+}
+
+//--------------------------------------------------------------------------
+void CleanupBlockCache(BLOCK_CACHE *cache)
+{
+	UINT32 index;
+
+	if (cache->Entries) {
+		for (index = 0; index < cache->Capacity; index++) {
+			free(cache->Entries[index].Data);
+		}
+		free(cache->Entries);
+	}
+	free(cache->SectionHeader);
+	free(cache->Interfaces);
+	ZeroMemory(cache, sizeof(BLOCK_CACHE));
+}
+
+//--------------------------------------------------------------------------
+int __cdecl CompareCachedBlocks(const void *left, const void *right)
+{
+	const CACHED_BLOCK *leftBlock  = *reinterpret_cast<CACHED_BLOCK* const*>(left);
+	const CACHED_BLOCK *rightBlock = *reinterpret_cast<CACHED_BLOCK* const*>(right);
+
+	if (leftBlock->Sequence < rightBlock->Sequence) {
+		return -1;
+	}
+	return (leftBlock->Sequence > rightBlock->Sequence) ? 1 : 0;
+}
+
+//--------------------------------------------------------------------------
+CACHED_BLOCK* FindCachedBlock(BLOCK_CACHE *cache, const UINT32 blockType,
+		const UINT32 id)
+{
+	const UINT32 mask  = cache->Capacity - 1;
+	UINT32       index = HashBlock(cache, blockType, id);
+
+	// Returns the matching entry or the empty entry where it belongs
+	for (;;) {
+		CACHED_BLOCK *entry = cache->Entries + index;
+		if (!entry->Data || ((entry->BlockType == blockType) && (entry->Id == id))) {
+			return entry;
+		}
+		index = (index + 1) & mask;
+	}
+}
+
+//--------------------------------------------------------------------------
+UINT8* GetCachedBlocks(BLOCK_CACHE *cache, UINT32 *length)
+{
+	UINT8         *buffer;
+	UINT32         count  = 0;
+	UINT32         index;
+	UINT32         offset;
+	CACHED_BLOCK **sorted = NULL;
+
+	*length = cache->SectionHeaderLength + cache->InterfacesLength;
+	if (cache->Count) {
+		sorted = reinterpret_cast<CACHED_BLOCK**>(
+				malloc(cache->Count * sizeof(CACHED_BLOCK*)));
+		if (!sorted) {
+			return NULL;
+		}
+		for (index = 0; index < cache->Capacity; index++) {
+			if (cache->Entries[index].Data) {
+				sorted[count++] = cache->Entries + index;
+				*length += cache->Entries[index].Length;
+			}
+		}
+		qsort(sorted, count, sizeof(CACHED_BLOCK*), CompareCachedBlocks);
+	}
+
+	buffer = reinterpret_cast<UINT8*>(malloc(*length ? *length : 1));
+	if (buffer) {
+		offset = 0;
+		if (cache->SectionHeader) {
+			memcpy(buffer, cache->SectionHeader, cache->SectionHeaderLength);
+			offset += cache->SectionHeaderLength;
+		}
+		if (cache->Interfaces) {
+			memcpy(buffer + offset, cache->Interfaces, cache->InterfacesLength);
+			offset += cache->InterfacesLength;
+		}
+		for (index = 0; index < count; index++) {
+			memcpy(buffer + offset, sorted[index]->Data, sorted[index]->Length);
+			offset += sorted[index]->Length;
+		}
+	}
+	free(sorted);
+	return buffer;
+}
+
+//--------------------------------------------------------------------------
+bool GrowBlockCache(BLOCK_CACHE *cache)
+{
+	const UINT32  oldCapacity = cache->Capacity;
+	const UINT32  oldBits     = cache->Bits;
+	CACHED_BLOCK *oldEntries  = cache->Entries;
+	UINT32        index;
+
+	cache->Bits     = oldCapacity ? oldBits + 1 : BLOCK_CACHE_MIN_BITS;
+	cache->Capacity = 1U << cache->Bits;
+	cache->Entries  = reinterpret_cast<CACHED_BLOCK*>(
+			calloc(cache->Capacity, sizeof(CACHED_BLOCK)));
+	if (!cache->Entries) {
+		cache->Capacity = oldCapacity;
+		cache->Bits     = oldBits;
+		cache->Entries  = oldEntries;
+		return false;
+	}
+	for (index = 0; index < oldCapacity; index++) {
+		if (oldEntries[index].Data) {
+			*FindCachedBlock(cache, oldEntries[index].BlockType,
+					oldEntries[index].Id) = oldEntries[index];
+		}
+	}
+	free(oldEntries);
+	return true;
+}
+
+//--------------------------------------------------------------------------
+void RemoveCachedBlock(BLOCK_CACHE *cache, CACHED_BLOCK *entry)
+{
+	const UINT32 mask  = cache->Capacity - 1;
+	UINT32       hole  = static_cast<UINT32>(entry - cache->Entries);
+	UINT32       index = hole;
+
+	free(entry->Data);
+	entry->Data = NULL;
+	cache->Count--;
+
+	// Shift later entries in the probe sequence back into the hole so that
+	// lookups don't stop early
+	for (;;) {
+		index = (index + 1) & mask;
+		CACHED_BLOCK *next = cache->Entries + index;
+		if (!next->Data) {
+			break;
+		}
+		const UINT32 home = HashBlock(cache, next->BlockType, next->Id);
+		if (((index - home) & mask) >= ((index - hole) & mask)) {
+			cache->Entries[hole] = *next;
+			next->Data = NULL;
+			hole = index;
+		}
+	}
+}
+
+//--------------------------------------------------------------------------
+bool UpdateBlockCache(BLOCK_CACHE *cache, const UINT8 *block,
+		const UINT32 length)
+{
+	UINT32 blockType;
+	UINT32 eventOffset;
+	UINT32 id;
+	UINT8 *copy;
+
+	if (length < 3 * sizeof(UINT32)) {
+		return true;
+	}
+	memcpy(&blockType, block, sizeof(blockType));
+
+	switch (blockType) {
+	case SectionHeaderBlock:
+		// The driver sends all of its initial blocks after a new section header
+		CleanupBlockCache(cache);
+		cache->SectionHeader = reinterpret_cast<UINT8*>(malloc(length));
+		if (!cache->SectionHeader) {
+			return false;
+		}
+		memcpy(cache->SectionHeader, block, length);
+		cache->SectionHeaderLength = length;
+		return true;
+	case InterfaceDescriptionBlock:
+		copy = reinterpret_cast<UINT8*>(realloc(cache->Interfaces,
+				cache->InterfacesLength + length));
+		if (!copy) {
+			return false;
+		}
+		memcpy(copy + cache->InterfacesLength, block, length);
+		cache->Interfaces        = copy;
+		cache->InterfacesLength += length;
+		return true;
+	case ProcessBlock:
+		eventOffset = sizeof(PCAP_NG_PROCESS_HEADER);
+		break;
+	case ConnectionBlock:
+		eventOffset = sizeof(PCAP_NG_CONNECTION_HEADER);
+		break;
+	default:
+		return true;
+	}
+
+	// Both block types have the ID right after the block length, and any event
+	// option right after the header
+	if (length < eventOffset + sizeof(UINT32)) {
+		return true;
+	}
+	memcpy(&id, block + 2 * sizeof(UINT32), sizeof(id));
+	if (eventOffset + sizeof(PCAP_NG_OPTION_HEADER) + sizeof(UINT32) +
+			sizeof(UINT32) <= length) {
+		PCAP_NG_OPTION_HEADER option;
+		UINT32                event;
+		memcpy(&option, block + eventOffset, sizeof(option));
+		memcpy(&event, block + eventOffset + sizeof(option), sizeof(event));
+		if ((option.OptionCode == PCAP_NG_EVENT_OPTION) &&
+				(event == PCAP_NG_ENDED_EVENT)) {
+			if (cache->Count) {
+				CACHED_BLOCK *entry = FindCachedBlock(cache, blockType, id);
+				if (entry->Data) {
+					RemoveCachedBlock(cache, entry);
+				}
+			}
+			return true;
+		}
+	}
+
+	// Keep the table at most half full
+	if ((cache->Count + 1) * 2 > cache->Capacity) {
+		if (!GrowBlockCache(cache)) {
+			return false;
+		}
+	}
+	copy = reinterpret_cast<UINT8*>(malloc(length));
+	if (!copy) {
+		return false;
+	}
+	memcpy(copy, block, length);
+
+	CACHED_BLOCK *entry = FindCachedBlock(cache, blockType, id);
+	if (entry->Data) {
+		free(entry->Data);
+	} else {
+		cache->Count++;
+	}
+	entry->Data      = copy;
+	entry->Length    = length;
+	entry->BlockType = blockType;
+	entry->Id        = id;
+	entry->Sequence  = cache->NextSequence++;
+	return true;
+}
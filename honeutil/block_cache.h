@@ -0,0 +1,75 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility PCAP-NG block cache
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+struct CACHED_BLOCK {
+	UINT8  *Data;       // Copy of the block (NULL if entry is empty)
+	UINT32  Length;     // Block length in bytes
+	UINT32  BlockType;  // ProcessBlock or ConnectionBlock
+	UINT32  Id;         // Process or connection ID
+	UINT64  Sequence;   // Order the block arrived in
+};
+
+struct BLOCK_CACHE {
+	UINT8         *SectionHeader;        // Latest section header block (NULL if none)
+	UINT32         SectionHeaderLength;  // Section header block length in bytes
+	UINT8         *Interfaces;           // Interface description blocks for the section
+	UINT32         InterfacesLength;     // Total interface description block length
+	CACHED_BLOCK  *Entries;              // Hash table of running processes and open connections
+	UINT32         Capacity;             // Number of entries (a power of 2)
+	UINT32         Bits;                 // Log2 of the number of entries
+	UINT32         Count;                // Number of entries in use
+	UINT64         NextSequence;         // Sequence number for the next block
+};
+
+//----------------------------------------------------------------------------
+/// @brief Frees all blocks held by the cache
+///
+/// @param cache  Cache to clean up
+void CleanupBlockCache(BLOCK_CACHE *cache);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the blocks that describe the current state of the system
+///
+/// Returns the section header and interface description blocks, followed by
+/// the blocks for running processes and open connections in the order they
+/// arrived.  Writing these blocks at the start of a file makes the file
+/// self-contained, like the initial blocks the driver sends to a new reader.
+///
+/// @param cache   Cache to get blocks from
+/// @param length  Receives the total length of the blocks in bytes
+///
+/// @returns Buffer holding the blocks, which the caller must free; NULL if
+///          there is not enough memory
+UINT8* GetCachedBlocks(BLOCK_CACHE *cache, UINT32 *length);
+
+//----------------------------------------------------------------------------
+/// @brief Updates the cache with a block from the driver
+///
+/// A section header block starts a new section and clears the cache.
+/// Process and connection blocks add or remove entries, depending on whether
+/// they are start or end events.  Other blocks are ignored.
+///
+/// @param cache   Cache to update
+/// @param block   Complete PCAP-NG block
+/// @param length  Block length in bytes
+///
+/// @returns True if successful; false if there is not enough memory
+bool UpdateBlockCache(BLOCK_CACHE *cache, const UINT8 *block,
+		const UINT32 length);
+
+#endif // BLOCK_CACHE_H
@@ -0,0 +1,162 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility capture index
+//
+// Builds the index files that let the query command find the blocks for a
+// process, connection, or time range without scanning the whole log.  The
+// log writer collects an entry for each process, connection, and packet
+// block as it writes them, and writes the sorted entries next to the log when
+// it closes the log.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../pcap_ng.h"
+#include "capture_index.h"
+#include "common.h"
+#include "log_writer.h"
+
+//--------------------------------------------------------------------------
+// Defines
+//--------------------------------------------------------------------------
+
+#define CAPTURE_INDEX_WRITE_COUNT  0x10000  // Entries to write at a time
+
+//--------------------------------------------------------------------------
+int __cdecl CompareCaptureIndexEntries(const void *left, const void *right)
+{
+	const CAPTURE_INDEX_ENTRY *leftEntry  =
+			reinterpret_cast<const CAPTURE_INDEX_ENTRY*>(left);
+	const CAPTURE_INDEX_ENTRY *rightEntry =
+			reinterpret_cast<const CAPTURE_INDEX_ENTRY*>(right);
+
+	if (leftEntry->ProcessId != rightEntry->ProcessId) {
+		return (leftEntry->ProcessId < rightEntry->ProcessId) ? -1 : 1;
+	}
+	if (leftEntry->Timestamp != rightEntry->Timestamp) {
+		return (leftEntry->Timestamp < rightEntry->Timestamp) ? -1 : 1;
+	}
+	if (leftEntry->Offset != rightEntry->Offset) {
+		return (leftEntry->Offset < rightEntry->Offset) ? -1 : 1;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------------
+bool GetCaptureIndexEntry(const UINT8 *block, const UINT32 length,
+		const UINT64 offset, CAPTURE_INDEX_ENTRY *entry)
+{
+	PCAP_NG_CONNECTION_HEADER connection;
+	PCAP_NG_PACKET_FOOTER     footer;
+	PCAP_NG_PACKET_HEADER     packet;
+	PCAP_NG_PROCESS_HEADER    process;
+
+	entry->Offset      = offset;
+	entry->BlockLength = length;
+	memcpy(&entry->BlockType, block, sizeof(entry->BlockType));
+
+	switch (entry->BlockType) {
+	case PacketBlock:
+		// The driver always ends packet blocks with the Hone options
+		if (length < sizeof(packet) + sizeof(footer)) {
+			return false;
+		}
+		memcpy(&packet, block, sizeof(packet));
+		memcpy(&footer, block + length - sizeof(footer), sizeof(footer));
+		if ((footer.ConnectionIdHeader.OptionCode != 257) ||
+				(footer.ProcessIdHeader.OptionCode != 258)) {
+			return false;
+		}
+		entry->Timestamp    = (static_cast<UINT64>(packet.TimestampHigh) << 32) |
+				packet.TimestampLow;
+		entry->ProcessId    = footer.ProcessId;
+		entry->ConnectionId = footer.ConnectionId;
+		return true;
+	case ProcessBlock:
+		if (length < sizeof(process)) {
+			return false;
+		}
+		memcpy(&process, block, sizeof(process));
+		entry->Timestamp    = (static_cast<UINT64>(process.TimestampHigh) << 32) |
+				process.TimestampLow;
+		entry->ProcessId    = process.ProcessId;
+		entry->ConnectionId = CAPTURE_INDEX_NO_ID;
+		return true;
+	case ConnectionBlock:
+		if (length < sizeof(connection)) {
+			return false;
+		}
+		memcpy(&connection, block, sizeof(connection));
+		entry->Timestamp    = (static_cast<UINT64>(connection.TimestampHigh) << 32) |
+				connection.TimestampLow;
+		entry->ProcessId    = connection.ProcessId;
+		entry->ConnectionId = connection.ConnectionId;
+		return true;
+	default:
+		return false;
+	}
+}
+
+//--------------------------------------------------------------------------
+void GetCaptureIndexName(const char *logFile, char *indexFile,
+		const size_t len)
+{
+	size_t length = strlen(logFile);
+
+	if ((length > 4) && (_stricmp(logFile + length - 4, ".lz4") == 0)) {
+		length -= 4;
+	}
+	_snprintf_s(indexFile, len, len, "%.*s.idx", static_cast<int>(length),
+			logFile);
+}
+
+//--------------------------------------------------------------------------
+bool WriteCaptureIndex(const char *logFile, CAPTURE_INDEX_ENTRY *entries,
+		const UINT64 numEntries)
+{
+	CAPTURE_INDEX_HEADER header;
+	HANDLE               index;
+	char                 indexFile[MAX_PATH];
+	UINT64               offset;
+	bool                 rc = true;
+
+	GetCaptureIndexName(logFile, indexFile, sizeof(indexFile));
+	index = CreateFile(indexFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, 0);
+	if (index == INVALID_HANDLE_VALUE) {
+		LogError("Cannot open index file %s", indexFile);
+		return false;
+	}
+
+	qsort(entries, static_cast<size_t>(numEntries), sizeof(CAPTURE_INDEX_ENTRY),
+			CompareCaptureIndexEntries);
+
+	header.Magic      = CAPTURE_INDEX_MAGIC;
+	header.Version    = CAPTURE_INDEX_VERSION;
+	header.NumEntries = numEntries;
+	if (!WriteLog(index, indexFile, &header, sizeof(header))) {
+		rc = false;
+	}
+	for (offset = 0; rc && (offset < numEntries);
+			offset += CAPTURE_INDEX_WRITE_COUNT) {
+		const UINT64 count = min(numEntries - offset, CAPTURE_INDEX_WRITE_COUNT);
+		if (!WriteLog(index, indexFile, entries + offset,
+				static_cast<DWORD>(count * sizeof(CAPTURE_INDEX_ENTRY)))) {
+			rc = false;
+		}
+	}
+	CloseHandle(index);
+	return rc;
+}
@@ -0,0 +1,84 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility capture index
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef CAPTURE_INDEX_H
+#define CAPTURE_INDEX_H
+
+//----------------------------------------------------------------------------
+// Defines
+//----------------------------------------------------------------------------
+
+#define CAPTURE_INDEX_MAGIC    0x58444948  // "HIDX"
+#define CAPTURE_INDEX_VERSION  1           // Index file format version
+#define CAPTURE_INDEX_NO_ID    0xFFFFFFFF  // Block has no process or connection ID
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+// An index file is a header followed by the entries sorted by process ID,
+// then timestamp, then offset.  All fields are little endian, and every
+// field is naturally aligned so the file can be used straight from a mapping.
+struct CAPTURE_INDEX_HEADER {
+	UINT32 Magic;       // CAPTURE_INDEX_MAGIC
+	UINT32 Version;     // CAPTURE_INDEX_VERSION
+	UINT64 NumEntries;  // Number of entries after the header
+};
+
+struct CAPTURE_INDEX_ENTRY {
+	UINT64 Offset;        // Offset of block in uncompressed log
+	UINT64 Timestamp;     // Block timestamp in microseconds since 1970
+	UINT32 ProcessId;     // Process ID
+	UINT32 ConnectionId;  // Connection ID (CAPTURE_INDEX_NO_ID for process blocks)
+	UINT32 BlockType;     // PacketBlock, ProcessBlock, or ConnectionBlock
+	UINT32 BlockLength;   // Block length in bytes
+};
+
+//----------------------------------------------------------------------------
+/// @brief Gets the index entry for a PCAP-NG block
+///
+/// Packet blocks take their IDs from the Hone packet options, and process and
+/// connection blocks take them from their headers.  Other blocks are not
+/// indexed.
+///
+/// @param block   Complete PCAP-NG block
+/// @param length  Block length in bytes
+/// @param offset  Offset of block in uncompressed log
+/// @param entry   Receives the index entry
+///
+/// @returns True if the block should be indexed; false otherwise
+bool GetCaptureIndexEntry(const UINT8 *block, const UINT32 length,
+		const UINT64 offset, CAPTURE_INDEX_ENTRY *entry);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the name of the index file for a log file
+///
+/// The index always describes the uncompressed log, so a compressed log's
+/// .lz4 extension is dropped before adding the .idx extension.
+///
+/// @param logFile    Log file name
+/// @param indexFile  Receives the index file name
+/// @param len        Size of indexFile, in bytes
+void GetCaptureIndexName(const char *logFile, char *indexFile,
+		const size_t len);
+
+//----------------------------------------------------------------------------
+/// @brief Sorts index entries and writes them to an index file
+///
+/// @param logFile     Log file the entries describe
+/// @param entries     Index entries, which are sorted in place
+/// @param numEntries  Number of entries
+///
+/// @returns True if successful; false otherwise
+bool WriteCaptureIndex(const char *logFile, CAPTURE_INDEX_ENTRY *entries,
+		const UINT64 numEntries);
+
+#endif // CAPTURE_INDEX_H
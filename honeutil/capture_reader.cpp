@@ -0,0 +1,339 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility capture reader
+//
+// Reads PCAP-NG blocks from an uncompressed log through a file mapping and
+// hands out pointers into the mapping instead of copying each block.  The
+// reader maps one view of the log at a time and moves the view forward when
+// the next block doesn't fit in it, so that even a 32-bit build can read logs
+// that are larger than its address space.  Views start on allocation
+// granularity boundaries, as MapViewOfFile requires.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <Windows.h>
+#include <stdio.h>
+
+#include "capture_reader.h"
+#include "common.h"
+
+//--------------------------------------------------------------------------
+// Function prototypes
+//--------------------------------------------------------------------------
+
+bool IsCaptureBlockAt(CAPTURE_FILE *capture, const UINT64 offset,
+		UINT32 *length);
+bool MapCaptureView(CAPTURE_FILE *capture, const UINT64 offset,
+		const UINT32 length);
+
+//--------------------------------------------------------------------------
+void CloseCaptureFile(CAPTURE_FILE *capture)
+{
+	if (capture->View != NULL) {
+		UnmapViewOfFile(capture->View);
+		capture->View = NULL;
+	}
+	if (capture->Mapping != NULL) {
+		CloseHandle(capture->Mapping);
+		capture->Mapping = NULL;
+	}
+	if (capture->File != INVALID_HANDLE_VALUE) {
+		CloseHandle(capture->File);
+		capture->File = INVALID_HANDLE_VALUE;
+	}
+}
+
+//--------------------------------------------------------------------------
+bool FindCaptureBlock(CAPTURE_FILE *capture, const UINT64 start,
+		const UINT64 end, UINT64 *offset)
+{
+	UINT64 candidate;
+	UINT32 length;
+	UINT32 nextLength;
+
+	// Blocks are 32-bit aligned, so only aligned offsets can start one
+	for (candidate = PCAP_NG_PADDING(start); candidate < end;
+			candidate += sizeof(UINT32)) {
+		if (!IsCaptureBlockAt(capture, candidate, &length)) {
+			continue;
+		}
+
+		// Packet data can look like one block by chance, but it is very
+		// unlikely to also look like the block that follows it
+		if ((length == capture->Size - candidate) ||
+				IsCaptureBlockAt(capture, candidate + length, &nextLength)) {
+			*offset = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+//--------------------------------------------------------------------------
+const PCAP_NG_CONNECTION_HEADER* GetCaptureConnection(
+		const CAPTURE_BLOCK *block)
+{
+	if ((block->BlockType != ConnectionBlock) ||
+			(block->BlockLength <
+			sizeof(PCAP_NG_CONNECTION_HEADER) + sizeof(UINT32))) {
+		return NULL;
+	}
+	return reinterpret_cast<const PCAP_NG_CONNECTION_HEADER*>(block->Data);
+}
+
+//--------------------------------------------------------------------------
+bool GetCapturePacket(const CAPTURE_BLOCK *block, CAPTURE_PACKET *packet)
+{
+	const PCAP_NG_PACKET_HEADER *header;
+	UINT32                       offset;
+	UINT32                       optionsEnd;
+
+	if ((block->BlockType != PacketBlock) ||
+			(block->BlockLength <
+			sizeof(PCAP_NG_PACKET_HEADER) + sizeof(UINT32))) {
+		return false;
+	}
+	header     = reinterpret_cast<const PCAP_NG_PACKET_HEADER*>(block->Data);
+	optionsEnd = block->BlockLength - sizeof(UINT32);
+	if (header->CapturedLength > optionsEnd - sizeof(PCAP_NG_PACKET_HEADER)) {
+		return false;
+	}
+
+	packet->Header       = header;
+	packet->Data         = block->Data + sizeof(PCAP_NG_PACKET_HEADER);
+	packet->Timestamp    = (static_cast<UINT64>(header->TimestampHigh) << 32) |
+			header->TimestampLow;
+	packet->ProcessId    = CAPTURE_NO_ID;
+	packet->ConnectionId = CAPTURE_NO_ID;
+	packet->Flags        = 0;
+
+	// Look for the Hone options instead of assuming where they are
+	offset = sizeof(PCAP_NG_PACKET_HEADER) +
+			PCAP_NG_PADDING(header->CapturedLength);
+	while (offset + sizeof(PCAP_NG_OPTION_HEADER) <= optionsEnd) {
+		const PCAP_NG_OPTION_HEADER *option =
+				reinterpret_cast<const PCAP_NG_OPTION_HEADER*>(block->Data + offset);
+		const UINT32 optionLength = PCAP_NG_PADDING(option->OptionLength);
+		offset += sizeof(PCAP_NG_OPTION_HEADER);
+		if ((option->OptionCode == 0) || (optionLength > optionsEnd - offset)) {
+			break;
+		}
+		if (option->OptionLength == sizeof(UINT32)) {
+			const UINT32 value =
+					*reinterpret_cast<const UINT32*>(block->Data + offset);
+			switch (option->OptionCode) {
+			case 2:
+				packet->Flags = value;
+				break;
+			case 257:
+				packet->ConnectionId = value;
+				break;
+			case 258:
+				packet->ProcessId = value;
+				break;
+			}
+		}
+		offset += optionLength;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------
+const PCAP_NG_PROCESS_HEADER* GetCaptureProcess(const CAPTURE_BLOCK *block)
+{
+	if ((block->BlockType != ProcessBlock) ||
+			(block->BlockLength <
+			sizeof(PCAP_NG_PROCESS_HEADER) + sizeof(UINT32))) {
+		return NULL;
+	}
+	return reinterpret_cast<const PCAP_NG_PROCESS_HEADER*>(block->Data);
+}
+
+//--------------------------------------------------------------------------
+bool IsCaptureBlockAt(CAPTURE_FILE *capture, const UINT64 offset,
+		UINT32 *length)
+{
+	const UINT32 *header;
+
+	if ((offset >= capture->Size) ||
+			(capture->Size - offset < 3 * sizeof(UINT32)) ||
+			!MapCaptureView(capture, offset, 2 * sizeof(UINT32))) {
+		return false;
+	}
+	header = reinterpret_cast<const UINT32*>(capture->View +
+			(offset - capture->ViewOffset));
+	switch (header[0]) {
+	case ConnectionBlock:
+	case InterfaceDescriptionBlock:
+	case PacketBlock:
+	case ProcessBlock:
+	case SectionHeaderBlock:
+		break;
+	default:
+		return false;
+	}
+	*length = header[1];
+	if ((*length < 3 * sizeof(UINT32)) || (*length & 3) ||
+			(*length > capture->Size - offset)) {
+		return false;
+	}
+
+	// Blocks repeat their length at the end
+	if (!MapCaptureView(capture, offset + *length - sizeof(UINT32),
+			sizeof(UINT32))) {
+		return false;
+	}
+	return (*reinterpret_cast<const UINT32*>(capture->View +
+			(offset + *length - sizeof(UINT32) - capture->ViewOffset)) ==
+			*length) ? true : false;
+}
+
+//--------------------------------------------------------------------------
+bool MapCaptureView(CAPTURE_FILE *capture, const UINT64 offset,
+		const UINT32 length)
+{
+	UINT64 start;
+	UINT64 viewLength;
+
+	// Keep the current view if it already holds the whole range
+	if ((capture->View != NULL) && (offset >= capture->ViewOffset) &&
+			(offset + length <= capture->ViewOffset + capture->ViewLength)) {
+		return true;
+	}
+	if (capture->View != NULL) {
+		UnmapViewOfFile(capture->View);
+		capture->View = NULL;
+	}
+
+	start      = offset - (offset % capture->Granularity);
+	viewLength = offset + length - start;
+	if (viewLength < capture->ViewSize) {
+		viewLength = capture->ViewSize;
+	}
+	if (viewLength > capture->Size - start) {
+		viewLength = capture->Size - start;
+	}
+	if (viewLength > MAXDWORD) {
+		printf("Cannot map %I64u bytes at offset %I64u\n", viewLength, start);
+		return false;
+	}
+
+	capture->View = reinterpret_cast<const UINT8*>(MapViewOfFile(
+			capture->Mapping, FILE_MAP_READ, static_cast<DWORD>(start >> 32),
+			static_cast<DWORD>(start), static_cast<SIZE_T>(viewLength)));
+	if (capture->View == NULL) {
+		LogError("Cannot map %I64u bytes at offset %I64u", viewLength, start);
+		return false;
+	}
+	capture->ViewOffset = start;
+	capture->ViewLength = static_cast<UINT32>(viewLength);
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool OpenCaptureFile(CAPTURE_FILE *capture, const char *fileName)
+{
+	LARGE_INTEGER size;
+	SYSTEM_INFO   systemInfo;
+
+	ZeroMemory(capture, sizeof(CAPTURE_FILE));
+	capture->File = INVALID_HANDLE_VALUE;
+	GetSystemInfo(&systemInfo);
+	capture->Granularity = systemInfo.dwAllocationGranularity;
+	capture->ViewSize    = CAPTURE_VIEW_SIZE;
+
+	capture->File = CreateFile(fileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (capture->File == INVALID_HANDLE_VALUE) {
+		LogError("Cannot open %s", fileName);
+		return false;
+	}
+	if (!GetFileSizeEx(capture->File, &size)) {
+		LogError("Cannot get size of %s", fileName);
+		CloseCaptureFile(capture);
+		return false;
+	}
+	capture->Size = static_cast<UINT64>(size.QuadPart);
+
+	// Empty files cannot be mapped, but they don't have any blocks anyway
+	if (capture->Size) {
+		capture->Mapping = CreateFileMapping(capture->File, NULL, PAGE_READONLY,
+				0, 0, NULL);
+		if (capture->Mapping == NULL) {
+			LogError("Cannot map %s", fileName);
+			CloseCaptureFile(capture);
+			return false;
+		}
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool ReadCaptureBlock(CAPTURE_FILE *capture, CAPTURE_BLOCK *block)
+{
+	const UINT32 *header;
+	UINT32        length;
+
+	if (capture->Failed) {
+		return false;
+	}
+	if ((capture->Offset >= capture->Size) ||
+			(capture->Size - capture->Offset < 3 * sizeof(UINT32))) {
+		if (capture->Offset != capture->Size) {
+			printf("Partial block at offset %I64u\n", capture->Offset);
+			capture->Failed = true;
+		}
+		return false;
+	}
+
+	// Check the block length before mapping the whole block
+	if (!MapCaptureView(capture, capture->Offset, 2 * sizeof(UINT32))) {
+		capture->Failed = true;
+		return false;
+	}
+	header = reinterpret_cast<const UINT32*>(capture->View +
+			(capture->Offset - capture->ViewOffset));
+	length = header[1];
+	if ((length < 3 * sizeof(UINT32)) || (length & 3) ||
+			(length > capture->Size - capture->Offset)) {
+		printf("Invalid block length %u at offset %I64u\n", length,
+				capture->Offset);
+		capture->Failed = true;
+		return false;
+	}
+	if (!MapCaptureView(capture, capture->Offset, length)) {
+		capture->Failed = true;
+		return false;
+	}
+
+	// Blocks repeat their length at the end
+	block->Data        = capture->View + (capture->Offset - capture->ViewOffset);
+	block->BlockType   = reinterpret_cast<const UINT32*>(block->Data)[0];
+	block->BlockLength = length;
+	block->Offset      = capture->Offset;
+	if (*reinterpret_cast<const UINT32*>(
+			block->Data + length - sizeof(UINT32)) != length) {
+		printf("Block at offset %I64u has a mismatched trailing length\n",
+				capture->Offset);
+		capture->Failed = true;
+		return false;
+	}
+	capture->Offset += length;
+	return true;
+}
+
+//--------------------------------------------------------------------------
+void SeekCaptureFile(CAPTURE_FILE *capture, const UINT64 offset)
+{
+	capture->Offset = offset;
+	capture->Failed = false;
+}
@@ -0,0 +1,142 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility capture reader
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef CAPTURE_READER_H
+#define CAPTURE_READER_H
+
+#include "../pcap_ng.h"
+
+//----------------------------------------------------------------------------
+// Defines
+//----------------------------------------------------------------------------
+
+#define CAPTURE_NO_ID      0xFFFFFFFF  // Packet has no process or connection option
+#define CAPTURE_VIEW_SIZE  0x4000000   // Default size of each view of the log (64 MB)
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+struct CAPTURE_FILE {
+	HANDLE        File;         // Log file
+	HANDLE        Mapping;      // File mapping for log file
+	UINT64        Size;         // Log file size in bytes
+	UINT32        Granularity;  // Views must start on a multiple of this
+	UINT32        ViewSize;     // Smallest view to map (CAPTURE_VIEW_SIZE unless changed)
+	const UINT8  *View;         // Current view of the log (NULL if none)
+	UINT64        ViewOffset;   // Offset of view in log
+	UINT32        ViewLength;   // Number of bytes in view
+	UINT64        Offset;       // Offset of next block in log
+	bool          Failed;       // Set if reading stopped before the end of the log
+};
+
+struct CAPTURE_BLOCK {
+	const UINT8  *Data;         // Block in current view
+	UINT32        BlockType;    // Block type
+	UINT32        BlockLength;  // Block length in bytes
+	UINT64        Offset;       // Offset of block in log
+};
+
+struct CAPTURE_PACKET {
+	const PCAP_NG_PACKET_HEADER *Header;        // Packet block header
+	const UINT8                 *Data;          // Captured packet data
+	UINT64                       Timestamp;     // Timestamp in microseconds since 1970
+	UINT32                       ProcessId;     // Process ID (option 258, or CAPTURE_NO_ID)
+	UINT32                       ConnectionId;  // Connection ID (option 257, or CAPTURE_NO_ID)
+	UINT32                       Flags;         // Direction flags (option 2, or 0)
+};
+
+//----------------------------------------------------------------------------
+/// @brief Unmaps and closes a log opened with OpenCaptureFile
+///
+/// @param capture  Log to close
+void CloseCaptureFile(CAPTURE_FILE *capture);
+
+//----------------------------------------------------------------------------
+/// @brief Finds the first block that starts in part of a log
+///
+/// Used to start reading in the middle of a log, where the offset of the
+/// nearest block isn't known.  An offset is taken to start a block if it
+/// holds a Hone block type and a length that the end of the block repeats,
+/// and if the block either ends the log or is followed by another block that
+/// passes the same checks.
+///
+/// @param capture  Log to search
+/// @param start    Offset to start searching at
+/// @param end      Offset to stop searching at
+/// @param offset   Receives the offset of the block
+///
+/// @returns True if a block was found; false otherwise
+bool FindCaptureBlock(CAPTURE_FILE *capture, const UINT64 start,
+		const UINT64 end, UINT64 *offset);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the header of a Hone connection block
+///
+/// @param block  Block from ReadCaptureBlock
+///
+/// @returns Pointer to header in the view; NULL if block is not a connection
+///          block
+const PCAP_NG_CONNECTION_HEADER* GetCaptureConnection(
+		const CAPTURE_BLOCK *block);
+
+//----------------------------------------------------------------------------
+/// @brief Decodes a packet block and its Hone options
+///
+/// @param block   Block from ReadCaptureBlock
+/// @param packet  Receives the decoded packet, which points into the view
+///
+/// @returns True if successful; false if block is not a valid packet block
+bool GetCapturePacket(const CAPTURE_BLOCK *block, CAPTURE_PACKET *packet);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the header of a Hone process block
+///
+/// @param block  Block from ReadCaptureBlock
+///
+/// @returns Pointer to header in the view; NULL if block is not a process
+///          block
+const PCAP_NG_PROCESS_HEADER* GetCaptureProcess(const CAPTURE_BLOCK *block);
+
+//----------------------------------------------------------------------------
+/// @brief Opens an uncompressed log for reading through a file mapping
+///
+/// Maps one view of the log at a time, so logs larger than the address
+/// space can still be read.
+///
+/// @param capture   Receives the open log
+/// @param fileName  Log file name
+///
+/// @returns True if successful; false otherwise
+bool OpenCaptureFile(CAPTURE_FILE *capture, const char *fileName);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the next block from a log without copying it
+///
+/// The block points into the current view, which stays valid until the next
+/// call to ReadCaptureBlock or SeekCaptureFile.
+///
+/// @param capture  Log to read from
+/// @param block    Receives the block
+///
+/// @returns True if successful; false at the end of the log, or if the next
+///          block is not valid or cannot be mapped, in which case Failed is
+///          set
+bool ReadCaptureBlock(CAPTURE_FILE *capture, CAPTURE_BLOCK *block);
+
+//----------------------------------------------------------------------------
+/// @brief Sets the offset of the next block to read
+///
+/// @param capture  Log to seek in
+/// @param offset   Offset of a block header
+void SeekCaptureFile(CAPTURE_FILE *capture, const UINT64 offset);
+
+#endif // CAPTURE_READER_H
@@ -64,13 +64,13 @@ void LogError(const UINT32 errorCode, const char *format, ...)
 }
 
 //--------------------------------------------------------------------------
-HANDLE OpenDriver(const bool verbose)
+HANDLE OpenDriver(const bool verbose, const DWORD flags)
 {
 	HANDLE      driver     = INVALID_HANDLE_VALUE;
 	const char *driverFile = "\\\\.\\HoneOut";
 
 	driver = CreateFile(driverFile, GENERIC_READ | GENERIC_WRITE, 0, NULL,
-			OPEN_EXISTING, 0, 0);
+			OPEN_EXISTING, flags, 0);
 	if (driver == INVALID_HANDLE_VALUE) {
 		LogError("Cannot open driver %s", driverFile);
 	} else if (verbose) {
@@ -37,8 +37,10 @@ void LogError(const UINT32 errorCode, const char *format, ...);
 /// @brief Open the Hone driver
 ///
 /// @param verbose  Print verbose output if true
+/// @param flags    File flags to open the driver with (such as
+///                 FILE_FLAG_OVERLAPPED)
 ///
 /// @returns 0 if successful; error code otherwise
-HANDLE OpenDriver(const bool verbose);
+HANDLE OpenDriver(const bool verbose, const DWORD flags = 0);
 
 #endif // COMMON_H
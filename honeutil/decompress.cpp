@@ -0,0 +1,223 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility decompress operations
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "decompress.h"
+#include "log_writer.h"
+#include "lz4.h"
+
+//--------------------------------------------------------------------------
+bool ReadInput(HANDLE input, const char *inputFile, void *data,
+		const DWORD length, DWORD *bytesRead)
+{
+	DWORD total = 0;
+
+	// Keep reading until we have everything or reach the end of the file
+	while (total < length) {
+		DWORD count;
+		if (!ReadFile(input, reinterpret_cast<UINT8*>(data) + total,
+				length - total, &count, NULL)) {
+			LogError("Cannot read %d bytes from %s", length - total, inputFile);
+			return false;
+		}
+		if (!count) {
+			break;
+		}
+		total += count;
+	}
+	*bytesRead = total;
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool DecompressLog(const bool verbose, const char *inputFile)
+{
+	UINT32  blockSize;
+	DWORD   bytesRead;
+	UINT8  *compressed   = NULL;
+	UINT8   flags;
+	UINT8   header[19];
+	UINT32  headerSize;
+	HANDLE  input        = INVALID_HANDLE_VALUE;
+	UINT32  length;
+	UINT32  maxBlock     = 0;
+	UINT32  numFrames    = 0;
+	HANDLE  output       = INVALID_HANDLE_VALUE;
+	char    outputFile[MAX_PATH];
+	bool    rc           = false;
+	UINT64  totalIn      = 0;
+	UINT64  totalOut     = 0;
+	UINT8  *uncompressed = NULL;
+
+	// Strip the .lz4 extension to get the output name
+	length = static_cast<UINT32>(strlen(inputFile));
+	if ((length > 4) && (_stricmp(inputFile + length - 4, ".lz4") == 0)) {
+		_snprintf_s(outputFile, sizeof(outputFile), sizeof(outputFile), "%.*s",
+				length - 4, inputFile);
+	} else {
+		_snprintf_s(outputFile, sizeof(outputFile), sizeof(outputFile),
+				"%s.pcapng", inputFile);
+	}
+
+	input = CreateFile(inputFile, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (input == INVALID_HANDLE_VALUE) {
+		LogError("Cannot open %s", inputFile);
+		goto Cleanup;
+	}
+	output = CreateFile(outputFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, 0);
+	if (output == INVALID_HANDLE_VALUE) {
+		LogError("Cannot open %s", outputFile);
+		goto Cleanup;
+	}
+	if (verbose) {
+		printf("Decompressing %s to %s\n", inputFile, outputFile);
+	}
+
+	// A file may hold several frames back to back
+	for (;;) {
+		if (!ReadInput(input, inputFile, header, LZ4_FRAME_HEADER_SIZE,
+				&bytesRead)) {
+			goto Cleanup;
+		}
+		if (!bytesRead && numFrames) {
+			break;
+		}
+		if (bytesRead < LZ4_FRAME_HEADER_SIZE) {
+			printf("%s is not an LZ4 file\n", inputFile);
+			goto Cleanup;
+		}
+		headerSize = LZ4_FRAME_HEADER_SIZE;
+		if (header[4] & LZ4_FLG_CONTENT_SIZE) {
+			headerSize += 8;
+		}
+		if (header[4] & LZ4_FLG_DICT_ID) {
+			headerSize += 4;
+		}
+		if (!ReadInput(input, inputFile, header + LZ4_FRAME_HEADER_SIZE,
+				headerSize - LZ4_FRAME_HEADER_SIZE, &bytesRead)) {
+			goto Cleanup;
+		}
+		if (!Lz4ParseFrameHeader(header, LZ4_FRAME_HEADER_SIZE + bytesRead,
+				&blockSize, &flags)) {
+			printf("%s has an invalid LZ4 frame header\n", inputFile);
+			goto Cleanup;
+		}
+		if (!(flags & LZ4_FLG_BLOCK_INDEP) || (flags & LZ4_FLG_DICT_ID)) {
+			printf("%s uses linked blocks or a dictionary, which are not supported\n",
+					inputFile);
+			goto Cleanup;
+		}
+		numFrames++;
+
+		if (blockSize > maxBlock) {
+			free(compressed);
+			free(uncompressed);
+			maxBlock     = blockSize;
+			compressed   = reinterpret_cast<UINT8*>(malloc(maxBlock));
+			uncompressed = reinterpret_cast<UINT8*>(malloc(maxBlock));
+			if (!compressed || !uncompressed) {
+				printf("Cannot allocate %u bytes for decompression\n", maxBlock);
+				goto Cleanup;
+			}
+		}
+
+		for (;;) {
+			UINT32 size;
+
+			if (!ReadInput(input, inputFile, &size, sizeof(size), &bytesRead)) {
+				goto Cleanup;
+			}
+			if (bytesRead < sizeof(size)) {
+				printf("%s is truncated\n", inputFile);
+				goto Cleanup;
+			}
+			if (!size) {
+				break;  // End mark
+			}
+
+			length = size & ~LZ4_BLOCK_UNCOMPRESSED;
+			if (length > blockSize) {
+				printf("%s has a block larger than its frame allows\n", inputFile);
+				goto Cleanup;
+			}
+			if (!ReadInput(input, inputFile, compressed, length, &bytesRead)) {
+				goto Cleanup;
+			}
+			if (bytesRead < length) {
+				printf("%s is truncated\n", inputFile);
+				goto Cleanup;
+			}
+			totalIn += length;
+
+			if (size & LZ4_BLOCK_UNCOMPRESSED) {
+				if (!WriteLog(output, outputFile, compressed, length)) {
+					goto Cleanup;
+				}
+			} else {
+				if (!Lz4DecompressBlock(compressed, length, uncompressed, blockSize,
+						&length)) {
+					printf("%s has a corrupt block\n", inputFile);
+					goto Cleanup;
+				}
+				if (!WriteLog(output, outputFile, uncompressed, length)) {
+					goto Cleanup;
+				}
+			}
+			totalOut += length;
+
+			// Skip block checksum
+			if ((flags & LZ4_FLG_BLOCK_CSUM) && !ReadInput(input, inputFile,
+					&size, sizeof(size), &bytesRead)) {
+				goto Cleanup;
+			}
+		}
+
+		// Skip content checksum
+		if (flags & LZ4_FLG_CONTENT_CSUM) {
+			UINT32 checksum;
+			if (!ReadInput(input, inputFile, &checksum, sizeof(checksum),
+					&bytesRead)) {
+				goto Cleanup;
+			}
+		}
+	}
+
+	if (verbose) {
+		printf("Decompressed %I64u bytes in %u frames to %I64u bytes\n", totalIn,
+				numFrames, totalOut);
+	}
+	rc = true;
+
+Cleanup:
+	if (input != INVALID_HANDLE_VALUE) {
+		CloseHandle(input);
+	}
+	if (output != INVALID_HANDLE_VALUE) {
+		CloseHandle(output);
+	}
+	if (compressed != NULL) {
+		free(compressed);
+	}
+	if (uncompressed != NULL) {
+		free(uncompressed);
+	}
+	return rc;
+}
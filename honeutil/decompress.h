@@ -0,0 +1,40 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility decompress operations
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+//----------------------------------------------------------------------------
+/// @brief Decompresses an LZ4 compressed log back into a PCAP-NG file
+///
+/// The output file has the same name as the input file without the .lz4
+/// extension, or with a .pcapng extension added if it has no .lz4 extension.
+///
+/// @param verbose    Print verbose output if true
+/// @param inputFile  Compressed log to decompress
+///
+/// @returns True if successful; false otherwise
+bool DecompressLog(const bool verbose, const char *inputFile);
+
+//----------------------------------------------------------------------------
+/// @brief Reads from a file until the buffer is full or the file ends
+///
+/// @param input      File to read from
+/// @param inputFile  File name
+/// @param data       Buffer to read into
+/// @param length     Number of bytes to read
+/// @param bytesRead  Receives the number of bytes read
+///
+/// @returns True if successful; false otherwise
+bool ReadInput(HANDLE input, const char *inputFile, void *data,
+		const DWORD length, DWORD *bytesRead);
+
+#endif // DECOMPRESS_H
@@ -0,0 +1,572 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility packet filter compiler
+//
+// Parses a filter expression into a tree, then generates instructions for the
+// tree with each test jumping forward to labels for the true and false cases.
+// The program ends with PfAccept and PfReject instructions for the final
+// labels.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../packet_filter.h"
+#include "filter_compiler.h"
+
+//--------------------------------------------------------------------------
+// Defines
+//--------------------------------------------------------------------------
+
+#define FILTER_MAX_NODES  (PACKET_FILTER_MAX_INSNS * 2) // Maximum number of nodes in an expression tree
+#define FILTER_MAX_LABELS (FILTER_MAX_NODES + 2)        // Maximum number of jump labels
+#define FILTER_MAX_TOKEN  64                            // Maximum length of a token
+
+//--------------------------------------------------------------------------
+// Structures and enumerations
+//--------------------------------------------------------------------------
+
+enum FilterNodeTypes {
+	NodeTest,
+	NodeAnd,
+	NodeOr,
+	NodeNot,
+};
+
+enum FilterQualifiers {
+	QualifierAny,
+	QualifierLocal,
+	QualifierRemote,
+};
+
+struct FILTER_NODE {
+	FilterNodeTypes     Type;   // Type of node
+	PACKET_FILTER_INSN  Test;   // Test instruction for NodeTest
+	FILTER_NODE        *Left;   // Left operand, or operand for NodeNot
+	FILTER_NODE        *Right;  // Right operand
+};
+
+struct FILTER_COMPILER {
+	const char         *Next;                                    // Next character to scan
+	char                Token[FILTER_MAX_TOKEN];                 // Current token (empty at end of expression)
+	bool                Failed;                                  // True if an error was reported
+	FILTER_NODE         Nodes[FILTER_MAX_NODES];                 // Nodes of the expression tree
+	UINT32              NumNodes;                                // Number of nodes used
+	PACKET_FILTER_INSN *Insns;                                   // Generated program
+	UINT32              NumInsns;                                // Number of instructions generated
+	UINT32              MaxInsns;                                // Maximum number of instructions
+	UINT32              TrueLabels[PACKET_FILTER_MAX_INSNS];     // Label to jump to when each test passes
+	UINT32              FalseLabels[PACKET_FILTER_MAX_INSNS];    // Label to jump to when each test fails
+	UINT32              LabelInsns[FILTER_MAX_LABELS];           // Instruction that each label marks
+	UINT32              NumLabels;                               // Number of labels used
+};
+
+//--------------------------------------------------------------------------
+FILTER_NODE* ParseFilterOr(FILTER_COMPILER *compiler);
+
+//--------------------------------------------------------------------------
+void FilterError(FILTER_COMPILER *compiler, const char *message)
+{
+	if (!compiler->Failed) {
+		if (compiler->Token[0]) {
+			printf("Invalid filter: %s at \"%s\"\n", message, compiler->Token);
+		} else {
+			printf("Invalid filter: %s at end of expression\n", message);
+		}
+		compiler->Failed = true;
+	}
+}
+
+//--------------------------------------------------------------------------
+void NextFilterToken(FILTER_COMPILER *compiler)
+{
+	const char *next   = compiler->Next;
+	size_t      length = 0;
+
+	while ((*next == ' ') || (*next == '\t')) {
+		next++;
+	}
+	if ((*next == '(') || (*next == ')')) {
+		compiler->Token[length++] = *next++;
+	} else {
+		while (*next && (*next != ' ') && (*next != '\t') &&
+				(*next != '(') && (*next != ')')) {
+			if (length + 1 >= sizeof(compiler->Token)) {
+				compiler->Token[length] = '\0';
+				FilterError(compiler, "token too long");
+				return;
+			}
+			compiler->Token[length++] = *next++;
+		}
+	}
+	compiler->Token[length] = '\0';
+	compiler->Next          = next;
+}
+
+//--------------------------------------------------------------------------
+bool IsFilterToken(FILTER_COMPILER *compiler, const char *token)
+{
+	return (strcmp(compiler->Token, token) == 0) ? true : false;
+}
+
+//--------------------------------------------------------------------------
+FILTER_NODE* NewFilterNode(
+	FILTER_COMPILER *compiler,
+	FilterNodeTypes  type,
+	FILTER_NODE     *left,
+	FILTER_NODE     *right)
+{
+	FILTER_NODE *node;
+
+	if (compiler->Failed) {
+		return NULL;
+	}
+	if (compiler->NumNodes >= FILTER_MAX_NODES) {
+		FilterError(compiler, "expression too complex");
+		return NULL;
+	}
+	node = &compiler->Nodes[compiler->NumNodes++];
+	memset(node, 0, sizeof(FILTER_NODE));
+	node->Type  = type;
+	node->Left  = left;
+	node->Right = right;
+	return node;
+}
+
+//--------------------------------------------------------------------------
+FILTER_NODE* NewFilterTest(
+	FILTER_COMPILER *compiler,
+	const UINT16     opcode,
+	const UINT32     value1,
+	const UINT32     value2)
+{
+	FILTER_NODE *node = NewFilterNode(compiler, NodeTest, NULL, NULL);
+
+	if (node) {
+		node->Test.Opcode = opcode;
+		node->Test.Value1 = value1;
+		node->Test.Value2 = value2;
+	}
+	return node;
+}
+
+//--------------------------------------------------------------------------
+bool ParseFilterNumber(const char *str, const UINT32 maxValue, UINT32 &value)
+{
+	char          *endptr;
+	unsigned long  temp;
+
+	if ((*str < '0') || (*str > '9')) {
+		return false;
+	}
+	errno = 0;
+#pragma warning(push)
+#pragma warning(disable:28193) // We examine the value, so ignore this warning
+	temp = strtoul(str, &endptr, 0);
+#pragma warning(pop)
+	if (*endptr || errno || (temp > maxValue)) {
+		return false;
+	}
+	value = temp;
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool ParseFilterRange(
+	FILTER_COMPILER *compiler,
+	const UINT32     maxValue,
+	UINT32          &first,
+	UINT32          &last)
+{
+	char  buffer[FILTER_MAX_TOKEN];
+	char *dash;
+
+	strcpy_s(buffer, sizeof(buffer), compiler->Token);
+	dash = strchr(buffer, '-');
+	if (dash) {
+		*dash = '\0';
+	}
+	if (!ParseFilterNumber(buffer, maxValue, first)) {
+		FilterError(compiler, "invalid number");
+		return false;
+	}
+	last = first;
+	if (dash && (!ParseFilterNumber(dash + 1, maxValue, last) || (last < first))) {
+		FilterError(compiler, "invalid range");
+		return false;
+	}
+	NextFilterToken(compiler);
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool ParseFilterNet(
+	FILTER_COMPILER *compiler,
+	const bool       allowPrefix,
+	UINT32          &ipVersion,
+	UINT32          &prefixLength,
+	UINT8           *address)
+{
+	char  buffer[FILTER_MAX_TOKEN];
+	char *slash;
+
+	strcpy_s(buffer, sizeof(buffer), compiler->Token);
+	slash = strchr(buffer, '/');
+	if (slash) {
+		*slash = '\0';
+	}
+
+	memset(address, 0, 16);
+	if (strchr(buffer, ':')) {
+		ipVersion    = 6;
+		prefixLength = 128;
+		if (inet_pton(AF_INET6, buffer, address) != 1) {
+			FilterError(compiler, "invalid IPv6 address");
+			return false;
+		}
+	} else {
+		ipVersion    = 4;
+		prefixLength = 32;
+		if (inet_pton(AF_INET, buffer, address) != 1) {
+			FilterError(compiler, "invalid IPv4 address");
+			return false;
+		}
+	}
+
+	if (slash) {
+		if (!allowPrefix) {
+			FilterError(compiler, "host address has a prefix length");
+			return false;
+		}
+		if (!ParseFilterNumber(slash + 1, prefixLength, prefixLength)) {
+			FilterError(compiler, "invalid prefix length");
+			return false;
+		}
+	}
+	NextFilterToken(compiler);
+	return true;
+}
+
+//--------------------------------------------------------------------------
+FILTER_NODE* NewFilterQualifiedTest(
+	FILTER_COMPILER        *compiler,
+	const FilterQualifiers  qualifier,
+	const UINT16            localOpcode,
+	const UINT16            remoteOpcode,
+	const UINT32            value1,
+	const UINT32            value2,
+	const UINT8            *address)
+{
+	FILTER_NODE *local  = NULL;
+	FILTER_NODE *remote = NULL;
+
+	if (qualifier != QualifierRemote) {
+		local = NewFilterTest(compiler, localOpcode, value1, value2);
+		if (local && address) {
+			memcpy(local->Test.Address, address, sizeof(local->Test.Address));
+		}
+	}
+	if (qualifier != QualifierLocal) {
+		remote = NewFilterTest(compiler, remoteOpcode, value1, value2);
+		if (remote && address) {
+			memcpy(remote->Test.Address, address, sizeof(remote->Test.Address));
+		}
+	}
+
+	if (qualifier == QualifierLocal) {
+		return local;
+	} else if (qualifier == QualifierRemote) {
+		return remote;
+	}
+	return NewFilterNode(compiler, NodeOr, local, remote);
+}
+
+//--------------------------------------------------------------------------
+FILTER_NODE* ParseFilterPrimitive(FILTER_COMPILER *compiler)
+{
+	FilterQualifiers qualifier = QualifierAny;
+	UINT32           first;
+	UINT32           last;
+	UINT8            address[16];
+
+	if (IsFilterToken(compiler, "local")) {
+		qualifier = QualifierLocal;
+		NextFilterToken(compiler);
+	} else if (IsFilterToken(compiler, "remote")) {
+		qualifier = QualifierRemote;
+		NextFilterToken(compiler);
+	}
+
+	if (IsFilterToken(compiler, "port")) {
+		NextFilterToken(compiler);
+		if (!ParseFilterRange(compiler, 0xFFFF, first, last)) {
+			return NULL;
+		}
+		return NewFilterQualifiedTest(compiler, qualifier, PfLocalPort,
+				PfRemotePort, first, last, NULL);
+	}
+	if (IsFilterToken(compiler, "host") || IsFilterToken(compiler, "net")) {
+		const bool isNet = IsFilterToken(compiler, "net");
+		NextFilterToken(compiler);
+		if (!ParseFilterNet(compiler, isNet, first, last, address)) {
+			return NULL;
+		}
+		return NewFilterQualifiedTest(compiler, qualifier, PfLocalNet,
+				PfRemoteNet, first, last, address);
+	}
+	if (qualifier != QualifierAny) {
+		FilterError(compiler, "expected port, host, or net");
+		return NULL;
+	}
+
+	if (IsFilterToken(compiler, "tcp")) {
+		first = IPPROTO_TCP;
+	} else if (IsFilterToken(compiler, "udp")) {
+		first = IPPROTO_UDP;
+	} else if (IsFilterToken(compiler, "icmp")) {
+		first = IPPROTO_ICMP;
+	} else if (IsFilterToken(compiler, "icmp6")) {
+		first = IPPROTO_ICMPV6;
+	} else if (IsFilterToken(compiler, "proto")) {
+		NextFilterToken(compiler);
+		if (!ParseFilterRange(compiler, 0xFF, first, last)) {
+			return NULL;
+		}
+		return NewFilterTest(compiler, PfProtocol, first, last);
+	} else if (IsFilterToken(compiler, "ip")) {
+		NextFilterToken(compiler);
+		return NewFilterTest(compiler, PfIpVersion, 4, 0);
+	} else if (IsFilterToken(compiler, "ip6")) {
+		NextFilterToken(compiler);
+		return NewFilterTest(compiler, PfIpVersion, 6, 0);
+	} else if (IsFilterToken(compiler, "inbound")) {
+		NextFilterToken(compiler);
+		return NewFilterTest(compiler, PfDirection, PfInbound, 0);
+	} else if (IsFilterToken(compiler, "outbound")) {
+		NextFilterToken(compiler);
+		return NewFilterTest(compiler, PfDirection, PfOutbound, 0);
+	} else if (IsFilterToken(compiler, "pid")) {
+		NextFilterToken(compiler);
+		if (!ParseFilterRange(compiler, 0xFFFFFFFF, first, last)) {
+			return NULL;
+		}
+		return NewFilterTest(compiler, PfProcessId, first, last);
+	} else {
+		FilterError(compiler, "unknown primitive");
+		return NULL;
+	}
+
+	// Protocol names
+	NextFilterToken(compiler);
+	return NewFilterTest(compiler, PfProtocol, first, first);
+}
+
+//--------------------------------------------------------------------------
+FILTER_NODE* ParseFilterNot(FILTER_COMPILER *compiler)
+{
+	FILTER_NODE *node;
+
+	if (compiler->Failed) {
+		return NULL;
+	}
+	if (IsFilterToken(compiler, "not")) {
+		NextFilterToken(compiler);
+		node = ParseFilterNot(compiler);
+		return NewFilterNode(compiler, NodeNot, node, NULL);
+	}
+	if (IsFilterToken(compiler, "(")) {
+		NextFilterToken(compiler);
+		node = ParseFilterOr(compiler);
+		if (!IsFilterToken(compiler, ")")) {
+			FilterError(compiler, "expected \")\"");
+			return NULL;
+		}
+		NextFilterToken(compiler);
+		return node;
+	}
+	return ParseFilterPrimitive(compiler);
+}
+
+//--------------------------------------------------------------------------
+FILTER_NODE* ParseFilterAnd(FILTER_COMPILER *compiler)
+{
+	FILTER_NODE *node = ParseFilterNot(compiler);
+
+	while (!compiler->Failed && compiler->Token[0] &&
+			!IsFilterToken(compiler, "or") &&
+			!IsFilterToken(compiler, ")")) {
+		if (IsFilterToken(compiler, "and")) {
+			NextFilterToken(compiler);
+		}
+		node = NewFilterNode(compiler, NodeAnd, node, ParseFilterNot(compiler));
+	}
+	return node;
+}
+
+//--------------------------------------------------------------------------
+FILTER_NODE* ParseFilterOr(FILTER_COMPILER *compiler)
+{
+	FILTER_NODE *node = ParseFilterAnd(compiler);
+
+	while (!compiler->Failed && IsFilterToken(compiler, "or")) {
+		NextFilterToken(compiler);
+		node = NewFilterNode(compiler, NodeOr, node, ParseFilterAnd(compiler));
+	}
+	return node;
+}
+
+//--------------------------------------------------------------------------
+UINT32 NewFilterLabel(FILTER_COMPILER *compiler)
+{
+	return compiler->NumLabels++;
+}
+
+//--------------------------------------------------------------------------
+void PlaceFilterLabel(FILTER_COMPILER *compiler, const UINT32 label)
+{
+	compiler->LabelInsns[label] = compiler->NumInsns;
+}
+
+//--------------------------------------------------------------------------
+bool EmitFilterInsn(
+	FILTER_COMPILER          *compiler,
+	const PACKET_FILTER_INSN *insn,
+	const UINT32              trueLabel,
+	const UINT32              falseLabel)
+{
+	if (compiler->NumInsns >= compiler->MaxInsns) {
+		compiler->Token[0] = '\0';
+		FilterError(compiler, "expression too complex");
+		return false;
+	}
+	compiler->Insns[compiler->NumInsns]       = *insn;
+	compiler->TrueLabels[compiler->NumInsns]  = trueLabel;
+	compiler->FalseLabels[compiler->NumInsns] = falseLabel;
+	compiler->NumInsns++;
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool GenerateFilterNode(
+	FILTER_COMPILER   *compiler,
+	const FILTER_NODE *node,
+	const UINT32       trueLabel,
+	const UINT32       falseLabel)
+{
+	UINT32 nextLabel;
+
+	switch (node->Type) {
+	case NodeTest:
+		return EmitFilterInsn(compiler, &node->Test, trueLabel, falseLabel);
+	case NodeAnd:
+		// The right side only runs if the left side passes
+		nextLabel = NewFilterLabel(compiler);
+		if (!GenerateFilterNode(compiler, node->Left, nextLabel, falseLabel)) {
+			return false;
+		}
+		PlaceFilterLabel(compiler, nextLabel);
+		return GenerateFilterNode(compiler, node->Right, trueLabel, falseLabel);
+	case NodeOr:
+		// The right side only runs if the left side fails
+		nextLabel = NewFilterLabel(compiler);
+		if (!GenerateFilterNode(compiler, node->Left, trueLabel, nextLabel)) {
+			return false;
+		}
+		PlaceFilterLabel(compiler, nextLabel);
+		return GenerateFilterNode(compiler, node->Right, trueLabel, falseLabel);
+	case NodeNot:
+		return GenerateFilterNode(compiler, node->Left, falseLabel, trueLabel);
+	default:
+		return false;
+	}
+}
+
+//--------------------------------------------------------------------------
+UINT32 CompileFilterExpression(
+	const char         *expression,
+	PACKET_FILTER_INSN *insns,
+	const UINT32        maxInsns)
+{
+	FILTER_COMPILER    *compiler;
+	PACKET_FILTER_INSN  insn     = {0};
+	UINT32              numInsns = 0;
+	FILTER_NODE        *root;
+	UINT32              acceptLabel;
+	UINT32              rejectLabel;
+	UINT32              index;
+
+	compiler = reinterpret_cast<FILTER_COMPILER*>(calloc(1, sizeof(FILTER_COMPILER)));
+	if (!compiler) {
+		fputs("Cannot allocate memory for filter compiler\n", stdout);
+		return 0;
+	}
+	compiler->Next     = expression;
+	compiler->Insns    = insns;
+	compiler->MaxInsns = (maxInsns < PACKET_FILTER_MAX_INSNS) ?
+			maxInsns : PACKET_FILTER_MAX_INSNS;
+
+	// Parse the expression into a tree
+	NextFilterToken(compiler);
+	if (!compiler->Token[0]) {
+		fputs("Invalid filter: Empty expression\n", stdout);
+		goto Cleanup;
+	}
+	root = ParseFilterOr(compiler);
+	if (!compiler->Failed && compiler->Token[0]) {
+		FilterError(compiler, "unexpected token");
+	}
+	if (compiler->Failed) {
+		goto Cleanup;
+	}
+
+	// Generate the tests, followed by the instructions for the final labels
+	acceptLabel = NewFilterLabel(compiler);
+	rejectLabel = NewFilterLabel(compiler);
+	if (!GenerateFilterNode(compiler, root, acceptLabel, rejectLabel)) {
+		goto Cleanup;
+	}
+	PlaceFilterLabel(compiler, acceptLabel);
+	insn.Opcode = PfAccept;
+	if (!EmitFilterInsn(compiler, &insn, acceptLabel, acceptLabel)) {
+		goto Cleanup;
+	}
+	PlaceFilterLabel(compiler, rejectLabel);
+	insn.Opcode = PfReject;
+	if (!EmitFilterInsn(compiler, &insn, rejectLabel, rejectLabel)) {
+		goto Cleanup;
+	}
+
+	// Convert labels to forward jumps
+	for (index = 0; index < compiler->NumInsns; index++) {
+		if ((insns[index].Opcode == PfAccept) || (insns[index].Opcode == PfReject)) {
+			continue;
+		}
+		insns[index].JumpTrue  = static_cast<UINT16>(
+				compiler->LabelInsns[compiler->TrueLabels[index]] - index - 1);
+		insns[index].JumpFalse = static_cast<UINT16>(
+				compiler->LabelInsns[compiler->FalseLabels[index]] - index - 1);
+	}
+	if (!IsPacketFilterValid(insns, compiler->NumInsns)) {
+		fputs("Compiled filter is invalid\n", stdout);
+		goto Cleanup;
+	}
+	numInsns = compiler->NumInsns;
+
+Cleanup:
+	free(compiler);
+	return numInsns;
+}
@@ -0,0 +1,40 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility packet filter compiler
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef FILTER_COMPILER_H
+#define FILTER_COMPILER_H
+
+//----------------------------------------------------------------------------
+/// @brief Compiles a filter expression into a packet filter program
+///
+/// Expressions combine the following primitives with "and", "or", "not", and
+/// parentheses.  Primitives next to each other are joined with "and".
+///
+/// * tcp, udp, icmp, icmp6, or proto N
+/// * ip or ip6
+/// * inbound or outbound
+/// * pid N[-M]
+/// * [local|remote] port N[-M]
+/// * [local|remote] host ADDRESS
+/// * [local|remote] net ADDRESS[/LENGTH]
+///
+/// Port, host, and net primitives without "local" or "remote" match either
+/// end of the connection.
+///
+/// @param expression  Filter expression to compile
+/// @param insns       Receives the program
+/// @param maxInsns    Maximum number of instructions that insns can hold
+///
+/// @returns Number of instructions in the program if successful; 0 otherwise
+UINT32 CompileFilterExpression(const char *expression,
+		PACKET_FILTER_INSN *insns, const UINT32 maxInsns);
+
+#endif // FILTER_COMPILER_H
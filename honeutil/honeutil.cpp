@@ -16,13 +16,19 @@
 #include <Windows.h>
 #include <conio.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "decompress.h"
 #include "filters.h"
+#include "log_writer.h"
+#include "merge.h"
 #include "oconn.h"
+#include "query.h"
 #include "read.h"
+#include "scan.h"
 #include "stats.h"
 
 //--------------------------------------------------------------------------
@@ -31,9 +37,13 @@
 
 enum Operations {
 	OpNone,
+	OpDecompress,
 	OpGetStatistics,
 	OpInstallFilters,
+	OpMerge,
+	OpQuery,
 	OpRead,
+	OpScan,
 	OpSendOpenConnections,
 	OpUninstallFilters,
 };
@@ -42,11 +52,25 @@ enum Operations {
 // Global variables
 //--------------------------------------------------------------------------
 
+static UINT32      gBufferSize = LOG_WRITER_DEFAULT_BUFFER_SIZE;
+static bool        gCompress   = false;
+static UINT32      gDepth      = LOG_WRITER_DEFAULT_DEPTH;
+static const char *gFilter     = NULL;
+static UINT32      gInFlight   = 0;
+static const char *gInputFile  = NULL;
 static const char *gLogDir     = ".";
+static bool        gMapRing    = false;
 static Operations  gOperation  = OpNone;
 static bool        gPause      = false;
+static LOG_QUERY   gQuery      = { false, 0, false, 0, 0, _UI64_MAX };
+static UINT32      gResyncTime = 0;
+static UINT32      gRotateSize = 0;
+static UINT32      gRotateTime = 0;
 static bool        gVerbose    = false;
 static UINT32      gSnapLength = 0;
+static UINT32      gThreads    = 0;
+static UINT32      gWatchTime  = 0;
+static bool        gWriteIndex = false;
 
 //--------------------------------------------------------------------------
 bool StrToUInt32(const char *str, UINT32 &val, const char *msg)
@@ -100,6 +124,14 @@ bool ParseArgs(const int argc, char const* const* argv)
 		gOperation = OpInstallFilters;
 	} else if (strcmp(argv[1], "uninstall") == 0) {
 		gOperation = OpUninstallFilters;
+	} else if (strcmp(argv[1], "decompress") == 0) {
+		gOperation = OpDecompress;
+	} else if (strcmp(argv[1], "query") == 0) {
+		gOperation = OpQuery;
+	} else if (strcmp(argv[1], "scan") == 0) {
+		gOperation = OpScan;
+	} else if (strcmp(argv[1], "merge") == 0) {
+		gOperation = OpMerge;
 	} else {
 		printf("Unknown command \"%s\"\n", argv[1]);
 		return false;
@@ -114,6 +146,50 @@ bool ParseArgs(const int argc, char const* const* argv)
 			continue;
 		}
 		switch (argv[index][1]) {
+		case 'a':
+			if (index + 1 >= argc) {
+				printf("You must supply a start time with the %s option\n",
+						argv[index]);
+				errors++;
+			} else {
+				UINT32 seconds;
+				index++;
+				if (!StrToUInt32(argv[index], seconds, "start time")) {
+					errors++;
+				} else {
+					gQuery.StartTime = static_cast<UINT64>(seconds) * 1000000;
+				}
+			}
+			break;
+		case 'b':
+			if (index + 1 >= argc) {
+				printf("You must supply a buffer size with the %s option\n",
+						argv[index]);
+				errors++;
+			} else {
+				index++;
+				if (!StrToUInt32(argv[index], gBufferSize, "buffer size")) {
+					errors++;
+				} else if (!gBufferSize) {
+					fputs("Buffer size must be greater than 0\n", stdout);
+					errors++;
+				}
+			}
+			break;
+		case 'c':
+			if (index + 1 >= argc) {
+				printf("You must supply a connection ID with the %s option\n",
+						argv[index]);
+				errors++;
+			} else {
+				index++;
+				if (!StrToUInt32(argv[index], gQuery.ConnectionId, "connection ID")) {
+					errors++;
+				} else {
+					gQuery.MatchConnection = true;
+				}
+			}
+			break;
 		case 'd':
 			if (index + 1 >= argc) {
 				printf("You must supply a directory name with the %s option\n",
@@ -124,11 +200,96 @@ bool ParseArgs(const int argc, char const* const* argv)
 				gLogDir = argv[index];
 			}
 			break;
+		case 'f':
+			if (index + 1 >= argc) {
+				printf("You must supply a filter expression with the %s option\n",
+						argv[index]);
+				errors++;
+			} else {
+				index++;
+				gFilter = argv[index];
+			}
+			break;
 		case 'h':
 			return false;
+		case 'i':
+			if (index + 1 >= argc) {
+				printf("You must supply a file name with the %s option\n",
+						argv[index]);
+				errors++;
+			} else {
+				index++;
+				gInputFile = argv[index];
+			}
+			break;
+		case 'j':
+			if (index + 1 >= argc) {
+				printf("You must supply a number of threads with the %s option\n",
+						argv[index]);
+				errors++;
+			} else {
+				index++;
+				if (!StrToUInt32(argv[index], gThreads, "number of threads")) {
+					errors++;
+				}
+			}
+			break;
+		case 'l':
+			if (index + 1 >= argc) {
+				printf("You must supply a log size with the %s option\n",
+						argv[index]);
+				errors++;
+			} else {
+				index++;
+				if (!StrToUInt32(argv[index], gRotateSize, "log size")) {
+					errors++;
+				}
+			}
+			break;
+		case 'm':
+			gMapRing = true;
+			break;
+		case 'n':
+			if (index + 1 >= argc) {
+				printf("You must supply a process ID with the %s option\n",
+						argv[index]);
+				errors++;
+			} else {
+				index++;
+				if (!StrToUInt32(argv[index], gQuery.ProcessId, "process ID")) {
+					errors++;
+				} else {
+					gQuery.MatchProcess = true;
+				}
+			}
+			break;
+		case 'o':
+			if (index + 1 >= argc) {
+				printf("You must supply a number of reads with the %s option\n",
+						argv[index]);
+				errors++;
+			} else {
+				index++;
+				if (!StrToUInt32(argv[index], gInFlight, "number of reads")) {
+					errors++;
+				}
+			}
+			break;
 		case 'p':
 			gPause = true;
 			break;
+		case 'r':
+			if (index + 1 >= argc) {
+				printf("You must supply a number of seconds with the %s option\n",
+						argv[index]);
+				errors++;
+			} else {
+				index++;
+				if (!StrToUInt32(argv[index], gResyncTime, "number of seconds")) {
+					errors++;
+				}
+			}
+			break;
 		case 's':
 			if (index + 1 >= argc) {
 				printf("You must supply a snap length with the %s option\n",
@@ -141,9 +302,66 @@ bool ParseArgs(const int argc, char const* const* argv)
 				}
 			}
 			break;
+		case 'q':
+			if (index + 1 >= argc) {
+				printf("You must supply a number of buffers with the %s option\n",
+						argv[index]);
+				errors++;
+			} else {
+				index++;
+				if (!StrToUInt32(argv[index], gDepth, "number of buffers")) {
+					errors++;
+				}
+			}
+			break;
+		case 't':
+			if (index + 1 >= argc) {
+				printf("You must supply a number of seconds with the %s option\n",
+						argv[index]);
+				errors++;
+			} else {
+				index++;
+				if (!StrToUInt32(argv[index], gRotateTime, "number of seconds")) {
+					errors++;
+				}
+			}
+			break;
+		case 'u':
+			if (index + 1 >= argc) {
+				printf("You must supply an end time with the %s option\n",
+						argv[index]);
+				errors++;
+			} else {
+				UINT32 seconds;
+				index++;
+				if (!StrToUInt32(argv[index], seconds, "end time")) {
+					errors++;
+				} else {
+					gQuery.EndTime = static_cast<UINT64>(seconds) * 1000000;
+				}
+			}
+			break;
 		case 'v':
 			gVerbose = true;
 			break;
+		case 'w':
+			if (index + 1 >= argc) {
+				printf("You must supply a number of seconds with the %s option\n",
+						argv[index]);
+				errors++;
+			} else {
+				index++;
+				if (!StrToUInt32(argv[index], gWatchTime, "number of seconds")) {
+					errors++;
+				}
+			}
+			break;
+		case 'x':
+			gWriteIndex = true;
+			break;
+		case 'z':
+			gCompress = true;
+			break;
 		default:
 			printf("Unknown option \"%s\"\n", argv[index]);
 			errors++;
@@ -151,6 +369,27 @@ bool ParseArgs(const int argc, char const* const* argv)
 		}
 	}
 
+	if ((gOperation == OpDecompress) && !gInputFile) {
+		fputs("You must supply a file to decompress with the -i option\n", stdout);
+		errors++;
+	}
+	if ((gOperation == OpQuery) && !gInputFile) {
+		fputs("You must supply a file to query with the -i option\n", stdout);
+		errors++;
+	}
+	if ((gOperation == OpScan) && !gInputFile) {
+		fputs("You must supply a file to scan with the -i option\n", stdout);
+		errors++;
+	}
+	if ((gOperation == OpMerge) && !gInputFile) {
+		fputs("You must supply the files to merge with the -i option\n", stdout);
+		errors++;
+	}
+	if (gResyncTime && !gWatchTime) {
+		fputs("You must supply the -w option to use the -r option\n", stdout);
+		errors++;
+	}
+
 	return errors ? false : true;
 }
 
@@ -164,13 +403,54 @@ void Usage(const char *progname)
 			"  send-conns  Send open connections to the driver\n"
 			"  install     Install network filters used by the driver\n"
 			"  uninstall   Uninstall network filters used by the driver\n"
+			"  decompress  Decompress a compressed log to a PCAP-NG file\n"
+			"  query       Copy the blocks that match a query to a new log\n"
+			"  scan        Check a log and count the blocks in it\n"
+			"  merge       Merge logs from many hosts into one log in time order\n"
 			"Options:\n"
 			"  -h        Help (this text)\n"
+			"  -a secs   Only match packets at or after this time, in seconds\n"
+			"            since 1970 (query only)\n"
+			"  -b bytes  Size of each read buffer (read only, default: %u)\n"
+			"  -c id     Only match blocks for this connection (query only)\n"
 			"  -d dir    Output file directory (default: current directory)\n"
+			"  -f expr   Only capture packets that match the filter expression\n"
+			"            (read only, see below)\n"
+			"  -i file   Compressed log to decompress, log to query or scan, or logs\n"
+			"            to merge, such as logs\\*.pcapng (decompress, query, scan,\n"
+			"            and merge only)\n"
+			"  -j count  Number of threads that scan the log (scan only,\n"
+			"            default: 0 for one per processor)\n"
+			"  -l mb     Start a new log once it reaches this many megabytes\n"
+			"            (read only, default: 0 to only rotate on CTRL-BREAK)\n"
+			"  -m        Read through a ring buffer mapped from the driver\n"
+			"            (read only)\n"
+			"  -n pid    Only match blocks for this process (query only)\n"
+			"  -o reads  Keep this many overlapped reads pending in the driver\n"
+			"            (read only, default: 0 for synchronous reads)\n"
 			"  -p        Pause before exiting\n"
+			"  -q count  Number of read buffers queued for the thread that writes\n"
+			"            the log (read only, default: %u)\n"
+			"  -r secs   Send the full list of open connections this often while\n"
+			"            sending changes (send-conns only, default: 0 for never)\n"
 			"  -s bytes  The snap length in bytes (default: unlimited)\n"
-			"  -v        Verbose output\n",
-			progname);
+			"  -t secs   Start a new log once it is this many seconds old\n"
+			"            (read only, default: 0 to only rotate on CTRL-BREAK)\n"
+			"  -u secs   Only match packets before this time, in seconds since 1970\n"
+			"            (query only)\n"
+			"  -v        Verbose output\n"
+			"  -w secs   Keep running and send changes to the open connections this\n"
+			"            often (send-conns only, default: 0 to send once)\n"
+			"  -x        Write an index file next to each log for the query command\n"
+			"            (read only)\n"
+			"  -z        Compress the log with LZ4 (read only)\n"
+			"Filter expressions:\n"
+			"  Combine these primitives with and, or, not, and parentheses:\n"
+			"    tcp, udp, icmp, icmp6, proto N, ip, ip6, inbound, outbound,\n"
+			"    pid N[-M], [local|remote] port N[-M],\n"
+			"    [local|remote] host ADDRESS, [local|remote] net ADDRESS[/LENGTH]\n"
+			"  Example: -f \"tcp and remote port 443 and not net 10.0.0.0/8\"\n",
+			progname, LOG_WRITER_DEFAULT_BUFFER_SIZE, LOG_WRITER_DEFAULT_DEPTH);
 }
 
 //--------------------------------------------------------------------------
@@ -184,17 +464,32 @@ int __cdecl main(int argc, char *argv[])
 		rc = false;
 	} else {
 		switch (gOperation) {
+		case OpDecompress:
+			rc = DecompressLog(gVerbose, gInputFile);
+			break;
 		case OpGetStatistics:
 			rc = GetStatistics(gVerbose, gSnapLength);
 			break;
 		case OpInstallFilters:
 			rc = SetupFilters(gVerbose, true);
 			break;
+		case OpMerge:
+			rc = MergeLogs(gVerbose, gInputFile, gLogDir);
+			break;
+		case OpQuery:
+			rc = QueryLog(gVerbose, gInputFile, &gQuery);
+			break;
 		case OpRead:
-			rc = ReadDriver(gVerbose, gLogDir, gSnapLength);
+			rc = ReadDriver(gVerbose, gLogDir, gSnapLength, gFilter, gMapRing,
+					gInFlight, gBufferSize, gDepth, gCompress,
+					static_cast<UINT64>(gRotateSize) * 1024 * 1024, gRotateTime,
+					gWriteIndex);
+			break;
+		case OpScan:
+			rc = ScanLog(gVerbose, gInputFile, gThreads);
 			break;
 		case OpSendOpenConnections:
-			rc = SendOptionConnections(gVerbose);
+			rc = SendOptionConnections(gVerbose, gWatchTime, gResyncTime);
 			break;
 		case OpUninstallFilters:
 			rc = SetupFilters(gVerbose, false);
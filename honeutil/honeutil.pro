@@ -9,15 +9,26 @@ DEFINES  -= UNICODE
 LIBS += -LC:/WinDDK/7600.16385.1/lib/win7/i386 \
 	-lfwpuclnt \
 	-liphlpapi \
-	-luuid
+	-luuid \
+	-lws2_32
 
 SOURCES += \
 	../wfp_common.cpp \
+	block_cache.cpp \
+	capture_index.cpp \
+	capture_reader.cpp \
 	common.cpp \
+	decompress.cpp \
+	filter_compiler.cpp \
 	filters.cpp \
 	honeutil.cpp \
+	log_writer.cpp \
+	lz4.cpp \
+	merge.cpp \
 	oconn.cpp \
+	query.cpp \
 	read.cpp \
+	scan.cpp \
 	stats.cpp
 
 OTHER_FILES += \
@@ -27,12 +38,25 @@ OTHER_FILES += \
 
 HEADERS += \
 	../ioctls.h \
+	../packet_filter.h \
+	../pcap_ng.h \
+	../shared_ring.h \
 	../version.h \
 	../version_info.h \
 	../wfp_common.h \
+	block_cache.h \
+	capture_index.h \
+	capture_reader.h \
 	common.h \
+	decompress.h \
+	filter_compiler.h \
 	filters.h \
 	honeutil_info.h \
+	log_writer.h \
+	lz4.h \
+	merge.h \
 	oconn.h \
+	query.h \
 	read.h \
+	scan.h \
 	stats.h
@@ -0,0 +1,655 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility log writer
+//
+// Writes read buffers to the log file on a separate thread so that a slow
+// disk doesn't keep the read loop from draining the driver.  The read loop
+// takes buffers from a fixed pool, and the writer thread returns them to the
+// pool once it has written them.
+//
+// When compressing, the thread collects data in a staging buffer and writes
+// it as LZ4 blocks that end on PCAP-NG block boundaries, so each compressed
+// block holds whole PCAP-NG blocks unless a single block is larger than the
+// staging buffer.
+//
+// When rotating on size or time, the thread keeps a cache of the blocks for
+// running processes and open connections.  It starts the new file at the next
+// block boundary and writes the cached blocks first, so every file stands on
+// its own without the driver having to send its initial blocks again.
+//
+// When indexing, the thread also collects an index entry for each process,
+// connection, and packet block, and writes the index next to the log when it
+// closes the log.  A block that was written in pieces because it was larger
+// than the staging buffer is not indexed.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../pcap_ng.h"
+#include "common.h"
+#include "log_writer.h"
+#include "lz4.h"
+
+//--------------------------------------------------------------------------
+// Defines
+//--------------------------------------------------------------------------
+
+#define INDEX_MIN_CAPACITY  0x10000     // Initial number of index entries
+#define NO_BLOCK            0xFFFFFFFF  // Start of current block was already written
+
+//--------------------------------------------------------------------------
+// Function prototypes
+//--------------------------------------------------------------------------
+
+bool CloseLogFile(LOG_WRITER *writer);
+bool FinishLogFile(LOG_WRITER *writer);
+bool FlushLogStaging(LOG_WRITER *writer, const UINT32 length);
+bool HandleLogBlock(LOG_WRITER *writer, UINT32 start, const UINT32 length);
+bool IndexLogBlock(LOG_WRITER *writer, const UINT8 *block,
+		const UINT32 length, const UINT64 offset);
+bool IsRotationDue(LOG_WRITER *writer);
+DWORD WINAPI LogWriterThread(void *param);
+bool OpenLogFile(LOG_WRITER *writer);
+bool WriteCachedBlocks(LOG_WRITER *writer);
+bool WriteLogBlock(LOG_WRITER *writer, const UINT8 *data, const UINT32 length);
+bool WriteLogData(LOG_WRITER *writer, const char *data, DWORD length);
+
+//--------------------------------------------------------------------------
+bool CleanupLogWriter(LOG_WRITER *writer)
+{
+	bool rc;
+
+	// Let the thread finish writing everything that's already queued
+	if (writer->Thread != NULL) {
+		InterlockedExchange(&writer->Stopping, 1);
+		ReleaseSemaphore(writer->ItemSemaphore, 1, NULL);
+		WaitForSingleObject(writer->Thread, INFINITE);
+		CloseHandle(writer->Thread);
+	}
+	if ((writer->Log != INVALID_HANDLE_VALUE) && !CloseLogFile(writer)) {
+		InterlockedExchange(&writer->Failed, 1);
+	}
+	rc = writer->Failed ? false : true;
+
+	if (writer->ItemSemaphore != NULL) {
+		CloseHandle(writer->ItemSemaphore);
+	}
+	if (writer->FreeSemaphore != NULL) {
+		CloseHandle(writer->FreeSemaphore);
+	}
+	if (writer->Items != NULL) {
+		free(writer->Items);
+	}
+	if (writer->FreeBuffers != NULL) {
+		free(writer->FreeBuffers);
+	}
+	if (writer->Buffers != NULL) {
+		VirtualFree(writer->Buffers, 0, MEM_RELEASE);
+	}
+	if (writer->Staging != NULL) {
+		free(writer->Staging);
+	}
+	if (writer->Compressed != NULL) {
+		free(writer->Compressed);
+	}
+	if (writer->HashTable != NULL) {
+		free(writer->HashTable);
+	}
+	if (writer->IndexEntries != NULL) {
+		free(writer->IndexEntries);
+	}
+	CleanupBlockCache(&writer->Cache);
+	DeleteCriticalSection(&writer->Lock);
+	return rc;
+}
+
+//--------------------------------------------------------------------------
+bool CloseLogFile(LOG_WRITER *writer)
+{
+	bool rc = true;
+
+	// A rotation request happens on a PCAP-NG block boundary, so everything
+	// left in the staging buffer belongs in this file
+	if (writer->StagingLength && !writer->Failed &&
+			!FlushLogStaging(writer, writer->StagingLength)) {
+		rc = false;
+	}
+	writer->StagingLength = 0;
+	writer->BlocksEnd     = 0;
+	writer->NextBlock     = 0;
+	writer->BlockStart    = NO_BLOCK;
+
+	if (!FinishLogFile(writer)) {
+		rc = false;
+	}
+	return rc;
+}
+
+//--------------------------------------------------------------------------
+bool FinishLogFile(LOG_WRITER *writer)
+{
+	bool rc = true;
+
+	if (writer->Compress && !writer->Failed) {
+		const UINT32 endMark = 0;
+		if (!WriteLog(writer->Log, writer->LogFile, &endMark, sizeof(endMark))) {
+			rc = false;
+		}
+	}
+	CloseHandle(writer->Log);
+	writer->Log = INVALID_HANDLE_VALUE;
+
+	if (writer->Index && !writer->Failed && !WriteCaptureIndex(writer->LogFile,
+			writer->IndexEntries, writer->NumIndexEntries)) {
+		rc = false;
+	}
+	writer->NumIndexEntries = 0;
+	return rc;
+}
+
+//--------------------------------------------------------------------------
+bool FlushLogStaging(LOG_WRITER *writer, const UINT32 length)
+{
+	if (!WriteLogBlock(writer, writer->Staging, length)) {
+		return false;
+	}
+
+	// Keep the start of the next block
+	writer->StagingLength -= length;
+	memmove(writer->Staging, writer->Staging + length, writer->StagingLength);
+	writer->BlocksEnd  = (writer->BlocksEnd > length) ? writer->BlocksEnd - length : 0;
+	writer->NextBlock -= length;
+	if (writer->BlockStart != NO_BLOCK) {
+		writer->BlockStart = (writer->BlockStart >= length) ?
+				writer->BlockStart - length : NO_BLOCK;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------
+char* GetLogBuffer(LOG_WRITER *writer)
+{
+	char *buffer;
+
+	if (WaitForSingleObject(writer->FreeSemaphore, INFINITE) != WAIT_OBJECT_0) {
+		LogError("Cannot wait for free read buffer");
+		return NULL;
+	}
+	EnterCriticalSection(&writer->Lock);
+	buffer = writer->FreeBuffers[--writer->NumFree];
+	LeaveCriticalSection(&writer->Lock);
+
+	if (writer->Failed) {
+		QueueLogBuffer(writer, buffer, 0, LogWrite);
+		return NULL;
+	}
+	return buffer;
+}
+
+//--------------------------------------------------------------------------
+bool HandleLogBlock(LOG_WRITER *writer, UINT32 start, const UINT32 length)
+{
+	UINT32 blockType;
+
+	// Start the new file before any block but the ones that begin a section,
+	// so that the section header and its interfaces stay together
+	memcpy(&blockType, writer->Staging + start, sizeof(blockType));
+	if ((blockType != SectionHeaderBlock) &&
+			(blockType != InterfaceDescriptionBlock) && IsRotationDue(writer)) {
+		if (start && !FlushLogStaging(writer, start)) {
+			return false;
+		}
+		start = 0;
+		if (!FinishLogFile(writer) || !OpenLogFile(writer) ||
+				!WriteCachedBlocks(writer)) {
+			return false;
+		}
+	}
+
+	if ((writer->RotateSize || writer->RotateSeconds) &&
+			!UpdateBlockCache(&writer->Cache, writer->Staging + start, length)) {
+		fputs("Cannot allocate memory for block cache\n", stdout);
+		return false;
+	}
+	if (writer->Index && !IndexLogBlock(writer, writer->Staging + start, length,
+			writer->FileOffset + start)) {
+		return false;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool IndexLogBlock(LOG_WRITER *writer, const UINT8 *block,
+		const UINT32 length, const UINT64 offset)
+{
+	CAPTURE_INDEX_ENTRY entry;
+
+	if (!GetCaptureIndexEntry(block, length, offset, &entry)) {
+		return true;
+	}
+	if (writer->NumIndexEntries == writer->IndexCapacity) {
+		const UINT64 capacity = writer->IndexCapacity ?
+				writer->IndexCapacity * 2 : INDEX_MIN_CAPACITY;
+		CAPTURE_INDEX_ENTRY *entries = reinterpret_cast<CAPTURE_INDEX_ENTRY*>(
+				realloc(writer->IndexEntries,
+				static_cast<size_t>(capacity * sizeof(CAPTURE_INDEX_ENTRY))));
+		if (entries == NULL) {
+			fputs("Cannot allocate memory for index entries\n", stdout);
+			return false;
+		}
+		writer->IndexEntries  = entries;
+		writer->IndexCapacity = capacity;
+	}
+	writer->IndexEntries[writer->NumIndexEntries++] = entry;
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool InitLogWriter(LOG_WRITER *writer, const char *logDir,
+		const UINT32 bufferSize, const UINT32 depth, const bool compress,
+		const UINT64 rotateSize, const UINT32 rotateSeconds, const bool buildIndex)
+{
+	SYSTEM_INFO systemInfo;
+	UINT32      index;
+
+	ZeroMemory(writer, sizeof(LOG_WRITER));
+	InitializeCriticalSection(&writer->Lock);
+	writer->Log           = INVALID_HANDLE_VALUE;
+	writer->LogDir        = logDir;
+	writer->Depth         = depth;
+	writer->Compress      = compress;
+	writer->BlockStart    = NO_BLOCK;
+	writer->RotateSize    = rotateSize;
+	writer->RotateSeconds = rotateSeconds;
+	writer->Index         = buildIndex;
+	writer->HandleBlocks  = (rotateSize || rotateSeconds || buildIndex) ? true : false;
+
+	// Round buffers up to a whole number of pages so each one is page aligned
+	GetSystemInfo(&systemInfo);
+	writer->BufferSize = (bufferSize + systemInfo.dwPageSize - 1) &
+			~(systemInfo.dwPageSize - 1);
+	writer->Buffers = reinterpret_cast<char*>(VirtualAlloc(NULL,
+			static_cast<SIZE_T>(writer->BufferSize) * depth,
+			MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+	if (writer->Buffers == NULL) {
+		LogError("Cannot allocate %u read buffers of %u bytes", depth,
+				writer->BufferSize);
+		goto Cleanup;
+	}
+	writer->FreeBuffers = reinterpret_cast<char**>(malloc(depth * sizeof(char*)));
+	writer->Items       = reinterpret_cast<LOG_WRITER_ITEM*>(
+			malloc(depth * sizeof(LOG_WRITER_ITEM)));
+	if ((writer->FreeBuffers == NULL) || (writer->Items == NULL)) {
+		fputs("Cannot allocate memory for log writer queue\n", stdout);
+		goto Cleanup;
+	}
+	for (index = 0; index < depth; index++) {
+		writer->FreeBuffers[index] = writer->Buffers + index * writer->BufferSize;
+	}
+	writer->NumFree = depth;
+
+	// Compression, rotation, and indexing all need to find PCAP-NG block
+	// boundaries
+	if (compress || writer->HandleBlocks) {
+		writer->Staging = reinterpret_cast<UINT8*>(malloc(LZ4_BLOCK_MAX_SIZE));
+		if (writer->Staging == NULL) {
+			fputs("Cannot allocate memory for staging buffer\n", stdout);
+			goto Cleanup;
+		}
+	}
+	if (compress) {
+		writer->Compressed = reinterpret_cast<UINT8*>(
+				malloc(LZ4_COMPRESS_BOUND(LZ4_BLOCK_MAX_SIZE)));
+		writer->HashTable  = reinterpret_cast<UINT32*>(
+				malloc(LZ4_HASH_TABLE_SIZE * sizeof(UINT32)));
+		if ((writer->Compressed == NULL) || (writer->HashTable == NULL)) {
+			fputs("Cannot allocate memory for compression\n", stdout);
+			goto Cleanup;
+		}
+	}
+
+	writer->FreeSemaphore = CreateSemaphore(NULL, depth, depth, NULL);
+	writer->ItemSemaphore = CreateSemaphore(NULL, 0, depth + 1, NULL);
+	if ((writer->FreeSemaphore == NULL) || (writer->ItemSemaphore == NULL)) {
+		LogError("Cannot create log writer semaphores");
+		goto Cleanup;
+	}
+
+	if (!OpenLogFile(writer)) {
+		goto Cleanup;
+	}
+
+	writer->Thread = CreateThread(NULL, 0, LogWriterThread, writer, 0, NULL);
+	if (writer->Thread == NULL) {
+		LogError("Cannot create log writer thread");
+		goto Cleanup;
+	}
+	return true;
+
+Cleanup:
+	CleanupLogWriter(writer);
+	return false;
+}
+
+//--------------------------------------------------------------------------
+bool IsRotationDue(LOG_WRITER *writer)
+{
+	if (writer->RotateSize && (writer->FileBytes >= writer->RotateSize)) {
+		return true;
+	}
+	if (writer->RotateSeconds && (GetTickCount64() - writer->FileOpened >=
+			static_cast<ULONGLONG>(writer->RotateSeconds) * 1000)) {
+		return true;
+	}
+	return false;
+}
+
+//--------------------------------------------------------------------------
+DWORD WINAPI LogWriterThread(void *param)
+{
+	LOG_WRITER      *writer = reinterpret_cast<LOG_WRITER*>(param);
+	LOG_WRITER_ITEM  item;
+
+	for (;;) {
+		WaitForSingleObject(writer->ItemSemaphore, INFINITE);
+		EnterCriticalSection(&writer->Lock);
+		if (!writer->NumItems) {
+			LeaveCriticalSection(&writer->Lock);
+			if (writer->Stopping) {
+				break;
+			}
+			continue;
+		}
+		item = writer->Items[writer->ItemsFront];
+		writer->ItemsFront = (writer->ItemsFront + 1) % writer->Depth;
+		writer->NumItems--;
+		LeaveCriticalSection(&writer->Lock);
+
+		// Once a write fails, just return buffers to the pool so the read loop
+		// can see the failure instead of blocking
+		if (!writer->Failed) {
+			switch (item.Command) {
+			case LogWrite:
+				if (item.Length && !WriteLogData(writer, item.Buffer, item.Length)) {
+					InterlockedExchange(&writer->Failed, 1);
+				}
+				break;
+			case LogRotate:
+				if (!CloseLogFile(writer) || !OpenLogFile(writer)) {
+					InterlockedExchange(&writer->Failed, 1);
+				}
+				break;
+			}
+		}
+
+		EnterCriticalSection(&writer->Lock);
+		writer->FreeBuffers[writer->NumFree++] = item.Buffer;
+		LeaveCriticalSection(&writer->Lock);
+		ReleaseSemaphore(writer->FreeSemaphore, 1, NULL);
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------------
+bool OpenLogFile(LOG_WRITER *writer)
+{
+	UINT8 header[LZ4_FRAME_HEADER_SIZE];
+
+	writer->Log = OpenPcapNgFile(writer->LogDir, writer->LogFile,
+			sizeof(writer->LogFile), writer->Compress);
+	if (writer->Log == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	writer->FileBytes  = 0;
+	writer->FileOffset = 0;
+	writer->FileOpened = GetTickCount64();
+
+	// Each log file is a single LZ4 frame
+	if (writer->Compress) {
+		Lz4WriteFrameHeader(header);
+		if (!WriteLog(writer->Log, writer->LogFile, header, sizeof(header))) {
+			return false;
+		}
+		writer->FileBytes += sizeof(header);
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------
+HANDLE OpenPcapNgFile(const char *logDir, char *filename, const size_t len,
+		const bool compressed)
+{
+	char        timeStr[16];
+	__time64_t  timestamp;
+	struct tm   localtime;
+	char        hostname[MAX_COMPUTERNAME_LENGTH+1];
+	char        suffix[16];
+	DWORD       hostnameLen = sizeof(hostname);
+	HANDLE      file        = NULL;
+	UINT32      sequence;
+
+	if (!GetComputerName(hostname, &hostnameLen)) {
+		LogError("Cannot get hostname");
+		return INVALID_HANDLE_VALUE;
+	}
+
+	// Get time
+	_time64(&timestamp);
+	_localtime64_s(&localtime, &timestamp);
+	strftime(timeStr, sizeof(timeStr), "%Y%m%d_%H%M%S", &localtime);
+
+	// Automatic rotation can start several files in the same second, so add a
+	// sequence number to the name instead of overwriting an earlier file
+	for (sequence = 0; ; sequence++) {
+		suffix[0] = '\0';
+		if (sequence) {
+			_snprintf_s(suffix, sizeof(suffix), sizeof(suffix), "_%u", sequence);
+		}
+		_snprintf_s(filename, len, len, "%s\\%s_%s%s.pcapng%s",
+				logDir, hostname, timeStr, suffix, compressed ? ".lz4" : "");
+
+		file = CreateFile(filename, GENERIC_WRITE, 0, NULL, CREATE_NEW, 0, 0);
+		if (file != INVALID_HANDLE_VALUE) {
+			break;
+		}
+		if ((GetLastError() != ERROR_FILE_EXISTS) || (sequence >= 1000)) {
+			LogError("Cannot open log file %s", filename);
+			return INVALID_HANDLE_VALUE;
+		}
+	}
+
+	printf("Writing events to %s\n", filename);
+	return file;
+}
+
+//--------------------------------------------------------------------------
+bool QueueLogBuffer(LOG_WRITER *writer, char *buffer, const DWORD length,
+		const LogWriterCommands command)
+{
+	EnterCriticalSection(&writer->Lock);
+	LOG_WRITER_ITEM *item = writer->Items +
+			((writer->ItemsFront + writer->NumItems) % writer->Depth);
+	item->Buffer  = buffer;
+	item->Length  = length;
+	item->Command = command;
+	writer->NumItems++;
+	LeaveCriticalSection(&writer->Lock);
+	ReleaseSemaphore(writer->ItemSemaphore, 1, NULL);
+	return writer->Failed ? false : true;
+}
+
+//--------------------------------------------------------------------------
+bool WriteLog(HANDLE log, const char *logFile, const void *data,
+		const DWORD length)
+{
+	DWORD bytesWritten;
+
+	if (!WriteFile(log, data, length, &bytesWritten, NULL)) {
+		LogError("Cannot write %d bytes to %s", length, logFile);
+		return false;
+	}
+	if (length != bytesWritten) {
+		printf("Only wrote %d of %d bytes to %s\n", bytesWritten, length,
+				logFile);
+		return false;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool WriteCachedBlocks(LOG_WRITER *writer)
+{
+	UINT8  *blocks;
+	UINT32  blockLength;
+	UINT32  chunk;
+	UINT32  length;
+	UINT32  offset;
+	bool    rc = true;
+
+	blocks = GetCachedBlocks(&writer->Cache, &length);
+	if (blocks == NULL) {
+		fputs("Cannot allocate memory for cached blocks\n", stdout);
+		return false;
+	}
+
+	// Every cached block fit in the staging buffer, so each chunk holds at
+	// least one whole block
+	for (offset = 0; offset < length; offset += chunk) {
+		for (chunk = 0; offset + chunk < length; chunk += blockLength) {
+			memcpy(&blockLength, blocks + offset + chunk + sizeof(UINT32),
+					sizeof(blockLength));
+			if (chunk && (chunk + blockLength > LZ4_BLOCK_MAX_SIZE)) {
+				break;
+			}
+			if (writer->Index && !IndexLogBlock(writer, blocks + offset + chunk,
+					blockLength, writer->FileOffset + chunk)) {
+				rc = false;
+				break;
+			}
+		}
+		if (!rc) {
+			break;
+		}
+		if (!WriteLogBlock(writer, blocks + offset, chunk)) {
+			rc = false;
+			break;
+		}
+	}
+	free(blocks);
+	return rc;
+}
+
+//--------------------------------------------------------------------------
+bool WriteLogBlock(LOG_WRITER *writer, const UINT8 *data, const UINT32 length)
+{
+	UINT32 *size = reinterpret_cast<UINT32*>(writer->Compressed);
+	UINT32  compressedLength;
+
+	writer->FileOffset += length;
+	if (!writer->Compress) {
+		if (!WriteLog(writer->Log, writer->LogFile, data, length)) {
+			return false;
+		}
+		writer->FileBytes += length;
+		return true;
+	}
+
+	// Store the data as is if it doesn't compress
+	compressedLength = Lz4CompressBlock(data, length,
+			writer->Compressed + sizeof(UINT32), length, writer->HashTable);
+	if (compressedLength) {
+		*size = compressedLength;
+		if (!WriteLog(writer->Log, writer->LogFile, writer->Compressed,
+				compressedLength + sizeof(UINT32))) {
+			return false;
+		}
+	} else {
+		*size = length | LZ4_BLOCK_UNCOMPRESSED;
+		if (!WriteLog(writer->Log, writer->LogFile, size, sizeof(UINT32)) ||
+				!WriteLog(writer->Log, writer->LogFile, data, length)) {
+			return false;
+		}
+	}
+	writer->BytesIn   += length;
+	writer->BytesOut  += (compressedLength ? compressedLength : length) +
+			sizeof(UINT32);
+	writer->FileBytes += (compressedLength ? compressedLength : length) +
+			sizeof(UINT32);
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool WriteLogData(LOG_WRITER *writer, const char *data, DWORD length)
+{
+	if (writer->Staging == NULL) {
+		return WriteLog(writer->Log, writer->LogFile, data, length);
+	}
+
+	while (length) {
+		// Write the complete PCAP-NG blocks once the staging buffer is full, or
+		// all of it if it holds part of a single large block
+		if (writer->StagingLength == LZ4_BLOCK_MAX_SIZE) {
+			if (!FlushLogStaging(writer, writer->BlocksEnd ?
+					writer->BlocksEnd : writer->StagingLength)) {
+				return false;
+			}
+		}
+
+		const DWORD count = min(length, LZ4_BLOCK_MAX_SIZE - writer->StagingLength);
+		memcpy(writer->Staging + writer->StagingLength, data, count);
+		writer->StagingLength += count;
+		data                  += count;
+		length                -= count;
+
+		// Find the end of the last complete block.  The next block's header
+		// may start past the end of the data we have so far.
+		for (;;) {
+			UINT32 blockLength;
+
+			if ((writer->NextBlock <= writer->StagingLength) &&
+					(writer->NextBlock > writer->BlocksEnd)) {
+				if ((writer->BlockStart != NO_BLOCK) && writer->HandleBlocks &&
+						!HandleLogBlock(writer, writer->BlockStart,
+						writer->NextBlock - writer->BlockStart)) {
+					return false;
+				}
+				writer->BlocksEnd = writer->NextBlock;
+			}
+			if (writer->NextBlock + 2 * sizeof(UINT32) > writer->StagingLength) {
+				break;
+			}
+			memcpy(&blockLength, writer->Staging + writer->NextBlock +
+					sizeof(UINT32), sizeof(blockLength));
+			if ((blockLength < 3 * sizeof(UINT32)) || (blockLength & 3) ||
+					(writer->NextBlock + blockLength < writer->NextBlock)) {
+				// Not a PCAP-NG block, so just write whatever we have
+				writer->NextBlock  = writer->StagingLength;
+				writer->BlocksEnd  = writer->StagingLength;
+				writer->BlockStart = NO_BLOCK;
+				break;
+			}
+			writer->BlockStart  = writer->NextBlock;
+			writer->NextBlock  += blockLength;
+		}
+	}
+
+	// Compressed blocks collect as much data as they can, but there's no
+	// reason to hold on to complete blocks otherwise
+	if (!writer->Compress && writer->BlocksEnd) {
+		return FlushLogStaging(writer, writer->BlocksEnd);
+	}
+	return true;
+}
@@ -0,0 +1,160 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility log writer
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef LOG_WRITER_H
+#define LOG_WRITER_H
+
+#include "block_cache.h"
+#include "capture_index.h"
+
+//----------------------------------------------------------------------------
+// Defines
+//----------------------------------------------------------------------------
+
+#define LOG_WRITER_DEFAULT_BUFFER_SIZE  0x40000  // Default read buffer size
+#define LOG_WRITER_DEFAULT_DEPTH        16       // Default number of read buffers
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+enum LogWriterCommands {
+	LogWrite,   // Write the buffer to the log
+	LogRotate,  // Close the log and open a new one
+};
+
+struct LOG_WRITER_ITEM {
+	char              *Buffer;   // Buffer holding data to write
+	DWORD              Length;   // Number of bytes in buffer
+	LogWriterCommands  Command;  // What to do with the buffer
+};
+
+struct LOG_WRITER {
+	char                *Buffers;            // Pool of read buffers
+	UINT32               BufferSize;         // Size of each read buffer, in bytes
+	UINT32               Depth;              // Number of read buffers
+	char               **FreeBuffers;        // Stack of buffers that are free to read into
+	UINT32               NumFree;            // Number of buffers on the free stack
+	LOG_WRITER_ITEM     *Items;              // Queue of buffers waiting to be written
+	UINT32               ItemsFront;         // Index of next item to write
+	UINT32               NumItems;           // Number of items in the queue
+	CRITICAL_SECTION     Lock;               // Protects the free stack and item queue
+	HANDLE               FreeSemaphore;      // Counts buffers on the free stack
+	HANDLE               ItemSemaphore;      // Counts items in the queue
+	HANDLE               Thread;             // Thread that writes the log
+	volatile LONG        Failed;             // Set if the thread cannot write the log
+	volatile LONG        Stopping;           // Set to stop the thread once the queue is empty
+	HANDLE               Log;                // Log file
+	char                 LogFile[MAX_PATH];  // Log file name
+	const char          *LogDir;             // Directory to save log files in
+	bool                 Compress;           // Compress the log with LZ4 if true
+	UINT8               *Staging;            // Data waiting to be compressed
+	UINT32               StagingLength;      // Number of bytes in staging buffer
+	UINT32               BlocksEnd;          // Offset of end of last complete PCAP-NG block
+	UINT32               NextBlock;          // Offset of next PCAP-NG block header
+	UINT32               BlockStart;         // Offset of current PCAP-NG block header
+	UINT8               *Compressed;         // Compressed block with its size field
+	UINT32              *HashTable;          // Compressor hash table
+	UINT64               BytesIn;            // Number of bytes compressed
+	UINT64               BytesOut;           // Number of compressed bytes written
+	UINT64               RotateSize;         // Start a new log at this size (0 to disable)
+	UINT32               RotateSeconds;      // Start a new log after this long (0 to disable)
+	UINT64               FileBytes;          // Number of bytes written to current log
+	ULONGLONG            FileOpened;         // Tick count when current log was opened
+	BLOCK_CACHE          Cache;              // Blocks to start each new log with
+	bool                 HandleBlocks;       // Examine each complete PCAP-NG block if true
+	bool                 Index;              // Write an index file for each log if true
+	CAPTURE_INDEX_ENTRY *IndexEntries;       // Index entries for current log
+	UINT64               NumIndexEntries;    // Number of index entries for current log
+	UINT64               IndexCapacity;      // Number of index entries allocated
+	UINT64               FileOffset;         // Number of uncompressed bytes in current log
+};
+
+//----------------------------------------------------------------------------
+/// @brief Stops the log writer thread and frees the log writer's resources
+///
+/// Waits for the thread to write everything already queued before closing
+/// the log.
+///
+/// @param writer  Log writer to clean up
+///
+/// @returns True if all data was written to the log; false otherwise
+bool CleanupLogWriter(LOG_WRITER *writer);
+
+//----------------------------------------------------------------------------
+/// @brief Gets a free read buffer from the log writer
+///
+/// Blocks until the log writer thread has written a buffer if all of the
+/// buffers are in use.
+///
+/// @param writer  Log writer to get buffer from
+///
+/// @returns Pointer to buffer if successful; NULL if the log writer failed
+char* GetLogBuffer(LOG_WRITER *writer);
+
+//----------------------------------------------------------------------------
+/// @brief Opens the first log file and starts the log writer thread
+///
+/// @param writer         Log writer to initialize
+/// @param logDir         Directory to save log files in
+/// @param bufferSize     Size of each read buffer, in bytes
+/// @param depth          Number of read buffers
+/// @param compress       Write the log as an LZ4 frame if true
+/// @param rotateSize     Start a new log once it reaches this many bytes
+///                       (0 to disable)
+/// @param rotateSeconds  Start a new log once it is this many seconds old
+///                       (0 to disable)
+/// @param buildIndex     Write an index file next to each log if true
+///
+/// @returns True if successful; false otherwise
+bool InitLogWriter(LOG_WRITER *writer, const char *logDir,
+		const UINT32 bufferSize, const UINT32 depth, const bool compress,
+		const UINT64 rotateSize, const UINT32 rotateSeconds, const bool buildIndex);
+
+//----------------------------------------------------------------------------
+/// @brief Opens a new PCAP-NG log file named after the host and current time
+///
+/// @param logDir      Directory to save log file in
+/// @param filename    Receives the log file name
+/// @param len         Size of filename, in bytes
+/// @param compressed  Add an .lz4 extension to the name if true
+///
+/// @returns Handle to log file if successful; INVALID_HANDLE_VALUE otherwise
+HANDLE OpenPcapNgFile(const char *logDir, char *filename, const size_t len,
+		const bool compressed);
+
+//----------------------------------------------------------------------------
+/// @brief Queues a read buffer for the log writer thread
+///
+/// The buffer returns to the free stack once the thread is done with it.
+///
+/// @param writer   Log writer to queue buffer on
+/// @param buffer   Buffer obtained from GetLogBuffer
+/// @param length   Number of bytes of data in the buffer
+/// @param command  What the thread should do with the buffer
+///
+/// @returns True if successful; false if the log writer failed
+bool QueueLogBuffer(LOG_WRITER *writer, char *buffer, const DWORD length,
+		const LogWriterCommands command);
+
+//----------------------------------------------------------------------------
+/// @brief Writes data to a log file
+///
+/// @param log      Log file to write to
+/// @param logFile  Log file name
+/// @param data     Data to write
+/// @param length   Number of bytes to write
+///
+/// @returns True if successful; false otherwise
+bool WriteLog(HANDLE log, const char *logFile, const void *data,
+		const DWORD length);
+
+#endif // LOG_WRITER_H
@@ -0,0 +1,309 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility LZ4 compression
+//
+// Writes and reads the LZ4 frame format, so the standard lz4 tool can also
+// decompress our logs.  The compressor is the simple greedy LZ4 matcher with
+// a single hash table, which is fast enough to keep up with the driver.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <Windows.h>
+#include <string.h>
+
+#include "lz4.h"
+
+//--------------------------------------------------------------------------
+// Defines
+//--------------------------------------------------------------------------
+
+#define LZ4_LAST_LITERALS  5       // Block must end with this many literals
+#define LZ4_MATCH_LIMIT    12      // Last match must start this far from the end
+#define LZ4_MAX_OFFSET     0xFFFF  // Largest distance back to a match
+#define LZ4_MIN_MATCH      4       // Shortest match
+
+#define XXH_PRIME32_1  0x9E3779B1U
+#define XXH_PRIME32_2  0x85EBCA77U
+#define XXH_PRIME32_3  0xC2B2AE3DU
+#define XXH_PRIME32_4  0x27D4EB2FU
+#define XXH_PRIME32_5  0x165667B1U
+
+#define XXH_ROTL32(x, r)  (((x) << (r)) | ((x) >> (32 - (r))))
+
+//--------------------------------------------------------------------------
+static inline UINT32 Read32(const UINT8 *data)
+{
+	UINT32 value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+//--------------------------------------------------------------------------
+static inline UINT32 HashSequence(const UINT32 sequence)
+{
+	return (sequence * 2654435761U) >> (32 - 14);
+}
+
+//--------------------------------------------------------------------------
+static inline UINT8* WriteLength(UINT8 *op, UINT32 length)
+{
+	for (; length >= 255; length -= 255) {
+		*op++ = 255;
+	}
+	*op++ = static_cast<UINT8>(length);
+	return op;
+}
+
+//--------------------------------------------------------------------------
+UINT32 XXH32(const UINT8 *data, const UINT32 length, const UINT32 seed)
+{
+	const UINT8 *end = data + length;
+	UINT32       hash;
+
+	if (length >= 16) {
+		UINT32 v1 = seed + XXH_PRIME32_1 + XXH_PRIME32_2;
+		UINT32 v2 = seed + XXH_PRIME32_2;
+		UINT32 v3 = seed;
+		UINT32 v4 = seed - XXH_PRIME32_1;
+
+		for (; data + 16 <= end; data += 16) {
+			v1 = XXH_ROTL32(v1 + Read32(data) * XXH_PRIME32_2, 13) * XXH_PRIME32_1;
+			v2 = XXH_ROTL32(v2 + Read32(data + 4) * XXH_PRIME32_2, 13) * XXH_PRIME32_1;
+			v3 = XXH_ROTL32(v3 + Read32(data + 8) * XXH_PRIME32_2, 13) * XXH_PRIME32_1;
+			v4 = XXH_ROTL32(v4 + Read32(data + 12) * XXH_PRIME32_2, 13) * XXH_PRIME32_1;
+		}
+		hash = XXH_ROTL32(v1, 1) + XXH_ROTL32(v2, 7) + XXH_ROTL32(v3, 12) +
+				XXH_ROTL32(v4, 18);
+	} else {
+		hash = seed + XXH_PRIME32_5;
+	}
+
+	hash += length;
+	for (; data + 4 <= end; data += 4) {
+		hash = XXH_ROTL32(hash + Read32(data) * XXH_PRIME32_3, 17) * XXH_PRIME32_4;
+	}
+	for (; data < end; data++) {
+		hash = XXH_ROTL32(hash + *data * XXH_PRIME32_5, 11) * XXH_PRIME32_1;
+	}
+	hash ^= hash >> 15;
+	hash *= XXH_PRIME32_2;
+	hash ^= hash >> 13;
+	hash *= XXH_PRIME32_3;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+//--------------------------------------------------------------------------
+UINT32 Lz4CompressBlock(const UINT8 *src, const UINT32 srcLength, UINT8 *dst,
+		const UINT32 dstLength, UINT32 *hashTable)
+{
+	const UINT8 *anchor = src;
+	const UINT8 *ip     = src;
+	const UINT8 *iend   = src + srcLength;
+	UINT8       *op     = dst;
+	UINT8       *oend   = dst + dstLength;
+	UINT32       length;
+
+	memset(hashTable, 0, LZ4_HASH_TABLE_SIZE * sizeof(UINT32));
+	if (srcLength > LZ4_MATCH_LIMIT) {
+		const UINT8 *mflimit    = iend - LZ4_MATCH_LIMIT;
+		const UINT8 *matchlimit = iend - LZ4_LAST_LITERALS;
+
+		for (ip++; ip < mflimit; ) {
+			const UINT32  sequence = Read32(ip);
+			const UINT32  hash     = HashSequence(sequence);
+			const UINT8  *ref      = src + hashTable[hash];
+
+			hashTable[hash] = static_cast<UINT32>(ip - src);
+			if ((ref >= ip) || (ip - ref > LZ4_MAX_OFFSET) ||
+					(Read32(ref) != sequence)) {
+				// Skip ahead faster the longer we go without a match
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			// Extend the match backwards over literals and then forwards
+			while ((ip > anchor) && (ref > src) && (ip[-1] == ref[-1])) {
+				ip--;
+				ref--;
+			}
+			UINT32 matchLength = LZ4_MIN_MATCH;
+			while ((ip + matchLength < matchlimit) &&
+					(ip[matchLength] == ref[matchLength])) {
+				matchLength++;
+			}
+
+			// Make sure the sequence fits, including the last literals
+			length = static_cast<UINT32>(ip - anchor);
+			if (op + 1 + length + length / 255 + 2 +
+					(matchLength - LZ4_MIN_MATCH) / 255 + 1 > oend) {
+				return 0;
+			}
+
+			UINT8 *token = op++;
+			*token = static_cast<UINT8>(((length >= 15) ? 15 : length) << 4);
+			if (length >= 15) {
+				op = WriteLength(op, length - 15);
+			}
+			memcpy(op, anchor, length);
+			op += length;
+
+			const UINT32 offset = static_cast<UINT32>(ip - ref);
+			*op++ = static_cast<UINT8>(offset);
+			*op++ = static_cast<UINT8>(offset >> 8);
+
+			length = matchLength - LZ4_MIN_MATCH;
+			*token |= static_cast<UINT8>((length >= 15) ? 15 : length);
+			if (length >= 15) {
+				op = WriteLength(op, length - 15);
+			}
+
+			ip    += matchLength;
+			anchor = ip;
+			if (ip < mflimit) {
+				hashTable[HashSequence(Read32(ip - 2))] =
+						static_cast<UINT32>(ip - 2 - src);
+			}
+		}
+	}
+
+	// Finish with the remaining literals
+	length = static_cast<UINT32>(iend - anchor);
+	if (op + 1 + length + length / 255 + 1 > oend) {
+		return 0;
+	}
+	*op++ = static_cast<UINT8>(((length >= 15) ? 15 : length) << 4);
+	if (length >= 15) {
+		op = WriteLength(op, length - 15);
+	}
+	memcpy(op, anchor, length);
+	op += length;
+	return static_cast<UINT32>(op - dst);
+}
+
+//--------------------------------------------------------------------------
+bool Lz4DecompressBlock(const UINT8 *src, const UINT32 srcLength, UINT8 *dst,
+		const UINT32 dstLength, UINT32 *length)
+{
+	const UINT8 *ip   = src;
+	const UINT8 *iend = src + srcLength;
+	UINT8       *op   = dst;
+	UINT8       *oend = dst + dstLength;
+
+	while (ip < iend) {
+		const UINT8 token = *ip++;
+		UINT32      count = token >> 4;
+		UINT8       extra;
+
+		// Copy literals
+		if (count == 15) {
+			do {
+				if (ip >= iend) {
+					return false;
+				}
+				extra  = *ip++;
+				count += extra;
+			} while (extra == 255);
+		}
+		if ((count > static_cast<UINT32>(iend - ip)) ||
+				(count > static_cast<UINT32>(oend - op))) {
+			return false;
+		}
+		memcpy(op, ip, count);
+		ip += count;
+		op += count;
+		if (ip == iend) {
+			break;  // Last literals
+		}
+
+		// Copy match, which may overlap the output
+		if (iend - ip < 2) {
+			return false;
+		}
+		const UINT32 offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!offset || (offset > static_cast<UINT32>(op - dst))) {
+			return false;
+		}
+		count = token & 15;
+		if (count == 15) {
+			do {
+				if (ip >= iend) {
+					return false;
+				}
+				extra  = *ip++;
+				count += extra;
+			} while (extra == 255);
+		}
+		count += LZ4_MIN_MATCH;
+		if (count > static_cast<UINT32>(oend - op)) {
+			return false;
+		}
+		const UINT8 *match = op - offset;
+		if (offset >= count) {
+			memcpy(op, match, count);
+			op += count;
+		} else {
+			while (count--) {
+				*op++ = *match++;
+			}
+		}
+	}
+
+	*length = static_cast<UINT32>(op - dst);
+	return true;
+}
+
+//--------------------------------------------------------------------------
+UINT32 Lz4ParseFrameHeader(const UINT8 *header, const UINT32 length,
+		UINT32 *maxBlock, UINT8 *flags)
+{
+	UINT32 size = LZ4_FRAME_HEADER_SIZE;
+
+	if ((length < LZ4_FRAME_HEADER_SIZE) || (Read32(header) != LZ4_FRAME_MAGIC)) {
+		return 0;
+	}
+	*flags = header[4];
+	if ((*flags & 0xC0) != LZ4_FLG_VERSION) {
+		return 0;
+	}
+	if (*flags & LZ4_FLG_CONTENT_SIZE) {
+		size += 8;
+	}
+	if (*flags & LZ4_FLG_DICT_ID) {
+		size += 4;
+	}
+	if (length < size) {
+		return 0;
+	}
+
+	const UINT8 blockSize = (header[5] >> 4) & 7;
+	if (blockSize < 4) {
+		return 0;
+	}
+	*maxBlock = 1 << (8 + 2 * blockSize);
+	if (static_cast<UINT8>(XXH32(header + 4, size - 5, 0) >> 8) != header[size - 1]) {
+		return 0;
+	}
+	return size;
+}
+
+//--------------------------------------------------------------------------
+void Lz4WriteFrameHeader(UINT8 *header)
+{
+	const UINT32 magic = LZ4_FRAME_MAGIC;
+
+	memcpy(header, &magic, sizeof(magic));
+	header[4] = LZ4_FLG_VERSION | LZ4_FLG_BLOCK_INDEP;
+	header[5] = 7 << 4;  // 4 MB blocks
+	header[6] = static_cast<UINT8>(XXH32(header + 4, 2, 0) >> 8);
+}
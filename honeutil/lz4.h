@@ -0,0 +1,82 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility LZ4 compression
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef LZ4_H
+#define LZ4_H
+
+//----------------------------------------------------------------------------
+// Defines
+//----------------------------------------------------------------------------
+
+#define LZ4_BLOCK_MAX_SIZE     0x400000    // Largest block in our frames (4 MB)
+#define LZ4_BLOCK_UNCOMPRESSED 0x80000000  // Block size flag for stored blocks
+#define LZ4_END_MARK_SIZE      4           // Size of the frame end mark
+#define LZ4_FRAME_HEADER_SIZE  7           // Size of the frames we write
+#define LZ4_FRAME_MAGIC        0x184D2204  // Magic number at start of frame
+#define LZ4_HASH_TABLE_SIZE    0x4000      // Number of entries in hash table
+
+#define LZ4_FLG_VERSION       0x40  // Frame version 01
+#define LZ4_FLG_BLOCK_INDEP   0x20  // Blocks are independent
+#define LZ4_FLG_BLOCK_CSUM    0x10  // Blocks have checksums
+#define LZ4_FLG_CONTENT_SIZE  0x08  // Frame header has content size
+#define LZ4_FLG_CONTENT_CSUM  0x04  // Frame ends with content checksum
+#define LZ4_FLG_DICT_ID       0x01  // Frame header has dictionary ID
+
+// Worst-case size of a compressed block with its size field
+#define LZ4_COMPRESS_BOUND(size)  ((size) + (size) / 255 + 16 + sizeof(UINT32))
+
+//----------------------------------------------------------------------------
+/// @brief Compresses data into an LZ4 block
+///
+/// @param src        Data to compress
+/// @param srcLength  Number of bytes to compress
+/// @param dst        Receives the compressed block
+/// @param dstLength  Size of dst, in bytes
+/// @param hashTable  Scratch table of LZ4_HASH_TABLE_SIZE entries
+///
+/// @returns Size of compressed block if successful; 0 if it doesn't fit in dst
+UINT32 Lz4CompressBlock(const UINT8 *src, const UINT32 srcLength, UINT8 *dst,
+		const UINT32 dstLength, UINT32 *hashTable);
+
+//----------------------------------------------------------------------------
+/// @brief Decompresses an LZ4 block
+///
+/// @param src        Compressed block
+/// @param srcLength  Size of compressed block, in bytes
+/// @param dst        Receives the decompressed data
+/// @param dstLength  Size of dst, in bytes
+/// @param length     Receives the number of bytes decompressed
+///
+/// @returns True if successful; false if the block is corrupt or too large
+bool Lz4DecompressBlock(const UINT8 *src, const UINT32 srcLength, UINT8 *dst,
+		const UINT32 dstLength, UINT32 *length);
+
+//----------------------------------------------------------------------------
+/// @brief Gets the size of the header at the start of an LZ4 frame
+///
+/// @param header    Start of the frame
+/// @param length    Number of bytes available at header
+/// @param maxBlock  Receives the largest block size the frame allows
+/// @param flags     Receives the frame flags
+///
+/// @returns Size of header if successful; 0 if the header is invalid or
+///          incomplete
+UINT32 Lz4ParseFrameHeader(const UINT8 *header, const UINT32 length,
+		UINT32 *maxBlock, UINT8 *flags);
+
+//----------------------------------------------------------------------------
+/// @brief Writes the header for a frame of independent blocks of up to
+///        LZ4_BLOCK_MAX_SIZE bytes with no checksums
+///
+/// @param header  Receives LZ4_FRAME_HEADER_SIZE bytes of frame header
+void Lz4WriteFrameHeader(UINT8 *header);
+
+#endif // LZ4_H
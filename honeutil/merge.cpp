@@ -0,0 +1,972 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility merge operations
+//
+// Merges logs from many hosts into one log in timestamp order.  Each host's
+// logs are read one after another as a single stream, and a heap of streams
+// ordered by the timestamp of each stream's next block picks the block to
+// write next.  Only one view of one log per host is mapped at a time, and
+// blocks are copied straight from the views to a fixed size output buffer,
+// so memory use doesn't grow with the size of the logs.
+//
+// PCAP-NG can't interleave blocks from several sections, so the merged log
+// has a single section.  Instead, each host gets its own interface
+// descriptions, which hold the host name and the options from the host's
+// section header, including the system ID (option 257), and packet blocks
+// are rewritten to use the merged interface IDs.  Process and connection IDs
+// are only unique within a host, so they are renumbered too: each host keeps
+// a map from its IDs to IDs that are unique in the merged log, and process,
+// connection, and packet blocks are rewritten to use the merged IDs.  The
+// maps are the only memory that grows, and only with the number of
+// processes and connections.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <Windows.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture_reader.h"
+#include "common.h"
+#include "log_writer.h"
+#include "merge.h"
+
+//--------------------------------------------------------------------------
+// Defines
+//--------------------------------------------------------------------------
+
+#define MERGE_APPLICATION     "honeutil merge"  // Application option for the merged log
+#define MERGE_BUFFER_SIZE     0x100000          // Size of output buffer (1 MB)
+#define MERGE_ID_MAP_BITS     10                // Log2 of the initial number of ID map slots
+#define MERGE_MAX_INTERFACES  16                // Interfaces per host
+#define MERGE_NO_INTERFACE    0xFFFFFFFF        // Output ID of an interface whose description was dropped
+#define MERGE_OUTPUT_NAME     "merged.pcapng"   // Name of the merged log
+#define MERGE_VIEW_SIZE       0x400000          // Size of each view of a log (4 MB)
+
+#define MERGE_SECTION_LENGTH  (sizeof(PCAP_NG_SECTION_HEADER) + \
+		2 * sizeof(PCAP_NG_OPTION_HEADER) + \
+		PCAP_NG_PADDING(sizeof(MERGE_APPLICATION) - 1) + sizeof(UINT32))
+
+//--------------------------------------------------------------------------
+// Structures and enumerations
+//--------------------------------------------------------------------------
+
+struct MERGE_INTERFACE {
+	UINT32 OutputId;    // Interface ID in the merged log
+	UINT16 LinkType;    // Link type of the host's interface
+	UINT32 SnapLength;  // Snap length of the host's interface
+};
+
+struct MERGE_ID {
+	UINT32 Id;        // ID in the host's logs
+	UINT32 MergedId;  // ID in the merged log (0 if the slot is empty)
+};
+
+struct MERGE_ID_MAP {
+	MERGE_ID *Slots;  // Open-addressing hash table of IDs
+	UINT32    Bits;   // Log2 of the number of slots
+	UINT32    Count;  // Number of IDs in the map
+};
+
+struct MERGE_STREAM {
+	char          **Files;                             // Host's logs, oldest first
+	UINT32          NumFiles;                          // Number of logs
+	UINT32          NextFile;                          // Index of next log to open
+	const char     *Host;                              // Host name from the first log name
+	UINT32          HostLength;                        // Length of host name
+	UINT32          Index;                             // Stream number, which breaks timestamp ties
+	CAPTURE_FILE    Capture;                           // Log being read
+	bool            IsOpen;                            // Set if Capture is open
+	bool            Replaying;                         // Set while skipping blocks repeated by rotation
+	CAPTURE_BLOCK   Block;                             // Next block to write
+	bool            HasBlock;                          // Set if Block holds a block
+	UINT64          Timestamp;                         // Timestamp of Block
+	UINT64          LastTimestamp;                     // Timestamp of the last block written
+	UINT8          *SectionHeader;                     // Copy of the latest section header block
+	UINT32          SectionHeaderLength;               // Section header block length in bytes
+	MERGE_INTERFACE Interfaces[MERGE_MAX_INTERFACES];  // Host's interfaces
+	UINT32          NumInterfaces;                     // Number of interfaces seen in any log
+	UINT32          FileInterfaces;                    // Number of interfaces seen in this log
+	MERGE_ID_MAP    Processes;                         // Host's process IDs
+	MERGE_ID_MAP    Connections;                       // Host's connection IDs
+};
+
+struct MERGE_OUTPUT {
+	HANDLE      File;           // Merged log
+	const char *FileName;       // Merged log file name
+	UINT8      *Buffer;         // Blocks waiting to be written
+	UINT32      Used;           // Number of bytes in Buffer
+	UINT64      BytesWritten;   // Number of bytes written to the merged log
+	UINT32      NumInterfaces;  // Number of interfaces in the merged log
+	UINT64      NumBlocks;      // Number of blocks copied from the logs
+	UINT64      NumReplayed;    // Number of blocks skipped at the start of rotated logs
+	UINT64      NumDropped;     // Number of invalid blocks skipped
+	UINT32      NumErrors;      // Number of logs that couldn't be read to the end
+	UINT8      *Scratch;        // Copy of a block whose IDs are being rewritten
+	UINT32      ScratchSize;    // Size of Scratch in bytes
+	UINT32      NumProcesses;   // Number of process IDs given out in the merged log
+	UINT32      NumConnections; // Number of connection IDs given out in the merged log
+};
+
+//--------------------------------------------------------------------------
+// Function prototypes
+//--------------------------------------------------------------------------
+
+UINT32 AppendMergeOption(UINT8 *buffer, UINT32 offset, const UINT16 code,
+		const void *data, const UINT16 length);
+bool MapMergeId(MERGE_ID_MAP *map, const UINT32 id, UINT32 *numIds,
+		UINT32 *mergedId);
+bool NextMergeBlock(MERGE_OUTPUT *output, MERGE_STREAM *stream);
+const PCAP_NG_OPTION_HEADER* NextMergeOption(const UINT8 *block,
+		const UINT32 length, UINT32 *offset);
+bool RemapMergeOptions(MERGE_OUTPUT *output, MERGE_STREAM *stream,
+		UINT8 *block, const UINT32 length, UINT32 offset,
+		const UINT16 connectionCode, const UINT16 processCode);
+bool SaveMergeSectionHeader(MERGE_STREAM *stream);
+void SiftMergeHeap(MERGE_STREAM **heap, const UINT32 count, UINT32 index);
+bool WriteMergeBlock(MERGE_OUTPUT *output, MERGE_STREAM *stream);
+bool WriteMergeData(MERGE_OUTPUT *output, const void *data, UINT32 length);
+bool WriteMergeSectionHeader(MERGE_OUTPUT *output);
+
+//--------------------------------------------------------------------------
+bool AddMergeInterface(MERGE_OUTPUT *output, MERGE_STREAM *stream)
+{
+	static const UINT16 sectionOptions[][2] = {
+		{   2,  15 },  // Hardware becomes if_hardware
+		{   3,  12 },  // Operating system becomes if_os
+		{ 257, 257 },  // System ID stays the same
+	};
+	const UINT32                          optionsStart =
+			offsetof(PCAP_NG_INTERFACE_DESCRIPTION, IfDescHeader);
+	const CAPTURE_BLOCK                  *block        = &stream->Block;
+	UINT8                                *buffer;
+	MERGE_INTERFACE                      *entry;
+	const PCAP_NG_INTERFACE_DESCRIPTION  *header;
+	UINT32                                index;
+	bool                                  known;
+	UINT32                                length;
+	UINT32                                offset;
+	const PCAP_NG_OPTION_HEADER          *option;
+	UINT32                                position;
+	bool                                  rc;
+
+	// Dropped interface descriptions still use up an interface ID, so the
+	// packets for the interfaces after them keep pointing at the right ones
+	index = stream->FileInterfaces++;
+	if (index >= MERGE_MAX_INTERFACES) {
+		if (index == MERGE_MAX_INTERFACES) {
+			printf("Skipping interfaces after the first %u in %s\n",
+					MERGE_MAX_INTERFACES, stream->Files[stream->NextFile - 1]);
+		}
+		output->NumDropped++;
+		return true;
+	}
+	entry = stream->Interfaces + index;
+	known = (index < stream->NumInterfaces) ? true : false;
+	if (!known) {
+		stream->NumInterfaces = index + 1;
+	}
+	if (block->BlockLength < optionsStart + sizeof(UINT32)) {
+		entry->OutputId = MERGE_NO_INTERFACE;
+		output->NumDropped++;
+		return true;
+	}
+	header = reinterpret_cast<const PCAP_NG_INTERFACE_DESCRIPTION*>(block->Data);
+
+	// Keep using the interface from the host's previous log if it matches
+	if (known && (entry->OutputId != MERGE_NO_INTERFACE) &&
+			(entry->LinkType == header->LinkType) &&
+			(entry->SnapLength == header->SnapLength)) {
+		return true;
+	}
+	entry->OutputId   = output->NumInterfaces++;
+	entry->LinkType   = header->LinkType;
+	entry->SnapLength = header->SnapLength;
+
+	// The new interface description can only be longer by the host name and
+	// the options from the section header
+	length = block->BlockLength + stream->SectionHeaderLength +
+			2 * sizeof(PCAP_NG_OPTION_HEADER) + PCAP_NG_PADDING(stream->HostLength);
+	buffer = reinterpret_cast<UINT8*>(malloc(length));
+	if (buffer == NULL) {
+		fputs("Cannot allocate memory for interface description\n", stdout);
+		return false;
+	}
+	memcpy(buffer, block->Data, optionsStart);
+	offset = AppendMergeOption(buffer, optionsStart, 2, stream->Host,
+			static_cast<UINT16>(stream->HostLength));
+
+	// Copy the interface's own options, except for its name
+	position = optionsStart;
+	while ((option = NextMergeOption(block->Data, block->BlockLength,
+			&position)) != NULL) {
+		if (option->OptionCode != 2) {
+			offset = AppendMergeOption(buffer, offset, option->OptionCode,
+					option + 1, option->OptionLength);
+		}
+	}
+
+	// Describe the host with the options from its section header
+	for (index = 0; (stream->SectionHeader != NULL) &&
+			(index < sizeof(sectionOptions) / sizeof(sectionOptions[0])); index++) {
+		position = sizeof(PCAP_NG_SECTION_HEADER);
+		while ((option = NextMergeOption(stream->SectionHeader,
+				stream->SectionHeaderLength, &position)) != NULL) {
+			if (option->OptionCode == sectionOptions[index][0]) {
+				offset = AppendMergeOption(buffer, offset, sectionOptions[index][1],
+						option + 1, option->OptionLength);
+				break;
+			}
+		}
+	}
+	offset = AppendMergeOption(buffer, offset, 0, NULL, 0);
+
+	length = offset + sizeof(UINT32);
+	reinterpret_cast<UINT32*>(buffer)[1] = length;
+	*reinterpret_cast<UINT32*>(buffer + offset) = length;
+	rc = WriteMergeData(output, buffer, length);
+	free(buffer);
+	return rc;
+}
+
+//--------------------------------------------------------------------------
+UINT32 AppendMergeOption(UINT8 *buffer, UINT32 offset, const UINT16 code,
+		const void *data, const UINT16 length)
+{
+	PCAP_NG_OPTION_HEADER *option =
+			reinterpret_cast<PCAP_NG_OPTION_HEADER*>(buffer + offset);
+	const UINT32           padded = PCAP_NG_PADDING(length);
+
+	option->OptionCode   = code;
+	option->OptionLength = length;
+	offset += sizeof(PCAP_NG_OPTION_HEADER);
+	if (length) {
+		memcpy(buffer + offset, data, length);
+		ZeroMemory(buffer + offset + length, padded - length);
+		offset += padded;
+	}
+	return offset;
+}
+
+//--------------------------------------------------------------------------
+int __cdecl CompareMergeFiles(const void *left, const void *right)
+{
+	const char *leftName  = *reinterpret_cast<char* const*>(left);
+	const char *rightName = *reinterpret_cast<char* const*>(right);
+	const char *leftNext  = leftName;
+	const char *rightNext = rightName;
+
+	// Compare runs of digits by value, so that the sequence numbers that log
+	// rotation adds put "_2" before "_10"
+	while (*leftNext && *rightNext) {
+		if (isdigit(static_cast<unsigned char>(*leftNext)) &&
+				isdigit(static_cast<unsigned char>(*rightNext))) {
+			size_t leftDigits  = 0;
+			size_t rightDigits = 0;
+			int    diff;
+
+			while (*leftNext == '0') {
+				leftNext++;
+			}
+			while (*rightNext == '0') {
+				rightNext++;
+			}
+			while (isdigit(static_cast<unsigned char>(leftNext[leftDigits]))) {
+				leftDigits++;
+			}
+			while (isdigit(static_cast<unsigned char>(rightNext[rightDigits]))) {
+				rightDigits++;
+			}
+			if (leftDigits != rightDigits) {
+				return (leftDigits < rightDigits) ? -1 : 1;
+			}
+			diff = strncmp(leftNext, rightNext, leftDigits);
+			if (diff) {
+				return diff;
+			}
+			leftNext  += leftDigits;
+			rightNext += rightDigits;
+		} else {
+			const int diff = tolower(static_cast<unsigned char>(*leftNext)) -
+					tolower(static_cast<unsigned char>(*rightNext));
+			if (diff) {
+				return diff;
+			}
+			leftNext++;
+			rightNext++;
+		}
+	}
+	if (*leftNext || *rightNext) {
+		return *leftNext ? 1 : -1;
+	}
+	return _stricmp(leftName, rightName);
+}
+
+//--------------------------------------------------------------------------
+bool CopyMergeBlock(MERGE_OUTPUT *output, const CAPTURE_BLOCK *block)
+{
+	if (block->BlockLength > output->ScratchSize) {
+		UINT8 *scratch = reinterpret_cast<UINT8*>(realloc(output->Scratch,
+				block->BlockLength));
+		if (scratch == NULL) {
+			fputs("Cannot allocate memory for block\n", stdout);
+			return false;
+		}
+		output->Scratch     = scratch;
+		output->ScratchSize = block->BlockLength;
+	}
+	memcpy(output->Scratch, block->Data, block->BlockLength);
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool FlushMergeOutput(MERGE_OUTPUT *output)
+{
+	if (output->Used && !WriteLog(output->File, output->FileName,
+			output->Buffer, output->Used)) {
+		return false;
+	}
+	output->BytesWritten += output->Used;
+	output->Used          = 0;
+	return true;
+}
+
+//--------------------------------------------------------------------------
+UINT32 GetMergeIdSlot(const UINT32 id, const UINT32 bits)
+{
+	// Use the top bits of the product, which depend on every bit of the ID
+	return (id * 2654435761U) >> (32 - bits);
+}
+
+//--------------------------------------------------------------------------
+bool GrowMergeIdMap(MERGE_ID_MAP *map)
+{
+	const UINT32  bits  = map->Slots ? map->Bits + 1 : MERGE_ID_MAP_BITS;
+	const UINT32  mask  = (1U << bits) - 1;
+	MERGE_ID     *slots = reinterpret_cast<MERGE_ID*>(calloc(mask + 1,
+			sizeof(MERGE_ID)));
+	UINT32        index;
+
+	if (slots == NULL) {
+		fputs("Cannot allocate memory for ID map\n", stdout);
+		return false;
+	}
+	for (index = 0; (map->Slots != NULL) && (index < (1U << map->Bits)); index++) {
+		if (map->Slots[index].MergedId) {
+			UINT32 slot = GetMergeIdSlot(map->Slots[index].Id, bits);
+			while (slots[slot].MergedId) {
+				slot = (slot + 1) & mask;
+			}
+			slots[slot] = map->Slots[index];
+		}
+	}
+	if (map->Slots != NULL) {
+		free(map->Slots);
+	}
+	map->Slots = slots;
+	map->Bits  = bits;
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool IsMergeDigits(const char *str, const UINT32 count)
+{
+	UINT32 index;
+
+	for (index = 0; index < count; index++) {
+		if (!isdigit(static_cast<unsigned char>(str[index]))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------
+UINT32 GetMergeHostLength(const char *name)
+{
+	UINT32 digits;
+	UINT32 end;
+	UINT32 length = static_cast<UINT32>(strlen(name));
+
+	if ((length > 7) && (_stricmp(name + length - 7, ".pcapng") == 0)) {
+		length -= 7;
+	}
+
+	// Skip the sequence number added when several logs start in one second
+	end = length;
+	for (digits = 0; (digits < end) &&
+			isdigit(static_cast<unsigned char>(name[end - digits - 1])); digits++);
+	if ((digits >= 1) && (digits <= 3) && (digits < end) &&
+			(name[end - digits - 1] == '_')) {
+		end -= digits + 1;
+	}
+
+	// Log names end with _YYYYMMDD_HHMMSS after the host name
+	if ((end > 16) && (name[end - 16] == '_') && (name[end - 7] == '_') &&
+			IsMergeDigits(name + end - 15, 8) && IsMergeDigits(name + end - 6, 6)) {
+		return end - 16;
+	}
+	return length;
+}
+
+//--------------------------------------------------------------------------
+bool IsMergeStreamBefore(const MERGE_STREAM *left, const MERGE_STREAM *right)
+{
+	if (left->Timestamp != right->Timestamp) {
+		return (left->Timestamp < right->Timestamp) ? true : false;
+	}
+	return (left->Index < right->Index) ? true : false;
+}
+
+//--------------------------------------------------------------------------
+bool MapMergeId(MERGE_ID_MAP *map, const UINT32 id, UINT32 *numIds,
+		UINT32 *mergedId)
+{
+	UINT32 mask;
+	UINT32 slot;
+
+	// Missing IDs stay missing
+	if (id == CAPTURE_NO_ID) {
+		*mergedId = id;
+		return true;
+	}
+
+	// Keep the map at most half full, so probe sequences stay short
+	if (((map->Slots == NULL) || (2 * (map->Count + 1) > (1U << map->Bits))) &&
+			!GrowMergeIdMap(map)) {
+		return false;
+	}
+	mask = (1U << map->Bits) - 1;
+	for (slot = GetMergeIdSlot(id, map->Bits); map->Slots[slot].MergedId &&
+			(map->Slots[slot].Id != id); slot = (slot + 1) & mask);
+	if (!map->Slots[slot].MergedId) {
+		if (*numIds == CAPTURE_NO_ID - 1) {
+			fputs("Too many IDs to merge\n", stdout);
+			return false;
+		}
+		map->Slots[slot].Id       = id;
+		map->Slots[slot].MergedId = ++(*numIds);
+		map->Count++;
+	}
+	*mergedId = map->Slots[slot].MergedId;
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool MergeLogs(const bool verbose, const char *inputPattern,
+		const char *outputDir)
+{
+	UINT32            dirLength    = 0;
+	LARGE_INTEGER     end;
+	UINT32            fileCapacity = 0;
+	char            **files        = NULL;
+	HANDLE            find;
+	WIN32_FIND_DATA   findData;
+	LARGE_INTEGER     frequency;
+	MERGE_STREAM    **heap         = NULL;
+	UINT32            heapCount    = 0;
+	UINT32            index;
+	UINT32            numFiles     = 0;
+	UINT32            numStreams   = 0;
+	MERGE_OUTPUT      output;
+	char              outputFile[MAX_PATH];
+	bool              rc           = false;
+	double            seconds;
+	LARGE_INTEGER     start;
+	MERGE_STREAM     *stream;
+	MERGE_STREAM     *streams      = NULL;
+
+	ZeroMemory(&output, sizeof(output));
+	output.File     = INVALID_HANDLE_VALUE;
+	output.FileName = outputFile;
+	_snprintf_s(outputFile, sizeof(outputFile), sizeof(outputFile), "%s\\%s",
+			outputDir, MERGE_OUTPUT_NAME);
+
+	// Find the logs, which are all in the directory from the pattern
+	for (index = 0; inputPattern[index] != '\0'; index++) {
+		if ((inputPattern[index] == '\\') || (inputPattern[index] == '/') ||
+				(inputPattern[index] == ':')) {
+			dirLength = index + 1;
+		}
+	}
+	find = FindFirstFile(inputPattern, &findData);
+	if (find == INVALID_HANDLE_VALUE) {
+		printf("No logs match %s\n", inputPattern);
+		goto Cleanup;
+	}
+	do {
+		size_t length;
+
+		if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+				(_stricmp(findData.cFileName, MERGE_OUTPUT_NAME) == 0)) {
+			continue;
+		}
+		if (numFiles == fileCapacity) {
+			const UINT32   capacity = fileCapacity ? fileCapacity * 2 : 64;
+			char         **newFiles = reinterpret_cast<char**>(realloc(files,
+					capacity * sizeof(char*)));
+			if (newFiles == NULL) {
+				fputs("Cannot allocate memory for log names\n", stdout);
+				FindClose(find);
+				goto Cleanup;
+			}
+			files        = newFiles;
+			fileCapacity = capacity;
+		}
+		length = dirLength + strlen(findData.cFileName) + 1;
+		files[numFiles] = reinterpret_cast<char*>(malloc(length));
+		if (files[numFiles] == NULL) {
+			fputs("Cannot allocate memory for log names\n", stdout);
+			FindClose(find);
+			goto Cleanup;
+		}
+		_snprintf_s(files[numFiles], length, length, "%.*s%s", dirLength,
+				inputPattern, findData.cFileName);
+		numFiles++;
+	} while (FindNextFile(find, &findData));
+	FindClose(find);
+	if (!numFiles) {
+		printf("No logs match %s\n", inputPattern);
+		goto Cleanup;
+	}
+
+	// Sorting by name puts each host's logs together in the order they were
+	// written, so each run of logs with the same host name is a stream
+	qsort(files, numFiles, sizeof(char*), CompareMergeFiles);
+	streams = reinterpret_cast<MERGE_STREAM*>(calloc(numFiles,
+			sizeof(MERGE_STREAM)));
+	heap    = reinterpret_cast<MERGE_STREAM**>(calloc(numFiles,
+			sizeof(MERGE_STREAM*)));
+	if ((streams == NULL) || (heap == NULL)) {
+		fputs("Cannot allocate memory for streams\n", stdout);
+		goto Cleanup;
+	}
+	for (index = 0; index < numFiles; index++) {
+		const char   *name       = files[index] + dirLength;
+		const UINT32  hostLength = GetMergeHostLength(name);
+
+		stream = numStreams ? streams + numStreams - 1 : NULL;
+		if ((stream == NULL) || (stream->HostLength != hostLength) ||
+				(_strnicmp(stream->Host, name, hostLength) != 0)) {
+			stream = streams + numStreams;
+			stream->Files         = files + index;
+			stream->Host          = name;
+			stream->HostLength    = hostLength;
+			stream->Index         = numStreams;
+			numStreams++;
+		}
+		stream->NumFiles++;
+	}
+	if (verbose) {
+		for (index = 0; index < numStreams; index++) {
+			printf("Host %.*s: %u logs\n", streams[index].HostLength,
+					streams[index].Host, streams[index].NumFiles);
+		}
+	}
+
+	output.Buffer = reinterpret_cast<UINT8*>(malloc(MERGE_BUFFER_SIZE));
+	if (output.Buffer == NULL) {
+		fputs("Cannot allocate memory for output buffer\n", stdout);
+		goto Cleanup;
+	}
+	output.File = CreateFile(outputFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			0, 0);
+	if (output.File == INVALID_HANDLE_VALUE) {
+		LogError("Cannot open %s", outputFile);
+		goto Cleanup;
+	}
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	if (!WriteMergeSectionHeader(&output)) {
+		goto Cleanup;
+	}
+
+	// Build the heap from the first block of each stream
+	for (index = 0; index < numStreams; index++) {
+		if (!NextMergeBlock(&output, streams + index)) {
+			goto Cleanup;
+		}
+		if (streams[index].HasBlock) {
+			heap[heapCount++] = streams + index;
+		}
+	}
+	for (index = heapCount / 2; index > 0; index--) {
+		SiftMergeHeap(heap, heapCount, index - 1);
+	}
+
+	// Write the oldest block, then put its stream back in the heap
+	while (heapCount) {
+		stream = heap[0];
+		if (!WriteMergeBlock(&output, stream) || !NextMergeBlock(&output, stream)) {
+			goto Cleanup;
+		}
+		if (!stream->HasBlock) {
+			heap[0] = heap[--heapCount];
+		}
+		SiftMergeHeap(heap, heapCount, 0);
+	}
+	if (!FlushMergeOutput(&output)) {
+		goto Cleanup;
+	}
+	QueryPerformanceCounter(&end);
+	seconds = static_cast<double>(end.QuadPart - start.QuadPart) /
+			static_cast<double>(frequency.QuadPart);
+
+	printf("Merged %I64u blocks from %u logs from %u hosts into %s\n",
+			output.NumBlocks, numFiles, numStreams, outputFile);
+	if (output.NumReplayed) {
+		printf("  Skipped %I64u blocks that rotation repeated at the start of a log\n",
+				output.NumReplayed);
+	}
+	if (output.NumDropped) {
+		printf("  Skipped %I64u invalid blocks\n", output.NumDropped);
+	}
+	if (seconds > 0.0) {
+		printf("Wrote %I64u bytes in %.3f seconds (%.2f MB/s)\n",
+				output.BytesWritten, seconds,
+				static_cast<double>(static_cast<INT64>(output.BytesWritten)) /
+				seconds / (1024.0 * 1024.0));
+	}
+	rc = output.NumErrors ? false : true;
+
+Cleanup:
+	for (index = 0; (streams != NULL) && (index < numStreams); index++) {
+		if (streams[index].IsOpen) {
+			CloseCaptureFile(&streams[index].Capture);
+		}
+		if (streams[index].SectionHeader != NULL) {
+			free(streams[index].SectionHeader);
+		}
+		if (streams[index].Processes.Slots != NULL) {
+			free(streams[index].Processes.Slots);
+		}
+		if (streams[index].Connections.Slots != NULL) {
+			free(streams[index].Connections.Slots);
+		}
+	}
+	if (output.File != INVALID_HANDLE_VALUE) {
+		CloseHandle(output.File);
+	}
+	if (output.Buffer != NULL) {
+		free(output.Buffer);
+	}
+	if (output.Scratch != NULL) {
+		free(output.Scratch);
+	}
+	for (index = 0; index < numFiles; index++) {
+		free(files[index]);
+	}
+	if (files != NULL) {
+		free(files);
+	}
+	if (streams != NULL) {
+		free(streams);
+	}
+	if (heap != NULL) {
+		free(heap);
+	}
+	return rc;
+}
+
+//--------------------------------------------------------------------------
+bool NextMergeBlock(MERGE_OUTPUT *output, MERGE_STREAM *stream)
+{
+	const PCAP_NG_CONNECTION_HEADER *connection;
+	CAPTURE_PACKET                   packet;
+	const PCAP_NG_PROCESS_HEADER    *process;
+
+	stream->HasBlock = false;
+	for (;;) {
+		if (!stream->IsOpen) {
+			if (stream->NextFile == stream->NumFiles) {
+				return true;
+			}
+			if (!OpenCaptureFile(&stream->Capture, stream->Files[stream->NextFile])) {
+				output->NumErrors++;
+				stream->NextFile++;
+				continue;
+			}
+			stream->Capture.ViewSize = MERGE_VIEW_SIZE;
+			stream->IsOpen           = true;
+			stream->Replaying        = stream->NextFile ? true : false;
+			stream->FileInterfaces   = 0;
+			stream->NextFile++;
+		}
+		if (!ReadCaptureBlock(&stream->Capture, &stream->Block)) {
+			if (stream->Capture.Failed) {
+				printf("Skipping the rest of %s\n",
+						stream->Files[stream->NextFile - 1]);
+				output->NumErrors++;
+			}
+			CloseCaptureFile(&stream->Capture);
+			stream->IsOpen = false;
+			continue;
+		}
+
+		switch (stream->Block.BlockType) {
+		case SectionHeaderBlock:
+			if (!SaveMergeSectionHeader(stream)) {
+				return false;
+			}
+			continue;
+		case InterfaceDescriptionBlock:
+			if (!AddMergeInterface(output, stream)) {
+				return false;
+			}
+			continue;
+		case PacketBlock:
+			if (!GetCapturePacket(&stream->Block, &packet) ||
+					(packet.Header->InterfaceId >= stream->FileInterfaces) ||
+					(packet.Header->InterfaceId >= MERGE_MAX_INTERFACES) ||
+					(stream->Interfaces[packet.Header->InterfaceId].OutputId ==
+					MERGE_NO_INTERFACE)) {
+				output->NumDropped++;
+				continue;
+			}
+			stream->Timestamp = packet.Timestamp;
+			stream->Replaying = false;
+			break;
+		case ProcessBlock:
+			process = GetCaptureProcess(&stream->Block);
+			if (process == NULL) {
+				output->NumDropped++;
+				continue;
+			}
+			stream->Timestamp = (static_cast<UINT64>(process->TimestampHigh) << 32) |
+					process->TimestampLow;
+			break;
+		case ConnectionBlock:
+			connection = GetCaptureConnection(&stream->Block);
+			if (connection == NULL) {
+				output->NumDropped++;
+				continue;
+			}
+			stream->Timestamp = (static_cast<UINT64>(connection->TimestampHigh) << 32) |
+					connection->TimestampLow;
+			break;
+		default:
+			stream->Timestamp = stream->LastTimestamp;
+			break;
+		}
+
+		// Rotated logs start with copies of the blocks for running processes
+		// and open connections, which were already merged from the last log
+		if (stream->Replaying) {
+			if (stream->Timestamp < stream->LastTimestamp) {
+				output->NumReplayed++;
+				continue;
+			}
+			stream->Replaying = false;
+		}
+		stream->HasBlock = true;
+		return true;
+	}
+}
+
+//--------------------------------------------------------------------------
+const PCAP_NG_OPTION_HEADER* NextMergeOption(const UINT8 *block,
+		const UINT32 length, UINT32 *offset)
+{
+	const UINT32                 end = length - sizeof(UINT32);
+	const PCAP_NG_OPTION_HEADER *option;
+
+	if ((*offset > end) || (end - *offset < sizeof(PCAP_NG_OPTION_HEADER))) {
+		return NULL;
+	}
+	option = reinterpret_cast<const PCAP_NG_OPTION_HEADER*>(block + *offset);
+	if ((option->OptionCode == 0) ||
+			(static_cast<UINT32>(PCAP_NG_PADDING(option->OptionLength)) >
+			end - *offset - sizeof(PCAP_NG_OPTION_HEADER))) {
+		return NULL;
+	}
+	*offset += sizeof(PCAP_NG_OPTION_HEADER) +
+			PCAP_NG_PADDING(option->OptionLength);
+	return option;
+}
+
+//--------------------------------------------------------------------------
+bool RemapMergeOptions(MERGE_OUTPUT *output, MERGE_STREAM *stream,
+		UINT8 *block, const UINT32 length, UINT32 offset,
+		const UINT16 connectionCode, const UINT16 processCode)
+{
+	const PCAP_NG_OPTION_HEADER *option;
+
+	while ((option = NextMergeOption(block, length, &offset)) != NULL) {
+		UINT32 *value = const_cast<UINT32*>(
+				reinterpret_cast<const UINT32*>(option + 1));
+
+		if (option->OptionLength != sizeof(UINT32)) {
+			continue;
+		}
+		if (connectionCode && (option->OptionCode == connectionCode) &&
+				!MapMergeId(&stream->Connections, *value,
+				&output->NumConnections, value)) {
+			return false;
+		}
+		if (processCode && (option->OptionCode == processCode) &&
+				!MapMergeId(&stream->Processes, *value,
+				&output->NumProcesses, value)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool SaveMergeSectionHeader(MERGE_STREAM *stream)
+{
+	UINT8 *copy = reinterpret_cast<UINT8*>(malloc(stream->Block.BlockLength));
+
+	if (copy == NULL) {
+		fputs("Cannot allocate memory for section header\n", stdout);
+		return false;
+	}
+	memcpy(copy, stream->Block.Data, stream->Block.BlockLength);
+	if (stream->SectionHeader != NULL) {
+		free(stream->SectionHeader);
+	}
+	stream->SectionHeader       = copy;
+	stream->SectionHeaderLength = stream->Block.BlockLength;
+
+	// A new section starts numbering its interfaces again
+	stream->FileInterfaces = 0;
+	return true;
+}
+
+//--------------------------------------------------------------------------
+void SiftMergeHeap(MERGE_STREAM **heap, const UINT32 count, UINT32 index)
+{
+	for (;;) {
+		const UINT32  left     = 2 * index + 1;
+		const UINT32  right    = left + 1;
+		UINT32        smallest = index;
+		MERGE_STREAM *swap;
+
+		if ((left < count) && IsMergeStreamBefore(heap[left], heap[smallest])) {
+			smallest = left;
+		}
+		if ((right < count) && IsMergeStreamBefore(heap[right], heap[smallest])) {
+			smallest = right;
+		}
+		if (smallest == index) {
+			return;
+		}
+		swap            = heap[index];
+		heap[index]     = heap[smallest];
+		heap[smallest]  = swap;
+		index           = smallest;
+	}
+}
+
+//--------------------------------------------------------------------------
+bool WriteMergeBlock(MERGE_OUTPUT *output, MERGE_STREAM *stream)
+{
+	const CAPTURE_BLOCK          *block = &stream->Block;
+	UINT32                       *fields;
+	const PCAP_NG_PACKET_HEADER  *header;
+	bool                          rc;
+
+	switch (block->BlockType) {
+	case PacketBlock:
+		// Switch to the host's interface and IDs in the merged log
+		if (!CopyMergeBlock(output, block)) {
+			return false;
+		}
+		fields    = reinterpret_cast<UINT32*>(output->Scratch);
+		header    = reinterpret_cast<const PCAP_NG_PACKET_HEADER*>(fields);
+		fields[2] = stream->Interfaces[fields[2]].OutputId;
+		rc = RemapMergeOptions(output, stream, output->Scratch,
+				block->BlockLength, sizeof(PCAP_NG_PACKET_HEADER) +
+				PCAP_NG_PADDING(header->CapturedLength), 257, 258) &&
+				WriteMergeData(output, output->Scratch, block->BlockLength);
+		break;
+	case ProcessBlock:
+		// Switch to the host's process and parent process IDs in the merged log
+		if (!CopyMergeBlock(output, block)) {
+			return false;
+		}
+		fields = reinterpret_cast<UINT32*>(output->Scratch);
+		rc = MapMergeId(&stream->Processes, fields[2], &output->NumProcesses,
+				fields + 2) &&
+				RemapMergeOptions(output, stream, output->Scratch,
+				block->BlockLength, offsetof(PCAP_NG_PROCESS_HEADER,
+				ParentPidHeader), 0, 5) &&
+				WriteMergeData(output, output->Scratch, block->BlockLength);
+		break;
+	case ConnectionBlock:
+		// Switch to the host's connection and process IDs in the merged log
+		if (!CopyMergeBlock(output, block)) {
+			return false;
+		}
+		fields = reinterpret_cast<UINT32*>(output->Scratch);
+		rc = MapMergeId(&stream->Connections, fields[2],
+				&output->NumConnections, fields + 2) &&
+				MapMergeId(&stream->Processes, fields[3], &output->NumProcesses,
+				fields + 3) &&
+				WriteMergeData(output, output->Scratch, block->BlockLength);
+		break;
+	default:
+		rc = WriteMergeData(output, block->Data, block->BlockLength);
+		break;
+	}
+	output->NumBlocks++;
+	stream->LastTimestamp = stream->Timestamp;
+	return rc;
+}
+
+//--------------------------------------------------------------------------
+bool WriteMergeData(MERGE_OUTPUT *output, const void *data, UINT32 length)
+{
+	const UINT8 *bytes = reinterpret_cast<const UINT8*>(data);
+
+	while (length) {
+		UINT32 count;
+
+		if ((output->Used == MERGE_BUFFER_SIZE) && !FlushMergeOutput(output)) {
+			return false;
+		}
+		count = min(length, MERGE_BUFFER_SIZE - output->Used);
+		memcpy(output->Buffer + output->Used, bytes, count);
+		output->Used += count;
+		bytes        += count;
+		length       -= count;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool WriteMergeSectionHeader(MERGE_OUTPUT *output)
+{
+	UINT32                  buffer[MERGE_SECTION_LENGTH / sizeof(UINT32)];
+	PCAP_NG_SECTION_HEADER *header = reinterpret_cast<PCAP_NG_SECTION_HEADER*>(buffer);
+	UINT32                  offset;
+
+	header->BlockType     = SectionHeaderBlock;
+	header->BlockLength   = MERGE_SECTION_LENGTH;
+	header->ByteOrder     = 0x1A2B3C4D;
+	header->MajorVersion  = 1;
+	header->MinorVersion  = 0;
+	header->SectionLength = _UI64_MAX;
+	offset = AppendMergeOption(reinterpret_cast<UINT8*>(buffer),
+			sizeof(PCAP_NG_SECTION_HEADER), 4, MERGE_APPLICATION,
+			sizeof(MERGE_APPLICATION) - 1);
+	offset = AppendMergeOption(reinterpret_cast<UINT8*>(buffer), offset, 0,
+			NULL, 0);
+	buffer[offset / sizeof(UINT32)] = MERGE_SECTION_LENGTH;
+	return WriteMergeData(output, buffer, MERGE_SECTION_LENGTH);
+}
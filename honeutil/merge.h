@@ -0,0 +1,32 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility merge operations
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef MERGE_H
+#define MERGE_H
+
+//----------------------------------------------------------------------------
+/// @brief Merges logs from many hosts into one log in timestamp order
+///
+/// Logs are grouped by the host name at the start of their names, and each
+/// host's logs are read in the order they were written.  The merged log is
+/// named merged.pcapng and has one section, with separate interface
+/// descriptions for each host that hold the host name and the options from
+/// the host's section header, including its system ID.
+///
+/// @param verbose       Print verbose output if true
+/// @param inputPattern  Uncompressed logs to merge, which may hold wildcards
+/// @param outputDir     Directory to write the merged log to
+///
+/// @returns True if every log was merged; false otherwise
+bool MergeLogs(const bool verbose, const char *inputPattern,
+		const char *outputDir);
+
+#endif // MERGE_H
@@ -24,11 +24,29 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "common.h"
 #include "oconn.h"
 #include "../ioctls.h"
 
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+static HANDLE gStopEvent = NULL;  // Signaled when the user stops sending changes
+
+//-----------------------------------------------------------------------------
+// Function prototypes
+//-----------------------------------------------------------------------------
+
+CONNECTIONS* ParseRecords(
+	MIB_TCPTABLE_OWNER_MODULE  *tableTcpV4,
+	MIB_TCP6TABLE_OWNER_MODULE *tableTcpV6,
+	MIB_UDPTABLE_OWNER_MODULE  *tableUdpV4,
+	MIB_UDP6TABLE_OWNER_MODULE *tableUdpV6);
+
 //-----------------------------------------------------------------------------
 void* AllocateTable(const ULONG af, const ULONG proto)
 {
@@ -72,6 +90,137 @@ void* AllocateTable(const ULONG af, const ULONG proto)
 	return table;
 }
 
+//-----------------------------------------------------------------------------
+int CompareRecordKeys(const CONNECTION_RECORD *first, const CONNECTION_RECORD *second)
+{
+	if (first->AddressFamily != second->AddressFamily) {
+		return (first->AddressFamily < second->AddressFamily) ? -1 : 1;
+	}
+	if (first->Protocol != second->Protocol) {
+		return (first->Protocol < second->Protocol) ? -1 : 1;
+	}
+	if (first->Port != second->Port) {
+		return (first->Port < second->Port) ? -1 : 1;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+int __cdecl CompareRecords(const void *left, const void *right)
+{
+	const CONNECTION_RECORD *first  = reinterpret_cast<const CONNECTION_RECORD*>(left);
+	const CONNECTION_RECORD *second = reinterpret_cast<const CONNECTION_RECORD*>(right);
+	const int                result = CompareRecordKeys(first, second);
+
+	// Sort the oldest connection on each port first
+	if (result) {
+		return result;
+	}
+	if (first->Timestamp.QuadPart != second->Timestamp.QuadPart) {
+		return (first->Timestamp.QuadPart < second->Timestamp.QuadPart) ? -1 : 1;
+	}
+	if (first->ProcessId != second->ProcessId) {
+		return (first->ProcessId < second->ProcessId) ? -1 : 1;
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+BOOL WINAPI ConnectionsConsoleHandler(DWORD ctrlType)
+{
+	UNREFERENCED_PARAMETER(ctrlType);
+	SetEvent(gStopEvent);
+	return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+CONNECTION_CHANGES* DiffRecords(
+	const CONNECTIONS *oldConnections,
+	const CONNECTIONS *newConnections)
+{
+	const UINT32        maxRecords = oldConnections->NumRecords + newConnections->NumRecords;
+	const UINT32        bytes      = offsetof(CONNECTION_CHANGES, Records) +
+			((maxRecords ? maxRecords : 1) * sizeof(CONNECTION_RECORD));
+	CONNECTION_CHANGES *changes    = NULL;
+	UINT32              newIndex   = 0;
+	UINT32              numAdded   = 0;
+	UINT32              numRemoved = 0;
+	UINT32              oldIndex   = 0;
+
+	changes = reinterpret_cast<CONNECTION_CHANGES*>(malloc(bytes));
+	if (!changes) {
+		printf("Cannot allocate %d bytes of data for %d connection changes\n",
+				bytes, maxRecords);
+		return NULL;
+	}
+
+	// Both lists are sorted with one record per port, so walk them together.
+	// Added records fill the array from the front and removed records fill it
+	// from the back, and then removed records are moved after added records.
+	while ((oldIndex < oldConnections->NumRecords) ||
+			(newIndex < newConnections->NumRecords)) {
+		const CONNECTION_RECORD *oldRecord = &oldConnections->Records[oldIndex];
+		const CONNECTION_RECORD *newRecord = &newConnections->Records[newIndex];
+		int                      result;
+
+		if (oldIndex >= oldConnections->NumRecords) {
+			result = 1;
+		} else if (newIndex >= newConnections->NumRecords) {
+			result = -1;
+		} else {
+			result = CompareRecordKeys(oldRecord, newRecord);
+		}
+
+		if (result < 0) {
+			numRemoved++;
+			changes->Records[maxRecords - numRemoved] = *oldRecord;
+			oldIndex++;
+		} else if (result > 0) {
+			changes->Records[numAdded++] = *newRecord;
+			newIndex++;
+		} else {
+			if ((oldRecord->ProcessId != newRecord->ProcessId) ||
+					(oldRecord->Timestamp.QuadPart != newRecord->Timestamp.QuadPart)) {
+				changes->Records[numAdded++] = *newRecord;
+			}
+			oldIndex++;
+			newIndex++;
+		}
+	}
+
+	memmove(changes->Records + numAdded, changes->Records + maxRecords - numRemoved,
+			numRemoved * sizeof(CONNECTION_RECORD));
+	changes->NumAdded   = numAdded;
+	changes->NumRemoved = numRemoved;
+	return changes;
+}
+
+//-----------------------------------------------------------------------------
+CONNECTIONS* GetRecords(void)
+{
+	MIB_TCPTABLE_OWNER_MODULE  *tableTcpV4  = NULL;
+	MIB_TCP6TABLE_OWNER_MODULE *tableTcpV6  = NULL;
+	MIB_UDPTABLE_OWNER_MODULE  *tableUdpV4  = NULL;
+	MIB_UDP6TABLE_OWNER_MODULE *tableUdpV6  = NULL;
+	CONNECTIONS                *connections = NULL;
+
+	tableTcpV4 = reinterpret_cast<MIB_TCPTABLE_OWNER_MODULE*>(AllocateTable(AF_INET, IPPROTO_TCP));
+	tableTcpV6 = reinterpret_cast<MIB_TCP6TABLE_OWNER_MODULE*>(AllocateTable(AF_INET6, IPPROTO_TCP));
+	tableUdpV4 = reinterpret_cast<MIB_UDPTABLE_OWNER_MODULE*>(AllocateTable(AF_INET, IPPROTO_UDP));
+	tableUdpV6 = reinterpret_cast<MIB_UDP6TABLE_OWNER_MODULE*>(AllocateTable(AF_INET6, IPPROTO_UDP));
+
+	connections = ParseRecords(tableTcpV4, tableTcpV6, tableUdpV4, tableUdpV6);
+	if (connections) {
+		ReduceRecords(connections);
+	}
+
+	free(tableTcpV4);
+	free(tableTcpV6);
+	free(tableUdpV4);
+	free(tableUdpV6);
+	return connections;
+}
+
 //-----------------------------------------------------------------------------
 UINT16 NetToHost(const DWORD val)
 {
@@ -189,6 +338,54 @@ void PrintRecords(CONNECTIONS *connections)
 	}
 }
 
+//-----------------------------------------------------------------------------
+void ReduceRecords(CONNECTIONS *connections)
+{
+	UINT32 index;
+	UINT32 numRecords = 0;
+
+	if (!connections->NumRecords) {
+		return;
+	}
+
+	// The driver only keeps one connection for each port, so keep the oldest
+	qsort(connections->Records, connections->NumRecords, sizeof(CONNECTION_RECORD),
+			CompareRecords);
+	for (index = 1; index < connections->NumRecords; index++) {
+		if (CompareRecordKeys(&connections->Records[numRecords],
+				&connections->Records[index])) {
+			numRecords++;
+			connections->Records[numRecords] = connections->Records[index];
+		}
+	}
+	connections->NumRecords = numRecords + 1;
+}
+
+//-----------------------------------------------------------------------------
+bool SendChanges(CONNECTION_CHANGES *changes)
+{
+	DWORD  bytesReturned;
+	DWORD  bytesToSend;
+	HANDLE driver = INVALID_HANDLE_VALUE;
+
+	driver = OpenDriver(false);
+	if (driver == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	bytesToSend = offsetof(CONNECTION_CHANGES, Records) +
+			((changes->NumAdded + changes->NumRemoved) * sizeof(CONNECTION_RECORD));
+	if (!DeviceIoControl(driver, IOCTL_HONE_UPDATE_OPEN_CONNECTIONS, changes,
+			bytesToSend, NULL, 0, &bytesReturned, NULL)) {
+		LogError("Cannot send IOCTL to update open connections");
+		CloseHandle(driver);
+		return false;
+	}
+
+	CloseHandle(driver);
+	return true;
+}
+
 //-----------------------------------------------------------------------------
 bool SendRecords(CONNECTIONS *connections)
 {
@@ -215,32 +412,88 @@ bool SendRecords(CONNECTIONS *connections)
 }
 
 //-----------------------------------------------------------------------------
-bool SendOptionConnections(const bool verbose)
+bool SendOptionConnections(
+	const bool   verbose,
+	const UINT32 interval,
+	const UINT32 resyncInterval)
 {
-	MIB_TCPTABLE_OWNER_MODULE  *tableTcpV4  = NULL;
-	MIB_TCP6TABLE_OWNER_MODULE *tableTcpV6  = NULL;
-	MIB_UDPTABLE_OWNER_MODULE  *tableUdpV4  = NULL;
-	MIB_UDP6TABLE_OWNER_MODULE *tableUdpV6  = NULL;
-	CONNECTIONS                *connections = NULL;
-	bool                        rc          = true;
+	CONNECTION_CHANGES *changes        = NULL;
+	CONNECTIONS        *connections    = NULL;
+	time_t              lastSync       = 0;
+	CONNECTIONS        *oldConnections = NULL;
+	bool                rc             = true;
 
-	tableTcpV4 = reinterpret_cast<MIB_TCPTABLE_OWNER_MODULE*>(AllocateTable(AF_INET, IPPROTO_TCP));
-	tableTcpV6 = reinterpret_cast<MIB_TCP6TABLE_OWNER_MODULE*>(AllocateTable(AF_INET6, IPPROTO_TCP));
-	tableUdpV4 = reinterpret_cast<MIB_UDPTABLE_OWNER_MODULE*>(AllocateTable(AF_INET, IPPROTO_UDP));
-	tableUdpV6 = reinterpret_cast<MIB_UDP6TABLE_OWNER_MODULE*>(AllocateTable(AF_INET6, IPPROTO_UDP));
-
-	connections = ParseRecords(tableTcpV4, tableTcpV6, tableUdpV4, tableUdpV6);
-	if (connections) {
+	if (interval) {
+		gStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (!gStopEvent) {
+			LogError("Cannot create stop event");
+			return false;
+		}
+		if (!SetConsoleCtrlHandler(ConnectionsConsoleHandler, TRUE)) {
+			LogError("Cannot set console handler");
+			CloseHandle(gStopEvent);
+			gStopEvent = NULL;
+			return false;
+		}
 		if (verbose) {
-			PrintRecords(connections);
+			printf("Sending open connection changes every %u seconds\n", interval);
 		}
-		rc = SendRecords(connections);
 	}
 
-	free(tableTcpV4);
-	free(tableTcpV6);
-	free(tableUdpV4);
-	free(tableUdpV6);
-	free(connections);
+	for (;;) {
+		const time_t now = time(NULL);
+
+		connections = GetRecords();
+		if (!connections) {
+			rc = false;
+			break;
+		}
+
+		// Send the full list the first time, when it's time to resynchronize,
+		// or when the driver may have missed the last changes
+		if (!oldConnections || (resyncInterval &&
+				(now - lastSync >= static_cast<time_t>(resyncInterval)))) {
+			if (verbose) {
+				PrintRecords(connections);
+			}
+			rc = SendRecords(connections);
+			if (rc) {
+				lastSync = now;
+			}
+		} else {
+			changes = DiffRecords(oldConnections, connections);
+			if (!changes) {
+				rc = false;
+			} else if (changes->NumAdded || changes->NumRemoved) {
+				if (verbose) {
+					printf("Sending %u added and %u removed open connection records\n",
+							changes->NumAdded, changes->NumRemoved);
+				}
+				rc = SendChanges(changes);
+			}
+			free(changes);
+			changes = NULL;
+		}
+
+		free(oldConnections);
+		oldConnections = rc ? connections : NULL;
+		if (!rc) {
+			free(connections);
+		}
+		connections = NULL;
+
+		if (!interval || (WaitForSingleObject(gStopEvent, interval * 1000) !=
+				WAIT_TIMEOUT)) {
+			break;
+		}
+		rc = true;
+	}
+
+	if (interval) {
+		SetConsoleCtrlHandler(ConnectionsConsoleHandler, FALSE);
+		CloseHandle(gStopEvent);
+		gStopEvent = NULL;
+	}
+	free(oldConnections);
 	return rc;
 }
@@ -12,12 +12,44 @@
 #ifndef OCONN_H
 #define OCONN_H
 
+#include "../ioctls.h"
+
+//----------------------------------------------------------------------------
+/// @brief Gets the changes between two lists of open connections
+///
+/// Both lists must already be reduced with ReduceRecords.  A connection whose
+/// process ID or timestamp changed is reported as added.
+///
+/// @param oldConnections  Previous list of connections
+/// @param newConnections  Current list of connections
+///
+/// @returns Changes, which the caller must free, if successful; NULL otherwise
+CONNECTION_CHANGES* DiffRecords(
+	const CONNECTIONS *oldConnections,
+	const CONNECTIONS *newConnections);
+
+//----------------------------------------------------------------------------
+/// @brief Sorts a list of open connections and keeps the oldest one on each port
+///
+/// @param connections  List of connections to reduce
+void ReduceRecords(CONNECTIONS *connections);
+
 //----------------------------------------------------------------------------
 /// @brief Sends list of open connections to the Hone driver
 ///
-/// @param verbose  Print verbose output if true
+/// If interval is not 0, keeps running until CTRL-C or CTRL-BREAK, and every
+/// interval seconds sends only the connections that were added or removed
+/// since the last list.  The full list is sent first, after a failure, and
+/// every resyncInterval seconds, if it is not 0.
+///
+/// @param verbose         Print verbose output if true
+/// @param interval        Seconds between sending changes (0 to send once)
+/// @param resyncInterval  Seconds between sending the full list (0 for never)
 ///
 /// @returns True if successful; false otherwise
-bool SendOptionConnections(const bool verbose);
+bool SendOptionConnections(
+	const bool   verbose,
+	const UINT32 interval,
+	const UINT32 resyncInterval);
 
 #endif // OCONN_H
@@ -0,0 +1,356 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility query operations
+//
+// Finds the blocks for a process, connection, or time range through the
+// index file that the log writer saves next to each log.  Index entries are
+// sorted by process ID, so a process query only looks at that process's
+// entries, and only the matching blocks are read from the log.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../pcap_ng.h"
+#include "capture_index.h"
+#include "common.h"
+#include "decompress.h"
+#include "log_writer.h"
+#include "query.h"
+
+//--------------------------------------------------------------------------
+// Structures and enumerations
+//--------------------------------------------------------------------------
+
+struct QUERY_RESULTS {
+	const CAPTURE_INDEX_ENTRY **Entries;   // Matching index entries
+	UINT64                      Count;     // Number of matching entries
+	UINT64                      Capacity;  // Number of entries allocated
+};
+
+//--------------------------------------------------------------------------
+bool AddQueryResult(QUERY_RESULTS *results, const CAPTURE_INDEX_ENTRY *entry)
+{
+	if (results->Count == results->Capacity) {
+		const UINT64 capacity = results->Capacity ? results->Capacity * 2 : 1024;
+		const CAPTURE_INDEX_ENTRY **entries =
+				reinterpret_cast<const CAPTURE_INDEX_ENTRY**>(realloc(
+				results->Entries, static_cast<size_t>(
+				capacity * sizeof(CAPTURE_INDEX_ENTRY*))));
+		if (entries == NULL) {
+			fputs("Cannot allocate memory for query results\n", stdout);
+			return false;
+		}
+		results->Entries  = entries;
+		results->Capacity = capacity;
+	}
+	results->Entries[results->Count++] = entry;
+	return true;
+}
+
+//--------------------------------------------------------------------------
+int __cdecl CompareQueryResults(const void *left, const void *right)
+{
+	const CAPTURE_INDEX_ENTRY *leftEntry  =
+			*reinterpret_cast<const CAPTURE_INDEX_ENTRY* const*>(left);
+	const CAPTURE_INDEX_ENTRY *rightEntry =
+			*reinterpret_cast<const CAPTURE_INDEX_ENTRY* const*>(right);
+
+	if (leftEntry->Offset != rightEntry->Offset) {
+		return (leftEntry->Offset < rightEntry->Offset) ? -1 : 1;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------------
+bool CopyLogBlock(HANDLE input, const char *inputFile, HANDLE output,
+		const char *outputFile, const UINT64 offset, const UINT32 length,
+		UINT8 **buffer, UINT32 *bufferSize)
+{
+	DWORD         bytesRead;
+	LARGE_INTEGER position;
+
+	if (length > *bufferSize) {
+		UINT8 *newBuffer = reinterpret_cast<UINT8*>(realloc(*buffer, length));
+		if (newBuffer == NULL) {
+			printf("Cannot allocate %u bytes for block\n", length);
+			return false;
+		}
+		*buffer     = newBuffer;
+		*bufferSize = length;
+	}
+
+	position.QuadPart = static_cast<LONGLONG>(offset);
+	if (!SetFilePointerEx(input, position, NULL, FILE_BEGIN)) {
+		LogError("Cannot seek to offset %I64u in %s", offset, inputFile);
+		return false;
+	}
+	if (!ReadInput(input, inputFile, *buffer, length, &bytesRead)) {
+		return false;
+	}
+	if (bytesRead < length) {
+		printf("%s is truncated\n", inputFile);
+		return false;
+	}
+	return WriteLog(output, outputFile, *buffer, length);
+}
+
+//--------------------------------------------------------------------------
+UINT64 FindProcessEntries(const CAPTURE_INDEX_ENTRY *entries,
+		const UINT64 numEntries, const UINT32 processId)
+{
+	UINT64 first = 0;
+	UINT64 last  = numEntries;
+
+	// Find the first entry for the process, or where it would be
+	while (first < last) {
+		const UINT64 middle = first + (last - first) / 2;
+		if (entries[middle].ProcessId < processId) {
+			first = middle + 1;
+		} else {
+			last = middle;
+		}
+	}
+	return first;
+}
+
+//--------------------------------------------------------------------------
+bool MatchesLogQuery(const CAPTURE_INDEX_ENTRY *entry, const LOG_QUERY *query)
+{
+	if (query->MatchProcess && (entry->ProcessId != query->ProcessId)) {
+		return false;
+	}
+	switch (entry->BlockType) {
+	case PacketBlock:
+		if ((entry->Timestamp < query->StartTime) ||
+				(entry->Timestamp >= query->EndTime)) {
+			return false;
+		}
+		// Fall through
+	case ConnectionBlock:
+		return (!query->MatchConnection ||
+				(entry->ConnectionId == query->ConnectionId)) ? true : false;
+	case ProcessBlock:
+		// Process blocks for a connection query are added separately
+		return !query->MatchConnection;
+	default:
+		return false;
+	}
+}
+
+//--------------------------------------------------------------------------
+bool QueryLog(const bool verbose, const char *inputFile,
+		const LOG_QUERY *query)
+{
+	UINT8                      *buffer     = NULL;
+	UINT32                      bufferSize = 0;
+	DWORD                       bytesRead;
+	const CAPTURE_INDEX_ENTRY  *entries;
+	UINT64                      first;
+	const CAPTURE_INDEX_HEADER *header     = NULL;
+	HANDLE                      index      = INVALID_HANDLE_VALUE;
+	char                        indexFile[MAX_PATH];
+	LARGE_INTEGER               indexSize;
+	HANDLE                      input      = INVALID_HANDLE_VALUE;
+	UINT64                      last;
+	UINT32                      length;
+	HANDLE                      mapping    = NULL;
+	UINT64                      numBlocks  = 0;
+	UINT64                      offset;
+	HANDLE                      output     = INVALID_HANDLE_VALUE;
+	char                        outputFile[MAX_PATH];
+	UINT64                      position;
+	bool                        rc         = false;
+	QUERY_RESULTS               results;
+
+	ZeroMemory(&results, sizeof(results));
+
+	// The index holds offsets in the uncompressed log
+	length = static_cast<UINT32>(strlen(inputFile));
+	if ((length > 4) && (_stricmp(inputFile + length - 4, ".lz4") == 0)) {
+		printf("Decompress %s before querying it\n", inputFile);
+		goto Cleanup;
+	}
+	if ((length > 7) && (_stricmp(inputFile + length - 7, ".pcapng") == 0)) {
+		length -= 7;
+	}
+	_snprintf_s(outputFile, sizeof(outputFile), sizeof(outputFile),
+			"%.*s_query.pcapng", length, inputFile);
+
+	// Map the index so that we only touch the entries we need
+	GetCaptureIndexName(inputFile, indexFile, sizeof(indexFile));
+	index = CreateFile(indexFile, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, 0, 0);
+	if (index == INVALID_HANDLE_VALUE) {
+		LogError("Cannot open index file %s", indexFile);
+		goto Cleanup;
+	}
+	if (!GetFileSizeEx(index, &indexSize)) {
+		LogError("Cannot get size of %s", indexFile);
+		goto Cleanup;
+	}
+	if (indexSize.QuadPart <
+			static_cast<LONGLONG>(sizeof(CAPTURE_INDEX_HEADER))) {
+		printf("%s is not an index file\n", indexFile);
+		goto Cleanup;
+	}
+	mapping = CreateFileMapping(index, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL) {
+		LogError("Cannot map %s", indexFile);
+		goto Cleanup;
+	}
+	header = reinterpret_cast<const CAPTURE_INDEX_HEADER*>(
+			MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	if (header == NULL) {
+		LogError("Cannot map %s", indexFile);
+		goto Cleanup;
+	}
+	if ((header->Magic != CAPTURE_INDEX_MAGIC) ||
+			(header->Version != CAPTURE_INDEX_VERSION) ||
+			(header->NumEntries != (static_cast<UINT64>(indexSize.QuadPart) -
+			sizeof(CAPTURE_INDEX_HEADER)) / sizeof(CAPTURE_INDEX_ENTRY))) {
+		printf("%s is not a valid index file\n", indexFile);
+		goto Cleanup;
+	}
+	entries = reinterpret_cast<const CAPTURE_INDEX_ENTRY*>(header + 1);
+
+	// Only look at a single process's entries if we can
+	first = 0;
+	last  = header->NumEntries;
+	if (query->MatchProcess) {
+		first = FindProcessEntries(entries, header->NumEntries, query->ProcessId);
+		for (last = first; (last < header->NumEntries) &&
+				(entries[last].ProcessId == query->ProcessId); last++);
+	}
+	for (position = first; position < last; position++) {
+		if (MatchesLogQuery(entries + position, query) &&
+				!AddQueryResult(&results, entries + position)) {
+			goto Cleanup;
+		}
+	}
+
+	// Add the process blocks for the connection's process
+	if (query->MatchConnection) {
+		const UINT64 numMatches = results.Count;
+		UINT32       processId  = CAPTURE_INDEX_NO_ID;
+		UINT64       match;
+
+		for (match = 0; match < numMatches; match++) {
+			if ((results.Entries[match]->BlockType != ConnectionBlock) ||
+					(results.Entries[match]->ProcessId == processId)) {
+				continue;
+			}
+			processId = results.Entries[match]->ProcessId;
+			for (position = FindProcessEntries(entries, header->NumEntries,
+					processId); (position < header->NumEntries) &&
+					(entries[position].ProcessId == processId); position++) {
+				if ((entries[position].BlockType == ProcessBlock) &&
+						!AddQueryResult(&results, entries + position)) {
+					goto Cleanup;
+				}
+			}
+		}
+	}
+	qsort(results.Entries, static_cast<size_t>(results.Count),
+			sizeof(CAPTURE_INDEX_ENTRY*), CompareQueryResults);
+
+	input = CreateFile(inputFile, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, 0, 0);
+	if (input == INVALID_HANDLE_VALUE) {
+		LogError("Cannot open %s", inputFile);
+		goto Cleanup;
+	}
+	output = CreateFile(outputFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, 0);
+	if (output == INVALID_HANDLE_VALUE) {
+		LogError("Cannot open %s", outputFile);
+		goto Cleanup;
+	}
+
+	// Copy the section header and interface description blocks from the
+	// start of the log
+	for (offset = 0; ; offset += length) {
+		UINT32        blockHeader[2];
+		LARGE_INTEGER seek;
+
+		seek.QuadPart = static_cast<LONGLONG>(offset);
+		if (!SetFilePointerEx(input, seek, NULL, FILE_BEGIN) ||
+				!ReadInput(input, inputFile, blockHeader, sizeof(blockHeader),
+				&bytesRead)) {
+			goto Cleanup;
+		}
+		if ((bytesRead < sizeof(blockHeader)) ||
+				((blockHeader[0] != SectionHeaderBlock) &&
+				(blockHeader[0] != InterfaceDescriptionBlock))) {
+			break;
+		}
+		length = blockHeader[1];
+		if ((length < 3 * sizeof(UINT32)) || (length & 3)) {
+			printf("%s is not a PCAP-NG file\n", inputFile);
+			goto Cleanup;
+		}
+		if (!CopyLogBlock(input, inputFile, output, outputFile, offset, length,
+				&buffer, &bufferSize)) {
+			goto Cleanup;
+		}
+	}
+
+	// Copy the matching blocks in the order they appear in the log
+	for (position = 0; position < results.Count; position++) {
+		const CAPTURE_INDEX_ENTRY *entry = results.Entries[position];
+		if (position && (entry->Offset == results.Entries[position - 1]->Offset)) {
+			continue;
+		}
+		if (!CopyLogBlock(input, inputFile, output, outputFile, entry->Offset,
+				entry->BlockLength, &buffer, &bufferSize)) {
+			goto Cleanup;
+		}
+		if (memcmp(buffer, &entry->BlockType, sizeof(entry->BlockType)) != 0) {
+			printf("%s does not match %s\n", indexFile, inputFile);
+			goto Cleanup;
+		}
+		numBlocks++;
+	}
+
+	if (verbose) {
+		printf("Found %I64u of %I64u indexed blocks in %s\n", numBlocks,
+				header->NumEntries, inputFile);
+	}
+	printf("Wrote matching blocks to %s\n", outputFile);
+	rc = true;
+
+Cleanup:
+	if (output != INVALID_HANDLE_VALUE) {
+		CloseHandle(output);
+	}
+	if (input != INVALID_HANDLE_VALUE) {
+		CloseHandle(input);
+	}
+	if (header != NULL) {
+		UnmapViewOfFile(header);
+	}
+	if (mapping != NULL) {
+		CloseHandle(mapping);
+	}
+	if (index != INVALID_HANDLE_VALUE) {
+		CloseHandle(index);
+	}
+	if (results.Entries != NULL) {
+		free(results.Entries);
+	}
+	if (buffer != NULL) {
+		free(buffer);
+	}
+	return rc;
+}
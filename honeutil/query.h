@@ -0,0 +1,46 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility query operations
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef QUERY_H
+#define QUERY_H
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+struct LOG_QUERY {
+	bool   MatchProcess;     // Only match blocks for ProcessId if true
+	UINT32 ProcessId;        // Process ID to match
+	bool   MatchConnection;  // Only match blocks for ConnectionId if true
+	UINT32 ConnectionId;     // Connection ID to match
+	UINT64 StartTime;        // Earliest packet timestamp to match, in microseconds
+	UINT64 EndTime;          // Packet timestamps must be before this, in microseconds
+};
+
+//----------------------------------------------------------------------------
+/// @brief Copies the blocks that match a query from a log to a new log
+///
+/// Uses the log's index file to find the matching blocks and reads only
+/// those blocks from the log.  The new log starts with the log's section
+/// header and interface description blocks.  The time range only applies to
+/// packet blocks, so the new log also holds the process and connection blocks
+/// for the matching packets.  The new log has the same name as the log with
+/// _query added before the extension.
+///
+/// @param verbose    Print verbose output if true
+/// @param inputFile  Uncompressed log to query
+/// @param query      Blocks to match
+///
+/// @returns True if successful; false otherwise
+bool QueryLog(const bool verbose, const char *inputFile,
+		const LOG_QUERY *query);
+
+#endif // QUERY_H
@@ -22,6 +22,10 @@
 #include "common.h"
 #include "read.h"
 #include "../ioctls.h"
+#include "../packet_filter.h"
+#include "../shared_ring.h"
+#include "filter_compiler.h"
+#include "log_writer.h"
 
 //--------------------------------------------------------------------------
 // Defines
@@ -76,42 +80,47 @@ BOOL WINAPI ConsoleHandler(DWORD ctrlType)
 }
 
 //--------------------------------------------------------------------------
-HANDLE OpenPcapNgFile(const char *logDir, char *filename, const size_t len)
+bool IssueRead(HANDLE driver, char *buffer, const DWORD length,
+		OVERLAPPED *overlapped)
 {
-	char        timeStr[16];
-	__time64_t  timestamp;
-	struct tm   localtime;
-	char        hostname[MAX_COMPUTERNAME_LENGTH+1];
-	DWORD       hostnameLen = sizeof(hostname);
-	HANDLE      file        = NULL;
-
-	if (!GetComputerName(hostname, &hostnameLen)) {
-		LogError("Cannot get hostname");
-		return INVALID_HANDLE_VALUE;
+	ResetEvent(overlapped->hEvent);
+	if (!ReadFile(driver, buffer, length, NULL, overlapped) &&
+			(GetLastError() != ERROR_IO_PENDING)) {
+		LogError("Cannot read %d bytes from driver", length);
+		return false;
 	}
+	return true;
+}
 
-	// Get time
-	_time64(&timestamp);
-	_localtime64_s(&localtime, &timestamp);
-	strftime(timeStr, sizeof(timeStr), "%Y%m%d_%H%M%S", &localtime);
-
-	// Format log file name
-	_snprintf_s(filename, len, len, "%s\\%s_%s.pcapng",
-			logDir, hostname, timeStr);
+//--------------------------------------------------------------------------
+bool WriteSharedRing(SHARED_RING_HEADER *ring, HANDLE log, const char *logFile)
+{
+	const UINT8 *data = reinterpret_cast<const UINT8*>(ring) + ring->DataOffset;
 
-	// Open file
-	file = CreateFile(filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, 0);
-	if (file == INVALID_HANDLE_VALUE) {
-		LogError("Cannot open log file %s", filename);
-		return INVALID_HANDLE_VALUE;
+	// Write everything the driver has added straight from the mapping
+	for (;;) {
+		UINT32       offset;
+		const UINT32 producer = ring->Producer;
+		SHARED_RING_BARRIER();
+		const UINT32 length   = GetSharedRingReadSpan(ring->DataSize, producer,
+				ring->Consumer, &offset);
+		if (!length) {
+			break;
+		}
+		if (!WriteLog(log, logFile, data + offset, length)) {
+			return false;
+		}
+		SHARED_RING_BARRIER();
+		ring->Consumer += length;
 	}
-
-	printf("Writing events to %s\n", filename);
-	return file;
+	return true;
 }
 
 //--------------------------------------------------------------------------
-bool ReadDriver(const bool verbose, const char *logDir, UINT32 snapLen)
+bool ReadDriver(const bool verbose, const char *logDir, UINT32 snapLen,
+		const char *filter, const bool mapRing, const UINT32 inFlight,
+		const UINT32 bufferSize, const UINT32 depth, const bool compress,
+		const UINT64 rotateSize, const UINT32 rotateTime, const bool buildIndex)
 {
 	enum State {
 		STATE_NORMAL,       // Normal operation
@@ -120,20 +129,70 @@ bool ReadDriver(const bool verbose, const char *logDir, UINT32 snapLen)
 		STATE_DONE,         // Done running
 	};
 
-	char                *buffer     = NULL;
-	static const UINT32  bufferSize = 75000;
+	char               **buffers    = NULL;
 	DWORD                bytesRead;
 	DWORD                bytesReturned;
-	DWORD                bytesWritten;
 	HANDLE               driver     = INVALID_HANDLE_VALUE;
+	PACKET_FILTER_INSN  *insns      = NULL;
+	UINT32               index;
 	HANDLE               log        = INVALID_HANDLE_VALUE;
 	char                 logFile[MAX_PATH];
+	UINT32               next       = 0;
+	UINT32               numInsns   = 0;
+	UINT32               numReads   = inFlight ? inFlight : 1;
+	OVERLAPPED          *overlapped = NULL;
 	bool                 rc         = false;
+	SHARED_RING_HEADER  *ring       = NULL;
+	UINT64               ringAddress;
+	UINT32               ringSize   = SHARED_RING_DEFAULT_SIZE;
 	enum State           state      = STATE_NORMAL;
 	UINT32               snapLenSet;
+	LOG_WRITER           writer;
+	bool                 writerStarted = false;
 
 	gVerbose = verbose;
 
+	// The shared ring is written straight from the mapping, so it can't go
+	// through the compressor
+	if (mapRing && compress) {
+		fputs("Cannot compress the log when reading through a shared ring\n",
+				stdout);
+		goto Cleanup;
+	}
+	if (mapRing && (rotateSize || rotateTime)) {
+		fputs("Cannot rotate the log automatically when reading through a "
+				"shared ring\n", stdout);
+		goto Cleanup;
+	}
+	if (mapRing && buildIndex) {
+		fputs("Cannot index the log when reading through a shared ring\n",
+				stdout);
+		goto Cleanup;
+	}
+
+	// Each pending read holds a buffer, so the writer needs at least one more
+	if (!mapRing && (depth <= numReads)) {
+		printf("Number of read buffers must be greater than %u\n", numReads);
+		goto Cleanup;
+	}
+
+	// Compile the filter first so that mistakes are reported right away
+	if (filter) {
+		insns = reinterpret_cast<PACKET_FILTER_INSN*>(malloc(
+				PACKET_FILTER_MAX_INSNS * sizeof(PACKET_FILTER_INSN)));
+		if (!insns) {
+			fputs("Cannot allocate memory for packet filter\n", stdout);
+			goto Cleanup;
+		}
+		numInsns = CompileFilterExpression(filter, insns, PACKET_FILTER_MAX_INSNS);
+		if (!numInsns) {
+			goto Cleanup;
+		}
+		if (verbose) {
+			printf("Compiled packet filter into %u instructions\n", numInsns);
+		}
+	}
+
 	if (!SetConsoleCtrlHandler(ConsoleHandler, TRUE)) {
 		LogError("Cannot set console control handler");
 		goto Cleanup;
@@ -151,13 +210,15 @@ bool ReadDriver(const bool verbose, const char *logDir, UINT32 snapLen)
 		printf("Data event handle is %u\n", gDataEvent);
 	}
 
-	driver = OpenDriver(verbose);
+	// With overlapped reads the driver completes a pending read when data
+	// arrives, so the data event only has to wake us for console events
+	driver = OpenDriver(verbose, inFlight ? FILE_FLAG_OVERLAPPED : 0);
 	if (driver == INVALID_HANDLE_VALUE) {
 		goto Cleanup;
 	}
 
-	if (!DeviceIoControl(driver, IOCTL_HONE_SET_DATA_EVENT, &gDataEvent,
-			sizeof(HANDLE), NULL, 0, &bytesReturned, NULL)) {
+	if (!inFlight && !DeviceIoControl(driver, IOCTL_HONE_SET_DATA_EVENT,
+			&gDataEvent, sizeof(HANDLE), NULL, 0, &bytesReturned, NULL)) {
 		LogError("Cannot send IOCTL to set data event");
 		goto Cleanup;
 	}
@@ -181,15 +242,78 @@ bool ReadDriver(const bool verbose, const char *logDir, UINT32 snapLen)
 		}
 	}
 
-	log = OpenPcapNgFile(logDir, logFile, sizeof(logFile));
-	if (log == INVALID_HANDLE_VALUE) {
+	if (numInsns && !DeviceIoControl(driver, IOCTL_HONE_SET_PACKET_FILTER, insns,
+			numInsns * sizeof(PACKET_FILTER_INSN), NULL, 0, &bytesReturned, NULL)) {
+		LogError("Cannot send IOCTL to set packet filter");
 		goto Cleanup;
 	}
 
-	buffer = reinterpret_cast<char*>(malloc(bufferSize));
-	if (!buffer) {
-		printf("Cannot allocate %d bytes for read buffer\n", bufferSize);
-		goto Cleanup;
+	if (mapRing) {
+		log = OpenPcapNgFile(logDir, logFile, sizeof(logFile), false);
+		if (log == INVALID_HANDLE_VALUE) {
+			goto Cleanup;
+		}
+
+		if (!DeviceIoControl(driver, IOCTL_HONE_MAP_SHARED_RING, &ringSize,
+				sizeof(ringSize), &ringAddress, sizeof(ringAddress), &bytesReturned,
+				NULL)) {
+			LogError("Cannot send IOCTL to map shared ring");
+			goto Cleanup;
+		}
+		ring = reinterpret_cast<SHARED_RING_HEADER*>(
+				static_cast<ULONG_PTR>(ringAddress));
+		if (verbose) {
+			printf("Mapped %u byte shared ring at %p\n", ring->DataSize, ring);
+		}
+	} else {
+		// Write the log on a separate thread so a slow disk doesn't keep us
+		// from draining the driver
+		if (!InitLogWriter(&writer, logDir, bufferSize, depth, compress,
+				rotateSize, rotateTime, buildIndex)) {
+			goto Cleanup;
+		}
+		writerStarted = true;
+		if (verbose) {
+			printf("Writing log through %u read buffers of %u bytes\n", depth,
+					writer.BufferSize);
+		}
+
+		buffers = reinterpret_cast<char**>(calloc(numReads, sizeof(char*)));
+		if (!buffers) {
+			fputs("Cannot allocate memory for read buffers\n", stdout);
+			goto Cleanup;
+		}
+		for (index = 0; index < numReads; index++) {
+			buffers[index] = GetLogBuffer(&writer);
+			if (!buffers[index]) {
+				goto Cleanup;
+			}
+		}
+	}
+
+	if (inFlight) {
+		overlapped = reinterpret_cast<OVERLAPPED*>(
+				calloc(inFlight, sizeof(OVERLAPPED)));
+		if (!overlapped) {
+			fputs("Cannot allocate memory for overlapped reads\n", stdout);
+			goto Cleanup;
+		}
+		for (index = 0; index < inFlight; index++) {
+			overlapped[index].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+			if (overlapped[index].hEvent == NULL) {
+				LogError("Cannot create read event");
+				goto Cleanup;
+			}
+		}
+		for (index = 0; index < inFlight; index++) {
+			if (!IssueRead(driver, ring ? NULL : buffers[index],
+					ring ? 0 : bufferSize, overlapped + index)) {
+				goto Cleanup;
+			}
+		}
+		if (verbose) {
+			printf("Issued %u overlapped reads\n", inFlight);
+		}
 	}
 
 	while (state != STATE_DONE) {
@@ -209,7 +333,27 @@ bool ReadDriver(const bool verbose, const char *logDir, UINT32 snapLen)
 			}
 		}
 
-		if (!ReadFile(driver, buffer, bufferSize, &bytesRead, NULL)) {
+		// With a shared ring, reads move blocks into the ring and return the
+		// number of bytes added to it
+		char *readBuffer = ring ? NULL : buffers[next];
+		if (inFlight) {
+			// Reads complete in the order they were issued, so wait for the
+			// oldest one unless a console event wakes us first
+			HANDLE handles[2] = { overlapped[next].hEvent, gDataEvent };
+			const DWORD wait = WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+			if (wait == WAIT_OBJECT_0 + 1) {
+				ResetEvent(gDataEvent);
+				continue;
+			} else if (wait != WAIT_OBJECT_0) {
+				LogError("Cannot wait for read to complete");
+				goto Cleanup;
+			}
+			if (!GetOverlappedResult(driver, overlapped + next, &bytesRead, FALSE)) {
+				LogError("Cannot read %d bytes from driver", bufferSize);
+				goto Cleanup;
+			}
+		} else if (!ReadFile(driver, readBuffer, ring ? 0 : bufferSize,
+				&bytesRead, NULL)) {
 			LogError("Cannot read %d bytes from driver", bufferSize);
 			goto Cleanup;
 		}
@@ -218,19 +362,27 @@ bool ReadDriver(const bool verbose, const char *logDir, UINT32 snapLen)
 				printf("Read %d bytes\n", bytesRead);
 			}
 
-			if (!WriteFile(log, buffer, bytesRead, &bytesWritten, NULL)) {
-				LogError("Cannot write %d bytes to %s", bytesRead, logFile);
-				goto Cleanup;
-			}
-			if (bytesRead != bytesWritten) {
-				printf("Only wrote %d of %d bytes to %s\n", bytesWritten, bytesRead,
-						logFile);
-				goto Cleanup;
+			if (ring) {
+				if (!WriteSharedRing(ring, log, logFile)) {
+					goto Cleanup;
+				}
+			} else {
+				// Hand the buffer to the writer thread and read into a new one
+				if (!QueueLogBuffer(&writer, readBuffer, bytesRead, LogWrite)) {
+					goto Cleanup;
+				}
+				buffers[next] = GetLogBuffer(&writer);
+				if (!buffers[next]) {
+					goto Cleanup;
+				}
 			}
 		} else {
 			// No data to read
 			switch (state) {
 			case STATE_NORMAL:
+				if (inFlight) {
+					break;
+				}
 				if (WaitForSingleObject(gDataEvent, INFINITE) == WAIT_FAILED) {
 					LogError("Cannot wait for data event");
 					goto Cleanup;
@@ -238,10 +390,22 @@ bool ReadDriver(const bool verbose, const char *logDir, UINT32 snapLen)
 				ResetEvent(gDataEvent);
 				break;
 			case STATE_ROTATING:
-				CloseHandle(log);
-				log = OpenPcapNgFile(logDir, logFile, sizeof(logFile));
-				if (!log) {
-					goto Cleanup;
+				if (ring) {
+					CloseHandle(log);
+					log = OpenPcapNgFile(logDir, logFile, sizeof(logFile), false);
+					if (log == INVALID_HANDLE_VALUE) {
+						goto Cleanup;
+					}
+				} else {
+					// Rotate after the writer thread writes the buffers
+					// already queued
+					if (!QueueLogBuffer(&writer, readBuffer, 0, LogRotate)) {
+						goto Cleanup;
+					}
+					buffers[next] = GetLogBuffer(&writer);
+					if (!buffers[next]) {
+						goto Cleanup;
+					}
 				}
 				state = STATE_NORMAL;
 				break;
@@ -250,6 +414,15 @@ bool ReadDriver(const bool verbose, const char *logDir, UINT32 snapLen)
 				break;
 			}
 		}
+
+		// Put the completed read back in flight
+		if (inFlight && (state != STATE_DONE)) {
+			if (!IssueRead(driver, ring ? NULL : buffers[next],
+					ring ? 0 : bufferSize, overlapped + next)) {
+				goto Cleanup;
+			}
+			next = (next + 1) % inFlight;
+		}
 	}
 
 	rc = true;
@@ -258,14 +431,40 @@ Cleanup:
 	if (gDataEvent != NULL) {
 		CloseHandle(gDataEvent);
 	}
+	if (overlapped != NULL) {
+		// Make sure the driver is done with the buffers before freeing them
+		if (driver != INVALID_HANDLE_VALUE) {
+			CancelIo(driver);
+		}
+		for (index = 0; index < inFlight; index++) {
+			if (overlapped[index].hEvent != NULL) {
+				if (driver != INVALID_HANDLE_VALUE) {
+					GetOverlappedResult(driver, overlapped + index, &bytesRead, TRUE);
+				}
+				CloseHandle(overlapped[index].hEvent);
+			}
+		}
+		free(overlapped);
+	}
 	if (driver != INVALID_HANDLE_VALUE) {
 		CloseHandle(driver);
 	}
+	if (writerStarted) {
+		if (!CleanupLogWriter(&writer)) {
+			rc = false;
+		} else if (verbose && compress) {
+			printf("Compressed %I64u bytes to %I64u bytes\n", writer.BytesIn,
+					writer.BytesOut);
+		}
+	}
 	if (log != INVALID_HANDLE_VALUE) {
 		CloseHandle(log);
 	}
-	if (buffer != NULL) {
-		free(buffer);
+	if (buffers != NULL) {
+		free(buffers);
+	}
+	if (insns != NULL) {
+		free(insns);
 	}
 	return rc;
 }
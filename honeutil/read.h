@@ -15,11 +15,26 @@
 //----------------------------------------------------------------------------
 /// @brief Reads PCAP-NG blocks from the Hone driver
 ///
-/// @param verbose  Print verbose output if true
-/// @param logDir   Directory to save log files in
-/// @param snapLen  Maximum number of bytes to capture for a packet, in bytes
+/// @param verbose     Print verbose output if true
+/// @param logDir      Directory to save log files in
+/// @param snapLen     Maximum number of bytes to capture for a packet, in bytes
+/// @param filter      Packet filter expression (NULL to capture all packets)
+/// @param mapRing     Read through a ring mapped from the driver if true
+/// @param inFlight    Number of overlapped reads to keep in flight (0 to read
+///                    synchronously)
+/// @param bufferSize  Size of each read buffer, in bytes
+/// @param depth       Number of read buffers shared with the log writer thread
+/// @param compress    Compress the log with LZ4 if true
+/// @param rotateSize  Start a new log once it reaches this many bytes (0 to
+///                    disable)
+/// @param rotateTime  Start a new log once it is this many seconds old (0 to
+///                    disable)
+/// @param buildIndex  Write an index file next to each log if true
 ///
 /// @returns True if successful; false otherwise
-bool ReadDriver(const bool verbose, const char *logDir, UINT32 snapLen);
+bool ReadDriver(const bool verbose, const char *logDir, UINT32 snapLen,
+		const char *filter, const bool mapRing, const UINT32 inFlight,
+		const UINT32 bufferSize, const UINT32 depth, const bool compress,
+		const UINT64 rotateSize, const UINT32 rotateTime, const bool buildIndex);
 
 #endif // READ_H
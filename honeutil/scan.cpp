@@ -0,0 +1,426 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility scan operations
+//
+// Scans a log on several threads by splitting it into chunks.  Since a chunk
+// boundary usually falls in the middle of a block, each thread other than the
+// first searches for the first block in its chunk, then reads every block
+// that starts in the chunk.  The chunks are merged in log order, and a chunk
+// whose first block doesn't match where the previous chunk stopped is
+// scanned again from the right offset, so the results are always the same as
+// a scan on one thread.  Packets are matched with the process and connection
+// blocks from earlier chunks while merging.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "capture_reader.h"
+#include "common.h"
+#include "scan.h"
+
+//--------------------------------------------------------------------------
+// Defines
+//--------------------------------------------------------------------------
+
+#define SCAN_IDS_MIN_BITS      10         // Log2 of the initial number of entries in an ID table
+#define SCAN_MIN_CHUNK_SIZE    0x1000000  // Smallest chunk worth a thread (16 MB)
+
+//--------------------------------------------------------------------------
+// Structures and enumerations
+//--------------------------------------------------------------------------
+
+struct SCAN_ID {
+	UINT32 Id;          // Process or connection ID (CAPTURE_NO_ID if entry is empty)
+	bool   HasBlock;    // Set once the process or connection block is read
+	UINT64 NumPending;  // Packets read before the process or connection block
+};
+
+struct SCAN_IDS {
+	SCAN_ID *Entries;   // Hash table of IDs
+	UINT32   Capacity;  // Number of entries (a power of 2)
+	UINT32   Bits;      // Log2 of the number of entries
+	UINT32   Count;     // Number of entries in use
+};
+
+struct SCAN_COUNTS {
+	UINT64 NumBlocks;       // Blocks read
+	UINT64 NumConnections;  // Connection blocks read
+	UINT64 NumOther;        // Other blocks read
+	UINT64 NumPackets;      // Packet blocks read
+	UINT64 NumProcesses;    // Process blocks read
+	UINT64 PacketBytes;     // Bytes of packet data read
+	UINT64 Unattributed;    // Packets without a process ID
+};
+
+struct SCAN_CHUNK {
+	const char  *InputFile;    // Log to scan
+	UINT64       ChunkStart;   // Offset of chunk in log
+	UINT64       ChunkEnd;     // Offset of next chunk in log
+	bool         FindStart;    // Search for the first block instead of reading at ChunkStart
+	HANDLE       Thread;       // Thread scanning the chunk (NULL if none)
+	UINT64       Start;        // Offset of first block read (ChunkEnd if none found)
+	UINT64       End;          // Offset after last block read
+	bool         Failed;       // Set if an invalid block or an error stopped the scan
+	SCAN_COUNTS  Counts;       // Blocks read from chunk
+	SCAN_IDS     Processes;    // Process IDs seen in chunk
+	SCAN_IDS     Connections;  // Connection IDs seen in chunk
+};
+
+//--------------------------------------------------------------------------
+// Function prototypes
+//--------------------------------------------------------------------------
+
+SCAN_ID* FindScanId(const SCAN_IDS *ids, const UINT32 id);
+
+//--------------------------------------------------------------------------
+SCAN_ID* AddScanId(SCAN_IDS *ids, const UINT32 id)
+{
+	SCAN_ID *entry;
+	UINT32   index;
+
+	// Grow the table before probing gets slow
+	if ((ids->Count + 1) * 4 > ids->Capacity * 3) {
+		const UINT32  oldCapacity = ids->Capacity;
+		SCAN_ID      *oldEntries  = ids->Entries;
+		const UINT32  bits        = oldCapacity ? ids->Bits + 1 :
+				SCAN_IDS_MIN_BITS;
+		const UINT32  capacity    = 1U << bits;
+		SCAN_ID      *entries     = reinterpret_cast<SCAN_ID*>(malloc(
+				capacity * sizeof(SCAN_ID)));
+
+		if (entries == NULL) {
+			fputs("Cannot allocate memory for process and connection IDs\n",
+					stdout);
+			return NULL;
+		}
+		for (index = 0; index < capacity; index++) {
+			entries[index].Id = CAPTURE_NO_ID;
+		}
+		ids->Entries  = entries;
+		ids->Capacity = capacity;
+		ids->Bits     = bits;
+		for (index = 0; index < oldCapacity; index++) {
+			if (oldEntries[index].Id != CAPTURE_NO_ID) {
+				*FindScanId(ids, oldEntries[index].Id) = oldEntries[index];
+			}
+		}
+		if (oldEntries != NULL) {
+			free(oldEntries);
+		}
+	}
+
+	entry = FindScanId(ids, id);
+	if (entry->Id == CAPTURE_NO_ID) {
+		entry->Id         = id;
+		entry->HasBlock   = false;
+		entry->NumPending = 0;
+		ids->Count++;
+	}
+	return entry;
+}
+
+//--------------------------------------------------------------------------
+void CleanupScanIds(SCAN_IDS *ids)
+{
+	if (ids->Entries != NULL) {
+		free(ids->Entries);
+	}
+	ZeroMemory(ids, sizeof(SCAN_IDS));
+}
+
+//--------------------------------------------------------------------------
+SCAN_ID* FindScanId(const SCAN_IDS *ids, const UINT32 id)
+{
+	const UINT32 mask  = ids->Capacity - 1;
+	UINT32       index = (id * 2654435761U) >> (32 - ids->Bits);
+
+	// The slot comes from the top bits of the product, since process IDs are
+	// multiples of 4 and the low bits would leave most slots unused
+	while ((ids->Entries[index].Id != id) &&
+			(ids->Entries[index].Id != CAPTURE_NO_ID)) {
+		index = (index + 1) & mask;
+	}
+	return ids->Entries + index;
+}
+
+//--------------------------------------------------------------------------
+bool MergeScanIds(SCAN_IDS *total, const SCAN_IDS *ids, UINT64 *numPending)
+{
+	UINT32 index;
+
+	for (index = 0; index < ids->Capacity; index++) {
+		const SCAN_ID *entry = ids->Entries + index;
+		if (entry->Id == CAPTURE_NO_ID) {
+			continue;
+		}
+
+		// Packets read before their block in this chunk only have a block if
+		// an earlier chunk had one
+		if (entry->NumPending && (!total->Capacity ||
+				(FindScanId(total, entry->Id)->Id != entry->Id))) {
+			*numPending += entry->NumPending;
+		}
+		if (entry->HasBlock) {
+			SCAN_ID *totalEntry = AddScanId(total, entry->Id);
+			if (totalEntry == NULL) {
+				return false;
+			}
+			totalEntry->HasBlock = true;
+		}
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------
+bool NoteScanId(SCAN_IDS *ids, const UINT32 id, const bool isBlock)
+{
+	SCAN_ID *entry;
+
+	if (id == CAPTURE_NO_ID) {
+		return true;
+	}
+	entry = AddScanId(ids, id);
+	if (entry == NULL) {
+		return false;
+	}
+	if (isBlock) {
+		entry->HasBlock = true;
+	} else if (!entry->HasBlock) {
+		entry->NumPending++;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------
+void ScanChunk(SCAN_CHUNK *chunk)
+{
+	CAPTURE_BLOCK                    block;
+	CAPTURE_FILE                     capture;
+	const PCAP_NG_CONNECTION_HEADER *connection;
+	bool                             ok = true;
+	CAPTURE_PACKET                   packet;
+	const PCAP_NG_PROCESS_HEADER    *process;
+
+	ZeroMemory(&chunk->Counts, sizeof(chunk->Counts));
+	chunk->Start  = chunk->ChunkStart;
+	chunk->End    = chunk->ChunkStart;
+	chunk->Failed = false;
+	if (!OpenCaptureFile(&capture, chunk->InputFile)) {
+		chunk->Failed = true;
+		return;
+	}
+	if (chunk->FindStart && !FindCaptureBlock(&capture, chunk->ChunkStart,
+			chunk->ChunkEnd, &chunk->Start)) {
+		chunk->Start = chunk->ChunkEnd;
+		chunk->End   = chunk->ChunkEnd;
+		CloseCaptureFile(&capture);
+		return;
+	}
+
+	// Read every block that starts in this chunk, even if it ends in the next
+	SeekCaptureFile(&capture, chunk->Start);
+	while (ok && (capture.Offset < chunk->ChunkEnd) &&
+			ReadCaptureBlock(&capture, &block)) {
+		chunk->Counts.NumBlocks++;
+		if (GetCapturePacket(&block, &packet)) {
+			chunk->Counts.NumPackets++;
+			chunk->Counts.PacketBytes += packet.Header->CapturedLength;
+			if (packet.ProcessId == CAPTURE_NO_ID) {
+				chunk->Counts.Unattributed++;
+			}
+			ok = NoteScanId(&chunk->Processes, packet.ProcessId, false) &&
+					NoteScanId(&chunk->Connections, packet.ConnectionId, false);
+		} else if ((process = GetCaptureProcess(&block)) != NULL) {
+			chunk->Counts.NumProcesses++;
+			ok = NoteScanId(&chunk->Processes, process->ProcessId, true);
+		} else if ((connection = GetCaptureConnection(&block)) != NULL) {
+			chunk->Counts.NumConnections++;
+			ok = NoteScanId(&chunk->Connections, connection->ConnectionId, true);
+		} else {
+			chunk->Counts.NumOther++;
+		}
+	}
+
+	chunk->End    = capture.Offset;
+	chunk->Failed = (!ok || capture.Failed) ? true : false;
+	CloseCaptureFile(&capture);
+}
+
+//--------------------------------------------------------------------------
+DWORD WINAPI ScanChunkThread(void *param)
+{
+	ScanChunk(reinterpret_cast<SCAN_CHUNK*>(param));
+	return 0;
+}
+
+//--------------------------------------------------------------------------
+bool ScanLog(const bool verbose, const char *inputFile,
+		const UINT32 numThreads)
+{
+	CAPTURE_FILE   capture;
+	SCAN_CHUNK    *chunk;
+	SCAN_CHUNK    *chunks             = NULL;
+	SCAN_IDS       connections;
+	LARGE_INTEGER  end;
+	UINT64         expected           = 0;
+	LARGE_INTEGER  frequency;
+	UINT32         index;
+	UINT64         noConnectionBlock  = 0;
+	UINT64         noProcessBlock     = 0;
+	UINT32         numChunks          = numThreads;
+	SCAN_IDS       processes;
+	bool           rc                 = true;
+	double         seconds;
+	UINT64         size;
+	LARGE_INTEGER  start;
+	SYSTEM_INFO    systemInfo;
+	SCAN_COUNTS    total;
+
+	ZeroMemory(&connections, sizeof(connections));
+	ZeroMemory(&processes, sizeof(processes));
+	ZeroMemory(&total, sizeof(total));
+
+	// Only the size is needed here, since each chunk opens the log itself
+	if (!OpenCaptureFile(&capture, inputFile)) {
+		return false;
+	}
+	size = capture.Size;
+	CloseCaptureFile(&capture);
+
+	if (!numChunks) {
+		GetSystemInfo(&systemInfo);
+		numChunks = systemInfo.dwNumberOfProcessors;
+	}
+	if (numChunks > size / SCAN_MIN_CHUNK_SIZE) {
+		numChunks = static_cast<UINT32>(size / SCAN_MIN_CHUNK_SIZE);
+	}
+	if (!numChunks) {
+		numChunks = 1;
+	}
+	chunks = reinterpret_cast<SCAN_CHUNK*>(calloc(numChunks,
+			sizeof(SCAN_CHUNK)));
+	if (chunks == NULL) {
+		fputs("Cannot allocate memory for chunks\n", stdout);
+		return false;
+	}
+	for (index = 0; index < numChunks; index++) {
+		chunk = chunks + index;
+		chunk->InputFile  = inputFile;
+		chunk->ChunkStart = (size / numChunks) * index;
+		chunk->ChunkEnd   = (index + 1 == numChunks) ? size :
+				(size / numChunks) * (index + 1);
+		chunk->FindStart  = index ? true : false;
+	}
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	// Scan the first chunk on this thread while other threads scan the rest
+	for (index = 1; index < numChunks; index++) {
+		chunks[index].Thread = CreateThread(NULL, 0, ScanChunkThread,
+				chunks + index, 0, NULL);
+		if (chunks[index].Thread == NULL) {
+			LogError("Cannot create scan thread");
+		}
+	}
+	ScanChunk(chunks);
+	for (index = 1; index < numChunks; index++) {
+		chunk = chunks + index;
+		if (chunk->Thread != NULL) {
+			WaitForSingleObject(chunk->Thread, INFINITE);
+			CloseHandle(chunk->Thread);
+			chunk->Thread = NULL;
+		} else {
+			ScanChunk(chunk);
+		}
+	}
+
+	// Merge the chunks in log order, checking that each one started where
+	// the previous one stopped
+	for (index = 0; index < numChunks; index++) {
+		chunk = chunks + index;
+		if (expected >= chunk->ChunkEnd) {
+			// The previous chunk's last block covers this whole chunk
+			continue;
+		}
+		if (chunk->Start != expected) {
+			if (verbose) {
+				printf("Rescanning chunk at offset %I64u from offset %I64u\n",
+						chunk->ChunkStart, expected);
+			}
+			CleanupScanIds(&chunk->Processes);
+			CleanupScanIds(&chunk->Connections);
+			chunk->ChunkStart = expected;
+			chunk->FindStart  = false;
+			ScanChunk(chunk);
+		}
+
+		total.NumBlocks      += chunk->Counts.NumBlocks;
+		total.NumConnections += chunk->Counts.NumConnections;
+		total.NumOther       += chunk->Counts.NumOther;
+		total.NumPackets     += chunk->Counts.NumPackets;
+		total.NumProcesses   += chunk->Counts.NumProcesses;
+		total.PacketBytes    += chunk->Counts.PacketBytes;
+		total.Unattributed   += chunk->Counts.Unattributed;
+		if (!MergeScanIds(&processes, &chunk->Processes, &noProcessBlock) ||
+				!MergeScanIds(&connections, &chunk->Connections,
+				&noConnectionBlock)) {
+			rc = false;
+			break;
+		}
+		expected = chunk->End;
+		if (chunk->Failed) {
+			rc = false;
+			break;
+		}
+	}
+	QueryPerformanceCounter(&end);
+	seconds = static_cast<double>(end.QuadPart - start.QuadPart) /
+			static_cast<double>(frequency.QuadPart);
+
+	printf("%s: %I64u blocks in %I64u bytes\n", inputFile, total.NumBlocks,
+			expected);
+	printf("  %I64u packet blocks with %I64u bytes of packet data\n",
+			total.NumPackets, total.PacketBytes);
+	printf("  %I64u process blocks\n", total.NumProcesses);
+	printf("  %I64u connection blocks\n", total.NumConnections);
+	printf("  %I64u other blocks\n", total.NumOther);
+	if (total.Unattributed) {
+		printf("  %I64u packets without a process ID\n", total.Unattributed);
+	}
+	if (noProcessBlock) {
+		printf("  %I64u packets without an earlier process block\n",
+				noProcessBlock);
+	}
+	if (noConnectionBlock) {
+		printf("  %I64u packets without an earlier connection block\n",
+				noConnectionBlock);
+	}
+	if (verbose && (seconds > 0.0)) {
+		printf("Read blocks on %u threads in %.3f seconds (%.2f GB/s)\n",
+				numChunks, seconds,
+				static_cast<double>(static_cast<INT64>(expected)) /
+				seconds / (1024.0 * 1024.0 * 1024.0));
+	}
+
+	for (index = 0; index < numChunks; index++) {
+		CleanupScanIds(&chunks[index].Processes);
+		CleanupScanIds(&chunks[index].Connections);
+	}
+	CleanupScanIds(&processes);
+	CleanupScanIds(&connections);
+	free(chunks);
+	return rc;
+}
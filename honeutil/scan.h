@@ -0,0 +1,35 @@
+//----------------------------------------------------------------------------
+// Hone user-mode utility scan operations
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef SCAN_H
+#define SCAN_H
+
+//----------------------------------------------------------------------------
+/// @brief Reads every block in a log and reports what it holds
+///
+/// Decodes the packet, process, and connection blocks in place and prints
+/// how many of each the log holds and how fast they were read, which makes
+/// it useful for checking a log and for measuring the capture reader.
+///
+/// Large logs are split into one chunk per thread.  Each thread finds the
+/// first block in its chunk and reads up to the first block in the next
+/// chunk, and the results are merged in log order so that packets are still
+/// matched with process and connection blocks from earlier chunks.
+///
+/// @param verbose     Print verbose output if true
+/// @param inputFile   Uncompressed log to scan
+/// @param numThreads  Number of threads to use (0 for one per processor)
+///
+/// @returns True if every block in the log is valid; false otherwise
+bool ScanLog(const bool verbose, const char *inputFile,
+		const UINT32 numThreads);
+
+#endif // SCAN_H
@@ -37,6 +37,9 @@ enum IOCTL_FUNCTIONS {
 	IoctlSetDataEvent,
 	IoctlOpenConnections,
 	IoctlGetStatistics,
+	IoctlSetPacketFilter,
+	IoctlMapSharedRing,
+	IoctlUpdateOpenConnections,
 	IoctlFlag   = 0x800, // Start of user-defined IOCTL function range
 	IoctlFlag64 = 0xC00, // Used for IOCTLs that require a 64-bit version
 };
@@ -56,6 +59,12 @@ struct CONNECTIONS {
 	struct CONNECTION_RECORD Records[1];  // Array of connection records
 };
 
+struct CONNECTION_CHANGES {
+	UINT32                   NumAdded;    // Number of added or changed records at the start of the array
+	UINT32                   NumRemoved;  // Number of removed records after the added records
+	struct CONNECTION_RECORD Records[1];  // Array of added records followed by removed records
+};
+
 struct STATISTICS {
 	UINT8  VersionMajor;           // Major version number (year)
 	UINT8  VersionMinor;           // Minor version number (month)
@@ -155,7 +164,7 @@ struct STATISTICS {
 /// @brief Passes a list of open connections to the driver
 ///
 /// * The reader passes the list in the buffer, which contains a populated
-///   CONNECTION_LIST structure
+///   CONNECTIONS structure
 /// * The buffer must be large enough to hold the list
 /// * Passing a new list of open connections will overwrite the previously
 ///   stored list
@@ -172,6 +181,53 @@ struct STATISTICS {
 #define IOCTL_HONE_GET_STATISTICS CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
 	IoctlGetStatistics, METHOD_BUFFERED, FILE_READ_ACCESS)
 
+/// @brief Sets the packet filter program for packet blocks
+///
+/// * The reader passes an array of PACKET_FILTER_INSN structures (see
+///   packet_filter.h) in the buffer
+/// * An empty buffer disables the packet filter
+/// * The driver rejects programs with jumps that leave the program or with
+///   more than PACKET_FILTER_MAX_INSNS instructions
+/// * The driver runs the program on each packet before queueing it for the
+///   reader, so rejected packets never use space in the reader's ring buffer
+/// * Packet filters are on a per-reader basis, so different readers can
+///   filter blocks with different programs
+#define IOCTL_HONE_SET_PACKET_FILTER CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+	IoctlSetPacketFilter, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+/// @brief Maps a shared byte ring into the reader's address space
+///
+/// * The reader passes the number of data bytes for the ring in the buffer,
+///   which must be a power of 2 between SHARED_RING_MIN_SIZE and
+///   SHARED_RING_MAX_SIZE, or 0 for SHARED_RING_DEFAULT_SIZE (see
+///   shared_ring.h)
+/// * The driver returns the 64-bit address of the SHARED_RING_HEADER in the
+///   buffer
+/// * After the ring is mapped, read operations copy PCAP-NG blocks into the
+///   ring instead of the read buffer, and return the number of bytes added to
+///   the ring.  The reader may pass a zero-length read buffer.
+/// * The reader writes out the data between the consumer and producer offsets
+///   and then advances the consumer offset to free the space
+/// * A reader can only map one ring, and the driver unmaps it when the reader
+///   closes its handle
+#define IOCTL_HONE_MAP_SHARED_RING CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+	IoctlMapSharedRing, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+/// @brief Applies changes to the list of open connections stored in the driver
+///
+/// * The reader passes a populated CONNECTION_CHANGES structure in the buffer
+/// * The buffer must be large enough to hold all of the records
+/// * The driver keeps one connection for each protocol, address family, and
+///   port.  Added records replace the stored connection for their port, and
+///   removed records clear it.  The driver ignores the process ID and
+///   timestamp of removed records.
+/// * The driver applies the removed records before the added records
+/// * Changes are applied to the list from IOCTL_HONE_SET_OPEN_CONNECTIONS, so
+///   the reader should send the full list again if it cannot be sure that the
+///   driver's list matches its own, such as after the driver reloads
+#define IOCTL_HONE_UPDATE_OPEN_CONNECTIONS CTL_CODE(FILE_DEVICE_UNKNOWN, IoctlFlag | \
+	IoctlUpdateOpenConnections, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
 #ifdef __cplusplus
 };
 #endif
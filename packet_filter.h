@@ -0,0 +1,219 @@
+//----------------------------------------------------------------------------
+// Packet filter programs shared by the Hone driver and its readers
+//
+// A packet filter program is a short array of instructions that readers
+// compile from a filter expression and pass to the driver.  Each test
+// instruction checks one field of a packet and skips forward a number of
+// instructions based on the result.  Jumps only go forward, so every program
+// runs in at most one pass over its instructions.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef PACKET_FILTER_H
+#define PACKET_FILTER_H
+
+//----------------------------------------------------------------------------
+// Defines
+//----------------------------------------------------------------------------
+
+#define PACKET_FILTER_MAX_INSNS 512 // Maximum number of instructions in a program
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+// Packet filter opcodes
+enum PACKET_FILTER_OPCODES {
+	PfAccept,      // Return the packet to the reader
+	PfReject,      // Drop the packet for the reader
+	PfIpVersion,   // IP version equals Value1
+	PfProtocol,    // Protocol is in the range Value1 to Value2
+	PfLocalPort,   // Local port is in the range Value1 to Value2
+	PfRemotePort,  // Remote port is in the range Value1 to Value2
+	PfLocalNet,    // Local address is in the IP version Value1 network Address/Value2
+	PfRemoteNet,   // Remote address is in the IP version Value1 network Address/Value2
+	PfDirection,   // Direction equals Value1
+	PfProcessId,   // Process ID is in the range Value1 to Value2
+	PfNumOpcodes,  // Number of opcodes
+};
+
+// Packet directions
+enum PACKET_FILTER_DIRECTIONS {
+	PfInbound  = 1,  // Matches the PCAP-NG inbound flag
+	PfOutbound = 2,  // Matches the PCAP-NG outbound flag
+};
+
+#pragma pack(push, 4) // Ensure structures are 4 byte aligned
+
+struct PACKET_FILTER_INSN {
+	UINT16 Opcode;       // What to do
+	UINT16 JumpTrue;     // Instructions to skip if the test passes
+	UINT16 JumpFalse;    // Instructions to skip if the test fails
+	UINT16 Reserved;     // Must be zero
+	UINT32 Value1;       // First operand
+	UINT32 Value2;       // Second operand
+	UINT8  Address[16];  // Network address for PfLocalNet and PfRemoteNet
+};
+
+#pragma pack(pop)
+
+// Packet fields that filter programs test
+struct PACKET_FILTER_FIELDS {
+	UINT32 ProcessId;          // Process that owns the packet's connection
+	UINT8  Direction;          // PfInbound or PfOutbound
+	UINT8  IpVersion;          // 4 or 6, or 0 if the packet could not be parsed
+	UINT8  Protocol;           // IP protocol number
+	bool   HasPorts;           // True if the ports are valid (TCP or UDP)
+	UINT16 LocalPort;          // Local port
+	UINT16 RemotePort;         // Remote port
+	UINT8  LocalAddress[16];   // Local address (IPv4 uses the first 4 bytes)
+	UINT8  RemoteAddress[16];  // Remote address (IPv4 uses the first 4 bytes)
+};
+
+//----------------------------------------------------------------------------
+/// @brief Checks if an address is in a network
+///
+/// @param address       Address to check
+/// @param network       Network address
+/// @param prefixLength  Number of bits in the network prefix
+///
+/// @returns True if the address is in the network; false otherwise
+static inline bool IsInPacketFilterNet(
+	const UINT8  *address,
+	const UINT8  *network,
+	const UINT32  prefixLength)
+{
+	const UINT32 bytes = prefixLength / 8;
+	const UINT32 bits  = prefixLength % 8;
+	UINT32       index;
+
+	for (index = 0; index < bytes; index++) {
+		if (address[index] != network[index]) {
+			return false;
+		}
+	}
+	if (bits) {
+		const UINT8 mask = static_cast<UINT8>(0xFF << (8 - bits));
+		if ((address[bytes] & mask) != (network[bytes] & mask)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Checks that a packet filter program is safe to run
+///
+/// Every jump must land on an instruction inside the program, which also
+/// means that the last instruction must be PfAccept or PfReject.
+///
+/// @param insns     Instructions to check
+/// @param numInsns  Number of instructions
+///
+/// @returns True if the program is valid; false otherwise
+static inline bool IsPacketFilterValid(
+	const PACKET_FILTER_INSN *insns,
+	const UINT32              numInsns)
+{
+	UINT32 index;
+
+	if ((numInsns == 0) || (numInsns > PACKET_FILTER_MAX_INSNS)) {
+		return false;
+	}
+	for (index = 0; index < numInsns; index++) {
+		const PACKET_FILTER_INSN *insn = insns + index;
+
+		if ((insn->Opcode >= PfNumOpcodes) || insn->Reserved) {
+			return false;
+		}
+		if ((insn->Opcode == PfAccept) || (insn->Opcode == PfReject)) {
+			continue;
+		}
+		if ((index + 1 + insn->JumpTrue >= numInsns) ||
+				(index + 1 + insn->JumpFalse >= numInsns)) {
+			return false;
+		}
+		if ((insn->Opcode == PfLocalNet) || (insn->Opcode == PfRemoteNet)) {
+			if (!(((insn->Value1 == 4) && (insn->Value2 <= 32)) ||
+					((insn->Value1 == 6) && (insn->Value2 <= 128)))) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------------
+/// @brief Runs a packet filter program against a packet
+///
+/// The program must have passed IsPacketFilterValid.
+///
+/// @param insns     Instructions to run
+/// @param numInsns  Number of instructions
+/// @param fields    Fields parsed from the packet
+///
+/// @returns True if the program accepts the packet; false otherwise
+static inline bool RunPacketFilter(
+	const PACKET_FILTER_INSN   *insns,
+	const UINT32                numInsns,
+	const PACKET_FILTER_FIELDS *fields)
+{
+	UINT32 index = 0;
+
+	while (index < numInsns) {
+		const PACKET_FILTER_INSN *insn = insns + index;
+		bool                      result;
+
+		switch (insn->Opcode) {
+		case PfAccept:
+			return true;
+		case PfReject:
+			return false;
+		case PfIpVersion:
+			result = (fields->IpVersion == insn->Value1);
+			break;
+		case PfProtocol:
+			result = (fields->IpVersion != 0) &&
+					(fields->Protocol >= insn->Value1) &&
+					(fields->Protocol <= insn->Value2);
+			break;
+		case PfLocalPort:
+			result = fields->HasPorts &&
+					(fields->LocalPort >= insn->Value1) &&
+					(fields->LocalPort <= insn->Value2);
+			break;
+		case PfRemotePort:
+			result = fields->HasPorts &&
+					(fields->RemotePort >= insn->Value1) &&
+					(fields->RemotePort <= insn->Value2);
+			break;
+		case PfLocalNet:
+			result = (fields->IpVersion == insn->Value1) && IsInPacketFilterNet(
+					fields->LocalAddress, insn->Address, insn->Value2);
+			break;
+		case PfRemoteNet:
+			result = (fields->IpVersion == insn->Value1) && IsInPacketFilterNet(
+					fields->RemoteAddress, insn->Address, insn->Value2);
+			break;
+		case PfDirection:
+			result = (fields->Direction == insn->Value1);
+			break;
+		case PfProcessId:
+			result = (fields->ProcessId >= insn->Value1) &&
+					(fields->ProcessId <= insn->Value2);
+			break;
+		default:
+			return false;
+		}
+		index += 1 + (result ? insn->JumpTrue : insn->JumpFalse);
+	}
+	return false;
+}
+
+#endif // PACKET_FILTER_H
@@ -0,0 +1,238 @@
+//----------------------------------------------------------------------------
+// PCAP-NG block formats shared by the Hone driver and its readers
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Alexis J. Malozemoff <alexis.malozemoff@pnnl.gov>
+//   Peter L. Nordquist <peter.nordquist@pnnl.gov>
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//   Ruslan A. Doroshchuk <ruslan.doroshchuk@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef PCAP_NG_H
+#define PCAP_NG_H
+
+//----------------------------------------------------------------------------
+// Defines
+//----------------------------------------------------------------------------
+
+#ifndef PCAP_NG_PADDING
+#define PCAP_NG_PADDING(x) ((x) + ((4-(x)) & 0x03))
+#endif
+
+#define PCAP_NG_EVENT_OPTION  2           // Option code for process and connection events
+#define PCAP_NG_ENDED_EVENT   0xFFFFFFFF  // Event value when a process ends or connection closes
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+// Supported PCAP-NG block types
+enum BLOCK_TYPES {
+	ConnectionBlock           = 0x00000102,
+	InterfaceDescriptionBlock = 0x00000001,
+	PacketBlock               = 0x00000006,
+	ProcessBlock              = 0x00000101,
+	SectionHeaderBlock        = 0x0A0D0D0A,
+};
+
+#pragma pack(push, 4) // PCAP-NG structures are 32-bit aligned
+
+// PCAP-NG block option header
+struct PCAP_NG_OPTION_HEADER {
+	UINT16 OptionCode;
+	UINT16 OptionLength;
+};
+
+// PCAP-NG connection block format:
+//
+//     0                   1                   2                   3
+//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+//    +---------------------------------------------------------------+
+//  0 |                    Block Type = 0x00000102                    |
+//    +---------------------------------------------------------------+
+//  4 |                      Block Total Length                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//  8 |                        Connection ID                          |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 12 |                          Process ID                           |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 16 |                        Timestamp (High)                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 20 |                        Timestamp (Low)                        |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 24 /                                                               /
+//    /                      Options (variable)                       /
+//    /                                                               /
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//    |                      Block Total Length                       |
+//    +---------------------------------------------------------------+
+//
+struct PCAP_NG_CONNECTION_HEADER {
+	UINT32 BlockType;
+	UINT32 BlockLength;
+	UINT32 ConnectionId;
+	UINT32 ProcessId;
+	UINT32 TimestampHigh;
+	UINT32 TimestampLow;
+	// Options and block length
+};
+
+// PCAP-NG interface description block format:
+//
+//     0                   1                   2                   3
+//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+//    +---------------------------------------------------------------+
+//  0 |                    Block Type = 0x00000001                    |
+//    +---------------------------------------------------------------+
+//  4 |                      Block Total Length                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//  8 |           LinkType            |           Reserved            |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 12 |                            SnapLen                            |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 16 /                                                               /
+//    /                      Options (variable)                       /
+//    /                                                               /
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//    |                      Block Total Length                       |
+//    +---------------------------------------------------------------+
+//
+struct PCAP_NG_INTERFACE_DESCRIPTION {
+	UINT32                       BlockType;
+	UINT32                       BlockLength;
+	UINT16                       LinkType;
+	UINT16                       Reserved;
+	UINT32                       SnapLength;
+	struct PCAP_NG_OPTION_HEADER IfDescHeader;
+	char                         IfDesc[28];
+	struct PCAP_NG_OPTION_HEADER OptionEnd;
+	UINT32                       BlockLengthFooter;
+};
+
+// PCAP-NG enhanced packet block format:
+//
+//    0                   1                   2                   3
+//    0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+//    +---------------------------------------------------------------+
+//  0 |                    Block Type = 0x00000006                    |
+//    +---------------------------------------------------------------+
+//  4 |                      Block Total Length                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//  8 |                         Interface ID                          |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 12 |                        Timestamp (High)                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 16 |                        Timestamp (Low)                        |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 20 |                         Captured Len                          |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 24 |                          Packet Len                           |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 28 /                                                               /
+//    /                          Packet Data                          /
+//    /           ( variable length, aligned to 32 bits )             /
+//    /                                                               /
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//    /                                                               /
+//    /                      Options (variable)                       /
+//    /                                                               /
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//    |                      Block Total Length                       |
+//    +---------------------------------------------------------------+
+//
+struct PCAP_NG_PACKET_HEADER {
+	UINT32 BlockType;
+	UINT32 BlockLength;
+	UINT32 InterfaceId;
+	UINT32 TimestampHigh;
+	UINT32 TimestampLow;
+	UINT32 CapturedLength;
+	UINT32 PacketLength;
+	// Block data, options, and block length
+};
+
+struct PCAP_NG_PACKET_FOOTER {
+	struct PCAP_NG_OPTION_HEADER ConnectionIdHeader;
+	UINT32                       ConnectionId;
+	struct PCAP_NG_OPTION_HEADER ProcessIdHeader;
+	UINT32                       ProcessId;
+	struct PCAP_NG_OPTION_HEADER FlagsHeader;
+	UINT32                       Flags;
+	struct PCAP_NG_OPTION_HEADER OptionEnd;
+	UINT32                       BlockLength;
+};
+
+// PCAP-NG process event block format:
+//
+//     0                   1                   2                   3
+//     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+//    +---------------------------------------------------------------+
+//  0 |                    Block Type = 0x00000101                    |
+//    +---------------------------------------------------------------+
+//  4 |                      Block Total Length                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//  8 |                          Process ID                           |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 12 |                        Timestamp (High)                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 16 |                        Timestamp (Low)                        |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 20 /                                                               /
+//    /                      Options (variable)                       /
+//    /                                                               /
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//    |                      Block Total Length                       |
+//    +---------------------------------------------------------------+
+//
+struct PCAP_NG_PROCESS_HEADER {
+	UINT32                       BlockType;
+	UINT32                       BlockLength;
+	UINT32                       ProcessId;
+	UINT32                       TimestampHigh;
+	UINT32                       TimestampLow;
+	struct PCAP_NG_OPTION_HEADER ParentPidHeader;
+	UINT32                       ParentPid;
+	// Options and block length
+};
+
+// PCAP-NG section header block format:
+//
+//   0                   1                   2                   3
+//    0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+//    +---------------------------------------------------------------+
+//  0 |                   Block Type = 0x0A0D0D0A                     |
+//    +---------------------------------------------------------------+
+//  4 |                      Block Total Length                       |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//  8 |                      Byte-Order Magic                         |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 12 |          Major Version        |         Minor Version         |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 16 |                                                               |
+//    |                          Section Length                       |
+//    |                                                               |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 24 /                                                               /
+//    /                      Options (variable)                       /
+//    /                                                               /
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//    |                      Block Total Length                       |
+//    +---------------------------------------------------------------+
+//
+struct PCAP_NG_SECTION_HEADER {
+	UINT32 BlockType;
+	UINT32 BlockLength;
+	UINT32 ByteOrder;
+	UINT16 MajorVersion;
+	UINT16 MinorVersion;
+	UINT64 SectionLength;
+	// Options and block length
+};
+
+#pragma pack(pop)
+
+#endif  // PCAP_NG_H
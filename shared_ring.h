@@ -0,0 +1,102 @@
+//----------------------------------------------------------------------------
+// Byte ring shared between the Hone driver and a reader process
+//
+// The driver maps the ring into the reader's address space and copies
+// PCAP-NG blocks into it, so the reader can write them to disk straight from
+// the mapping.  There is exactly one producer (the driver) and one consumer
+// (the reader).  The producer and consumer offsets are free-running byte
+// counts that wrap at 4GB, and the number of data bytes must be a power of 2.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef SHARED_RING_H
+#define SHARED_RING_H
+
+//----------------------------------------------------------------------------
+// Defines
+//----------------------------------------------------------------------------
+
+#define SHARED_RING_HEADER_SIZE  0x1000    // Bytes before the data (one page)
+#define SHARED_RING_MIN_SIZE     0x10000   // Minimum number of data bytes
+#define SHARED_RING_DEFAULT_SIZE 0x400000  // Default number of data bytes
+#define SHARED_RING_MAX_SIZE     0x4000000 // Maximum number of data bytes
+
+#ifdef _MSC_VER
+#define SHARED_RING_BARRIER() MemoryBarrier()
+#else
+#define SHARED_RING_BARRIER() __sync_synchronize()
+#endif
+
+//----------------------------------------------------------------------------
+// Structures and enumerations
+//----------------------------------------------------------------------------
+
+struct SHARED_RING_HEADER {
+	volatile UINT32 Producer;         // Total bytes written by the driver
+	UINT8           ProducerPad[60];  // Keeps offsets on separate cache lines
+	volatile UINT32 Consumer;         // Total bytes consumed by the reader
+	UINT8           ConsumerPad[60];  // Keeps offsets on separate cache lines
+	UINT32          DataSize;         // Number of data bytes (power of 2)
+	UINT32          DataOffset;       // Offset from the header to the data
+};
+
+//----------------------------------------------------------------------------
+/// @brief Gets the free space that follows the producer offset without
+/// wrapping around the end of the ring
+///
+/// @param dataSize  Number of data bytes in the ring
+/// @param producer  Producer offset
+/// @param consumer  Consumer offset
+/// @param offset    Receives the offset of the free space in the data
+///
+/// @returns Number of contiguous free bytes (0 if the ring is full or the
+///          offsets are inconsistent)
+static inline UINT32 GetSharedRingWriteSpan(
+	const UINT32  dataSize,
+	const UINT32  producer,
+	const UINT32  consumer,
+	UINT32       *offset)
+{
+	const UINT32 used = producer - consumer;
+
+	if (used >= dataSize) {
+		return 0;
+	}
+	*offset = producer & (dataSize - 1);
+	return ((dataSize - used) < (dataSize - *offset)) ?
+			(dataSize - used) : (dataSize - *offset);
+}
+
+//----------------------------------------------------------------------------
+/// @brief Gets the data that follows the consumer offset without wrapping
+/// around the end of the ring
+///
+/// @param dataSize  Number of data bytes in the ring
+/// @param producer  Producer offset
+/// @param consumer  Consumer offset
+/// @param offset    Receives the offset of the bytes in the data
+///
+/// @returns Number of contiguous bytes to consume (0 if the ring is empty or
+///          the offsets are inconsistent)
+static inline UINT32 GetSharedRingReadSpan(
+	const UINT32  dataSize,
+	const UINT32  producer,
+	const UINT32  consumer,
+	UINT32       *offset)
+{
+	const UINT32 used = producer - consumer;
+
+	if ((used == 0) || (used > dataSize)) {
+		return 0;
+	}
+	*offset = consumer & (dataSize - 1);
+	return (used < (dataSize - *offset)) ? used : (dataSize - *offset);
+}
+
+#endif // SHARED_RING_H
@@ -0,0 +1,251 @@
+//----------------------------------------------------------------------------
+// Tests for the block cache used to start new log files
+//
+// Feeds section header, interface, process, connection, and packet blocks to
+// the cache and checks that it hands back the blocks that describe the
+// current state, in the order they arrived.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <Windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../honeutil/block_cache.h"
+#include "../pcap_ng.h"
+#include "test.h"
+
+//--------------------------------------------------------------------------
+// Defines
+//--------------------------------------------------------------------------
+
+#define TEST_BLOCK_SIZE 64  // Size of the buffers that hold test blocks
+
+//--------------------------------------------------------------------------
+// Structures and enumerations
+//--------------------------------------------------------------------------
+
+struct TEST_BLOCK {
+	UINT8  Data[TEST_BLOCK_SIZE];  // Block contents
+	UINT32 Length;                 // Block length in bytes
+};
+
+//--------------------------------------------------------------------------
+void AppendUint32(TEST_BLOCK *block, const UINT32 value)
+{
+	memcpy(block->Data + block->Length, &value, sizeof(value));
+	block->Length += static_cast<UINT32>(sizeof(value));
+}
+
+//--------------------------------------------------------------------------
+void AppendOption(TEST_BLOCK *block, const UINT16 optionCode, const UINT32 value)
+{
+	PCAP_NG_OPTION_HEADER option = {optionCode, sizeof(value)};
+
+	memcpy(block->Data + block->Length, &option, sizeof(option));
+	block->Length += static_cast<UINT32>(sizeof(option));
+	AppendUint32(block, value);
+}
+
+//--------------------------------------------------------------------------
+void FinishBlock(TEST_BLOCK *block)
+{
+	AppendUint32(block, 0);  // End of options
+	AppendUint32(block, block->Length + static_cast<UINT32>(sizeof(UINT32)));
+	memcpy(block->Data + sizeof(UINT32), &block->Length, sizeof(UINT32));
+}
+
+//--------------------------------------------------------------------------
+void MakeBlock(TEST_BLOCK *block, const UINT32 blockType, const UINT32 id,
+		const bool ended)
+{
+	memset(block, 0, sizeof(TEST_BLOCK));
+	AppendUint32(block, blockType);
+	AppendUint32(block, 0);  // Length, filled in by FinishBlock
+	AppendUint32(block, id);
+	switch (blockType) {
+	case ProcessBlock:
+		block->Length = sizeof(PCAP_NG_PROCESS_HEADER);
+		break;
+	case ConnectionBlock:
+		block->Length = sizeof(PCAP_NG_CONNECTION_HEADER);
+		break;
+	default:
+		break;
+	}
+	if (ended) {
+		AppendOption(block, PCAP_NG_EVENT_OPTION, PCAP_NG_ENDED_EVENT);
+	} else {
+		AppendOption(block, PCAP_NG_EVENT_OPTION + 1, id);
+	}
+	FinishBlock(block);
+}
+
+//--------------------------------------------------------------------------
+bool Update(BLOCK_CACHE *cache, const UINT32 blockType, const UINT32 id,
+		const bool ended)
+{
+	TEST_BLOCK block;
+
+	MakeBlock(&block, blockType, id, ended);
+	return UpdateBlockCache(cache, block.Data, block.Length);
+}
+
+//--------------------------------------------------------------------------
+bool CheckCachedBlocks(BLOCK_CACHE *cache, const UINT32 *blockTypes,
+		const UINT32 *ids, const UINT32 numBlocks)
+{
+	UINT32  length;
+	UINT32  offset = 0;
+	UINT8  *blocks = GetCachedBlocks(cache, &length);
+	bool    result = (blocks != NULL);
+
+	for (UINT32 index = 0; result && (index < numBlocks); index++) {
+		TEST_BLOCK expected;
+
+		MakeBlock(&expected, blockTypes[index], ids[index], false);
+		if ((offset + expected.Length > length) ||
+				memcmp(blocks + offset, expected.Data, expected.Length)) {
+			result = false;
+		}
+		offset += expected.Length;
+	}
+	if (offset != length) {
+		result = false;
+	}
+	free(blocks);
+	return result;
+}
+
+//--------------------------------------------------------------------------
+void TestBlockOrder(void)
+{
+	BLOCK_CACHE cache = {0};
+	TEST_BLOCK  block;
+	UINT32      length;
+	UINT8      *blocks;
+
+	blocks = GetCachedBlocks(&cache, &length);
+	Check(blocks && (length == 0), "empty cache has no blocks");
+	free(blocks);
+
+	Update(&cache, SectionHeaderBlock, 0, false);
+	Update(&cache, InterfaceDescriptionBlock, 0, false);
+	Update(&cache, ProcessBlock, 8, false);
+	Update(&cache, PacketBlock, 1, false);
+	Update(&cache, ConnectionBlock, 8, false);
+	Update(&cache, ProcessBlock, 4, false);
+	Update(&cache, InterfaceDescriptionBlock, 1, false);
+	{
+		const UINT32 types[] = {SectionHeaderBlock, InterfaceDescriptionBlock,
+				InterfaceDescriptionBlock, ProcessBlock, ConnectionBlock,
+				ProcessBlock};
+		const UINT32 ids[]   = {0, 0, 1, 8, 8, 4};
+		Check(CheckCachedBlocks(&cache, types, ids, ARRAYSIZE(types)),
+				"cache returns headers, then blocks in arrival order");
+	}
+
+	// Ended processes and closed connections are dropped, and ending an
+	// unknown ID does nothing
+	Update(&cache, ProcessBlock, 8, true);
+	Update(&cache, ConnectionBlock, 12, true);
+	{
+		const UINT32 types[] = {SectionHeaderBlock, InterfaceDescriptionBlock,
+				InterfaceDescriptionBlock, ConnectionBlock, ProcessBlock};
+		const UINT32 ids[]   = {0, 0, 1, 8, 4};
+		Check(CheckCachedBlocks(&cache, types, ids, ARRAYSIZE(types)),
+				"ended process is dropped, connection with same ID is kept");
+	}
+
+	// A repeated block replaces the old one and moves to the end
+	Update(&cache, ConnectionBlock, 8, false);
+	{
+		const UINT32 types[] = {SectionHeaderBlock, InterfaceDescriptionBlock,
+				InterfaceDescriptionBlock, ProcessBlock, ConnectionBlock};
+		const UINT32 ids[]   = {0, 0, 1, 4, 8};
+		Check(CheckCachedBlocks(&cache, types, ids, ARRAYSIZE(types)),
+				"repeated block replaces the old one");
+		Check(cache.Count == 2, "repeated block is counted once");
+	}
+
+	// Blocks too short to hold a whole header are ignored
+	MakeBlock(&block, ProcessBlock, 12, false);
+	Check(UpdateBlockCache(&cache, block.Data, sizeof(PCAP_NG_PROCESS_HEADER) - 1) &&
+			(cache.Count == 2), "truncated block is ignored");
+
+	// A new section starts over
+	Update(&cache, SectionHeaderBlock, 1, false);
+	{
+		const UINT32 types[] = {SectionHeaderBlock};
+		const UINT32 ids[]   = {1};
+		Check(CheckCachedBlocks(&cache, types, ids, ARRAYSIZE(types)) &&
+				(cache.Count == 0), "section header clears the cache");
+	}
+	CleanupBlockCache(&cache);
+}
+
+//--------------------------------------------------------------------------
+void TestManyProcesses(void)
+{
+	const UINT32  numProcesses = 20000;
+	BLOCK_CACHE   cache        = {0};
+	UINT32       *types        = reinterpret_cast<UINT32*>(
+			malloc(numProcesses * sizeof(UINT32)));
+	UINT32       *ids          = reinterpret_cast<UINT32*>(
+			malloc(numProcesses * sizeof(UINT32)));
+	UINT32        index;
+	UINT32        numIds       = 0;
+	bool          added        = true;
+
+	if (!types || !ids) {
+		Check(false, "allocate block cache test arrays");
+		free(types);
+		free(ids);
+		return;
+	}
+
+	// Process IDs are multiples of 4, and removing every other one exercises
+	// the backward shift that keeps probe sequences unbroken
+	for (index = 1; index <= numProcesses; index++) {
+		if (!Update(&cache, ProcessBlock, index * 4, false)) {
+			added = false;
+		}
+	}
+	Check(added && (cache.Count == numProcesses), "cache holds many processes");
+	Check(cache.Capacity >= cache.Count * 2, "cache stays at most half full");
+	for (index = 1; index <= numProcesses; index += 2) {
+		Update(&cache, ProcessBlock, index * 4, true);
+	}
+	for (index = 2; index <= numProcesses; index += 2) {
+		types[numIds] = ProcessBlock;
+		ids[numIds++] = index * 4;
+	}
+	Check(cache.Count == numIds, "ended processes are removed");
+	Check(CheckCachedBlocks(&cache, types, ids, numIds),
+			"remaining processes are found in arrival order");
+
+	for (index = 2; index <= numProcesses; index += 2) {
+		Update(&cache, ProcessBlock, index * 4, true);
+	}
+	Check(cache.Count == 0, "cache is empty after every process ends");
+	CleanupBlockCache(&cache);
+	free(types);
+	free(ids);
+}
+
+//--------------------------------------------------------------------------
+void RunBlockCacheTests(void)
+{
+	TestBlockOrder();
+	TestManyProcesses();
+}
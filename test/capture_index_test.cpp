@@ -0,0 +1,164 @@
+//----------------------------------------------------------------------------
+// Tests for the capture index written alongside logs
+//
+// Checks the entries taken from each kind of block, the index file name for
+// plain and compressed logs, and the sorted index file that is written.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <Windows.h>
+#include <string.h>
+
+#include "../honeutil/capture_index.h"
+#include "../pcap_ng.h"
+#include "test.h"
+
+//--------------------------------------------------------------------------
+void TestIndexEntries(void)
+{
+	CAPTURE_INDEX_ENTRY       entry;
+	PCAP_NG_CONNECTION_HEADER connection = {0};
+	PCAP_NG_PROCESS_HEADER    process    = {0};
+	PCAP_NG_PACKET_FOOTER     footer     = {0};
+	PCAP_NG_PACKET_HEADER     packet     = {0};
+	UINT8                     block[sizeof(packet) + 8 + sizeof(footer)] = {0};
+
+	// Packet block with 8 bytes of data followed by the Hone options
+	packet.BlockType          = PacketBlock;
+	packet.TimestampHigh      = 0x12;
+	packet.TimestampLow       = 0x34567890;
+	footer.ConnectionIdHeader.OptionCode = 257;
+	footer.ConnectionId       = 77;
+	footer.ProcessIdHeader.OptionCode    = 258;
+	footer.ProcessId          = 1234;
+	memcpy(block, &packet, sizeof(packet));
+	memcpy(block + sizeof(packet) + 8, &footer, sizeof(footer));
+	Check(GetCaptureIndexEntry(block, sizeof(block), 4096, &entry) &&
+			(entry.Offset == 4096) && (entry.BlockType == PacketBlock) &&
+			(entry.BlockLength == sizeof(block)) &&
+			(entry.Timestamp == 0x1234567890ULL) && (entry.ProcessId == 1234) &&
+			(entry.ConnectionId == 77), "packet block is indexed by its options");
+	Check(!GetCaptureIndexEntry(block, sizeof(packet), 0, &entry),
+			"truncated packet block is not indexed");
+	footer.ProcessIdHeader.OptionCode = 0;
+	memcpy(block + sizeof(packet) + 8, &footer, sizeof(footer));
+	Check(!GetCaptureIndexEntry(block, sizeof(block), 0, &entry),
+			"packet block without Hone options is not indexed");
+
+	process.BlockType     = ProcessBlock;
+	process.ProcessId     = 4;
+	process.TimestampLow  = 99;
+	memcpy(block, &process, sizeof(process));
+	Check(GetCaptureIndexEntry(block, sizeof(process), 0, &entry) &&
+			(entry.ProcessId == 4) && (entry.Timestamp == 99) &&
+			(entry.ConnectionId == CAPTURE_INDEX_NO_ID),
+			"process block is indexed without a connection");
+
+	connection.BlockType     = ConnectionBlock;
+	connection.ConnectionId  = 5;
+	connection.ProcessId     = 8;
+	connection.TimestampHigh = 1;
+	memcpy(block, &connection, sizeof(connection));
+	Check(GetCaptureIndexEntry(block, sizeof(connection), 0, &entry) &&
+			(entry.ProcessId == 8) && (entry.ConnectionId == 5) &&
+			(entry.Timestamp == 0x100000000ULL),
+			"connection block is indexed by its header");
+	Check(!GetCaptureIndexEntry(block, sizeof(connection) - 1, 0, &entry),
+			"truncated connection block is not indexed");
+
+	packet.BlockType = SectionHeaderBlock;
+	memcpy(block, &packet, sizeof(packet));
+	Check(!GetCaptureIndexEntry(block, sizeof(block), 0, &entry),
+			"section header block is not indexed");
+}
+
+//--------------------------------------------------------------------------
+void TestIndexNames(void)
+{
+	char name[MAX_PATH];
+
+	GetCaptureIndexName("C:\\logs\\hone.pcapng", name, sizeof(name));
+	Check(strcmp(name, "C:\\logs\\hone.pcapng.idx") == 0,
+			"index name adds .idx to the log name");
+	GetCaptureIndexName("C:\\logs\\hone.pcapng.lz4", name, sizeof(name));
+	Check(strcmp(name, "C:\\logs\\hone.pcapng.idx") == 0,
+			"index name for a compressed log drops .lz4");
+	GetCaptureIndexName("hone.pcapng.LZ4", name, sizeof(name));
+	Check(strcmp(name, "hone.pcapng.idx") == 0,
+			"index name drops .lz4 in any case");
+	GetCaptureIndexName(".lz4", name, sizeof(name));
+	Check(strcmp(name, ".lz4.idx") == 0, "index name keeps a bare .lz4");
+}
+
+//--------------------------------------------------------------------------
+void TestIndexFile(void)
+{
+	CAPTURE_INDEX_ENTRY  entries[5] = {0};
+	CAPTURE_INDEX_HEADER header     = {0};
+	CAPTURE_INDEX_ENTRY  readEntries[5] = {0};
+	char                 logFile[MAX_PATH];
+	char                 indexFile[MAX_PATH];
+	DWORD                bytesRead  = 0;
+	HANDLE               index;
+	bool                 sorted     = true;
+
+	const UINT32 processIds[] = {8, 4, 8, 4, 4};
+	const UINT64 timestamps[] = {20, 30, 10, 30, 5};
+	for (UINT32 entry = 0; entry < ARRAYSIZE(entries); entry++) {
+		entries[entry].ProcessId = processIds[entry];
+		entries[entry].Timestamp = timestamps[entry];
+		entries[entry].Offset    = 1000 - entry;
+	}
+
+	if (!GetTempPath(sizeof(logFile), logFile) ||
+			strcat_s(logFile, sizeof(logFile), "hone_test.pcapng.lz4")) {
+		Check(false, "get temporary log file name");
+		return;
+	}
+	Check(WriteCaptureIndex(logFile, entries, ARRAYSIZE(entries)),
+			"index file is written");
+	GetCaptureIndexName(logFile, indexFile, sizeof(indexFile));
+	index = CreateFile(indexFile, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, 0);
+	if (index == INVALID_HANDLE_VALUE) {
+		Check(false, "open index file");
+		return;
+	}
+	Check(ReadFile(index, &header, sizeof(header), &bytesRead, NULL) &&
+			(bytesRead == sizeof(header)) &&
+			(header.Magic == CAPTURE_INDEX_MAGIC) &&
+			(header.Version == CAPTURE_INDEX_VERSION) &&
+			(header.NumEntries == ARRAYSIZE(entries)),
+			"index file header is valid");
+	Check(ReadFile(index, readEntries, sizeof(readEntries), &bytesRead, NULL) &&
+			(bytesRead == sizeof(readEntries)),
+			"index file holds every entry");
+	CloseHandle(index);
+	DeleteFile(indexFile);
+
+	// Sorted by process ID, then timestamp, then offset
+	const UINT32 sortedOffsets[] = {996, 997, 999, 998, 1000};
+	for (UINT32 entry = 0; entry < ARRAYSIZE(readEntries); entry++) {
+		if (readEntries[entry].Offset != sortedOffsets[entry]) {
+			sorted = false;
+		}
+	}
+	Check(sorted, "index entries are sorted by process, time, and offset");
+}
+
+//--------------------------------------------------------------------------
+void RunCaptureIndexTests(void)
+{
+	TestIndexEntries();
+	TestIndexNames();
+	TestIndexFile();
+}
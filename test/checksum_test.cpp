@@ -0,0 +1,156 @@
+//----------------------------------------------------------------------------
+// Tests for the driver's internet checksum code
+//
+// Checks known checksums and compares the optimized code against a simple
+// RFC 1071 loop over random buffers, lengths, alignments, checksum field
+// offsets, and carried-in sums.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <string.h>
+
+#include "../hone/checksum.h"
+#include "test.h"
+
+//--------------------------------------------------------------------------
+// Defines
+//--------------------------------------------------------------------------
+
+#define CHECKSUM_TEST_SIZE 0x10010  // Largest packet plus room for misalignment
+
+//--------------------------------------------------------------------------
+// Global variables
+//--------------------------------------------------------------------------
+
+static UINT8  gBuffer[CHECKSUM_TEST_SIZE];  // Random data to checksum
+static UINT32 gSeed = 1;                    // Random number generator state
+
+//--------------------------------------------------------------------------
+UINT32 NextRandom(void)
+{
+	gSeed = gSeed * 1103515245 + 12345;
+	return gSeed >> 8;
+}
+
+//--------------------------------------------------------------------------
+UINT16 ReferenceChecksum(const UINT8 *buffer, const UINT32 length,
+		const UINT32 checksumIndex, const UINT32 innerLoopSum)
+{
+	UINT32 sum = innerLoopSum;
+	UINT16 checksum;
+
+	// Sum whole 16 bit values in network byte order, skipping the checksum
+	for (UINT32 index = 0; index + 1 < length; index += 2) {
+		if (index != (checksumIndex & ~1)) {
+			sum += (buffer[index] << 8) | buffer[index + 1];
+			sum  = (sum & 0xFFFF) + (sum >> 16);
+		}
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	}
+
+	// Return the one's complement in network byte order
+	checksum = static_cast<UINT16>(~sum);
+	checksum = static_cast<UINT16>((checksum << 8) | (checksum >> 8));
+	return (checksum == 0) ? 0xFFFF : checksum;
+}
+
+//--------------------------------------------------------------------------
+bool IsChecksum(const UINT16 checksum, const UINT8 high, const UINT8 low)
+{
+	UINT8 bytes[2];
+
+	memcpy(bytes, &checksum, sizeof(bytes));
+	return (bytes[0] == high) && (bytes[1] == low);
+}
+
+//--------------------------------------------------------------------------
+void TestKnownChecksums(void)
+{
+	// Example from RFC 1071 section 3
+	UINT8 rfcData[] = {0x00, 0x01, 0xF2, 0x03, 0xF4, 0xF5, 0xF6, 0xF7};
+	Check(IsChecksum(Checksum(rfcData, sizeof(rfcData)), 0x22, 0x0D),
+			"RFC 1071 example checksum");
+
+	// IPv4 header with its checksum field at offset 10
+	UINT8 ipHeader[] = {
+		0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11,
+		0xB8, 0x61, 0xC0, 0xA8, 0x00, 0x01, 0xC0, 0xA8, 0x00, 0xC7,
+	};
+	Check(IsChecksum(Checksum(ipHeader, sizeof(ipHeader), 10), 0xB8, 0x61),
+			"IPv4 header checksum skips the checksum field");
+	Check(ipHeader[10] == 0xB8, "checksum does not modify the buffer");
+
+	// A sum of 0xFFFF would give a checksum of 0, which is sent as 0xFFFF
+	UINT8 allOnes[] = {0xFF, 0xFF};
+	Check(Checksum(allOnes, sizeof(allOnes)) == 0xFFFF,
+			"zero checksum is sent as 0xFFFF");
+
+	// The pseudo-header sum carries into the payload checksum
+	UINT8 packet[] = {
+		0xC0, 0xA8, 0x00, 0x01, 0xC0, 0xA8, 0x00, 0xC7, 0x00, 0x11, 0x00, 0x0C,
+		0x30, 0x39, 0x00, 0x35, 0x00, 0x0C, 0x00, 0x00, 0x61, 0x62, 0x63, 0x64,
+	};
+	Check(Checksum(packet + 12, 12, 6, ChecksumInnerLoop(packet, 12)) ==
+			Checksum(packet, sizeof(packet), 18),
+			"carried sum matches checksum of whole buffer");
+}
+
+//--------------------------------------------------------------------------
+void TestRandomBuffers(void)
+{
+	UINT32 index;
+	bool   matched = true;
+
+	for (index = 0; index < sizeof(gBuffer); index++) {
+		gBuffer[index] = static_cast<UINT8>(NextRandom());
+	}
+
+	for (UINT32 iteration = 0; iteration < 20000; iteration++) {
+		const UINT32 offset        = NextRandom() % 16;
+		const UINT32 maxLength     = (iteration % 100) ? 1500 : 0x10000;
+		const UINT32 length        = NextRandom() % (maxLength + 1);
+		const UINT32 checksumIndex = (iteration % 3) ? NextRandom() % (length + 1) :
+				_UI32_MAX;
+		const UINT32 innerLoopSum  = (iteration % 5) ? 0 : NextRandom() & 0xFFFFF;
+		UINT8       *buffer        = gBuffer + offset;
+
+		// Runs of 0xFF make every addition carry
+		if (iteration % 7 == 0) {
+			memset(buffer, 0xFF, length);
+		}
+
+		if (Checksum(buffer, length, checksumIndex, innerLoopSum) !=
+				ReferenceChecksum(buffer, length, checksumIndex, innerLoopSum)) {
+			if (matched) {
+				Check(false, "checksum of %u bytes at offset %u with field at %u",
+						length, offset, checksumIndex);
+			}
+			matched = false;
+		}
+		if (iteration % 7 == 0) {
+			for (index = 0; index < length; index++) {
+				buffer[index] = static_cast<UINT8>(NextRandom());
+			}
+		}
+	}
+	Check(matched, "checksums of random buffers match the reference");
+}
+
+//--------------------------------------------------------------------------
+void RunChecksumTests(void)
+{
+	TestKnownChecksums();
+	TestRandomBuffers();
+}
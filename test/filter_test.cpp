@@ -0,0 +1,209 @@
+//----------------------------------------------------------------------------
+// Tests for the packet filter compiler, validator, and interpreter
+//
+// Compiles filter expressions with the honeutil compiler, runs the programs
+// against sample packets, and checks that the validator rejects programs the
+// driver must never run.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <WinSock2.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../packet_filter.h"
+#include "../honeutil/filter_compiler.h"
+#include "test.h"
+
+//--------------------------------------------------------------------------
+// Structures and enumerations
+//--------------------------------------------------------------------------
+
+struct FILTER_TEST {
+	const char *Expression;  // Filter expression to compile
+	bool        Accept;      // True if the filter should accept the packet
+};
+
+//--------------------------------------------------------------------------
+void SetAddress(UINT8 *address, const UINT8 a, const UINT8 b, const UINT8 c,
+		const UINT8 d)
+{
+	memset(address, 0, 16);
+	address[0] = a;
+	address[1] = b;
+	address[2] = c;
+	address[3] = d;
+}
+
+//--------------------------------------------------------------------------
+void TestCompiledFilters(void)
+{
+	PACKET_FILTER_FIELDS fields = {0};
+	PACKET_FILTER_INSN   insns[PACKET_FILTER_MAX_INSNS];
+	UINT32               numInsns;
+	UINT32               index;
+
+	// Outbound TCP packet from 10.1.2.3:49152 to 192.168.5.6:80 for PID 1234
+	const FILTER_TEST tests[] = {
+		{"tcp",                                  true},
+		{"udp",                                  false},
+		{"ip",                                   true},
+		{"ip6",                                  false},
+		{"tcp port 80",                          true},
+		{"tcp and port 443",                     false},
+		{"local port 80",                        false},
+		{"remote port 80",                       true},
+		{"port 1-1023",                          true},
+		{"local port 49152-65535 and outbound",  true},
+		{"inbound",                              false},
+		{"pid 1234",                             true},
+		{"pid 1-1000",                           false},
+		{"not pid 1-1000",                       true},
+		{"remote host 192.168.5.6",              true},
+		{"host 10.1.2.4",                        false},
+		{"local net 10.0.0.0/8",                 true},
+		{"net 172.16.0.0/12",                    false},
+		{"remote net 192.168.4.0/23",            true},
+		{"net 0.0.0.0/0",                        true},
+		{"udp or (tcp and not port 22)",         true},
+		{"(udp or icmp) and port 80",            false},
+		{"proto 6 and not (inbound or pid 4)",   true},
+		{"ip6 or net fe80::/10",                 false},
+	};
+
+	fields.ProcessId  = 1234;
+	fields.Direction  = PfOutbound;
+	fields.IpVersion  = 4;
+	fields.Protocol   = IPPROTO_TCP;
+	fields.HasPorts   = true;
+	fields.LocalPort  = 49152;
+	fields.RemotePort = 80;
+	SetAddress(fields.LocalAddress, 10, 1, 2, 3);
+	SetAddress(fields.RemoteAddress, 192, 168, 5, 6);
+
+	for (index = 0; index < ARRAYSIZE(tests); index++) {
+		numInsns = CompileFilterExpression(tests[index].Expression, insns,
+				ARRAYSIZE(insns));
+		Check(numInsns != 0, "\"%s\" compiles", tests[index].Expression);
+		if (!numInsns) {
+			continue;
+		}
+		Check(IsPacketFilterValid(insns, numInsns), "\"%s\" is valid",
+				tests[index].Expression);
+		Check(RunPacketFilter(insns, numInsns, &fields) == tests[index].Accept,
+				"\"%s\" %s the packet", tests[index].Expression,
+				tests[index].Accept ? "accepts" : "rejects");
+	}
+
+	// A packet that could not be parsed has no protocol or ports
+	memset(&fields, 0, sizeof(fields));
+	fields.Direction = PfInbound;
+	numInsns = CompileFilterExpression("proto 0 or port 0", insns, ARRAYSIZE(insns));
+	Check(numInsns && !RunPacketFilter(insns, numInsns, &fields),
+			"unparsed packet has no protocol or ports");
+
+	// Bad expressions
+	Check(CompileFilterExpression("", insns, ARRAYSIZE(insns)) == 0,
+			"empty expression is rejected");
+	Check(CompileFilterExpression("port", insns, ARRAYSIZE(insns)) == 0,
+			"missing port is rejected");
+	Check(CompileFilterExpression("port 70000", insns, ARRAYSIZE(insns)) == 0,
+			"port out of range is rejected");
+	Check(CompileFilterExpression("port 90-80", insns, ARRAYSIZE(insns)) == 0,
+			"reversed port range is rejected");
+	Check(CompileFilterExpression("net 10.0.0.0/33", insns, ARRAYSIZE(insns)) == 0,
+			"IPv4 prefix length over 32 is rejected");
+	Check(CompileFilterExpression("host 10.0.0.0/8", insns, ARRAYSIZE(insns)) == 0,
+			"host with prefix length is rejected");
+	Check(CompileFilterExpression("(tcp", insns, ARRAYSIZE(insns)) == 0,
+			"unbalanced parenthesis is rejected");
+	Check(CompileFilterExpression("tcp udp or", insns, ARRAYSIZE(insns)) == 0,
+			"trailing operator is rejected");
+	Check(CompileFilterExpression("tcp or udp", insns, 2) == 0,
+			"program too large for buffer is rejected");
+}
+
+//--------------------------------------------------------------------------
+void TestValidator(void)
+{
+	PACKET_FILTER_FIELDS fields   = {0};
+	PACKET_FILTER_INSN   insns[3] = {0};
+	PACKET_FILTER_INSN   bigInsns[PACKET_FILTER_MAX_INSNS + 1] = {0};
+
+	// PfProtocol 6-6, accept on true, reject on false
+	insns[0].Opcode    = PfProtocol;
+	insns[0].JumpTrue  = 0;
+	insns[0].JumpFalse = 1;
+	insns[0].Value1    = IPPROTO_TCP;
+	insns[0].Value2    = IPPROTO_TCP;
+	insns[1].Opcode    = PfAccept;
+	insns[2].Opcode    = PfReject;
+	Check(IsPacketFilterValid(insns, 3), "hand-built program is valid");
+	fields.IpVersion = 4;
+	fields.Protocol  = IPPROTO_TCP;
+	Check(RunPacketFilter(insns, 3, &fields), "hand-built program accepts TCP");
+	fields.Protocol  = IPPROTO_UDP;
+	Check(!RunPacketFilter(insns, 3, &fields), "hand-built program rejects UDP");
+
+	Check(!IsPacketFilterValid(insns, 0), "empty program is invalid");
+	Check(!IsPacketFilterValid(insns, 2),
+			"jump past the last instruction is invalid");
+	Check(!IsPacketFilterValid(insns, 1),
+			"program ending with a test is invalid");
+
+	// Jumps are unsigned offsets from the next instruction, so the only way
+	// to try to jump backwards is to wrap the offset, which lands past the end
+	insns[0].JumpFalse = 0xFFFF;
+	Check(!IsPacketFilterValid(insns, 3), "wrapped backward jump is invalid");
+	insns[0].JumpFalse = 1;
+	insns[0].JumpTrue  = 0xFFFE;
+	Check(!IsPacketFilterValid(insns, 3), "wrapped true jump is invalid");
+	insns[0].JumpTrue  = 0;
+
+	insns[0].Opcode = PfNumOpcodes;
+	Check(!IsPacketFilterValid(insns, 3), "unknown opcode is invalid");
+	insns[0].Opcode   = PfProtocol;
+	insns[0].Reserved = 1;
+	Check(!IsPacketFilterValid(insns, 3), "nonzero reserved field is invalid");
+	insns[0].Reserved = 0;
+
+	// Prefix lengths past the end of the address would read beyond it
+	insns[0].Opcode = PfLocalNet;
+	insns[0].Value1 = 4;
+	insns[0].Value2 = 32;
+	Check(IsPacketFilterValid(insns, 3), "IPv4 /32 is valid");
+	insns[0].Value2 = 33;
+	Check(!IsPacketFilterValid(insns, 3), "IPv4 prefix over 32 is invalid");
+	insns[0].Opcode = PfRemoteNet;
+	insns[0].Value1 = 6;
+	insns[0].Value2 = 128;
+	Check(IsPacketFilterValid(insns, 3), "IPv6 /128 is valid");
+	insns[0].Value2 = 129;
+	Check(!IsPacketFilterValid(insns, 3), "IPv6 prefix over 128 is invalid");
+	insns[0].Value1 = 5;
+	insns[0].Value2 = 0;
+	Check(!IsPacketFilterValid(insns, 3), "unknown IP version is invalid");
+
+	bigInsns[PACKET_FILTER_MAX_INSNS].Opcode = PfReject;
+	Check(IsPacketFilterValid(bigInsns, PACKET_FILTER_MAX_INSNS),
+			"program with maximum instructions is valid");
+	Check(!IsPacketFilterValid(bigInsns, PACKET_FILTER_MAX_INSNS + 1),
+			"program with too many instructions is invalid");
+}
+
+//--------------------------------------------------------------------------
+void RunFilterTests(void)
+{
+	TestCompiledFilters();
+	TestValidator();
+}
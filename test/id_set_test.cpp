@@ -0,0 +1,128 @@
+//----------------------------------------------------------------------------
+// Tests for the ID sets used by the driver's per-reader filters
+//
+// Builds sets of process IDs and ports and checks membership, duplicate and
+// zero handling, and that common ID patterns don't cluster in the table.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <stdlib.h>
+
+#include "../hone/id_set.h"
+#include "test.h"
+
+//--------------------------------------------------------------------------
+ID_SET* AllocateIdSet(const UINT32 numIds)
+{
+	ID_SET *set = reinterpret_cast<ID_SET*>(malloc(GetIdSetSize(numIds)));
+	if (set) {
+		InitIdSet(set, numIds);
+	}
+	return set;
+}
+
+//--------------------------------------------------------------------------
+UINT32 GetMaxProbeLength(const ID_SET *set)
+{
+	UINT32 maxLength = 0;
+
+	for (UINT32 slot = 0; slot <= set->Mask; slot++) {
+		if (set->Slots[slot]) {
+			const UINT32 length = (slot - GetIdSetHash(set, set->Slots[slot])) &
+					set->Mask;
+			if (length > maxLength) {
+				maxLength = length;
+			}
+		}
+	}
+	return maxLength;
+}
+
+//--------------------------------------------------------------------------
+void TestSmallSets(void)
+{
+	ID_SET *set = AllocateIdSet(0);
+
+	if (!set) {
+		Check(false, "allocate empty ID set");
+		return;
+	}
+	Check(GetIdSetSlots(0) == 8, "empty set has the minimum number of slots");
+	Check(!IsIdInSet(set, 0) && !IsIdInSet(set, 1) && !IsIdInSet(set, 0xFFFFFFFF),
+			"empty set contains nothing");
+	free(set);
+
+	set = AllocateIdSet(3);
+	if (!set) {
+		Check(false, "allocate small ID set");
+		return;
+	}
+	IdSetInsert(set, 0);
+	IdSetInsert(set, 0);
+	IdSetInsert(set, 0xFFFFFFFF);
+	IdSetInsert(set, 80);
+	IdSetInsert(set, 80);
+	Check(set->NumIds == 3, "duplicate IDs are counted once");
+	Check(IsIdInSet(set, 0), "set contains 0");
+	Check(IsIdInSet(set, 0xFFFFFFFF), "set contains the largest ID");
+	Check(IsIdInSet(set, 80), "set contains 80");
+	Check(!IsIdInSet(set, 443), "set does not contain 443");
+	free(set);
+}
+
+//--------------------------------------------------------------------------
+void TestLargeSet(const char *name, const UINT32 first, const UINT32 step)
+{
+	const UINT32 numIds  = 5000;
+	ID_SET      *set     = AllocateIdSet(numIds);
+	UINT32       index;
+	bool         found   = true;
+	bool         missing = true;
+
+	if (!set) {
+		Check(false, "allocate set of %s", name);
+		return;
+	}
+	Check(set->Mask + 1 >= numIds * 2,
+			"set of %s has at least twice as many slots as IDs", name);
+	for (index = 0; index < numIds; index++) {
+		IdSetInsert(set, first + (index * step));
+	}
+	Check(set->NumIds == numIds, "set of %s counts every ID", name);
+	for (index = 0; index < numIds; index++) {
+		if (!IsIdInSet(set, first + (index * step))) {
+			found = false;
+		}
+		if (IsIdInSet(set, first + (index * step) + 1)) {
+			missing = false;
+		}
+	}
+	Check(found, "set of %s contains every ID", name);
+	Check(missing, "set of %s does not contain other IDs", name);
+
+	// A poor hash puts aligned IDs in a few runs of slots, so lookups for
+	// IDs that hash near them have to walk the whole run
+	Check(GetMaxProbeLength(set) < 32, "set of %s has short probe sequences",
+			name);
+	free(set);
+}
+
+//--------------------------------------------------------------------------
+void RunIdSetTests(void)
+{
+	TestSmallSets();
+	TestLargeSet("sequential IDs", 1, 2);
+	TestLargeSet("process IDs", 4, 4);
+	TestLargeSet("page-aligned IDs", 0x1000, 0x1000);
+	TestLargeSet("high IDs", 0x80000000, 0x10000);
+}
@@ -0,0 +1,198 @@
+//----------------------------------------------------------------------------
+// Tests for the LZ4 block compressor and frame header code
+//
+// Round-trips several kinds of data through the compressor and decompressor,
+// decodes a block and frame headers written by the reference lz4 tool, and
+// checks that corrupt blocks and headers are rejected.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <Windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../honeutil/lz4.h"
+#include "test.h"
+
+//--------------------------------------------------------------------------
+// Global variables
+//--------------------------------------------------------------------------
+
+static UINT32 gHashTable[LZ4_HASH_TABLE_SIZE];  // Compressor scratch table
+
+//--------------------------------------------------------------------------
+void FillRandom(UINT8 *data, const UINT32 length, UINT32 seed)
+{
+	for (UINT32 index = 0; index < length; index++) {
+		seed        = seed * 1103515245 + 12345;
+		data[index] = static_cast<UINT8>(seed >> 16);
+	}
+}
+
+//--------------------------------------------------------------------------
+void TestRoundTrip(const char *name, const UINT8 *data, const UINT32 length,
+		const bool compressible)
+{
+	const UINT32  bound      = static_cast<UINT32>(LZ4_COMPRESS_BOUND(length));
+	UINT8        *compressed = reinterpret_cast<UINT8*>(malloc(bound));
+	UINT8        *output     = reinterpret_cast<UINT8*>(malloc(length + 1));
+	UINT32        compressedLength;
+	UINT32        outputLength = 0;
+
+	if (!compressed || !output) {
+		Check(false, "allocate buffers for %s", name);
+		free(compressed);
+		free(output);
+		return;
+	}
+
+	compressedLength = Lz4CompressBlock(data, length, compressed, bound,
+			gHashTable);
+	Check(compressedLength != 0, "%s compresses", name);
+	Check(compressedLength + sizeof(UINT32) <= bound,
+			"%s compresses within the bound", name);
+	if (compressible) {
+		Check(compressedLength < length / 2, "%s compresses to under half", name);
+	}
+	Check(Lz4DecompressBlock(compressed, compressedLength, output, length + 1,
+			&outputLength), "%s decompresses", name);
+	Check((outputLength == length) && !memcmp(data, output, length),
+			"%s round trips", name);
+	if (length) {
+		Check(!Lz4DecompressBlock(compressed, compressedLength, output,
+				length - 1, &outputLength),
+				"%s does not decompress into a smaller buffer", name);
+		Check(!Lz4DecompressBlock(compressed, compressedLength - 1, output,
+				length + 1, &outputLength),
+				"truncated %s is rejected", name);
+	}
+	if (compressedLength > 2) {
+		Check(Lz4CompressBlock(data, length, compressed, compressedLength - 1,
+				gHashTable) == 0,
+				"%s does not compress into a smaller buffer", name);
+	}
+	free(compressed);
+	free(output);
+}
+
+//--------------------------------------------------------------------------
+void TestRoundTrips(void)
+{
+	const char   text[]   = "GET /index.html HTTP/1.1\r\nHost: example.com\r\n\r\n";
+	const UINT32 maxSize  = LZ4_BLOCK_MAX_SIZE;
+	UINT8       *data     = reinterpret_cast<UINT8*>(malloc(maxSize));
+	UINT32       index;
+
+	if (!data) {
+		Check(false, "allocate LZ4 test data");
+		return;
+	}
+
+	TestRoundTrip("empty data", data, 0, false);
+	TestRoundTrip("short text", reinterpret_cast<const UINT8*>(text), 12, false);
+	TestRoundTrip("text", reinterpret_cast<const UINT8*>(text),
+			sizeof(text) - 1, false);
+
+	// A run of one byte is encoded as a match that overlaps its own output
+	memset(data, 0, 100000);
+	TestRoundTrip("run of zeros", data, 100000, true);
+
+	// Random data is stored as one long run of literals
+	FillRandom(data, 100000, 1);
+	TestRoundTrip("random data", data, 100000, false);
+
+	// Repeated packets with changing headers, like a capture
+	for (index = 0; index < maxSize; index++) {
+		data[index] = static_cast<UINT8>(text[index % (sizeof(text) - 1)]);
+		if ((index % 1500) < 4) {
+			data[index] = static_cast<UINT8>(index / 1500);
+		}
+	}
+	TestRoundTrip("largest block", data, maxSize, true);
+
+	// Matches far enough apart to be out of the compressor's reach
+	FillRandom(data, maxSize, 2);
+	memcpy(data + 0x20000, data, 0x1000);
+	TestRoundTrip("random data with distant repeat", data, 0x21000, false);
+	free(data);
+}
+
+//--------------------------------------------------------------------------
+void TestReferenceData(void)
+{
+	// "lz4 -B4 --no-frame-crc" output for a line of repeated words
+	const UINT8 frame[] = {
+		0x04, 0x22, 0x4D, 0x18, 0x60, 0x40, 0x82, 0x10, 0x00, 0x00, 0x00, 0x6F,
+		0x68, 0x65, 0x6C, 0x6C, 0x6F, 0x20, 0x06, 0x00, 0x18, 0x50, 0x65, 0x6C,
+		0x6C, 0x6F, 0x0A, 0x00, 0x00, 0x00, 0x00,
+	};
+	const char   expected[] = "hello hello hello hello hello hello hello hello hello\n";
+	const UINT8  defaultHeader[] = {0x04, 0x22, 0x4D, 0x18, 0x64, 0x40, 0xA7};
+	UINT8        header[LZ4_FRAME_HEADER_SIZE + 8];
+	UINT8        output[128];
+	UINT32       maxBlock = 0;
+	UINT32       length   = 0;
+	UINT8        flags    = 0;
+
+	Check(Lz4ParseFrameHeader(frame, sizeof(frame), &maxBlock, &flags) ==
+			LZ4_FRAME_HEADER_SIZE, "reference frame header parses");
+	Check(maxBlock == 0x10000 && flags == 0x60,
+			"reference frame header has 64 KB independent blocks");
+	Check(Lz4DecompressBlock(frame + 11, 16, output, sizeof(output), &length) &&
+			(length == sizeof(expected) - 1) && !memcmp(output, expected, length),
+			"reference block decompresses");
+	Check(Lz4ParseFrameHeader(defaultHeader, sizeof(defaultHeader), &maxBlock,
+			&flags) == LZ4_FRAME_HEADER_SIZE && (flags & LZ4_FLG_CONTENT_CSUM),
+			"default lz4 frame header parses");
+
+	// Our own header
+	Lz4WriteFrameHeader(header);
+	Check(Lz4ParseFrameHeader(header, LZ4_FRAME_HEADER_SIZE, &maxBlock, &flags) ==
+			LZ4_FRAME_HEADER_SIZE, "written frame header parses");
+	Check(maxBlock == LZ4_BLOCK_MAX_SIZE &&
+			flags == (LZ4_FLG_VERSION | LZ4_FLG_BLOCK_INDEP),
+			"written frame header has the expected block size and flags");
+
+	// Bad headers
+	Check(Lz4ParseFrameHeader(header, LZ4_FRAME_HEADER_SIZE - 1, &maxBlock,
+			&flags) == 0, "incomplete frame header is rejected");
+	header[6]++;
+	Check(Lz4ParseFrameHeader(header, LZ4_FRAME_HEADER_SIZE, &maxBlock, &flags) == 0,
+			"frame header with bad checksum is rejected");
+	header[6]--;
+	header[0]++;
+	Check(Lz4ParseFrameHeader(header, LZ4_FRAME_HEADER_SIZE, &maxBlock, &flags) == 0,
+			"frame header with bad magic is rejected");
+	header[0]--;
+	header[4] |= LZ4_FLG_CONTENT_SIZE;
+	Check(Lz4ParseFrameHeader(header, LZ4_FRAME_HEADER_SIZE, &maxBlock, &flags) == 0,
+			"frame header missing its content size is rejected");
+
+	// Bad blocks
+	UINT8 badOffset[] = {0x11, 'a', 0x02, 0x00, 0x00};
+	Check(!Lz4DecompressBlock(badOffset, sizeof(badOffset), output,
+			sizeof(output), &length), "match before the start is rejected");
+	UINT8 zeroOffset[] = {0x11, 'a', 0x00, 0x00, 0x00};
+	Check(!Lz4DecompressBlock(zeroOffset, sizeof(zeroOffset), output,
+			sizeof(output), &length), "match with zero offset is rejected");
+	UINT8 longLiterals[] = {0xF0, 0xFF};
+	Check(!Lz4DecompressBlock(longLiterals, sizeof(longLiterals), output,
+			sizeof(output), &length), "unterminated literal length is rejected");
+}
+
+//--------------------------------------------------------------------------
+void RunLz4Tests(void)
+{
+	TestRoundTrips();
+	TestReferenceData();
+}
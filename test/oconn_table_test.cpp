@@ -0,0 +1,212 @@
+//----------------------------------------------------------------------------
+// Tests for the driver's open connection tables
+//
+// Checks how connections map to tables and ports, then runs a writer thread
+// that keeps changing a few entries while reader threads look them up, and
+// checks that no reader sees a process ID paired with the wrong timestamp.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../hone/oconn_table.h"
+#include "test.h"
+
+//--------------------------------------------------------------------------
+// Defines
+//--------------------------------------------------------------------------
+
+#define OCONN_TEST_ENTRIES  4        // Number of entries the writer changes
+#define OCONN_TEST_READERS  2        // Number of reader threads
+#define OCONN_TEST_WRITES   1000000  // Number of times the writer changes an entry
+
+//--------------------------------------------------------------------------
+// Structures and enumerations
+//--------------------------------------------------------------------------
+
+struct OCONN_TEST_READER {
+	HANDLE  Thread;      // Reader thread
+	UINT32  NumReads;    // Number of entries read
+	UINT32  NumTorn;     // Number of entries whose fields did not match
+};
+
+//--------------------------------------------------------------------------
+// Global variables
+//--------------------------------------------------------------------------
+
+static OCONN_ENTRY    gOconnTestEntries[OCONN_TEST_ENTRIES];  // Entries shared by the threads
+static volatile LONG  gOconnTestDone = 0;                     // Set when the writer is done
+
+//--------------------------------------------------------------------------
+INT64 GetOconnTestTimestamp(const UINT32 processId)
+{
+	return static_cast<INT64>(processId) * 1000003 + 7;
+}
+
+//--------------------------------------------------------------------------
+void TestTableIndex(void)
+{
+	Check(GetOconnTableIndex(AF_INET, IPPROTO_TCP) == OconnTcp4Table,
+			"TCP over IPv4 uses the TCP4 table");
+	Check(GetOconnTableIndex(AF_INET6, IPPROTO_TCP) == OconnTcp6Table,
+			"TCP over IPv6 uses the TCP6 table");
+	Check(GetOconnTableIndex(AF_INET, IPPROTO_UDP) == OconnUdp4Table,
+			"UDP over IPv4 uses the UDP4 table");
+	Check(GetOconnTableIndex(AF_INET6, IPPROTO_UDP) == OconnUdp6Table,
+			"UDP over IPv6 uses the UDP6 table");
+}
+
+//--------------------------------------------------------------------------
+void TestEntries(void)
+{
+	OCONN_ENTRY   *oconnTable;
+	LARGE_INTEGER  timestamp;
+	UINT32         numEmpty = 0;
+	UINT32         port;
+
+	oconnTable = reinterpret_cast<OCONN_ENTRY*>(malloc(
+			OCONN_TABLE_SIZE * sizeof(OCONN_ENTRY)));
+	Check(oconnTable != NULL, "open connection table is allocated");
+	if (!oconnTable) {
+		return;
+	}
+	memset(oconnTable, 0xA5, OCONN_TABLE_SIZE * sizeof(OCONN_ENTRY));
+
+	InitOconnTable(oconnTable);
+	for (port = 0; port < OCONN_TABLE_SIZE; port++) {
+		if ((ReadOconnEntry(&oconnTable[port], &timestamp) == _UI32_MAX) &&
+				(oconnTable[port].Sequence == 0)) {
+			numEmpty++;
+		}
+	}
+	Check(numEmpty == OCONN_TABLE_SIZE, "new table has no connections (%u of %u empty)",
+			numEmpty, OCONN_TABLE_SIZE);
+
+	// Both ends of the port range are usable
+	timestamp.QuadPart = 111;
+	WriteOconnEntry(&oconnTable[0], 1234, &timestamp);
+	timestamp.QuadPart = 222;
+	WriteOconnEntry(&oconnTable[65535], 5678, &timestamp);
+	timestamp.QuadPart = 0;
+	Check(ReadOconnEntry(&oconnTable[0], &timestamp) == 1234 &&
+			timestamp.QuadPart == 111, "port 0 holds its connection");
+	Check(ReadOconnEntry(&oconnTable[65535], &timestamp) == 5678 &&
+			timestamp.QuadPart == 222, "port 65535 holds its connection");
+	Check(ReadOconnEntry(&oconnTable[1], &timestamp) == _UI32_MAX,
+			"neighboring port is still empty");
+	Check(oconnTable[0].Sequence == 2, "write leaves an even sequence number (%ld)",
+			oconnTable[0].Sequence);
+
+	// Removing a connection stores _UI32_MAX
+	timestamp.QuadPart = 0;
+	WriteOconnEntry(&oconnTable[0], _UI32_MAX, &timestamp);
+	Check(ReadOconnEntry(&oconnTable[0], &timestamp) == _UI32_MAX,
+			"removed connection is gone");
+	Check(oconnTable[0].Sequence == 4, "each write advances the sequence number by 2 (%ld)",
+			oconnTable[0].Sequence);
+
+	free(oconnTable);
+}
+
+//--------------------------------------------------------------------------
+DWORD WINAPI OconnTestWriterThread(void *param)
+{
+	LARGE_INTEGER timestamp;
+	UINT32        index;
+
+	UNREFERENCED_PARAMETER(param);
+	for (index = 1; index <= OCONN_TEST_WRITES; index++) {
+		timestamp.QuadPart = GetOconnTestTimestamp(index);
+		WriteOconnEntry(&gOconnTestEntries[index % OCONN_TEST_ENTRIES], index,
+				&timestamp);
+	}
+	InterlockedExchange(&gOconnTestDone, 1);
+	return 0;
+}
+
+//--------------------------------------------------------------------------
+DWORD WINAPI OconnTestReaderThread(void *param)
+{
+	OCONN_TEST_READER *reader = reinterpret_cast<OCONN_TEST_READER*>(param);
+	LARGE_INTEGER      timestamp;
+	UINT32             processId;
+	UINT32             index = 0;
+
+	while (!gOconnTestDone) {
+		processId = ReadOconnEntry(&gOconnTestEntries[index % OCONN_TEST_ENTRIES],
+				&timestamp);
+		if (timestamp.QuadPart != GetOconnTestTimestamp(processId)) {
+			reader->NumTorn++;
+		}
+		reader->NumReads++;
+		index++;
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------------
+void TestConcurrentReaders(void)
+{
+	OCONN_TEST_READER readers[OCONN_TEST_READERS] = {0};
+	LARGE_INTEGER     timestamp;
+	HANDLE            writer;
+	UINT32            numTorn  = 0;
+	UINT32            index;
+	bool              started  = true;
+
+	// Start every entry with a matching pair
+	for (index = 0; index < OCONN_TEST_ENTRIES; index++) {
+		timestamp.QuadPart = GetOconnTestTimestamp(0);
+		gOconnTestEntries[index].Sequence = 0;
+		WriteOconnEntry(&gOconnTestEntries[index], 0, &timestamp);
+	}
+	gOconnTestDone = 0;
+
+	for (index = 0; index < OCONN_TEST_READERS; index++) {
+		readers[index].Thread = CreateThread(NULL, 0, OconnTestReaderThread,
+				readers + index, 0, NULL);
+		started = started && (readers[index].Thread != NULL);
+	}
+	writer = CreateThread(NULL, 0, OconnTestWriterThread, NULL, 0, NULL);
+	if (writer) {
+		WaitForSingleObject(writer, INFINITE);
+		CloseHandle(writer);
+	} else {
+		started = false;
+		InterlockedExchange(&gOconnTestDone, 1);
+	}
+	for (index = 0; index < OCONN_TEST_READERS; index++) {
+		if (readers[index].Thread) {
+			WaitForSingleObject(readers[index].Thread, INFINITE);
+			CloseHandle(readers[index].Thread);
+		}
+		numTorn += readers[index].NumTorn;
+	}
+
+	Check(started, "writer and reader threads start");
+	Check(numTorn == 0, "readers never see a partly written entry (%u torn)",
+			numTorn);
+	for (index = 0; index < OCONN_TEST_ENTRIES; index++) {
+		Check((gOconnTestEntries[index].Sequence & 1) == 0,
+				"entry %u is not left mid-write", index);
+	}
+}
+
+//--------------------------------------------------------------------------
+void RunOconnTableTests(void)
+{
+	TestTableIndex();
+	TestEntries();
+	TestConcurrentReaders();
+}
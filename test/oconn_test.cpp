@@ -0,0 +1,182 @@
+//----------------------------------------------------------------------------
+// Tests for the open connection list operations in honeutil
+//
+// Checks that lists are reduced to the oldest connection on each port, and
+// that the changes between two lists hold exactly the added, changed, and
+// removed connections.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <WinSock2.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "../honeutil/oconn.h"
+#include "test.h"
+
+//--------------------------------------------------------------------------
+// Defines
+//--------------------------------------------------------------------------
+
+#define MAX_TEST_RECORDS 16  // Most records in a test list
+
+//--------------------------------------------------------------------------
+// Structures and enumerations
+//--------------------------------------------------------------------------
+
+struct TEST_CONNECTIONS {
+	UINT32            NumRecords;                 // Number of records in the array
+	CONNECTION_RECORD Records[MAX_TEST_RECORDS];  // Array of connection records
+};
+
+//--------------------------------------------------------------------------
+void AddRecord(TEST_CONNECTIONS *connections, const UINT8 addressFamily,
+		const UINT8 protocol, const UINT16 port, const UINT32 processId,
+		const INT64 timestamp)
+{
+	CONNECTION_RECORD *record = &connections->Records[connections->NumRecords++];
+
+	record->AddressFamily      = addressFamily;
+	record->Protocol           = protocol;
+	record->Port               = port;
+	record->ProcessId          = processId;
+	record->Timestamp.QuadPart = timestamp;
+}
+
+//--------------------------------------------------------------------------
+CONNECTIONS* ToConnections(TEST_CONNECTIONS *connections)
+{
+	return reinterpret_cast<CONNECTIONS*>(connections);
+}
+
+//--------------------------------------------------------------------------
+bool HasRecord(const CONNECTION_RECORD *records, const UINT32 numRecords,
+		const UINT16 port, const UINT32 processId)
+{
+	for (UINT32 index = 0; index < numRecords; index++) {
+		if ((records[index].Port == port) &&
+				(records[index].ProcessId == processId)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//--------------------------------------------------------------------------
+void TestReduceRecords(void)
+{
+	TEST_CONNECTIONS connections = {0};
+
+	ReduceRecords(ToConnections(&connections));
+	Check(connections.NumRecords == 0, "empty list reduces to nothing");
+
+	AddRecord(&connections, AF_INET6, IPPROTO_TCP, 80,  200, 50);
+	AddRecord(&connections, AF_INET,  IPPROTO_UDP, 53,  300, 10);
+	AddRecord(&connections, AF_INET,  IPPROTO_TCP, 443, 400, 30);
+	AddRecord(&connections, AF_INET,  IPPROTO_TCP, 80,  100, 20);
+	AddRecord(&connections, AF_INET,  IPPROTO_TCP, 80,  101, 10);
+	AddRecord(&connections, AF_INET,  IPPROTO_TCP, 80,  102, 10);
+	AddRecord(&connections, AF_INET,  IPPROTO_TCP, 443, 401, 40);
+	ReduceRecords(ToConnections(&connections));
+
+	Check(connections.NumRecords == 4, "reduced list has one record per port");
+	Check(connections.NumRecords == 4 &&
+			(connections.Records[0].AddressFamily == AF_INET) &&
+			(connections.Records[0].Protocol == IPPROTO_TCP) &&
+			(connections.Records[0].Port == 80) &&
+			(connections.Records[1].Port == 443) &&
+			(connections.Records[2].Protocol == IPPROTO_UDP) &&
+			(connections.Records[3].AddressFamily == AF_INET6),
+			"reduced list is sorted by family, protocol, and port");
+	Check(connections.Records[0].ProcessId == 101,
+			"oldest connection on a port is kept, lowest PID first");
+	Check(connections.Records[1].ProcessId == 400,
+			"oldest connection on a port is kept");
+	Check(connections.Records[3].ProcessId == 200,
+			"same port in another family is kept");
+}
+
+//--------------------------------------------------------------------------
+void TestDiffRecords(void)
+{
+	TEST_CONNECTIONS    empty          = {0};
+	TEST_CONNECTIONS    oldConnections = {0};
+	TEST_CONNECTIONS    newConnections = {0};
+	CONNECTION_CHANGES *changes;
+
+	AddRecord(&oldConnections, AF_INET, IPPROTO_TCP, 80,   100, 10);
+	AddRecord(&oldConnections, AF_INET, IPPROTO_TCP, 135,  4,   1);
+	AddRecord(&oldConnections, AF_INET, IPPROTO_TCP, 443,  200, 20);
+	AddRecord(&oldConnections, AF_INET, IPPROTO_UDP, 53,   300, 30);
+	AddRecord(&oldConnections, AF_INET, IPPROTO_UDP, 5353, 500, 50);
+
+	AddRecord(&newConnections, AF_INET, IPPROTO_TCP, 22,   600, 60);
+	AddRecord(&newConnections, AF_INET, IPPROTO_TCP, 135,  4,   1);
+	AddRecord(&newConnections, AF_INET, IPPROTO_TCP, 443,  201, 70);
+	AddRecord(&newConnections, AF_INET, IPPROTO_UDP, 53,   300, 80);
+	AddRecord(&newConnections, AF_INET, IPPROTO_UDP, 5353, 500, 50);
+	AddRecord(&newConnections, AF_INET6, IPPROTO_TCP, 80,  700, 90);
+
+	changes = DiffRecords(ToConnections(&oldConnections),
+			ToConnections(&newConnections));
+	if (!changes) {
+		Check(false, "diff connection lists");
+		return;
+	}
+	Check(changes->NumAdded == 4, "diff has added and changed connections");
+	Check(changes->NumRemoved == 1, "diff has removed connections");
+	Check(HasRecord(changes->Records, changes->NumAdded, 22, 600),
+			"new port is added");
+	Check(HasRecord(changes->Records, changes->NumAdded, 443, 201),
+			"port with new process is changed");
+	Check(HasRecord(changes->Records, changes->NumAdded, 53, 300),
+			"port with new timestamp is changed");
+	Check(HasRecord(changes->Records, changes->NumAdded, 80, 700),
+			"port in a new family is added");
+	Check(HasRecord(changes->Records + changes->NumAdded, changes->NumRemoved,
+			80, 100), "closed port is removed");
+	Check(!HasRecord(changes->Records, changes->NumAdded + changes->NumRemoved,
+			135, 4) && !HasRecord(changes->Records,
+			changes->NumAdded + changes->NumRemoved, 5353, 500),
+			"unchanged ports are left out");
+	free(changes);
+
+	changes = DiffRecords(ToConnections(&empty), ToConnections(&newConnections));
+	Check(changes && (changes->NumAdded == newConnections.NumRecords) &&
+			!changes->NumRemoved, "diff from an empty list adds everything");
+	free(changes);
+
+	changes = DiffRecords(ToConnections(&oldConnections), ToConnections(&empty));
+	Check(changes && !changes->NumAdded &&
+			(changes->NumRemoved == oldConnections.NumRecords),
+			"diff to an empty list removes everything");
+	free(changes);
+
+	changes = DiffRecords(ToConnections(&empty), ToConnections(&empty));
+	Check(changes && !changes->NumAdded && !changes->NumRemoved,
+			"diff of empty lists is empty");
+	free(changes);
+
+	changes = DiffRecords(ToConnections(&newConnections),
+			ToConnections(&newConnections));
+	Check(changes && !changes->NumAdded && !changes->NumRemoved,
+			"diff of identical lists is empty");
+	free(changes);
+}
+
+//--------------------------------------------------------------------------
+void RunOconnTests(void)
+{
+	TestReduceRecords();
+	TestDiffRecords();
+}
@@ -0,0 +1,265 @@
+//----------------------------------------------------------------------------
+// Tests for the driver's lock-free ring buffer
+//
+// Checks single and batch operations around full and empty buffers and
+// across many laps, then runs several producer and consumer threads through
+// a small buffer and checks that every block arrives once and in order.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include "../hone/ring_buffer.h"
+#include "test.h"
+
+//--------------------------------------------------------------------------
+// Defines
+//--------------------------------------------------------------------------
+
+#define RING_TEST_SLOTS      64      // Number of slots in the test buffers
+#define RING_TEST_PRODUCERS  4       // Number of producer threads
+#define RING_TEST_CONSUMERS  2       // Number of consumer threads
+#define RING_TEST_BLOCKS     100000  // Number of blocks from each producer
+
+//--------------------------------------------------------------------------
+// Structures and enumerations
+//--------------------------------------------------------------------------
+
+struct RING_TEST_CONSUMER {
+	HANDLE Thread;                            // Consumer thread
+	UINT32 Last[RING_TEST_PRODUCERS];         // Last sequence seen from each producer
+	bool   InOrder;                           // False if a producer's blocks arrived out of order
+};
+
+//--------------------------------------------------------------------------
+// Global variables
+//--------------------------------------------------------------------------
+
+static RING_BUFFER      gRing;                             // Ring buffer under test
+static RING_BUFFER_SLOT gSlots[RING_TEST_SLOTS];           // Slots for the ring buffer
+static volatile LONG    gNumConsumed;                      // Blocks consumed by all threads
+static volatile LONG    gCounts[RING_TEST_PRODUCERS][RING_TEST_BLOCKS]; // Times each block was consumed
+
+//--------------------------------------------------------------------------
+void* MakeBlock(const UINT32 producer, const UINT32 sequence)
+{
+	// Blocks are never dereferenced, so encode the producer and sequence in
+	// the pointer, offset by one so that no block is NULL
+	return reinterpret_cast<void*>(static_cast<ULONG_PTR>(
+			(producer << 24) | sequence) + 1);
+}
+
+//--------------------------------------------------------------------------
+void ParseBlock(void *block, UINT32 *producer, UINT32 *sequence)
+{
+	const UINT32 value = static_cast<UINT32>(
+			reinterpret_cast<ULONG_PTR>(block) - 1);
+
+	*producer = value >> 24;
+	*sequence = value & 0xFFFFFF;
+}
+
+//--------------------------------------------------------------------------
+void TestSingleThread(void)
+{
+	void   *blocks[RING_TEST_SLOTS + 1];
+	ULONG   position = 0;
+	UINT32  index;
+	UINT32  lap;
+	bool    inOrder  = true;
+
+	InitRingBuffer(&gRing, gSlots, sizeof(gSlots));
+	Check(gRing.Length == RING_TEST_SLOTS, "ring buffer has the expected slots");
+	Check(IsRingBufferEmpty(&gRing) && !IsRingBufferFull(&gRing),
+			"new ring buffer is empty");
+	Check(RingBufferDequeue(&gRing) == NULL, "empty ring buffer dequeues nothing");
+	Check(RingBufferDequeueBatch(&gRing, blocks, RING_TEST_SLOTS) == 0,
+			"empty ring buffer dequeues no batch");
+
+	// Fill and drain the buffer for many laps, one block at a time
+	for (lap = 0; lap < 100; lap++) {
+		for (index = 0; index < RING_TEST_SLOTS; index++) {
+			if (!RingBufferEnqueue(&gRing, MakeBlock(0, index), &position) ||
+					(position != lap * RING_TEST_SLOTS + index)) {
+				inOrder = false;
+			}
+		}
+		if (!IsRingBufferFull(&gRing) || RingBufferEnqueue(&gRing, MakeBlock(1, 0))) {
+			inOrder = false;
+		}
+		for (index = 0; index < RING_TEST_SLOTS; index++) {
+			if (RingBufferDequeue(&gRing) != MakeBlock(0, index)) {
+				inOrder = false;
+			}
+		}
+		if (!IsRingBufferEmpty(&gRing)) {
+			inOrder = false;
+		}
+	}
+	Check(inOrder, "single blocks go in and out in order for many laps");
+
+	// Batches are all or nothing on the way in and partial on the way out
+	for (index = 0; index < RING_TEST_SLOTS + 1; index++) {
+		blocks[index] = MakeBlock(2, index);
+	}
+	Check(!RingBufferEnqueueBatch(&gRing, blocks, RING_TEST_SLOTS + 1),
+			"batch larger than the buffer is rejected");
+	Check(RingBufferEnqueueBatch(&gRing, blocks, RING_TEST_SLOTS - 3),
+			"batch that fits is added");
+	Check(!RingBufferEnqueueBatch(&gRing, blocks, 4) && (gRing.Back ==
+			static_cast<LONG>(100 * RING_TEST_SLOTS + RING_TEST_SLOTS - 3)),
+			"batch without room is rejected without reserving slots");
+	Check(RingBufferDequeueBatch(&gRing, blocks, 10) == 10 &&
+			blocks[0] == MakeBlock(2, 0) && blocks[9] == MakeBlock(2, 9),
+			"batch dequeue takes blocks from the front");
+	Check(RingBufferEnqueueBatch(&gRing, blocks + 10, 13),
+			"batch wraps around the end of the buffer");
+	Check(RingBufferDequeueBatch(&gRing, blocks, RING_TEST_SLOTS + 1) ==
+			RING_TEST_SLOTS, "batch dequeue stops when the buffer is empty");
+	Check(blocks[RING_TEST_SLOTS - 14] == MakeBlock(2, RING_TEST_SLOTS - 4) &&
+			blocks[RING_TEST_SLOTS - 13] == MakeBlock(2, 10),
+			"wrapped batch comes out in order");
+
+	// A slot that a producer reserved but hasn't published stops readers
+	// instead of making them wait
+	RingBufferEnqueue(&gRing, MakeBlock(3, 0));
+	InterlockedIncrement(&gRing.Back);
+	RingBufferEnqueue(&gRing, MakeBlock(3, 2));
+	Check(RingBufferDequeueBatch(&gRing, blocks, 3) == 1 &&
+			blocks[0] == MakeBlock(3, 0), "batch dequeue stops at an unpublished slot");
+	Check(RingBufferDequeue(&gRing) == NULL, "dequeue stops at an unpublished slot");
+	gSlots[(gRing.Front) & gRing.Mask].Block    = MakeBlock(3, 1);
+	gSlots[(gRing.Front) & gRing.Mask].Sequence = gRing.Front + 1;
+	Check(RingBufferDequeue(&gRing) == MakeBlock(3, 1) &&
+			RingBufferDequeue(&gRing) == MakeBlock(3, 2),
+			"blocks come out once the slot is published");
+}
+
+//--------------------------------------------------------------------------
+DWORD WINAPI RingTestProducerThread(void *param)
+{
+	const UINT32 producer = static_cast<UINT32>(reinterpret_cast<ULONG_PTR>(param));
+	void        *blocks[3];
+	UINT32       sequence = 0;
+
+	while (sequence < RING_TEST_BLOCKS) {
+		// Mix single and batch enqueues
+		if ((sequence % 5 == 0) && (sequence + 3 <= RING_TEST_BLOCKS)) {
+			for (UINT32 index = 0; index < 3; index++) {
+				blocks[index] = MakeBlock(producer, sequence + index);
+			}
+			if (RingBufferEnqueueBatch(&gRing, blocks, 3)) {
+				sequence += 3;
+				continue;
+			}
+		} else if (RingBufferEnqueue(&gRing, MakeBlock(producer, sequence))) {
+			sequence++;
+			continue;
+		}
+		SwitchToThread();
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------------
+DWORD WINAPI RingTestConsumerThread(void *param)
+{
+	RING_TEST_CONSUMER *consumer = reinterpret_cast<RING_TEST_CONSUMER*>(param);
+	void               *blocks[4];
+	UINT32              count;
+	UINT32              producer;
+	UINT32              sequence;
+
+	while (gNumConsumed < RING_TEST_PRODUCERS * RING_TEST_BLOCKS) {
+		// Mix single and batch dequeues
+		if (gNumConsumed & 1) {
+			blocks[0] = RingBufferDequeue(&gRing);
+			count     = blocks[0] ? 1 : 0;
+		} else {
+			count = RingBufferDequeueBatch(&gRing, blocks, ARRAY_SIZEOF(blocks));
+		}
+		if (!count) {
+			SwitchToThread();
+			continue;
+		}
+		for (UINT32 index = 0; index < count; index++) {
+			ParseBlock(blocks[index], &producer, &sequence);
+			if ((producer >= RING_TEST_PRODUCERS) || (sequence >= RING_TEST_BLOCKS)) {
+				consumer->InOrder = false;
+				continue;
+			}
+			if (sequence + 1 <= consumer->Last[producer]) {
+				consumer->InOrder = false;
+			}
+			consumer->Last[producer] = sequence + 1;
+			InterlockedIncrement(&gCounts[producer][sequence]);
+		}
+		InterlockedExchangeAdd(&gNumConsumed, static_cast<LONG>(count));
+	}
+	return 0;
+}
+
+//--------------------------------------------------------------------------
+void TestThreads(void)
+{
+	RING_TEST_CONSUMER consumers[RING_TEST_CONSUMERS] = {0};
+	HANDLE             producers[RING_TEST_PRODUCERS] = {0};
+	UINT32             index;
+	bool               started  = true;
+	bool               once     = true;
+	bool               inOrder  = true;
+
+	InitRingBuffer(&gRing, gSlots, sizeof(gSlots));
+	gNumConsumed = 0;
+	for (index = 0; index < RING_TEST_CONSUMERS; index++) {
+		consumers[index].InOrder = true;
+		consumers[index].Thread  = CreateThread(NULL, 0, RingTestConsumerThread,
+				consumers + index, 0, NULL);
+		started = started && (consumers[index].Thread != NULL);
+	}
+	for (index = 0; index < RING_TEST_PRODUCERS; index++) {
+		producers[index] = CreateThread(NULL, 0, RingTestProducerThread,
+				reinterpret_cast<void*>(static_cast<ULONG_PTR>(index)), 0, NULL);
+		started = started && (producers[index] != NULL);
+	}
+	if (!started) {
+		// Threads that did start would never finish, so give up on the rest
+		Check(false, "create ring buffer test threads");
+		return;
+	}
+	for (index = 0; index < RING_TEST_PRODUCERS; index++) {
+		WaitForSingleObject(producers[index], INFINITE);
+		CloseHandle(producers[index]);
+	}
+	for (index = 0; index < RING_TEST_CONSUMERS; index++) {
+		WaitForSingleObject(consumers[index].Thread, INFINITE);
+		CloseHandle(consumers[index].Thread);
+		inOrder = inOrder && consumers[index].InOrder;
+	}
+
+	for (UINT32 producer = 0; producer < RING_TEST_PRODUCERS; producer++) {
+		for (index = 0; index < RING_TEST_BLOCKS; index++) {
+			if (gCounts[producer][index] != 1) {
+				once = false;
+			}
+		}
+	}
+	Check(once, "threads consume every block exactly once");
+	Check(inOrder, "each thread sees each producer's blocks in order");
+	Check(IsRingBufferEmpty(&gRing), "ring buffer is empty after the threads finish");
+}
+
+//--------------------------------------------------------------------------
+void RunRingBufferTests(void)
+{
+	TestSingleThread();
+	TestThreads();
+}
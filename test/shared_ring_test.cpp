@@ -0,0 +1,133 @@
+//----------------------------------------------------------------------------
+// Tests for the shared ring offset math
+//
+// Checks the write and read spans at the edges of the ring and streams data
+// through a small ring with offsets that wrap at 4GB.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <Windows.h>
+
+#include "../shared_ring.h"
+#include "test.h"
+
+//--------------------------------------------------------------------------
+void TestSpans(void)
+{
+	const UINT32 size = SHARED_RING_MIN_SIZE;
+	UINT32       offset;
+
+	// Empty ring
+	Check(GetSharedRingWriteSpan(size, 0, 0, &offset) == size && offset == 0,
+			"empty ring can be written in full");
+	Check(GetSharedRingReadSpan(size, 0, 0, &offset) == 0,
+			"empty ring has nothing to read");
+
+	// Full ring
+	Check(GetSharedRingWriteSpan(size, size, 0, &offset) == 0,
+			"full ring has no room");
+	Check(GetSharedRingReadSpan(size, size, 0, &offset) == size && offset == 0,
+			"full ring can be read in full");
+
+	// Free space and data that wrap around the end of the ring stop at it
+	Check(GetSharedRingWriteSpan(size, size - 10, 20, &offset) == 10 &&
+			offset == size - 10, "write span stops at the end of the ring");
+	Check(GetSharedRingWriteSpan(size, size, 20, &offset) == 20 && offset == 0,
+			"write span continues at the start of the ring");
+	Check(GetSharedRingReadSpan(size, size + 30, size - 10, &offset) == 10 &&
+			offset == size - 10, "read span stops at the end of the ring");
+	Check(GetSharedRingReadSpan(size, size + 30, size, &offset) == 30 &&
+			offset == 0, "read span continues at the start of the ring");
+
+	// Offsets that wrap at 4GB
+	Check(GetSharedRingWriteSpan(size, 0x10, 0xFFFFFFF0, &offset) == size - 0x20 &&
+			offset == 0x10, "write span handles producer wrapped at 4GB");
+	Check(GetSharedRingReadSpan(size, 0x10, 0xFFFFFFF0, &offset) == 0x10 &&
+			offset == size - 0x10, "read span handles producer wrapped at 4GB");
+
+	// Inconsistent offsets from a misbehaving reader
+	Check(GetSharedRingWriteSpan(size, 0, 1, &offset) == 0,
+			"write span rejects consumer ahead of producer");
+	Check(GetSharedRingReadSpan(size, 0, 1, &offset) == 0,
+			"read span rejects consumer ahead of producer");
+	Check(GetSharedRingWriteSpan(size, size + 1, 0, &offset) == 0,
+			"write span rejects overfilled ring");
+	Check(GetSharedRingReadSpan(size, size + 1, 0, &offset) == 0,
+			"read span rejects overfilled ring");
+}
+
+//--------------------------------------------------------------------------
+void TestStream(const UINT32 start)
+{
+	const UINT32 size     = 64;
+	const UINT32 numBytes = 100000;
+	UINT8        data[size];
+	UINT32       producer = start;
+	UINT32       consumer = start;
+	UINT32       written  = 0;
+	UINT32       read     = 0;
+	UINT32       chunk    = 0;
+	UINT32       offset;
+	UINT32       span;
+	bool         intact   = true;
+	bool         bounded  = true;
+
+	// Write and read in chunks of varying sizes, so the spans stop at every
+	// possible distance from the end of the ring
+	while (read < numBytes) {
+		chunk = (chunk * 7 + 5) % 41;
+		span  = GetSharedRingWriteSpan(size, producer, consumer, &offset);
+		if (span > chunk) {
+			span = chunk;
+		}
+		if (span > numBytes - written) {
+			span = numBytes - written;
+		}
+		if (span && (offset + span > size)) {
+			bounded = false;
+			break;
+		}
+		for (UINT32 index = 0; index < span; index++) {
+			data[offset + index] = static_cast<UINT8>(written++);
+		}
+		producer += span;
+
+		span = GetSharedRingReadSpan(size, producer, consumer, &offset);
+		if (span > (chunk * 3) % 37 + 1) {
+			span = (chunk * 3) % 37 + 1;
+		}
+		if (span && (offset + span > size)) {
+			bounded = false;
+			break;
+		}
+		for (UINT32 index = 0; index < span; index++) {
+			if (data[offset + index] != static_cast<UINT8>(read++)) {
+				intact = false;
+			}
+		}
+		consumer += span;
+	}
+	Check(bounded, "spans from offset 0x%08X stay inside the ring", start);
+	Check(intact, "data streamed from offset 0x%08X arrives intact", start);
+	Check(producer - start == numBytes && consumer == producer,
+			"stream from offset 0x%08X moves every byte", start);
+}
+
+//--------------------------------------------------------------------------
+void RunSharedRingTests(void)
+{
+	TestSpans();
+	TestStream(0);
+	TestStream(0xFFFFFF00);
+	TestStream(0xFFFFFFFF - 1000);
+}
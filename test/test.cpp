@@ -0,0 +1,66 @@
+//----------------------------------------------------------------------------
+// Entry point for the Hone test program
+//
+// Runs each group of tests, prints each failure, and returns nonzero if any
+// check fails.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "test.h"
+
+//--------------------------------------------------------------------------
+// Global variables
+//--------------------------------------------------------------------------
+
+static unsigned int gNumFailed = 0;  // Number of checks that failed
+
+//--------------------------------------------------------------------------
+void Check(const bool passed, const char *format, ...)
+{
+	va_list args;
+
+	if (!passed) {
+		printf("FAILED: ");
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+		printf("\n");
+		gNumFailed++;
+	}
+}
+
+//--------------------------------------------------------------------------
+int main(void)
+{
+	RunBlockCacheTests();
+	RunCaptureIndexTests();
+	RunChecksumTests();
+	RunFilterTests();
+	RunTimerWheelTests();
+	RunIdSetTests();
+	RunLz4Tests();
+	RunOconnTests();
+	RunOconnTableTests();
+	RunRingBufferTests();
+	RunSharedRingTests();
+
+	if (gNumFailed) {
+		printf("%u checks failed\n", gNumFailed);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
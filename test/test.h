@@ -0,0 +1,78 @@
+//----------------------------------------------------------------------------
+// Shared declarations for the Hone test program
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+#ifndef TEST_H
+#define TEST_H
+
+//----------------------------------------------------------------------------
+/// @brief Records the result of a check and prints it if it failed
+///
+/// @param passed  True if the check passed
+/// @param format  printf-style description of the check
+//----------------------------------------------------------------------------
+void Check(const bool passed, const char *format, ...);
+
+//----------------------------------------------------------------------------
+/// @brief Tests the packet filter compiler, validator, and interpreter
+//----------------------------------------------------------------------------
+void RunFilterTests(void);
+
+//----------------------------------------------------------------------------
+/// @brief Tests the block cache used to start new log files
+//----------------------------------------------------------------------------
+void RunBlockCacheTests(void);
+
+//----------------------------------------------------------------------------
+/// @brief Tests the capture index written alongside logs
+//----------------------------------------------------------------------------
+void RunCaptureIndexTests(void);
+
+//----------------------------------------------------------------------------
+/// @brief Tests the driver's internet checksum code
+//----------------------------------------------------------------------------
+void RunChecksumTests(void);
+
+//----------------------------------------------------------------------------
+/// @brief Tests the driver's hierarchical timing wheel
+//----------------------------------------------------------------------------
+void RunTimerWheelTests(void);
+
+//----------------------------------------------------------------------------
+/// @brief Tests the ID sets used by the driver's per-reader filters
+//----------------------------------------------------------------------------
+void RunIdSetTests(void);
+
+//----------------------------------------------------------------------------
+/// @brief Tests the LZ4 compression used for compressed logs
+//----------------------------------------------------------------------------
+void RunLz4Tests(void);
+
+//----------------------------------------------------------------------------
+/// @brief Tests the open connection list operations in honeutil
+//----------------------------------------------------------------------------
+void RunOconnTests(void);
+
+//----------------------------------------------------------------------------
+/// @brief Tests the driver's open connection tables
+//----------------------------------------------------------------------------
+void RunOconnTableTests(void);
+
+//----------------------------------------------------------------------------
+/// @brief Tests the driver's lock-free ring buffer
+//----------------------------------------------------------------------------
+void RunRingBufferTests(void);
+
+//----------------------------------------------------------------------------
+/// @brief Tests the offset math for the ring shared with readers
+//----------------------------------------------------------------------------
+void RunSharedRingTests(void);
+
+#endif	// TEST_H
@@ -0,0 +1,53 @@
+QT       -= core gui
+TEMPLATE  = app
+TARGET    = hone_test
+CONFIG   += console
+CONFIG   -= app_bundle
+DEFINES  += NTDDI_VERSION=0x06010000 _MBCS
+DEFINES  -= UNICODE
+
+LIBS += -LC:/WinDDK/7600.16385.1/lib/win7/i386 \
+	-liphlpapi \
+	-lws2_32
+
+SOURCES += \
+	../hone/checksum.cpp \
+	../honeutil/block_cache.cpp \
+	../honeutil/capture_index.cpp \
+	../honeutil/common.cpp \
+	../honeutil/filter_compiler.cpp \
+	../honeutil/log_writer.cpp \
+	../honeutil/lz4.cpp \
+	../honeutil/oconn.cpp \
+	block_cache_test.cpp \
+	capture_index_test.cpp \
+	checksum_test.cpp \
+	filter_test.cpp \
+	id_set_test.cpp \
+	lz4_test.cpp \
+	oconn_table_test.cpp \
+	oconn_test.cpp \
+	ring_buffer_test.cpp \
+	shared_ring_test.cpp \
+	test.cpp \
+	timer_wheel_test.cpp
+
+OTHER_FILES += \
+	SOURCES
+
+HEADERS += \
+	../hone/checksum.h \
+	../hone/common.h \
+	../hone/id_set.h \
+	../hone/oconn_table.h \
+	../hone/ring_buffer.h \
+	../hone/timer_wheel.h \
+	../honeutil/block_cache.h \
+	../honeutil/capture_index.h \
+	../honeutil/filter_compiler.h \
+	../honeutil/lz4.h \
+	../honeutil/oconn.h \
+	../packet_filter.h \
+	../pcap_ng.h \
+	../shared_ring.h \
+	test.h
@@ -0,0 +1,249 @@
+//----------------------------------------------------------------------------
+// Tests for the hierarchical timing wheel
+//
+// Schedules entries across every level of the wheel and checks that each one
+// expires on exactly the tick it was scheduled for, including entries that
+// cascade down from the upper levels.
+//
+// Copyright (c) 2014-2015 Battelle Memorial Institute
+// Licensed under a modification of the 3-clause BSD license
+// See License.txt for the full text of the license and additional disclaimers
+//
+// Authors
+//   Richard L. Griswold <richard.griswold@pnnl.gov>
+//----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Includes
+//-----------------------------------------------------------------------------
+
+#include "../hone/timer_wheel.h"
+#include "test.h"
+
+//--------------------------------------------------------------------------
+// Structures and enumerations
+//--------------------------------------------------------------------------
+
+struct TEST_TIMER {
+	TIMER_WHEEL_ENTRY Entry;    // Entry in the timer wheel
+	UINT64            Expires;  // Tick the entry should expire on
+	UINT64            Expired;  // Tick the entry actually expired on
+};
+
+//--------------------------------------------------------------------------
+// Global variables
+//--------------------------------------------------------------------------
+
+static TIMER_WHEEL gWheel;  // Timer wheel under test
+
+//--------------------------------------------------------------------------
+UINT32 CollectExpired(TIMER_WHEEL_ENTRY *expired, const UINT64 tick)
+{
+	TIMER_WHEEL_ENTRY *entry;
+	UINT32             count = 0;
+
+	while ((entry = TimerWheelListRemoveHead(expired)) != NULL) {
+		CONTAINING_RECORD(entry, TEST_TIMER, Entry)->Expired = tick;
+		count++;
+	}
+	return count;
+}
+
+//--------------------------------------------------------------------------
+void TestExpiry(const UINT64 start)
+{
+	TIMER_WHEEL_ENTRY expired;
+	UINT64            tick;
+	UINT32            index;
+	UINT32            numExpired = 0;
+	bool              allOnTime  = true;
+
+	// Delays on both sides of each level boundary
+	const UINT64 delays[] = {
+		0, 1, 2, 62, 63, 64, 65, 127, 128, 4095, 4096, 4097, 10000, 262143,
+		262144, 262145, 1000000, TIMER_WHEEL_RANGE - 2, TIMER_WHEEL_RANGE - 1,
+	};
+	TEST_TIMER timers[ARRAY_SIZEOF(delays)] = {0};
+
+	InitTimerWheelList(&expired);
+	InitTimerWheel(&gWheel, start);
+	for (index = 0; index < ARRAY_SIZEOF(delays); index++) {
+		timers[index].Expires = start + delays[index];
+		TimerWheelInsert(&gWheel, &timers[index].Entry, start,
+				timers[index].Expires);
+	}
+	Check(gWheel.Count == ARRAY_SIZEOF(delays),
+			"wheel starting at %llu counts every entry", start);
+
+	// Advance one tick at a time, so an entry that cascades to the wrong
+	// slot shows up as expiring early or late
+	for (tick = start; !IsTimerWheelEmpty(&gWheel); tick++) {
+		TimerWheelAdvance(&gWheel, tick, &expired);
+		numExpired += CollectExpired(&expired, tick);
+		if (tick > start + TIMER_WHEEL_RANGE) {
+			break;
+		}
+	}
+	Check(numExpired == ARRAY_SIZEOF(delays),
+			"wheel starting at %llu expires every entry", start);
+	for (index = 0; index < ARRAY_SIZEOF(delays); index++) {
+		if (timers[index].Expired != timers[index].Expires) {
+			allOnTime = false;
+			Check(false, "entry %llu ticks after %llu expires on tick %llu, not %llu",
+					delays[index], start, timers[index].Expired,
+					timers[index].Expires);
+		}
+	}
+	Check(allOnTime, "wheel starting at %llu expires every entry on time",
+			start);
+}
+
+//--------------------------------------------------------------------------
+void TestLargeAdvance(void)
+{
+	TIMER_WHEEL_ENTRY expired;
+	TEST_TIMER        timers[3] = {0};
+
+	// A single call that skips many ticks expires everything up to the tick
+	InitTimerWheelList(&expired);
+	InitTimerWheel(&gWheel, 0);
+	TimerWheelInsert(&gWheel, &timers[0].Entry, 0, 10);
+	TimerWheelInsert(&gWheel, &timers[1].Entry, 0, 5000);
+	TimerWheelInsert(&gWheel, &timers[2].Entry, 0, 5001);
+	Check(TimerWheelAdvance(&gWheel, 5000, &expired) == 2,
+			"large advance expires entries up to the tick");
+	CollectExpired(&expired, 5000);
+	Check(timers[0].Expired == 5000 && timers[1].Expired == 5000 &&
+			timers[2].Expired == 0, "large advance leaves later entries");
+	Check(TimerWheelAdvance(&gWheel, 5000, &expired) == 0,
+			"repeated advance expires nothing");
+	Check(TimerWheelAdvance(&gWheel, 5001, &expired) == 1,
+			"next tick expires the remaining entry");
+	CollectExpired(&expired, 5001);
+	Check(IsTimerWheelEmpty(&gWheel), "wheel is empty after the last expiry");
+}
+
+//--------------------------------------------------------------------------
+void TestEdgeCases(void)
+{
+	TIMER_WHEEL_ENTRY expired;
+	TIMER_WHEEL_ENTRY entries;
+	TEST_TIMER        timers[4] = {0};
+
+	InitTimerWheelList(&expired);
+	InitTimerWheelList(&entries);
+
+	// An idle wheel skips ahead instead of stepping through missed ticks
+	InitTimerWheel(&gWheel, 0);
+	TimerWheelInsert(&gWheel, &timers[0].Entry, 100000000, 100000001);
+	Check(gWheel.Tick == 100000000, "idle wheel skips ahead on insert");
+	Check(TimerWheelAdvance(&gWheel, 100000000, &expired) == 0,
+			"entry does not expire before its tick");
+	Check(TimerWheelAdvance(&gWheel, 100000001, &expired) == 1,
+			"entry expires on its tick after skipping ahead");
+	CollectExpired(&expired, 100000001);
+
+	// Entries that have already expired go off on the next advance
+	TimerWheelInsert(&gWheel, &timers[0].Entry, 100000005, 100000000);
+	Check(TimerWheelAdvance(&gWheel, 100000005, &expired) == 1,
+			"entry scheduled in the past expires on the next advance");
+	CollectExpired(&expired, 100000005);
+
+	// Entries past the end of the range are clamped to the end of it
+	InitTimerWheel(&gWheel, 0);
+	TimerWheelInsert(&gWheel, &timers[0].Entry, 0, TIMER_WHEEL_RANGE * 4);
+	Check(timers[0].Entry.Expires == TIMER_WHEEL_RANGE - 1,
+			"entry past the range is clamped to the end of it");
+	Check(TimerWheelAdvance(&gWheel, TIMER_WHEEL_RANGE - 2, &expired) == 0,
+			"clamped entry does not expire early");
+	Check(TimerWheelAdvance(&gWheel, TIMER_WHEEL_RANGE - 1, &expired) == 1,
+			"clamped entry expires at the end of the range");
+	CollectExpired(&expired, TIMER_WHEEL_RANGE - 1);
+
+	// Removed entries never expire, and removing twice is harmless
+	InitTimerWheel(&gWheel, 0);
+	TimerWheelInsert(&gWheel, &timers[0].Entry, 0, 3);
+	TimerWheelInsert(&gWheel, &timers[1].Entry, 0, 3);
+	TimerWheelInsert(&gWheel, &timers[2].Entry, 0, 70000);
+	TimerWheelRemove(&gWheel, &timers[1].Entry);
+	TimerWheelRemove(&gWheel, &timers[1].Entry);
+	TimerWheelRemove(&gWheel, &timers[2].Entry);
+	Check(gWheel.Count == 1, "removed entries are not counted");
+	Check(TimerWheelAdvance(&gWheel, 100000, &expired) == 1,
+			"removed entries do not expire");
+	Check(TimerWheelListRemoveHead(&expired) == &timers[0].Entry,
+			"remaining entry expires");
+
+	// Removing everything returns the entries from every level
+	InitTimerWheel(&gWheel, 0);
+	TimerWheelInsert(&gWheel, &timers[0].Entry, 0, 1);
+	TimerWheelInsert(&gWheel, &timers[1].Entry, 0, 100);
+	TimerWheelInsert(&gWheel, &timers[2].Entry, 0, 10000);
+	TimerWheelInsert(&gWheel, &timers[3].Entry, 0, 1000000);
+	Check(TimerWheelRemoveAll(&gWheel, &entries) == 4,
+			"remove all returns every entry");
+	Check(IsTimerWheelEmpty(&gWheel), "wheel is empty after remove all");
+	Check(TimerWheelAdvance(&gWheel, TIMER_WHEEL_RANGE, &expired) == 0,
+			"nothing expires after remove all");
+}
+
+//--------------------------------------------------------------------------
+void TestManyCloses(void)
+{
+	TIMER_WHEEL_ENTRY  expired;
+	TIMER_WHEEL_ENTRY *entry;
+	UINT64             tick;
+	UINT64             lastExpires = 0;
+	UINT32             index       = 0;
+	UINT32             numExpired  = 0;
+	UINT32             maxExpired  = 0;
+	bool               inOrder     = true;
+	bool               onTime      = true;
+
+	// Connection closes are held for 1 second on 10 ms ticks, so a burst of
+	// closes lands in the wheel as many entries 100 ticks out, a few per tick
+	const UINT32      numTimers = 20000;
+	const UINT64      holdTicks = 100;
+	static TEST_TIMER timers[numTimers];
+
+	InitTimerWheelList(&expired);
+	InitTimerWheel(&gWheel, 0);
+	for (tick = 0; (index < numTimers) || !IsTimerWheelEmpty(&gWheel); tick++) {
+		for (UINT32 count = 0; (count < 50) && (index < numTimers); count++, index++) {
+			timers[index].Expires = tick + holdTicks + (index % 7);
+			timers[index].Expired = 0;
+			TimerWheelInsert(&gWheel, &timers[index].Entry, tick,
+					timers[index].Expires);
+		}
+		const UINT32 count = TimerWheelAdvance(&gWheel, tick, &expired);
+		if (count > maxExpired) {
+			maxExpired = count;
+		}
+		while ((entry = TimerWheelListRemoveHead(&expired)) != NULL) {
+			TEST_TIMER *timer = CONTAINING_RECORD(entry, TEST_TIMER, Entry);
+			if (timer->Expires < lastExpires) {
+				inOrder = false;
+			}
+			if (timer->Expires != tick) {
+				onTime = false;
+			}
+			lastExpires = timer->Expires;
+			numExpired++;
+		}
+	}
+	Check(numExpired == numTimers, "every pending close expires");
+	Check(inOrder, "pending closes expire in order");
+	Check(onTime, "pending closes expire on their ticks");
+	Check(maxExpired <= 50, "each tick only expires the closes that are due");
+}
+
+//--------------------------------------------------------------------------
+void RunTimerWheelTests(void)
+{
+	TestExpiry(0);
+	TestExpiry(1000003);
+	TestExpiry((1ULL << 40) - 5);
+	TestLargeAdvance();
+	TestEdgeCases();
+	TestManyCloses();
+}